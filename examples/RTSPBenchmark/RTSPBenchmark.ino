@@ -0,0 +1,462 @@
+#include <WiFi.h>
+#include <ESP32-RTSPServer.h>
+#include "esp_camera.h"
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+#include "esp_heap_trace.h"
+#endif
+
+/**
+ * Packetizer benchmark.
+ *
+ * Captures a corpus of JPEG frames from the camera at each resolution into PSRAM, generates a PCM
+ * tone and then pushes both, plus subtitles, through sendRTSPFrame(), sendRTSPAudio() and
+ * sendRTSPSubtitles() as fast as possible. The sketch connects to its own server over loopback so
+ * the full send path is measured, into three sinks:
+ *   - null: UDP to ports nobody listens on, the cost of packetizing plus sendto()
+ *   - udp:  UDP to loopback sockets that are drained by a task
+ *   - tcp:  RTP interleaved on the RTSP connection, drained by a task
+ *
+ * For each run it prints ns per packet, MB/s and heap allocations per call, so packetizer changes
+ * can be compared against the same baseline. Allocations are counted with heap tracing, enable
+ * "Heap tracing: Standalone" in menuconfig (CONFIG_HEAP_TRACING_STANDALONE) to get them.
+ *
+ * Leave RTSP_VIDEO_NONBLOCK undefined, with it sendRTSPFrame() only hands the frame to another task.
+ */
+
+// ===================
+// Select camera model
+// ===================
+//#define CAMERA_MODEL_WROVER_KIT // Has PSRAM
+//#define CAMERA_MODEL_ESP_EYE  // Has PSRAM
+//#define CAMERA_MODEL_ESP32S3_EYE // Has PSRAM
+//#define CAMERA_MODEL_M5STACK_PSRAM // Has PSRAM
+//#define CAMERA_MODEL_M5STACK_V2_PSRAM // M5Camera version B Has PSRAM
+//#define CAMERA_MODEL_M5STACK_WIDE // Has PSRAM
+//#define CAMERA_MODEL_AI_THINKER // Has PSRAM
+//#define CAMERA_MODEL_XIAO_ESP32S3 // Has PSRAM
+#define CAMERA_MODEL_XENOIONEX // Has PSRAM Custom Board
+//#define CAMERA_MODEL_DFRobot_FireBeetle2_ESP32S3 // Has PSRAM
+#include "camera_pins.h"
+
+// ===========================
+// Enter your WiFi credentials
+// ===========================
+const char *ssid = "**********";
+const char *password = "**********";
+
+// RTSPServer instance
+RTSPServer rtspServer;
+
+#define RTSP_PORT 554
+#define CORPUS_FRAMES 8        // Frames captured per resolution
+#define VIDEO_CALLS 200        // sendRTSPFrame calls per run
+#define AUDIO_CALLS 2000       // sendRTSPAudio calls per run
+#define SUBTITLES_CALLS 2000   // sendRTSPSubtitles calls per run
+#define SAMPLE_RATE 16000
+#define AUDIO_BLOCK_BYTES 1024
+#define SINK_PORT 6000         // Loopback receive ports, video, audio and subtitles on +0, +2, +4
+#define NULL_SINK_PORT 7000    // Nobody listens here
+#define HEAP_TRACE_RECORDS 100
+
+enum Sink { SINK_NULL, SINK_UDP, SINK_TCP };
+const char* sinkNames[] = { "null", "udp", "tcp" };
+
+struct Resolution {
+  framesize_t size;
+  const char* name;
+};
+const Resolution resolutions[] = {
+  { FRAMESIZE_QVGA, "QVGA" },
+  { FRAMESIZE_VGA, "VGA" },
+  { FRAMESIZE_SVGA, "SVGA" },
+  { FRAMESIZE_XGA, "XGA" },
+  { FRAMESIZE_HD, "HD" },
+  { FRAMESIZE_SXGA, "SXGA" },
+  { FRAMESIZE_UXGA, "UXGA" },
+};
+
+struct CorpusFrame {
+  uint8_t* data;
+  size_t len;
+  int width;
+  int height;
+};
+CorpusFrame corpus[CORPUS_FRAMES];
+int16_t* pcm = NULL;
+int quality;
+
+// Sockets the drain task empties, -1 when unused
+volatile int drainSockets[3] = { -1, -1, -1 };
+volatile bool draining = false;
+TaskHandle_t drainTaskHandle = NULL;
+
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+heap_trace_record_t heapTraceRecords[HEAP_TRACE_RECORDS];
+#endif
+
+/**
+ * @brief Sets up the camera for capturing the corpus.
+*/
+bool setupCamera() {
+  camera_config_t config;
+  config.ledc_channel = LEDC_CHANNEL_0;
+  config.ledc_timer = LEDC_TIMER_0;
+  config.pin_d0 = Y2_GPIO_NUM;
+  config.pin_d1 = Y3_GPIO_NUM;
+  config.pin_d2 = Y4_GPIO_NUM;
+  config.pin_d3 = Y5_GPIO_NUM;
+  config.pin_d4 = Y6_GPIO_NUM;
+  config.pin_d5 = Y7_GPIO_NUM;
+  config.pin_d6 = Y8_GPIO_NUM;
+  config.pin_d7 = Y9_GPIO_NUM;
+  config.pin_xclk = XCLK_GPIO_NUM;
+  config.pin_pclk = PCLK_GPIO_NUM;
+  config.pin_vsync = VSYNC_GPIO_NUM;
+  config.pin_href = HREF_GPIO_NUM;
+  config.pin_sccb_sda = SIOD_GPIO_NUM;
+  config.pin_sccb_scl = SIOC_GPIO_NUM;
+  config.pin_pwdn = PWDN_GPIO_NUM;
+  config.pin_reset = RESET_GPIO_NUM;
+  config.xclk_freq_hz = 20000000;
+  config.frame_size = FRAMESIZE_UXGA;
+  config.pixel_format = PIXFORMAT_JPEG;
+  config.grab_mode = CAMERA_GRAB_LATEST;
+  config.fb_location = CAMERA_FB_IN_PSRAM;
+  config.jpeg_quality = 10;
+  config.fb_count = 2;
+
+  esp_err_t err = esp_camera_init(&config);
+  if (err != ESP_OK) {
+    Serial.printf("Camera init failed with error 0x%x\n", err);
+    return false;
+  }
+  sensor_t* s = esp_camera_sensor_get();
+  quality = s->status.quality;
+  return true;
+}
+
+/**
+ * @brief Captures CORPUS_FRAMES frames at one resolution into PSRAM.
+ */
+bool captureCorpus(framesize_t size) {
+  sensor_t* s = esp_camera_sensor_get();
+  s->set_framesize(s, size);
+  // Let exposure and frame size settle
+  for (int i = 0; i < 5; i++) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (fb) esp_camera_fb_return(fb);
+  }
+  for (int i = 0; i < CORPUS_FRAMES; i++) {
+    camera_fb_t* fb = esp_camera_fb_get();
+    if (!fb) return false;
+    corpus[i].data = (uint8_t*)ps_malloc(fb->len);
+    if (!corpus[i].data) {
+      esp_camera_fb_return(fb);
+      return false;
+    }
+    memcpy(corpus[i].data, fb->buf, fb->len);
+    corpus[i].len = fb->len;
+    corpus[i].width = fb->width;
+    corpus[i].height = fb->height;
+    esp_camera_fb_return(fb);
+  }
+  return true;
+}
+
+void freeCorpus() {
+  for (int i = 0; i < CORPUS_FRAMES; i++) {
+    free(corpus[i].data);
+    corpus[i].data = NULL;
+  }
+}
+
+/**
+ * @brief Empties the loopback sink sockets so the sender never waits on a full receive buffer.
+ */
+void drainTask(void* pvParameters) {
+  static uint8_t buf[2048];
+  while (true) {
+    bool received = false;
+    if (draining) {
+      for (int i = 0; i < 3; i++) {
+        int sock = drainSockets[i];
+        if (sock >= 0) {
+          while (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+            received = true;
+          }
+        }
+      }
+    }
+    if (!received) vTaskDelay(1);
+  }
+}
+
+int openUdpSink(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    Serial.printf("Failed to bind sink port %u\n", port);
+    if (sock >= 0) close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+/**
+ * @brief Sends one RTSP request and waits for a 200 OK.
+ */
+bool rtspRequest(int sock, const char* method, const char* url, const char* headers, char* response, size_t size) {
+  static int cseq = 0;
+  char request[512];
+  int len = snprintf(request, sizeof(request), "%s %s RTSP/1.0\r\nCSeq: %d\r\n%s\r\n", method, url, ++cseq, headers);
+  if (send(sock, request, len, 0) != len) return false;
+  size_t total = 0;
+  int64_t deadline = esp_timer_get_time() + 2000000;
+  while (total < size - 1 && esp_timer_get_time() < deadline) {
+    int n = recv(sock, response + total, size - 1 - total, MSG_DONTWAIT);
+    if (n > 0) {
+      total += n;
+      response[total] = 0;
+      if (strstr(response, "\r\n\r\n")) break;
+    } else {
+      vTaskDelay(1);
+    }
+  }
+  response[total] = 0;
+  if (!strstr(response, "200 OK")) {
+    Serial.printf("%s failed: %s\n", method, response);
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Connects to our own server and plays video, audio and subtitles into the given sink.
+ *
+ * @return The RTSP socket, or -1 on failure.
+ */
+int startSession(Sink sink) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(RTSP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock < 0 || connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    Serial.println("Failed to connect to the RTSP server");
+    if (sock >= 0) close(sock);
+    return -1;
+  }
+
+  char url[64];
+  char headers[192];
+  char response[1536];
+  snprintf(url, sizeof(url), "rtsp://127.0.0.1:%d/", RTSP_PORT);
+  if (!rtspRequest(sock, "OPTIONS", url, "", response, sizeof(response)) ||
+      !rtspRequest(sock, "DESCRIBE", url, "Accept: application/sdp\r\n", response, sizeof(response))) {
+    close(sock);
+    return -1;
+  }
+
+  const char* tracks[] = { "video", "audio", "subtitles" };
+  uint32_t sessionID = 0;
+  for (int i = 0; i < 3; i++) {
+    char trackUrl[80];
+    snprintf(trackUrl, sizeof(trackUrl), "%s%s", url, tracks[i]);
+    int len;
+    if (sink == SINK_TCP) {
+      len = snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n", i * 2, i * 2 + 1);
+    } else {
+      uint16_t port = (sink == SINK_UDP ? SINK_PORT : NULL_SINK_PORT) + i * 2;
+      len = snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n", port, port + 1);
+    }
+    if (sessionID) {
+      snprintf(headers + len, sizeof(headers) - len, "Session: %lu\r\n", sessionID);
+    }
+    if (!rtspRequest(sock, "SETUP", trackUrl, headers, response, sizeof(response))) {
+      close(sock);
+      return -1;
+    }
+    char* session = strstr(response, "Session: ");
+    if (session) sessionID = strtoul(session + 9, NULL, 10);
+  }
+
+  snprintf(headers, sizeof(headers), "Session: %lu\r\nRange: npt=0.000-\r\n", sessionID);
+  if (!rtspRequest(sock, "PLAY", url, headers, response, sizeof(response))) {
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
+void stopSession(int sock) {
+  char request[128];
+  int len = snprintf(request, sizeof(request), "TEARDOWN rtsp://127.0.0.1:%d/ RTSP/1.0\r\nCSeq: 999\r\n\r\n", RTSP_PORT);
+  send(sock, request, len, 0);
+  delay(200); // Let rtspTask remove the session before the next run
+  close(sock);
+}
+
+void startAllocationCount() {
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+  heap_trace_start(HEAP_TRACE_ALL);
+#endif
+}
+
+/**
+ * @return Allocations since startAllocationCount(), or -1 without heap tracing.
+ */
+int stopAllocationCount() {
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+  heap_trace_stop();
+  return heap_trace_get_count();
+#else
+  return -1;
+#endif
+}
+
+enum Stream { STREAM_VIDEO, STREAM_AUDIO, STREAM_SUBTITLES };
+
+const RTSP_StreamStats& streamStats(const RTSP_Stats& stats, Stream stream) {
+  return stream == STREAM_VIDEO ? stats.video : (stream == STREAM_AUDIO ? stats.audio : stats.subtitles);
+}
+
+/**
+ * @brief Runs one stream through the packetizer and prints a result line.
+ */
+void runStream(const char* resolution, Sink sink, Stream stream) {
+  const char* streamNames[] = { "video", "audio", "subtitles" };
+  int calls = stream == STREAM_VIDEO ? VIDEO_CALLS : (stream == STREAM_AUDIO ? AUDIO_CALLS : SUBTITLES_CALLS);
+  char subtitle[32];
+  RTSP_Stats before;
+  RTSP_Stats after;
+
+  rtspServer.getStats(before);
+  startAllocationCount();
+  int64_t start = esp_timer_get_time();
+  for (int i = 0; i < calls; i++) {
+    if (stream == STREAM_VIDEO) {
+      const CorpusFrame& frame = corpus[i % CORPUS_FRAMES];
+      rtspServer.sendRTSPFrame(frame.data, frame.len, quality, frame.width, frame.height);
+    } else if (stream == STREAM_AUDIO) {
+      rtspServer.sendRTSPAudio(pcm, AUDIO_BLOCK_BYTES);
+    } else {
+      size_t len = snprintf(subtitle, sizeof(subtitle), "Frame %d", i);
+      rtspServer.sendRTSPSubtitles(subtitle, len);
+    }
+  }
+  int64_t elapsedUs = esp_timer_get_time() - start;
+  int allocations = stopAllocationCount();
+  rtspServer.getStats(after);
+
+  const RTSP_StreamStats& b = streamStats(before, stream);
+  const RTSP_StreamStats& a = streamStats(after, stream);
+  uint32_t packets = a.packetsSent - b.packetsSent;
+  uint32_t bytes = a.bytesSent - b.bytesSent;
+  uint32_t errors = a.sendErrors - b.sendErrors;
+  double nsPerPacket = packets ? (elapsedUs * 1000.0) / packets : 0;
+  double mbPerSec = elapsedUs ? (double)bytes / elapsedUs : 0; // bytes per us is MB/s
+  Serial.printf("%-5s %-4s %-9s %6d calls %7lu packets %8.0f ns/packet %7.2f MB/s %6lu errors ",
+                resolution, sinkNames[sink], streamNames[stream], calls, packets, nsPerPacket, mbPerSec, errors);
+  if (allocations >= 0) {
+    Serial.printf("%5.2f allocs/call\n", (double)allocations / calls);
+  } else {
+    Serial.println("  - allocs/call");
+  }
+}
+
+/**
+ * @brief Runs all streams of one resolution into one sink.
+ */
+void runBenchmark(const char* resolution, Sink sink, bool withAudio) {
+  int sinkSockets[3] = { -1, -1, -1 };
+  if (sink == SINK_UDP) {
+    for (int i = 0; i < 3; i++) {
+      sinkSockets[i] = openUdpSink(SINK_PORT + i * 2);
+      drainSockets[i] = sinkSockets[i];
+    }
+  }
+  int sock = startSession(sink);
+  if (sock < 0) {
+    Serial.printf("Skipping %s %s, session setup failed\n", resolution, sinkNames[sink]);
+  } else {
+    if (sink == SINK_TCP) {
+      drainSockets[0] = sock;
+    }
+    draining = true;
+    runStream(resolution, sink, STREAM_VIDEO);
+    if (withAudio) {
+      runStream(resolution, sink, STREAM_AUDIO);
+      runStream(resolution, sink, STREAM_SUBTITLES);
+    }
+    draining = false;
+    delay(10); // Let the drain task finish with the sockets
+    for (int i = 0; i < 3; i++) {
+      drainSockets[i] = -1;
+    }
+    stopSession(sock);
+  }
+  for (int i = 0; i < 3; i++) {
+    if (sinkSockets[i] >= 0) close(sinkSockets[i]);
+  }
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  // Connect to WiFi, the benchmark itself only uses loopback
+  WiFi.begin(ssid, password);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(1000);
+    Serial.println("Connecting to WiFi...");
+  }
+
+  if (!psramFound() || !setupCamera()) {
+    Serial.println("Benchmark needs a camera and PSRAM");
+    return;
+  }
+
+  // One block of a 1kHz tone
+  pcm = (int16_t*)malloc(AUDIO_BLOCK_BYTES);
+  for (int i = 0; i < AUDIO_BLOCK_BYTES / 2; i++) {
+    pcm[i] = (int16_t)(8000 * sin(2 * PI * 1000 * i / SAMPLE_RATE));
+  }
+
+#ifdef CONFIG_HEAP_TRACING_STANDALONE
+  heap_trace_init_standalone(heapTraceRecords, HEAP_TRACE_RECORDS);
+#endif
+
+  xTaskCreate(drainTask, "Drain", 4096, NULL, 5, &drainTaskHandle);
+
+  if (!rtspServer.init(RTSPServer::VIDEO_AUDIO_SUBTITLES, RTSP_PORT, SAMPLE_RATE)) {
+    Serial.println("Failed to start RTSP server");
+    return;
+  }
+
+  Serial.printf("CPU %lu MHz, %d frames per resolution\n", getCpuFrequencyMhz(), CORPUS_FRAMES);
+  for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]); r++) {
+    if (!captureCorpus(resolutions[r].size)) {
+      Serial.printf("Failed to capture %s corpus\n", resolutions[r].name);
+      freeCorpus();
+      continue;
+    }
+    size_t corpusBytes = 0;
+    for (int i = 0; i < CORPUS_FRAMES; i++) corpusBytes += corpus[i].len;
+    Serial.printf("%s: %dx%d, average frame %u bytes\n", resolutions[r].name, corpus[0].width, corpus[0].height, corpusBytes / CORPUS_FRAMES);
+    for (int sink = SINK_NULL; sink <= SINK_TCP; sink++) {
+      // Audio and subtitles don't depend on the resolution, run them once per sink
+      runBenchmark(resolutions[r].name, (Sink)sink, r == 0);
+    }
+    freeCorpus();
+  }
+  Serial.println("Benchmark complete");
+}
+
+void loop() {
+  delay(1000);
+  vTaskDelete(NULL); // free 8k ram and delete the loop
+}
@@ -0,0 +1,353 @@
+#include <WiFi.h>
+#include <ESP32-RTSPServer.h>
+#include "esp_freertos_hooks.h"
+
+/**
+ * Multi-client load test.
+ *
+ * Streams synthetic video frames and opens N client sessions to its own server over loopback,
+ * for each transport (UDP, TCP interleaved and multicast) and client counts up to and beyond
+ * MAX_CLIENTS. Each client runs OPTIONS/DESCRIBE/SETUP/PLAY, receives the RTP stream and checks
+ * the sequence numbers are continuous. For every run it prints the handshake latency, delivered
+ * FPS, packet loss and CPU load per client, plus how many clients were turned away.
+ *
+ * No camera is needed. Unicast UDP and TCP only accept one client unless the library is built
+ * with OVERRIDE_RTSP_SINGLE_CLIENT_MODE, the extra clients then show up as rejected.
+ */
+
+// ===========================
+// Enter your WiFi credentials
+// ===========================
+const char *ssid = "**********";
+const char *password = "**********";
+
+// RTSPServer instance
+RTSPServer rtspServer;
+
+#define RTSP_PORT 554
+#define FRAME_BYTES 30000      // About a VGA frame
+#define FRAME_WIDTH 640
+#define FRAME_HEIGHT 480
+#define TARGET_FPS 25
+#define TEST_SECONDS 10
+#define CLIENT_PORT_BASE 20000 // Unicast UDP clients receive on CLIENT_PORT_BASE + 2 * index
+#define MAX_LOAD_CLIENTS (MAX_CLIENTS + 2)
+
+enum LoadTransport { LOAD_UDP, LOAD_TCP, LOAD_MULTICAST };
+const char* transportNames[] = { "udp", "tcp", "multicast" };
+
+struct LoadClient {
+  int index;
+  LoadTransport transport;
+  TaskHandle_t task;
+  bool accepted;
+  bool rejected;
+  bool done;
+  uint32_t handshakeUs;
+  uint32_t packets;
+  uint32_t lost;
+  uint32_t frames;
+  uint16_t lastSeq;
+  int64_t firstPacketUs;
+  int64_t lastPacketUs;
+};
+
+LoadClient clients[MAX_LOAD_CLIENTS];
+volatile bool stopClients = false;
+uint8_t* frame = NULL;
+
+// Idle hook counts, the drop against an unloaded baseline gives the CPU load
+volatile uint32_t idleCount[portNUM_PROCESSORS];
+uint32_t idleBaseline[portNUM_PROCESSORS];
+
+bool idleHook0() {
+  idleCount[0]++;
+  return false;
+}
+
+#if portNUM_PROCESSORS > 1
+bool idleHook1() {
+  idleCount[1]++;
+  return false;
+}
+#endif
+
+void sampleIdle(uint32_t* counts, uint32_t ms) {
+  uint32_t start[portNUM_PROCESSORS];
+  for (int i = 0; i < portNUM_PROCESSORS; i++) start[i] = idleCount[i];
+  delay(ms);
+  for (int i = 0; i < portNUM_PROCESSORS; i++) counts[i] = idleCount[i] - start[i];
+}
+
+/**
+ * @brief Sends the synthetic frame at TARGET_FPS.
+ */
+void sendVideo(void* pvParameters) {
+  TickType_t lastWake = xTaskGetTickCount();
+  while (true) {
+    if (rtspServer.readyToSendFrame()) {
+      rtspServer.sendRTSPFrame(frame, FRAME_BYTES, 10, FRAME_WIDTH, FRAME_HEIGHT);
+    }
+    vTaskDelayUntil(&lastWake, pdMS_TO_TICKS(1000 / TARGET_FPS));
+  }
+}
+
+/**
+ * @brief Sends one RTSP request and waits for the response.
+ *
+ * @return The status code, or 0 on timeout.
+ */
+int rtspRequest(int sock, int cseq, const char* method, const char* url, const char* headers, char* response, size_t size) {
+  char request[384];
+  int len = snprintf(request, sizeof(request), "%s %s RTSP/1.0\r\nCSeq: %d\r\n%s\r\n", method, url, cseq, headers);
+  if (send(sock, request, len, 0) != len) return 0;
+  size_t total = 0;
+  response[0] = 0;
+  while (total < size - 1) {
+    int n = recv(sock, response + total, size - 1 - total, 0);
+    if (n <= 0) break;
+    total += n;
+    response[total] = 0;
+    if (strstr(response, "\r\n\r\n")) break;
+  }
+  int status = 0;
+  sscanf(response, "RTSP/1.0 %d", &status);
+  return status;
+}
+
+/**
+ * @brief Receives exactly len bytes unless the test is stopped.
+ */
+bool recvAll(int sock, uint8_t* buf, size_t len) {
+  size_t got = 0;
+  while (got < len && !stopClients) {
+    int n = recv(sock, buf + got, len - got, 0);
+    if (n > 0) {
+      got += n;
+    } else if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+      return false;
+    }
+  }
+  return got == len;
+}
+
+/**
+ * @brief Checks sequence continuity and counts frames for one RTP packet.
+ */
+void countPacket(LoadClient& client, const uint8_t* rtp, size_t len) {
+  if (len < 12) return;
+  uint16_t seq = (rtp[2] << 8) | rtp[3];
+  int64_t now = esp_timer_get_time();
+  if (client.packets == 0) {
+    client.firstPacketUs = now;
+  } else {
+    uint16_t delta = seq - client.lastSeq;
+    if (delta == 0 || delta > 0x8000) return; // Duplicate or reordered
+    client.lost += delta - 1;
+  }
+  client.lastSeq = seq;
+  client.lastPacketUs = now;
+  client.packets++;
+  if (rtp[1] & 0x80) client.frames++; // Marker bit ends a frame
+}
+
+/**
+ * @brief One client: handshake, receive until stopped, teardown.
+ */
+void clientTask(void* pvParameters) {
+  LoadClient& client = *(LoadClient*)pvParameters;
+  int rtpSock = -1;
+  char response[1536];
+  char headers[192];
+  char url[48];
+  snprintf(url, sizeof(url), "rtsp://127.0.0.1:%d/", RTSP_PORT);
+  int64_t start = esp_timer_get_time();
+
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(RTSP_PORT);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  struct timeval tv = { .tv_sec = 0, .tv_usec = 200000 };
+
+  if (sock >= 0 && connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    int status = rtspRequest(sock, 1, "OPTIONS", url, "", response, sizeof(response));
+    if (status == 200) status = rtspRequest(sock, 2, "DESCRIBE", url, "Accept: application/sdp\r\n", response, sizeof(response));
+    if (status == 200) {
+      uint16_t port = CLIENT_PORT_BASE + client.index * 2;
+      if (client.transport == LOAD_TCP) {
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+      } else if (client.transport == LOAD_MULTICAST) {
+        port = rtspServer.rtpVideoPort;
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP;multicast\r\n");
+      } else {
+        snprintf(headers, sizeof(headers), "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n", port, port + 1);
+      }
+      if (client.transport != LOAD_TCP) {
+        rtpSock = socket(AF_INET, SOCK_DGRAM, 0);
+        int reuse = 1;
+        setsockopt(rtpSock, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        struct sockaddr_in rtpAddr;
+        memset(&rtpAddr, 0, sizeof(rtpAddr));
+        rtpAddr.sin_family = AF_INET;
+        rtpAddr.sin_port = htons(port);
+        rtpAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+        bind(rtpSock, (struct sockaddr*)&rtpAddr, sizeof(rtpAddr));
+        setsockopt(rtpSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (client.transport == LOAD_MULTICAST) {
+          struct ip_mreq mreq;
+          mreq.imr_multiaddr.s_addr = inet_addr(rtspServer.rtpIp.toString().c_str());
+          mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+          setsockopt(rtpSock, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+        }
+      }
+      char trackUrl[64];
+      snprintf(trackUrl, sizeof(trackUrl), "%svideo", url);
+      status = rtspRequest(sock, 3, "SETUP", trackUrl, headers, response, sizeof(response));
+    }
+    if (status == 200) {
+      char* session = strstr(response, "Session: ");
+      snprintf(headers, sizeof(headers), "Session: %lu\r\n", session ? strtoul(session + 9, NULL, 10) : 0);
+      status = rtspRequest(sock, 4, "PLAY", url, headers, response, sizeof(response));
+    }
+    if (status == 200) {
+      client.accepted = true;
+      client.handshakeUs = esp_timer_get_time() - start;
+    } else {
+      client.rejected = status != 0;
+    }
+  }
+
+  static const size_t bufSize = 2048;
+  uint8_t* buf = (uint8_t*)malloc(bufSize);
+  while (client.accepted && !stopClients && buf) {
+    if (client.transport == LOAD_TCP) {
+      uint8_t header[4];
+      if (!recvAll(sock, header, 4) || header[0] != '$') break;
+      size_t len = (header[2] << 8) | header[3];
+      if (len > bufSize || !recvAll(sock, buf, len)) break;
+      if (header[1] == 0) countPacket(client, buf, len);
+    } else {
+      int n = recv(rtpSock, buf, bufSize, 0);
+      if (n > 0) countPacket(client, buf, n);
+    }
+  }
+  free(buf);
+
+  if (sock >= 0) {
+    if (client.accepted) {
+      char request[96];
+      int len = snprintf(request, sizeof(request), "TEARDOWN %s RTSP/1.0\r\nCSeq: 5\r\n\r\n", url);
+      send(sock, request, len, 0);
+      delay(50);
+    }
+    close(sock);
+  }
+  if (rtpSock >= 0) close(rtpSock);
+  client.done = true;
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Runs one transport with a number of clients and prints a report line.
+ */
+void runLoad(LoadTransport transport, int clientCount) {
+  stopClients = false;
+  for (int i = 0; i < clientCount; i++) {
+    memset(&clients[i], 0, sizeof(LoadClient));
+    clients[i].index = i;
+    clients[i].transport = transport;
+    xTaskCreate(clientTask, "LoadClient", 4096, &clients[i], 5, &clients[i].task);
+    delay(20); // Stagger connects like real players
+  }
+
+  delay(1000); // Let handshakes finish before measuring
+  uint32_t idle[portNUM_PROCESSORS];
+  sampleIdle(idle, TEST_SECONDS * 1000);
+  stopClients = true;
+  for (int i = 0; i < clientCount; i++) {
+    while (!clients[i].done) delay(10);
+  }
+  delay(500); // Let rtspTask clean up the sessions
+
+  int accepted = 0;
+  int rejected = 0;
+  uint32_t handshakeSum = 0;
+  uint32_t handshakeMax = 0;
+  uint32_t packets = 0;
+  uint32_t lost = 0;
+  float fpsSum = 0;
+  float fpsMin = TARGET_FPS * 10;
+  for (int i = 0; i < clientCount; i++) {
+    const LoadClient& c = clients[i];
+    if (c.rejected) rejected++;
+    if (!c.accepted) continue;
+    accepted++;
+    handshakeSum += c.handshakeUs;
+    if (c.handshakeUs > handshakeMax) handshakeMax = c.handshakeUs;
+    packets += c.packets;
+    lost += c.lost;
+    float seconds = (c.lastPacketUs - c.firstPacketUs) / 1000000.0f;
+    float fps = (seconds > 0 && c.frames > 1) ? (c.frames - 1) / seconds : 0;
+    fpsSum += fps;
+    if (fps < fpsMin) fpsMin = fps;
+  }
+
+  float cpu = 0;
+  for (int i = 0; i < portNUM_PROCESSORS; i++) {
+    float baseline = idleBaseline[i] * TEST_SECONDS;
+    cpu += baseline ? 100.0f * (1.0f - idle[i] / baseline) : 0;
+  }
+  cpu /= portNUM_PROCESSORS;
+
+  Serial.printf("%-9s %3d %3d %3d %7.1f %7.1f %6.1f %6.1f %6.2f%% %6.1f%% %6.2f%% %7u\n",
+                transportNames[transport], clientCount, accepted, rejected,
+                accepted ? handshakeSum / 1000.0f / accepted : 0, handshakeMax / 1000.0f,
+                accepted ? fpsSum / accepted : 0, accepted ? fpsMin : 0,
+                (packets + lost) ? 100.0f * lost / (packets + lost) : 0,
+                cpu, accepted ? cpu / accepted : 0, ESP.getFreeHeap());
+}
+
+void setup() {
+  Serial.begin(115200);
+
+  // Connect to WiFi, multicast needs the interface up, the clients themselves use loopback
+  WiFi.begin(ssid, password);
+  while (WiFi.status() != WL_CONNECTED) {
+    delay(1000);
+    Serial.println("Connecting to WiFi...");
+  }
+
+  frame = (uint8_t*)malloc(FRAME_BYTES);
+  for (int i = 0; i < FRAME_BYTES; i++) frame[i] = esp_random();
+
+  esp_register_freertos_idle_hook_for_cpu(idleHook0, 0);
+#if portNUM_PROCESSORS > 1
+  esp_register_freertos_idle_hook_for_cpu(idleHook1, 1);
+#endif
+  sampleIdle(idleBaseline, 1000);
+
+  rtspServer.maxRTSPClients = MAX_CLIENTS;
+  if (!rtspServer.init(RTSPServer::VIDEO_ONLY, RTSP_PORT)) {
+    Serial.println("Failed to start RTSP server");
+    return;
+  }
+  xTaskCreate(sendVideo, "Video", 8192, NULL, 9, NULL);
+
+  int counts[] = { 1, 2, 4, 8, MAX_CLIENTS, MAX_LOAD_CLIENTS };
+  Serial.printf("%d byte frames at %d fps, %d s per run, MAX_CLIENTS %d\n", FRAME_BYTES, TARGET_FPS, TEST_SECONDS, MAX_CLIENTS);
+  Serial.println("transport   N  ok rej  hs avg  hs max fpsavg fpsmin   loss     cpu cpu/cli    heap");
+  for (int t = LOAD_UDP; t <= LOAD_MULTICAST; t++) {
+    for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+      runLoad((LoadTransport)t, counts[i]);
+    }
+  }
+  Serial.println("Load test complete");
+}
+
+void loop() {
+  delay(1000);
+  vTaskDelete(NULL); // free 8k ram and delete the loop
+}
@@ -217,7 +217,9 @@ void sendVideo(void* pvParameters) {
     // Send frame via RTP
     if(rtspServer.readyToSendFrame()) {
       camera_fb_t* fb = esp_camera_fb_get();
-      rtspServer.sendRTSPFrame(fb->buf, fb->len, quality, fb->width, fb->height);
+      // Stamp with the capture time so scheduling jitter doesn't end up in the RTP timestamps
+      int64_t captureUs = fb->timestamp.tv_sec * 1000000LL + fb->timestamp.tv_usec;
+      rtspServer.sendRTSPFrame(fb->buf, fb->len, quality, fb->width, fb->height, captureUs);
       esp_camera_fb_return(fb);
     }
     vTaskDelay(pdMS_TO_TICKS(1)); 
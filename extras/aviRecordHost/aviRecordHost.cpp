@@ -0,0 +1,311 @@
+/**
+ * Host check for the recorder, see RTSPServer::startRecording().
+ *
+ * Records the JPEGs given on the command line, over and over, with a tone into an AVI on the
+ * local filesystem. A producer thread paced like a 25 fps camera with 20 ms audio blocks feeds
+ * a 10 fps recording while a writer thread services the recorder, flushing once a (simulated)
+ * second. The camera pauses for a few seconds in the middle, as with static frame suppression.
+ * The finished file is then parsed and every idx1 entry checked against the chunk it points at.
+ *
+ * The file is then played back with RTSP_AviReader, the chunks compared with what was recorded,
+ * and random seeks checked to land on the last frame at or before their target.
+ *
+ * A second recording is abandoned halfway without close(), as a power cut would leave it, then
+ * completed with repair() and checked the same way.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -pthread -Isrc -o aviRecordHost extras/aviRecordHost/aviRecordHost.cpp src/aviRecorder.cpp
+ *   ./aviRecordHost /tmp/clip.avi frame1.jpg frame2.jpg
+ */
+
+#include "aviRecorder.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HOST_FPS 10
+#define HOST_SAMPLE_RATE 16000
+#define HOST_SECONDS 30
+#define HOST_SPEEDUP 10 // Simulated seconds per real second
+#define HOST_PAUSE_START 12 // Seconds into the recording the camera stops sending
+#define HOST_PAUSE_END 15
+
+struct HostRun {
+  RTSP_AviRecorder* recorder;
+  uint8_t** frames;
+  size_t* frameLens;
+  int frameCount;
+  int stopAfterSeconds; // Simulated, HOST_SECONDS for a full run
+  bool producing;
+  uint32_t framesPushed; // Including frames the recorder skipped to keep HOST_FPS
+  uint32_t audioBytesPushed;
+};
+
+static uint8_t* readFile(const char* path, size_t& len) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t* data = (uint8_t*)malloc(len);
+  if (data && fread(data, 1, len, file) != len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static uint32_t get32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void* producer(void* arg) {
+  HostRun* run = (HostRun*)arg;
+  int16_t block[HOST_SAMPLE_RATE / 50];
+  int64_t nowUs = 1000000;
+  uint32_t sample = 0;
+  int frame = 0;
+  for (int step = 0; step < run->stopAfterSeconds * 50; step++) { // 20 ms steps
+    for (size_t i = 0; i < sizeof(block) / sizeof(block[0]); i++, sample++) {
+      block[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * sample / HOST_SAMPLE_RATE));
+    }
+    if (run->recorder->pushAudio(block, sizeof(block))) {
+      run->audioBytesPushed += sizeof(block);
+    }
+    int64_t second = step / 50;
+    if ((second < HOST_PAUSE_START || second >= HOST_PAUSE_END) && step % 2 == 0) { // 25 fps camera
+      int f = frame++ % run->frameCount;
+      if (run->recorder->pushVideo(run->frames[f], run->frameLens[f], 640, 480, nowUs)) {
+        run->framesPushed++;
+      }
+    }
+    nowUs += 20000;
+    usleep(20000 / HOST_SPEEDUP);
+  }
+  __atomic_store_n(&run->producing, false, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void* writer(void* arg) {
+  HostRun* run = (HostRun*)arg;
+  int ticks = 0;
+  while (__atomic_load_n(&run->producing, __ATOMIC_ACQUIRE)) {
+    usleep(1000);
+    bool flush = ++ticks % (1000 / HOST_SPEEDUP) == 0; // Once a simulated second
+    if (!run->recorder->service(flush)) {
+      fprintf(stderr, "service failed\n");
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+static bool record(HostRun& run) {
+  run.producing = true;
+  pthread_t producerThread;
+  pthread_t writerThread;
+  pthread_create(&writerThread, NULL, writer, &run);
+  pthread_create(&producerThread, NULL, producer, &run);
+  pthread_join(producerThread, NULL);
+  pthread_join(writerThread, NULL);
+  return true;
+}
+
+/**
+ * Walks the file and checks idx1 against the chunks and the header counts.
+ */
+static bool verify(const char* path, uint32_t& videoChunks, uint32_t& videoFrames, uint32_t& audioBytes) {
+  size_t len = 0;
+  uint8_t* file = readFile(path, len);
+  videoChunks = videoFrames = audioBytes = 0;
+  if (!file || len < RTSP_AVI_HEADER_SIZE + 8 || memcmp(file, "RIFF", 4) != 0 || memcmp(file + 8, "AVI ", 4) != 0) {
+    printf("%s: not an AVI\n", path);
+    free(file);
+    return false;
+  }
+  uint32_t riffEnd = 8 + get32(file + 4);
+  uint32_t totalFrames = get32(file + 24 + 8 + 16); // avih dwTotalFrames
+  const uint8_t* movi = file + RTSP_AVI_HEADER_SIZE - 12;
+  if (riffEnd > len || memcmp(movi, "LIST", 4) != 0 || memcmp(movi + 8, "movi", 4) != 0) {
+    printf("%s: bad RIFF size or movi list\n", path);
+    free(file);
+    return false;
+  }
+  uint32_t moviFourcc = RTSP_AVI_HEADER_SIZE - 4;
+  uint32_t idx1 = moviFourcc + get32(movi + 4);
+  if (idx1 + 8 > riffEnd || memcmp(file + idx1, "idx1", 4) != 0) {
+    printf("%s: no idx1 after the movi list\n", path);
+    free(file);
+    return false;
+  }
+  uint32_t entries = get32(file + idx1 + 4) / 16;
+  bool ok = true;
+  for (uint32_t i = 0; i < entries && ok; i++) {
+    const uint8_t* entry = file + idx1 + 8 + i * 16;
+    uint32_t at = moviFourcc + get32(entry + 8);
+    uint32_t size = get32(entry + 12);
+    if (at + 8 + size > idx1 || memcmp(file + at, entry, 4) != 0 || get32(file + at + 4) != size) {
+      printf("%s: entry %u doesn't match its chunk\n", path, i);
+      ok = false;
+    } else if (memcmp(entry, "00dc", 4) == 0) {
+      videoChunks++;
+      if (size > 0) {
+        videoFrames++;
+        ok = file[at + 8] == 0xFF && file[at + 9] == 0xD8;
+        if (!ok) {
+          printf("%s: video chunk %u isn't a JPEG\n", path, i);
+        }
+      }
+    } else {
+      audioBytes += size;
+    }
+  }
+  if (ok && videoChunks != totalFrames) {
+    printf("%s: header says %u frames, index has %u\n", path, totalFrames, videoChunks);
+    ok = false;
+  }
+  free(file);
+  return ok;
+}
+
+/**
+ * Plays the file through and seeks around in it.
+ */
+static bool playBack(const char* path, uint32_t videoChunks, uint32_t videoFrames, uint32_t audioBytes) {
+  RTSP_AviReader reader;
+  if (!reader.open(path)) {
+    printf("%s: reader can't open it\n", path);
+    return false;
+  }
+  bool ok = reader.hasVideo() && reader.hasAudio() && reader.videoWidth() == 640 && reader.videoHeight() == 480 &&
+            reader.audioSampleRate() == HOST_SAMPLE_RATE && reader.frameIntervalUs() == 1000000 / HOST_FPS &&
+            reader.durationUs() == (int64_t)videoChunks * 1000000 / HOST_FPS;
+  if (!ok) {
+    printf("%s: reader got the wrong header\n", path);
+  }
+
+  // Straight through, noting when each frame starts
+  int64_t* frameTimes = (int64_t*)malloc(videoFrames * sizeof(int64_t));
+  uint32_t chunks = 0, frames = 0, bytes = 0, audioChunks = 0;
+  int64_t lastAudioUs = -1;
+  RTSP_AviChunk chunk;
+  int result;
+  while (ok && (result = reader.next(chunk)) == 1) {
+    if (chunk.isVideo) {
+      ok = chunk.position == chunks && chunk.timeUs == (int64_t)chunks * 1000000 / HOST_FPS &&
+           (chunk.size == 0 || (chunk.data[0] == 0xFF && chunk.data[1] == 0xD8 && frames < videoFrames));
+      if (ok && chunk.size) {
+        frameTimes[frames++] = chunk.timeUs;
+      }
+      chunks++;
+    } else {
+      ok = chunk.position * 2 == bytes && chunk.timeUs > lastAudioUs;
+      lastAudioUs = chunk.timeUs;
+      bytes += chunk.size;
+      audioChunks++;
+    }
+  }
+  if (!ok || result != 0 || chunks != videoChunks || frames != videoFrames || bytes != audioBytes) {
+    printf("%s: played %u chunks, %u frames, %u audio bytes, not what was recorded\n", path, chunks, frames, bytes);
+    free(frameTimes);
+    return false;
+  }
+
+  // Random seeks, each must land on the last frame at or before its target
+  uint32_t seeks = 0;
+  srand(1);
+  for (int i = 0; i < 500 && ok; i++, seeks++) {
+    int64_t target = (int64_t)rand() % (reader.durationUs() + 2000000);
+    int64_t landed = -1;
+    uint32_t f = 0;
+    while (f + 1 < frames && frameTimes[f + 1] <= target) {
+      f++;
+    }
+    ok = reader.seek(target, landed) && landed == frameTimes[f] && reader.next(chunk) == 1 && chunk.isVideo && chunk.timeUs == landed && chunk.size > 0;
+    if (!ok) {
+      printf("%s: seek to %.3f s landed at %.3f s, expected %.3f s\n", path, target / 1e6, landed / 1e6, frameTimes[f] / 1e6);
+    }
+  }
+  printf("%-10s %s: %u video and %u audio chunks read back, %u seeks\n", ok ? "played" : "FAILED", path, chunks, audioChunks, seeks);
+  free(frameTimes);
+  return ok;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3) {
+    fprintf(stderr, "usage: %s out.avi frame.jpg...\n", argv[0]);
+    return 1;
+  }
+  int frameCount = argc - 2;
+  uint8_t** frames = (uint8_t**)calloc(frameCount, sizeof(uint8_t*));
+  size_t* frameLens = (size_t*)calloc(frameCount, sizeof(size_t));
+  for (int i = 0; i < frameCount; i++) {
+    frames[i] = readFile(argv[i + 2], frameLens[i]);
+    if (!frames[i]) {
+      fprintf(stderr, "%s: can't read\n", argv[i + 2]);
+      return 1;
+    }
+  }
+
+  bool passed = true;
+  uint32_t videoChunks, videoFrames, audioBytes;
+
+  // A complete recording
+  RTSP_AviRecorder recorder;
+  if (!recorder.open(argv[1], HOST_FPS, HOST_SAMPLE_RATE, 256 * 1024)) {
+    fprintf(stderr, "%s: can't create\n", argv[1]);
+    return 1;
+  }
+  HostRun run = { &recorder, frames, frameLens, frameCount, HOST_SECONDS, true, 0, 0 };
+  record(run);
+  uint32_t dropped = recorder.chunksDropped();
+  if (!recorder.close()) {
+    printf("close failed\n");
+    passed = false;
+  }
+  bool ok = verify(argv[1], videoChunks, videoFrames, audioBytes);
+  printf("%-10s %s: %u camera frames, %u stored, %u chunks for %.1f s at %d fps, audio %.1f s of %.1f s, %u dropped\n",
+         ok ? "complete" : "FAILED", argv[1], run.framesPushed, videoFrames, videoChunks, (double)videoChunks / HOST_FPS, HOST_FPS,
+         audioBytes / 2.0 / HOST_SAMPLE_RATE, run.audioBytesPushed / 2.0 / HOST_SAMPLE_RATE, dropped);
+  // One chunk per 1/HOST_FPS up to the last camera frame, the pause filled with empty ones
+  uint32_t expectedChunks = HOST_SECONDS * HOST_FPS + 1;
+  uint32_t expectedEmpty = (HOST_PAUSE_END - HOST_PAUSE_START) * HOST_FPS - 1;
+  passed = passed && ok && dropped == 0 && videoChunks == expectedChunks && videoFrames == expectedChunks - expectedEmpty &&
+           audioBytes == run.audioBytesPushed;
+  passed = playBack(argv[1], videoChunks, videoFrames, audioBytes) && passed;
+
+  // Abandoned halfway, as after a power cut, then repaired
+  char cutPath[256];
+  snprintf(cutPath, sizeof(cutPath), "%s.cut.avi", argv[1]);
+  RTSP_AviRecorder cut;
+  if (!cut.open(cutPath, HOST_FPS, HOST_SAMPLE_RATE, 256 * 1024)) {
+    fprintf(stderr, "%s: can't create\n", cutPath);
+    return 1;
+  }
+  HostRun cutRun = { &cut, frames, frameLens, frameCount, HOST_SECONDS / 2 + 1, true, 0, 0 };
+  record(cutRun);
+  cut.release(); // No close(), the index is only in the sidecar
+  if (!RTSP_AviRecorder::repair(cutPath)) {
+    printf("repair failed\n");
+    passed = false;
+  }
+  ok = verify(cutPath, videoChunks, videoFrames, audioBytes);
+  printf("%-10s %s: %.1f s recorded, %.1f s of video and %.1f s of audio recovered\n", ok ? "repaired" : "FAILED", cutPath, (double)cutRun.stopAfterSeconds,
+         (double)videoChunks / HOST_FPS, audioBytes / 2.0 / HOST_SAMPLE_RATE);
+  // At most the data since the last flush, a second, may be missing
+  passed = passed && ok && videoChunks + 2 * HOST_FPS >= (uint32_t)cutRun.stopAfterSeconds * HOST_FPS && audioBytes + 2 * 2 * HOST_SAMPLE_RATE >= cutRun.audioBytesPushed;
+
+  for (int i = 0; i < frameCount; i++) {
+    free(frames[i]);
+  }
+  free(frames);
+  free(frameLens);
+  printf("%s\n", passed ? "PASS" : "FAIL");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,270 @@
+/**
+ * Host check for the frame cache new sessions start from, see RTSPServer::cacheFrame() and
+ * RTSPServer::replayFrameCache().
+ *
+ * Synthetic H.264 and H.265 streams are fed through RTSP_ParameterSets and RTSP_FrameCache the
+ * way sendRTSPAccessUnit() does, and the cache is checked after every frame: a keyframe restarts
+ * it with the keyframe at index 0, the frames since it are kept in order and byte for byte, a
+ * group of pictures that outgrows the buffer or MAX_CACHED_FRAMES is dropped and nothing is
+ * cached until the next keyframe (the awaiting-keyframe state a new session then waits in), a
+ * keyframe of the other codec restarts it too, and no buffer caches nothing. Replayed timestamps
+ * have to rise in FRAME_CACHE_REPLAY_STEP and end before the live frame, also when the RTP clock
+ * wraps. Keyframes without in-band parameter sets get the cached SPS and PPS (and VPS for H.265)
+ * in front, in the order the decoder needs them, and keyframes that carry their own don't.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -Isrc -o frameCacheHost extras/frameCacheHost/frameCacheHost.cpp src/nalUnits.cpp
+ *   ./frameCacheHost
+ */
+
+#include "nalUnits.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define HOST_CACHE_SIZE 65536
+#define HOST_FRAMES 600
+#define HOST_MAX_NALS 16
+#define HOST_CODEC_H264 1
+#define HOST_CODEC_H265 2
+
+typedef std::vector<uint8_t> Bytes;
+
+static bool passed = true;
+
+static void fail(const char* what, int frame) {
+  if (passed) {
+    printf("FAIL: %s at frame %d\n", what, frame);
+  }
+  passed = false;
+}
+
+static void addNal(Bytes& stream, const uint8_t* header, size_t headerLen, size_t bodyLen, uint8_t fill) {
+  static const uint8_t startCode[] = { 0, 0, 0, 1 };
+  stream.insert(stream.end(), startCode, startCode + 4);
+  stream.insert(stream.end(), header, header + headerLen);
+  for (size_t i = 0; i < bodyLen; i++) {
+    stream.push_back((uint8_t)(fill + i) | 0x80); // Never a start code
+  }
+}
+
+/**
+ * A keyframe with or without parameter sets, or a delta frame. Parameter set bodies change with
+ * version so the cache has to follow them.
+ */
+static Bytes makeFrame(bool hevc, bool isKeyframe, bool withParameterSets, int version, size_t pictureLen) {
+  Bytes stream;
+  if (!hevc) {
+    static const uint8_t aud[] = { 0x09 }, sps[] = { 0x67 }, pps[] = { 0x68 }, idr[] = { 0x65 }, slice[] = { 0x41 };
+    addNal(stream, aud, 1, 1, 0);
+    if (withParameterSets) {
+      addNal(stream, sps, 1, 12, (uint8_t)version);
+      addNal(stream, pps, 1, 4, (uint8_t)(version + 1));
+    }
+    addNal(stream, isKeyframe ? idr : slice, 1, pictureLen, (uint8_t)version);
+  } else {
+    static const uint8_t aud[] = { 0x46, 0x01 }, vps[] = { 0x40, 0x01 }, sps[] = { 0x42, 0x01 }, pps[] = { 0x44, 0x01 };
+    static const uint8_t idr[] = { 0x26, 0x01 }, trail[] = { 0x02, 0x01 };
+    addNal(stream, aud, 2, 1, 0);
+    if (withParameterSets) {
+      addNal(stream, vps, 2, 20, (uint8_t)version);
+      addNal(stream, sps, 2, 30, (uint8_t)(version + 1));
+      addNal(stream, pps, 2, 6, (uint8_t)(version + 2));
+    }
+    addNal(stream, isKeyframe ? idr : trail, 2, pictureLen, (uint8_t)version);
+  }
+  return stream;
+}
+
+static bool sameNal(const RTP_NalUnit& nal, const uint8_t* data, size_t len) {
+  return nal.len == len && memcmp(nal.data, data, len) == 0;
+}
+
+/**
+ * Checks the parameter sets a keyframe gets, against the NAL units of the last frame that carried them.
+ */
+static void checkPrepend(RTSP_ParameterSets& sets, bool hevc, const Bytes& withSets, int frame) {
+  RTP_NalUnit given[HOST_MAX_NALS];
+  RTSP_NalPacketizer::splitAnnexB(withSets.data(), withSets.size(), given, HOST_MAX_NALS);
+
+  Bytes bare = makeFrame(hevc, true, false, 0, 40);
+  RTP_NalUnit slots[RTSP_PARAMETER_SET_SLOTS + HOST_MAX_NALS];
+  RTP_NalUnit* nals = slots + RTSP_PARAMETER_SET_SLOTS;
+  size_t nalCount = RTSP_NalPacketizer::splitAnnexB(bare.data(), bare.size(), nals, HOST_MAX_NALS);
+  bool hasParameterSets = false;
+  if (!sets.scan(nals, nalCount, hasParameterSets) || hasParameterSets) {
+    fail("keyframe without parameter sets misread", frame);
+    return;
+  }
+  RTP_NalUnit before[RTSP_PARAMETER_SET_SLOTS + HOST_MAX_NALS];
+  memcpy(before, nals, nalCount * sizeof(RTP_NalUnit));
+  size_t prepended = sets.prepend(nals);
+  if (prepended != (hevc ? 3u : 2u)) {
+    fail("wrong number of parameter sets prepended", frame);
+    return;
+  }
+  if (memcmp(before, nals, nalCount * sizeof(RTP_NalUnit)) != 0) {
+    fail("access unit moved by prepend", frame);
+  }
+  // The frame with parameter sets is AUD, [VPS,] SPS, PPS, picture
+  for (size_t i = 0; i < prepended; i++) {
+    if (!sameNal(nals[(int)i - (int)prepended], given[1 + i].data, given[1 + i].len)) {
+      fail("prepended parameter set differs from the last one sent", frame);
+    }
+  }
+}
+
+/**
+ * Feeds one codec's stream through the cache, with a model of what it should hold.
+ */
+static void checkStream(bool hevc, RTSP_FrameCache& cache, int& keyframes, int& overflows, int& replays) {
+  RTSP_ParameterSets sets(hevc);
+  uint8_t codec = hevc ? HOST_CODEC_H265 : HOST_CODEC_H264;
+  std::vector<Bytes> model; // Frames the cache should hold, empty while awaiting a keyframe
+  Bytes lastWithSets;
+  int version = 0;
+  uint32_t liveTimestamp = 0xFFFFFFFFu - 90 * 100; // Wraps partway through
+
+  RTP_NalUnit empty[RTSP_PARAMETER_SET_SLOTS];
+  if (sets.prepend(empty + RTSP_PARAMETER_SET_SLOTS) != 0 || sets.complete()) {
+    fail("parameter sets prepended before any were seen", 0);
+  }
+
+  for (int frame = 0; frame < HOST_FRAMES; frame++) {
+    // Keyframes every 30 frames, a big group of pictures from 300 that overflows, parameter sets
+    // in band on every other keyframe and changing every fourth
+    bool isKeyframe = frame % 30 == 0;
+    bool withSets = isKeyframe && (frame % 60 == 0);
+    if (frame % 120 == 0) {
+      version++;
+    }
+    size_t pictureLen = isKeyframe ? 3000 + (size_t)(rand() % 2000) : 200 + (size_t)(rand() % 800);
+    if (frame >= 300 && frame < 360) {
+      pictureLen *= 8;
+    }
+    Bytes data = makeFrame(hevc, isKeyframe, withSets, version, pictureLen);
+    liveTimestamp += 3000;
+
+    // As sendRTSPAccessUnit() does
+    RTP_NalUnit slots[RTSP_PARAMETER_SET_SLOTS + HOST_MAX_NALS];
+    RTP_NalUnit* nals = slots + RTSP_PARAMETER_SET_SLOTS;
+    size_t nalCount = RTSP_NalPacketizer::splitAnnexB(data.data(), data.size(), nals, HOST_MAX_NALS);
+    bool hasParameterSets = false;
+    bool detected = sets.scan(nals, nalCount, hasParameterSets);
+    if (detected != isKeyframe || hasParameterSets != withSets) {
+      fail("keyframe or parameter sets misread", frame);
+    }
+    if (withSets) {
+      lastWithSets = data;
+    }
+    if (isKeyframe && !hasParameterSets && !lastWithSets.empty()) {
+      checkPrepend(sets, hevc, lastWithSets, frame);
+    }
+
+    // Replay to a session joining before this frame
+    if (cache.count() && cache.codec() == codec && !isKeyframe) {
+      uint32_t previous = 0;
+      for (size_t i = 0; i < cache.count(); i++) {
+        uint32_t timestamp = cache.replayTimestamp(i, liveTimestamp);
+        if (i && timestamp - previous != FRAME_CACHE_REPLAY_STEP) {
+          fail("replayed timestamps not FRAME_CACHE_REPLAY_STEP apart", frame);
+        }
+        previous = timestamp;
+      }
+      if (liveTimestamp - previous != FRAME_CACHE_REPLAY_STEP || (int32_t)(liveTimestamp - cache.replayTimestamp(0, liveTimestamp)) <= 0) {
+        fail("replay doesn't end just before the live frame", frame);
+      }
+      replays++;
+    }
+
+    bool kept = cache.add(codec, data.data(), data.size(), isKeyframe);
+    if (isKeyframe) {
+      model.clear();
+      model.push_back(data);
+      keyframes++;
+    } else if (!model.empty()) {
+      model.push_back(data);
+    }
+    size_t modelBytes = 0;
+    for (size_t i = 0; i < model.size(); i++) {
+      modelBytes += model[i].size();
+    }
+    if (model.size() > MAX_CACHED_FRAMES || modelBytes > HOST_CACHE_SIZE) {
+      model.clear();
+      if (kept) {
+        fail("overflow not reported", frame);
+      }
+      overflows++;
+    } else if (!kept) {
+      fail("overflow reported for a group of pictures that fits", frame);
+    }
+
+    if (cache.count() != model.size()) {
+      fail(model.empty() ? "frames cached while awaiting a keyframe" : "wrong number of frames cached", frame);
+      continue;
+    }
+    if (cache.count() && cache.codec() != codec) {
+      fail("cache holds the wrong codec", frame);
+    }
+    for (size_t i = 0; i < model.size(); i++) {
+      size_t len = 0;
+      const uint8_t* cached = cache.frame(i, len);
+      if (len != model[i].size() || memcmp(cached, model[i].data(), len) != 0) {
+        fail("cached frame differs from the one sent", frame);
+        break;
+      }
+    }
+  }
+}
+
+int main() {
+  srand(1);
+  static uint8_t buffer[HOST_CACHE_SIZE];
+  RTSP_FrameCache cache;
+
+  // Without a buffer nothing is cached and nothing is dropped
+  Bytes keyframe = makeFrame(false, true, true, 0, 100);
+  if (!cache.add(HOST_CODEC_H264, keyframe.data(), keyframe.size(), true) || cache.count() != 0) {
+    fail("frame cached without a buffer", 0);
+  }
+
+  cache.setBuffer(buffer, sizeof(buffer));
+  int keyframes = 0, overflows = 0, replays = 0;
+  checkStream(false, cache, keyframes, overflows, replays);
+
+  // A keyframe of the other codec restarts the cache
+  Bytes hevcKeyframe = makeFrame(true, true, true, 0, 100);
+  cache.add(HOST_CODEC_H265, hevcKeyframe.data(), hevcKeyframe.size(), true);
+  if (cache.count() != 1 || cache.codec() != HOST_CODEC_H265) {
+    fail("keyframe of the other codec didn't restart the cache", 0);
+  }
+  checkStream(true, cache, keyframes, overflows, replays);
+
+  // A delta frame after an overflow is never cached, the next keyframe starts over
+  Bytes big = makeFrame(false, true, true, 0, HOST_CACHE_SIZE);
+  if (cache.add(HOST_CODEC_H264, big.data(), big.size(), true) || cache.count() != 0) {
+    fail("keyframe larger than the cache kept", 0);
+  }
+  Bytes delta = makeFrame(false, false, false, 0, 100);
+  cache.add(HOST_CODEC_H264, delta.data(), delta.size(), false);
+  if (cache.count() != 0) {
+    fail("delta frame cached while awaiting a keyframe", 0);
+  }
+  cache.add(HOST_CODEC_H264, keyframe.data(), keyframe.size(), true);
+  if (cache.count() != 1) {
+    fail("keyframe after an overflow not cached", 0);
+  }
+  cache.setBuffer(NULL, 0);
+  if (cache.count() != 0 || cache.buffer() != NULL) {
+    fail("cache kept frames without a buffer", 0);
+  }
+
+  printf("%d keyframes, %d overflows, %d replays checked\n", keyframes, overflows, replays);
+  if (overflows == 0 || replays == 0) {
+    printf("FAIL: the streams didn't overflow or replay\n");
+    passed = false;
+  }
+  printf(passed ? "PASS\n" : "FAIL\n");
+  return passed ? 0 : 1;
+}
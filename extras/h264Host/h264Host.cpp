@@ -0,0 +1,368 @@
+/**
+ * Host check for the H.264 splitter and packetizer, see RTSPServer::sendRTSPH264().
+ *
+ * Each access unit of an Annex-B stream is split with RTSP_NalPacketizer::splitAnnexB() and the
+ * NAL units compared with a plain byte by byte scan. They are then packetized at a UDP, a small
+ * Blocksize and a TCP payload size, and the packets checked: single NAL unit packets only for NAL
+ * units that fit, STAP-A only for parameter sets with the highest NRI of its units, FU-A with the
+ * start bit on the first fragment and the end bit on the last, the marker bit on the last packet
+ * of the access unit only, and nothing over the payload size. Depacketizing has to give back the
+ * access unit's NAL units.
+ *
+ * Without arguments a synthetic stream is checked: IDR access units with SPS, PPS and SEI every
+ * 30 frames, P frames from a few bytes to several packets, two slices per IDR picture, access unit
+ * delimiters, 3 and 4 byte start codes and trailing zeros. Recorded streams can be given on the
+ * command line, e.g. from a camera or "ffmpeg -i clip.mp4 -c:v libx264 -bsf:v h264_mp4toannexb
+ * clip.h264", and are cut into access units at delimiters, parameter sets and first slices.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -Isrc -o h264Host extras/h264Host/h264Host.cpp src/nalUnits.cpp
+ *   ./h264Host [clip.h264 ...]
+ */
+
+#include "nalUnits.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define HOST_FRAMES 300
+#define HOST_GOP 30
+#define HOST_MAX_NALS 32
+#define HOST_AGGREGATE_SIZE 1520 // Room the server leaves in a packet buffer after the headers
+
+typedef std::vector<uint8_t> Bytes;
+
+struct HostPacket {
+  Bytes payload;
+  bool marker;
+};
+
+struct HostSink {
+  std::vector<HostPacket> packets;
+  size_t stopAfter; // Packets taken before the sink refuses one, to check that refusing stops the packetizer
+};
+
+struct HostCounts {
+  int accessUnits;
+  int nals;
+  int single;
+  int stapA;
+  int fuA;
+  int fragments;
+};
+
+static bool passed = true;
+
+static void fail(const char* what, int accessUnit) {
+  if (passed) {
+    printf("FAIL: %s in access unit %d\n", what, accessUnit);
+  }
+  passed = false;
+}
+
+static bool collect(void* context, const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker) {
+  HostSink* sink = static_cast<HostSink*>(context);
+  if (sink->packets.size() == sink->stopAfter) {
+    return false;
+  }
+  HostPacket packet;
+  packet.payload.assign(prefix, prefix + prefixLen);
+  packet.payload.insert(packet.payload.end(), payload, payload + payloadLen);
+  packet.marker = marker;
+  sink->packets.push_back(packet);
+  return true;
+}
+
+/**
+ * @brief Finds the NAL units of an Annex-B stream the slow way, as the reference.
+ */
+static std::vector<Bytes> scanNals(const uint8_t* data, size_t len) {
+  std::vector<Bytes> nals;
+  size_t i = 0;
+  while (i + 3 <= len && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)) {
+    i++;
+  }
+  i += 3;
+  while (i < len) {
+    size_t end = i;
+    while (end < len && !(end + 3 <= len && data[end] == 0 && data[end + 1] == 0 && data[end + 2] <= 1)) {
+      end++;
+    }
+    size_t next = end;
+    while (next + 3 <= len && !(data[next] == 0 && data[next + 1] == 0 && data[next + 2] == 1)) {
+      next++;
+    }
+    if (end > i) {
+      nals.push_back(Bytes(data + i, data + end));
+    }
+    i = next + 3;
+  }
+  return nals;
+}
+
+static void appendNal(Bytes& stream, std::vector<Bytes>& expected, uint8_t header, size_t len, bool fourByteStartCode, bool firstSlice) {
+  static const uint8_t startCode[] = { 0, 0, 0, 1 };
+  stream.insert(stream.end(), fourByteStartCode ? startCode : startCode + 1, startCode + 4);
+  Bytes nal(len);
+  nal[0] = header;
+  for (size_t i = 1; i < len; i++) {
+    nal[i] = 1 + rand() % 255; // No zeros, so no start code emulation
+  }
+  if (len > 1) {
+    nal[1] = firstSlice ? (nal[1] | 0x80) : (nal[1] & 0x7F); // first_mb_in_slice is 0 only for the first slice
+  }
+  stream.insert(stream.end(), nal.begin(), nal.end());
+  expected.push_back(nal);
+  if (rand() % 8 == 0) {
+    stream.insert(stream.end(), 1 + rand() % 3, 0); // trailing_zero_8bits
+  }
+}
+
+/**
+ * @brief Makes a synthetic access unit, with its NAL units as they should come out.
+ */
+static void makeAccessUnit(int frame, Bytes& stream, std::vector<Bytes>& expected) {
+  appendNal(stream, expected, 0x09, 2, true, true); // Access unit delimiter
+  if (frame % HOST_GOP == 0) {
+    appendNal(stream, expected, 0x67, 12 + rand() % 20, true, true); // SPS
+    appendNal(stream, expected, 0x68, 4 + rand() % 6, rand() % 2, true); // PPS
+    appendNal(stream, expected, 0x06, 8 + rand() % 30, false, true); // SEI
+    appendNal(stream, expected, 0x65, 3000 + rand() % 9000, false, true); // IDR slices
+    appendNal(stream, expected, 0x65, 3000 + rand() % 9000, false, false);
+  } else {
+    size_t len = rand() % 4 == 0 ? 2 + rand() % 20 : 200 + rand() % 4000;
+    appendNal(stream, expected, 0x41, len, rand() % 2, true); // P slice
+  }
+}
+
+/**
+ * @brief Cuts a recorded stream into access units per H.264 7.4.1.2.3.
+ */
+static std::vector<std::vector<Bytes> > cutAccessUnits(const std::vector<Bytes>& nals) {
+  std::vector<std::vector<Bytes> > units;
+  bool hasSlice = false;
+  for (size_t i = 0; i < nals.size(); i++) {
+    uint8_t type = nals[i][0] & 0x1F;
+    bool isSlice = type >= 1 && type <= 5;
+    bool firstSlice = isSlice && nals[i].size() > 1 && (nals[i][1] & 0x80);
+    if (units.empty() || (hasSlice && (type == 9 || type == 7 || type == 8 || type == 6 || firstSlice))) {
+      units.push_back(std::vector<Bytes>());
+      hasSlice = false;
+    }
+    units.back().push_back(nals[i]);
+    hasSlice |= isSlice;
+  }
+  return units;
+}
+
+/**
+ * @brief Checks the packets of one access unit and depacketizes them.
+ */
+static std::vector<Bytes> depacketize(const std::vector<HostPacket>& packets, size_t maxPayload, int accessUnit, HostCounts& counts) {
+  std::vector<Bytes> nals;
+  Bytes fragmented;
+  bool inFragment = false;
+  for (size_t p = 0; p < packets.size(); p++) {
+    const Bytes& payload = packets[p].payload;
+    if (payload.empty() || payload.size() > maxPayload) {
+      fail("packet empty or over the payload size", accessUnit);
+      continue;
+    }
+    if (packets[p].marker != (p + 1 == packets.size())) {
+      fail("marker bit not on the last packet only", accessUnit);
+    }
+    uint8_t type = payload[0] & 0x1F;
+    if (inFragment && type != 28) {
+      fail("FU-A without end bit", accessUnit);
+      inFragment = false;
+    }
+    if (type >= 1 && type <= 23) {
+      nals.push_back(payload);
+      counts.single++;
+    } else if (type == 24) {
+      uint8_t nri = 0;
+      size_t at = 1;
+      int units = 0;
+      while (at + 2 <= payload.size()) {
+        size_t len = (payload[at] << 8) | payload[at + 1];
+        at += 2;
+        if (len == 0 || at + len > payload.size()) {
+          fail("STAP-A unit overruns the packet", accessUnit);
+          break;
+        }
+        uint8_t unitType = payload[at] & 0x1F;
+        if (unitType != 7 && unitType != 8) {
+          fail("STAP-A with something other than parameter sets", accessUnit);
+        }
+        nri = (payload[at] & 0x60) > nri ? payload[at] & 0x60 : nri;
+        nals.push_back(Bytes(payload.begin() + at, payload.begin() + at + len));
+        at += len;
+        units++;
+      }
+      if (at != payload.size() || units < 2 || (payload[0] & 0x60) != nri) {
+        fail("malformed STAP-A", accessUnit);
+      }
+      counts.stapA++;
+    } else if (type == 28 && payload.size() > 2) {
+      bool start = payload[1] & 0x80;
+      bool end = payload[1] & 0x40;
+      if (start == inFragment || (payload[1] & 0x20)) {
+        fail("FU-A start bit out of place", accessUnit);
+      }
+      if (start) {
+        fragmented.assign(1, (payload[0] & 0xE0) | (payload[1] & 0x1F));
+        inFragment = true;
+      } else if (!end && payload.size() != maxPayload) {
+        fail("FU-A middle fragment not full", accessUnit);
+      }
+      fragmented.insert(fragmented.end(), payload.begin() + 2, payload.end());
+      counts.fragments++;
+      if (end) {
+        if (fragmented.size() <= maxPayload) {
+          fail("FU-A for a NAL unit that fits a packet", accessUnit);
+        }
+        nals.push_back(fragmented);
+        inFragment = false;
+        counts.fuA++;
+      }
+    } else {
+      fail("unexpected packet type", accessUnit);
+    }
+  }
+  if (inFragment) {
+    fail("access unit ends inside a FU-A", accessUnit);
+  }
+  return nals;
+}
+
+static void checkAccessUnit(const Bytes& stream, const std::vector<Bytes>& expected, int accessUnit, HostCounts* counts) {
+  RTP_NalUnit nals[HOST_MAX_NALS];
+  bool truncated;
+  size_t nalCount = RTSP_NalPacketizer::splitAnnexB(stream.data(), stream.size(), nals, HOST_MAX_NALS, &truncated);
+  bool same = !truncated && nalCount == expected.size();
+  for (size_t i = 0; same && i < nalCount; i++) {
+    same = nals[i].len == expected[i].size() && memcmp(nals[i].data, expected[i].data(), nals[i].len) == 0;
+  }
+  if (!same) {
+    fail("split differs from the reference", accessUnit);
+    return;
+  }
+
+  static const size_t payloadSizes[] = { 1438, 500, 8192 }; // UDP, a small Blocksize, TCP
+  uint8_t aggregate[HOST_AGGREGATE_SIZE];
+  for (size_t s = 0; s < sizeof(payloadSizes) / sizeof(payloadSizes[0]); s++) {
+    HostSink sink;
+    sink.stopAfter = (size_t)-1;
+    RTSP_NalPacketizer packetizer(payloadSizes[s], aggregate, sizeof(aggregate), collect, &sink);
+    if (!packetizer.packetizeH264(nals, nalCount)) {
+      fail("packetizer stopped", accessUnit);
+    }
+    if (depacketize(sink.packets, payloadSizes[s], accessUnit, counts[s]) != expected) {
+      fail("depacketized NAL units differ", accessUnit);
+    }
+    counts[s].accessUnits++;
+    counts[s].nals += nalCount;
+
+    if (s == 0 && sink.packets.size() > 1) {
+      // A refused packet ends the access unit there
+      HostSink stopping;
+      stopping.stopAfter = sink.packets.size() / 2;
+      RTSP_NalPacketizer stopped(payloadSizes[s], aggregate, sizeof(aggregate), collect, &stopping);
+      if (stopped.packetizeH264(nals, nalCount) || stopping.packets.size() != stopping.stopAfter) {
+        fail("packetizer went on after the sink refused a packet", accessUnit);
+      }
+    }
+  }
+
+  // Without an aggregation buffer parameter sets go out singly
+  HostSink single;
+  single.stopAfter = (size_t)-1;
+  RTSP_NalPacketizer noAggregate(payloadSizes[0], NULL, 0, collect, &single);
+  noAggregate.packetizeH264(nals, nalCount);
+  HostCounts singleCounts = {};
+  if (depacketize(single.packets, payloadSizes[0], accessUnit, singleCounts) != expected || singleCounts.stapA != 0) {
+    fail("parameter sets aggregated without a buffer", accessUnit);
+  }
+}
+
+static void checkStartCodes() {
+  // Start codes at the very end, split over trailing zeros and inside zero runs
+  static const uint8_t stream[] = { 0, 0, 0, 1, 0x67, 1, 2, 0, 0, 0, 0, 1, 0x68, 3, 0, 0, 1, 0x65, 0, 0, 0, 1 };
+  RTP_NalUnit nals[4];
+  size_t count = RTSP_NalPacketizer::splitAnnexB(stream, sizeof(stream), nals, 4);
+  if (count != 3 || nals[0].len != 3 || nals[1].len != 2 || nals[2].len != 1 || nals[2].data[0] != 0x65) {
+    fail("start codes at the edges", -1);
+  }
+  bool truncated;
+  if (RTSP_NalPacketizer::splitAnnexB(stream, sizeof(stream), nals, 2, &truncated) != 2 || !truncated) {
+    fail("truncation not reported", -1);
+  }
+  static const uint8_t noStartCode[] = { 0, 0, 2, 0x65, 0, 0 };
+  if (RTSP_NalPacketizer::splitAnnexB(noStartCode, sizeof(noStartCode), nals, 4) != 0) {
+    fail("NAL unit found without a start code", -1);
+  }
+}
+
+static Bytes readFile(const char* path) {
+  Bytes data;
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return data;
+  }
+  uint8_t block[65536];
+  size_t len;
+  while ((len = fread(block, 1, sizeof(block), file)) > 0) {
+    data.insert(data.end(), block, block + len);
+  }
+  fclose(file);
+  return data;
+}
+
+int main(int argc, char** argv) {
+  srand(1);
+  HostCounts counts[3] = {};
+  checkStartCodes();
+
+  if (argc < 2) {
+    for (int frame = 0; frame < HOST_FRAMES; frame++) {
+      Bytes stream;
+      std::vector<Bytes> expected;
+      makeAccessUnit(frame, stream, expected);
+      checkAccessUnit(stream, expected, frame, counts);
+    }
+  }
+  for (int arg = 1; arg < argc; arg++) {
+    Bytes data = readFile(argv[arg]);
+    if (data.empty()) {
+      printf("FAIL: can't read %s\n", argv[arg]);
+      return 1;
+    }
+    std::vector<std::vector<Bytes> > units = cutAccessUnits(scanNals(data.data(), data.size()));
+    for (size_t u = 0; u < units.size(); u++) {
+      if (units[u].size() > HOST_MAX_NALS) {
+        continue;
+      }
+      Bytes stream;
+      for (size_t i = 0; i < units[u].size(); i++) {
+        static const uint8_t startCode[] = { 0, 0, 0, 1 };
+        stream.insert(stream.end(), startCode, startCode + 4);
+        stream.insert(stream.end(), units[u][i].begin(), units[u][i].end());
+      }
+      checkAccessUnit(stream, units[u], u, counts);
+    }
+    printf("%s: %zu access units\n", argv[arg], units.size());
+  }
+
+  static const char* names[] = { "UDP 1438", "Blocksize 500", "TCP 8192" };
+  for (int s = 0; s < 3; s++) {
+    printf("%-14s %d access units, %d NAL units: %d single, %d STAP-A, %d FU-A in %d fragments\n", names[s],
+           counts[s].accessUnits, counts[s].nals, counts[s].single, counts[s].stapA, counts[s].fuA, counts[s].fragments);
+  }
+  if (counts[0].stapA == 0 || counts[0].fuA == 0 || counts[0].single == 0) {
+    printf("FAIL: not every packet type was made\n");
+    passed = false;
+  }
+  printf(passed ? "PASS\n" : "FAIL\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+/**
+ * Host check for the H.265 packetizer, see RTSPServer::sendRTSPH265().
+ *
+ * Each access unit of an Annex-B stream is split with RTSP_NalPacketizer::splitAnnexB(),
+ * packetized at a UDP, a small Blocksize and a TCP payload size and put back together by an
+ * RFC 7798 depacketizer, which has to give back the access unit's NAL units. On the way the
+ * packets are checked: single NAL unit packets only for NAL units that fit, APs only for
+ * parameter sets, with the lowest LayerId and TID of their units in the payload header, FUs with
+ * the start bit on the first fragment and the end bit on the last and the F bit, LayerId and TID
+ * of the NAL unit, the marker bit on the last packet of the access unit only, and nothing over
+ * the payload size.
+ *
+ * Without arguments a synthetic stream is checked: IDR access units every 30 frames with VPS,
+ * SPS and PPS of varying LayerId and TID, trailing pictures from a few bytes to several packets,
+ * two slice segments per IDR picture, access unit delimiters and stray one byte NAL units, which
+ * are too short for a header and dropped. Recorded streams can be given on the command line, e.g.
+ * "ffmpeg -i clip.mp4 -c:v libx265 -bsf:v hevc_mp4toannexb clip.h265", and are cut into access
+ * units at delimiters, parameter sets and first slice segments.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -Isrc -o h265Host extras/h265Host/h265Host.cpp src/nalUnits.cpp
+ *   ./h265Host [clip.h265 ...]
+ */
+
+#include "nalUnits.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define HOST_FRAMES 300
+#define HOST_GOP 30
+#define HOST_MAX_NALS 32
+#define HOST_AGGREGATE_SIZE 1520 // Room the server leaves in a packet buffer after the headers
+
+typedef std::vector<uint8_t> Bytes;
+
+struct HostPacket {
+  Bytes payload;
+  bool marker;
+};
+
+struct HostCounts {
+  int accessUnits;
+  int nals;
+  int single;
+  int ap;
+  int fu;
+  int fragments;
+};
+
+static bool passed = true;
+
+static void fail(const char* what, int accessUnit) {
+  if (passed) {
+    printf("FAIL: %s in access unit %d\n", what, accessUnit);
+  }
+  passed = false;
+}
+
+static bool collect(void* context, const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker) {
+  std::vector<HostPacket>* packets = static_cast<std::vector<HostPacket>*>(context);
+  HostPacket packet;
+  packet.payload.assign(prefix, prefix + prefixLen);
+  packet.payload.insert(packet.payload.end(), payload, payload + payloadLen);
+  packet.marker = marker;
+  packets->push_back(packet);
+  return true;
+}
+
+static uint8_t nalType(const uint8_t* nal) {
+  return (nal[0] >> 1) & 0x3F;
+}
+
+static uint8_t nalLayerId(const uint8_t* nal) {
+  return ((nal[0] & 0x01) << 5) | (nal[1] >> 3);
+}
+
+static uint8_t nalTid(const uint8_t* nal) {
+  return nal[1] & 0x07;
+}
+
+/**
+ * @brief Finds the NAL units of an Annex-B stream the slow way.
+ */
+static std::vector<Bytes> scanNals(const uint8_t* data, size_t len) {
+  std::vector<Bytes> nals;
+  size_t i = 0;
+  while (i + 3 <= len && !(data[i] == 0 && data[i + 1] == 0 && data[i + 2] == 1)) {
+    i++;
+  }
+  i += 3;
+  while (i < len) {
+    size_t end = i;
+    while (end < len && !(end + 3 <= len && data[end] == 0 && data[end + 1] == 0 && data[end + 2] <= 1)) {
+      end++;
+    }
+    size_t next = end;
+    while (next + 3 <= len && !(data[next] == 0 && data[next + 1] == 0 && data[next + 2] == 1)) {
+      next++;
+    }
+    if (end > i) {
+      nals.push_back(Bytes(data + i, data + end));
+    }
+    i = next + 3;
+  }
+  return nals;
+}
+
+/**
+ * @brief Appends a NAL unit with random contents, and to expected if the packetizer should send it.
+ */
+static void appendNal(Bytes& stream, std::vector<Bytes>& expected, uint8_t type, uint8_t layerId, uint8_t tid, size_t len, bool firstSlice) {
+  static const uint8_t startCode[] = { 0, 0, 0, 1 };
+  stream.insert(stream.end(), rand() % 2 ? startCode : startCode + 1, startCode + 4);
+  Bytes nal(len);
+  for (size_t i = 0; i < len; i++) {
+    nal[i] = 1 + rand() % 255; // No zeros, so no start code emulation
+  }
+  nal[0] = (type << 1) | (layerId >> 5);
+  if (len > 1) {
+    nal[1] = ((layerId & 0x1F) << 3) | tid;
+  }
+  if (len > 2) {
+    nal[2] = firstSlice ? (nal[2] | 0x80) : (nal[2] & 0x7F); // first_slice_segment_in_pic_flag
+  }
+  stream.insert(stream.end(), nal.begin(), nal.end());
+  if (len >= 2) {
+    expected.push_back(nal);
+  }
+}
+
+/**
+ * @brief Makes a synthetic access unit, with its NAL units as they should come out.
+ */
+static void makeAccessUnit(int frame, Bytes& stream, std::vector<Bytes>& expected) {
+  appendNal(stream, expected, 35, 0, 1, 3, true); // Access unit delimiter
+  if (frame % HOST_GOP == 0) {
+    // Parameter sets of other layers and sub-layers, the AP header takes the lowest of each
+    int gop = frame / HOST_GOP;
+    appendNal(stream, expected, 32, gop % 3, 1 + gop % 4, 16 + rand() % 16, true); // VPS
+    appendNal(stream, expected, 33, (gop + 1) % 3, 1 + (gop + 2) % 4, 30 + rand() % 60, true); // SPS
+    appendNal(stream, expected, 34, (gop + 2) % 3, 1 + (gop + 1) % 4, 6 + rand() % 10, true); // PPS
+    appendNal(stream, expected, 39, 0, 1, 10 + rand() % 30, true); // Prefix SEI
+    appendNal(stream, expected, 19, 0, 1, 3000 + rand() % 9000, true); // IDR_W_RADL slice segments
+    appendNal(stream, expected, 19, 0, 1, 3000 + rand() % 9000, false);
+  } else {
+    bool shortFirst = rand() % 10 == 0;
+    bool shortLast = rand() % 10 == 0;
+    if (shortFirst) {
+      appendNal(stream, expected, 1, 0, 1, 1, false); // Too short for a NAL unit header
+    }
+    size_t len = rand() % 4 == 0 ? 3 + rand() % 20 : 200 + rand() % 4000;
+    appendNal(stream, expected, 1, 0, 1 + rand() % 3, len, true); // TRAIL_R
+    if (shortLast) {
+      appendNal(stream, expected, 1, 0, 1, 1, false);
+    }
+  }
+}
+
+/**
+ * @brief Cuts a recorded stream into access units per H.265 7.4.2.4.4.
+ */
+static std::vector<std::vector<Bytes> > cutAccessUnits(const std::vector<Bytes>& nals) {
+  std::vector<std::vector<Bytes> > units;
+  bool hasSlice = false;
+  for (size_t i = 0; i < nals.size(); i++) {
+    if (nals[i].size() < 3) {
+      continue;
+    }
+    uint8_t type = nalType(nals[i].data());
+    bool isSlice = type <= 31;
+    bool firstSlice = isSlice && (nals[i][2] & 0x80);
+    if (units.empty() || (hasSlice && ((type >= 32 && type <= 35) || type == 39 || firstSlice))) {
+      units.push_back(std::vector<Bytes>());
+      hasSlice = false;
+    }
+    units.back().push_back(nals[i]);
+    hasSlice |= isSlice;
+  }
+  return units;
+}
+
+/**
+ * @brief Checks the packets of one access unit and depacketizes them.
+ */
+static std::vector<Bytes> depacketize(const std::vector<HostPacket>& packets, size_t maxPayload, int accessUnit, HostCounts& counts) {
+  std::vector<Bytes> nals;
+  Bytes fragmented;
+  bool inFragment = false;
+  for (size_t p = 0; p < packets.size(); p++) {
+    const Bytes& payload = packets[p].payload;
+    if (payload.size() < 2 || payload.size() > maxPayload) {
+      fail("packet too short or over the payload size", accessUnit);
+      continue;
+    }
+    if (packets[p].marker != (p + 1 == packets.size())) {
+      fail("marker bit not on the last packet only", accessUnit);
+    }
+    uint8_t type = nalType(payload.data());
+    if (inFragment && type != 49) {
+      fail("FU without end bit", accessUnit);
+      inFragment = false;
+    }
+    if (type < 48) {
+      nals.push_back(payload);
+      counts.single++;
+    } else if (type == 48) {
+      uint8_t layerId = 0x3F;
+      uint8_t tid = 0x07;
+      size_t at = 2;
+      int units = 0;
+      while (at + 2 <= payload.size()) {
+        size_t len = (payload[at] << 8) | payload[at + 1];
+        at += 2;
+        if (len < 2 || at + len > payload.size()) {
+          fail("AP unit overruns the packet", accessUnit);
+          break;
+        }
+        const uint8_t* unit = payload.data() + at;
+        if (nalType(unit) < 32 || nalType(unit) > 34) {
+          fail("AP with something other than parameter sets", accessUnit);
+        }
+        layerId = nalLayerId(unit) < layerId ? nalLayerId(unit) : layerId;
+        tid = nalTid(unit) < tid ? nalTid(unit) : tid;
+        nals.push_back(Bytes(unit, unit + len));
+        at += len;
+        units++;
+      }
+      if (at != payload.size() || units < 2 || (payload[0] & 0x80)) {
+        fail("malformed AP", accessUnit);
+      }
+      if (nalLayerId(payload.data()) != layerId || nalTid(payload.data()) != tid) {
+        fail("AP header without the lowest LayerId and TID of its units", accessUnit);
+      }
+      counts.ap++;
+    } else if (type == 49 && payload.size() > 3) {
+      bool start = payload[2] & 0x80;
+      bool end = payload[2] & 0x40;
+      if (start == inFragment) {
+        fail("FU start bit out of place", accessUnit);
+      }
+      if (start) {
+        // The payload header keeps F, LayerId and TID, the FU header has the type
+        fragmented.assign(1, (payload[0] & 0x81) | ((payload[2] & 0x3F) << 1));
+        fragmented.push_back(payload[1]);
+        inFragment = true;
+      } else if (fragmented.size() < 2 || payload[0] != ((fragmented[0] & 0x81) | (49 << 1)) || payload[1] != fragmented[1]) {
+        fail("FU payload header changes within a NAL unit", accessUnit);
+      }
+      if (!end && payload.size() != maxPayload) {
+        fail("FU fragment before the last not full", accessUnit);
+      }
+      fragmented.insert(fragmented.end(), payload.begin() + 3, payload.end());
+      counts.fragments++;
+      if (end) {
+        if (fragmented.size() <= maxPayload) {
+          fail("FU for a NAL unit that fits a packet", accessUnit);
+        }
+        nals.push_back(fragmented);
+        inFragment = false;
+        counts.fu++;
+      }
+    } else {
+      fail("unexpected packet type", accessUnit);
+    }
+  }
+  if (inFragment) {
+    fail("access unit ends inside an FU", accessUnit);
+  }
+  return nals;
+}
+
+static void checkAccessUnit(const Bytes& stream, const std::vector<Bytes>& expected, int accessUnit, HostCounts* counts) {
+  RTP_NalUnit nals[HOST_MAX_NALS];
+  size_t nalCount = RTSP_NalPacketizer::splitAnnexB(stream.data(), stream.size(), nals, HOST_MAX_NALS);
+
+  static const size_t payloadSizes[] = { 1438, 500, 8192 }; // UDP, a small Blocksize, TCP
+  uint8_t aggregate[HOST_AGGREGATE_SIZE];
+  for (size_t s = 0; s < sizeof(payloadSizes) / sizeof(payloadSizes[0]); s++) {
+    std::vector<HostPacket> packets;
+    RTSP_NalPacketizer packetizer(payloadSizes[s], aggregate, sizeof(aggregate), collect, &packets);
+    if (!packetizer.packetizeH265(nals, nalCount)) {
+      fail("packetizer stopped", accessUnit);
+    }
+    if (depacketize(packets, payloadSizes[s], accessUnit, counts[s]) != expected) {
+      fail("depacketized NAL units differ", accessUnit);
+    }
+    counts[s].accessUnits++;
+    counts[s].nals += expected.size();
+  }
+}
+
+static Bytes readFile(const char* path) {
+  Bytes data;
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    return data;
+  }
+  uint8_t block[65536];
+  size_t len;
+  while ((len = fread(block, 1, sizeof(block), file)) > 0) {
+    data.insert(data.end(), block, block + len);
+  }
+  fclose(file);
+  return data;
+}
+
+int main(int argc, char** argv) {
+  srand(1);
+  HostCounts counts[3] = {};
+
+  if (argc < 2) {
+    for (int frame = 0; frame < HOST_FRAMES; frame++) {
+      Bytes stream;
+      std::vector<Bytes> expected;
+      makeAccessUnit(frame, stream, expected);
+      checkAccessUnit(stream, expected, frame, counts);
+    }
+  }
+  for (int arg = 1; arg < argc; arg++) {
+    Bytes data = readFile(argv[arg]);
+    if (data.empty()) {
+      printf("FAIL: can't read %s\n", argv[arg]);
+      return 1;
+    }
+    std::vector<std::vector<Bytes> > units = cutAccessUnits(scanNals(data.data(), data.size()));
+    for (size_t u = 0; u < units.size(); u++) {
+      if (units[u].size() > HOST_MAX_NALS) {
+        continue;
+      }
+      Bytes stream;
+      for (size_t i = 0; i < units[u].size(); i++) {
+        static const uint8_t startCode[] = { 0, 0, 0, 1 };
+        stream.insert(stream.end(), startCode, startCode + 4);
+        stream.insert(stream.end(), units[u][i].begin(), units[u][i].end());
+      }
+      checkAccessUnit(stream, units[u], u, counts);
+    }
+    printf("%s: %zu access units\n", argv[arg], units.size());
+  }
+
+  static const char* names[] = { "UDP 1438", "Blocksize 500", "TCP 8192" };
+  for (int s = 0; s < 3; s++) {
+    printf("%-14s %d access units, %d NAL units: %d single, %d AP, %d FU in %d fragments\n", names[s],
+           counts[s].accessUnits, counts[s].nals, counts[s].single, counts[s].ap, counts[s].fu, counts[s].fragments);
+  }
+  if (counts[0].ap == 0 || counts[0].fu == 0 || counts[0].single == 0) {
+    printf("FAIL: not every packet type was made\n");
+    passed = false;
+  }
+  printf(passed ? "PASS\n" : "FAIL\n");
+  return passed ? 0 : 1;
+}
@@ -0,0 +1,201 @@
+/**
+ * Host check for the backchannel jitter buffer, see RTSPServer::setBackchannelCallback().
+ *
+ * A talker sends 20 ms RTP packets over a simulated network in four phases: a clean LAN, a
+ * congested one that delays packets by up to 80 ms, reorders, loses and duplicates them, the clean
+ * LAN again, and after a pause a second talkspurt in PCMU from a new source. Time is simulated,
+ * the consumer pops every millisecond like the playout task. Each packet carries its number in
+ * its samples, so the played stream can be checked to be in order, across the wrap of the
+ * sequence numbers, and to have its delay grow with the jitter and come back down after it.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -Isrc -o jitterBufferHost extras/jitterBufferHost/jitterBufferHost.cpp src/jitterBuffer.cpp
+ *   ./jitterBufferHost
+ */
+
+#include "jitterBuffer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+#define HOST_L16_RATE 16000
+#define HOST_PACKET_MS 20
+#define HOST_CLEAN_MS 5000
+#define HOST_CONGESTED_MS 5000
+#define HOST_PAUSE_MS 1000
+#define HOST_PCMU_MS 2000
+
+struct HostPacket {
+  int64_t arrivalUs;
+  int order; // Keeps packets arriving at the same time in sending order
+  std::vector<uint8_t> data;
+};
+
+/**
+ * @brief Encodes a sample as G.711 mu-law, to check the decoder against.
+ */
+static uint8_t encodeUlaw(int16_t sample) {
+  int sign = sample < 0 ? 0x80 : 0;
+  int magnitude = sample < 0 ? -(int)sample : sample;
+  magnitude = (magnitude > 32635 ? 32635 : magnitude) + 0x84;
+  int exponent = 7;
+  for (int mask = 0x4000; exponent > 0 && !(magnitude & mask); mask >>= 1) {
+    exponent--;
+  }
+  int mantissa = (magnitude >> (exponent + 3)) & 0x0F;
+  return ~(sign | (exponent << 4) | mantissa);
+}
+
+static std::vector<uint8_t> makePacket(uint8_t payloadType, uint16_t seq, uint32_t timestamp, uint32_t ssrc, size_t samples, int16_t value) {
+  std::vector<uint8_t> packet(12);
+  packet[0] = 0x80;
+  packet[1] = payloadType;
+  packet[2] = seq >> 8;
+  packet[3] = seq;
+  for (int i = 0; i < 4; i++) {
+    packet[4 + i] = timestamp >> (24 - 8 * i);
+    packet[8 + i] = ssrc >> (24 - 8 * i);
+  }
+  for (size_t i = 0; i < samples; i++) {
+    if (payloadType == RTSP_JITTER_PT_PCMU) {
+      packet.push_back(encodeUlaw(value));
+    } else {
+      packet.push_back((uint16_t)value >> 8);
+      packet.push_back((uint16_t)value & 0xFF);
+    }
+  }
+  return packet;
+}
+
+int main() {
+  srand(1);
+  std::vector<HostPacket> network;
+  int order = 0;
+  int sent = 0;
+  int duplicated = 0;
+  int dropped = 0;
+
+  // Talkspurt one, L16 through clean, congested and clean again
+  const int l16Packets = (2 * HOST_CLEAN_MS + HOST_CONGESTED_MS) / HOST_PACKET_MS;
+  const size_t l16Samples = HOST_L16_RATE * HOST_PACKET_MS / 1000;
+  for (int n = 0; n < l16Packets; n++) {
+    int64_t sentUs = (int64_t)n * HOST_PACKET_MS * 1000;
+    bool congested = sentUs >= HOST_CLEAN_MS * 1000LL && sentUs < (HOST_CLEAN_MS + HOST_CONGESTED_MS) * 1000LL;
+    int64_t delayUs = 1000 + rand() % (congested ? 80000 : 2000);
+    sent++;
+    if (congested && rand() % 100 < 3) {
+      dropped++;
+      continue;
+    }
+    std::vector<uint8_t> packet = makePacket(RTSP_JITTER_PT_L16, (uint16_t)(65300 + n), 1000 + n * l16Samples, 0x1234, l16Samples, (int16_t)n);
+    network.push_back({sentUs + delayUs, order++, packet});
+    if (congested && rand() % 100 < 2) {
+      network.push_back({sentUs + delayUs + rand() % 30000, order++, packet});
+      duplicated++;
+    }
+  }
+
+  // Talkspurt two, PCMU from another source after a pause
+  const int64_t pcmuStartUs = (2 * HOST_CLEAN_MS + HOST_CONGESTED_MS + HOST_PAUSE_MS) * 1000LL;
+  const int pcmuPackets = HOST_PCMU_MS / HOST_PACKET_MS;
+  const size_t pcmuSamples = 8000 * HOST_PACKET_MS / 1000;
+  for (int n = 0; n < pcmuPackets; n++) {
+    int64_t sentUs = pcmuStartUs + (int64_t)n * HOST_PACKET_MS * 1000;
+    network.push_back({sentUs + 1000 + rand() % 2000, order++,
+                       makePacket(RTSP_JITTER_PT_PCMU, (uint16_t)(7 + n), 555 + n * pcmuSamples, 0x5678, pcmuSamples, (int16_t)(-1000 * (n % 30)))});
+    sent++;
+  }
+  std::sort(network.begin(), network.end(), [](const HostPacket& a, const HostPacket& b) {
+    return a.arrivalUs != b.arrivalUs ? a.arrivalUs < b.arrivalUs : a.order < b.order;
+  });
+
+  RTSP_JitterBuffer buffer;
+  if (!buffer.begin(HOST_L16_RATE)) {
+    printf("FAIL: begin\n");
+    return 1;
+  }
+
+  bool passed = true;
+  size_t next = 0;
+  int lastL16 = -1;
+  int lastPcmu = -1;
+  int played = 0;
+  int silent = 0;
+  uint32_t maxDelayMs = 0;
+  uint32_t cleanDelayMs = 0;
+  uint32_t settledDelayMs = 0;
+  int64_t lastPlayUs = -1;
+  int64_t worstGapUs = 0;
+  const int64_t endUs = pcmuStartUs + (HOST_PCMU_MS + 500) * 1000LL;
+  for (int64_t nowUs = 0; nowUs < endUs; nowUs += 1000) {
+    while (next < network.size() && network[next].arrivalUs <= nowUs) {
+      const HostPacket& packet = network[next++];
+      memcpy(buffer.receiveBuffer(), packet.data.data(), packet.data.size());
+      if (!buffer.commit(packet.data.size(), packet.arrivalUs)) {
+        printf("FAIL: packet refused\n");
+        passed = false;
+      }
+    }
+    RTSP_JitterPacket out;
+    RTSP_JitterResult result;
+    while ((result = buffer.pop(nowUs, out)) == RTSP_JITTER_PACKET || result == RTSP_JITTER_LOST) {
+      if (result == RTSP_JITTER_LOST) {
+        silent++;
+        continue;
+      }
+      played++;
+      if (out.sampleRate == HOST_L16_RATE) {
+        int n = out.samples[0];
+        if (out.count != l16Samples || n <= lastL16 || out.samples[out.count - 1] != n) {
+          printf("FAIL: L16 packet %d played after %d, %zu samples\n", n, lastL16, out.count);
+          passed = false;
+        }
+        lastL16 = n;
+      } else {
+        int n = lastPcmu + 1;
+        while (n < pcmuPackets && abs(out.samples[0] - -1000 * (n % 30)) > 8 + 1000 * (n % 30) / 16) { // Within a mu-law step
+          n++;
+        }
+        if (out.count != pcmuSamples || n >= pcmuPackets) {
+          printf("FAIL: PCMU packet out of order or misdecoded, first sample %d\n", out.samples[0]);
+          passed = false;
+        }
+        lastPcmu = n;
+      }
+      if (lastPlayUs >= 0 && nowUs - lastPlayUs > worstGapUs && nowUs < pcmuStartUs - HOST_PAUSE_MS * 1000LL) {
+        worstGapUs = nowUs - lastPlayUs;
+      }
+      lastPlayUs = nowUs;
+    }
+    uint32_t delayMs = buffer.delayMs();
+    maxDelayMs = delayMs > maxDelayMs ? delayMs : maxDelayMs;
+    if (nowUs == HOST_CLEAN_MS * 1000LL - 1000) {
+      cleanDelayMs = delayMs;
+    }
+    if (nowUs == (2 * HOST_CLEAN_MS + HOST_CONGESTED_MS) * 1000LL - 1000) {
+      settledDelayMs = delayMs;
+    }
+  }
+
+  int expected = sent - dropped;
+  printf("sent       %d packets, %d lost and %d duplicated on the way\n", sent, dropped, duplicated);
+  printf("played     %d, %d as silence, %u late or dropped for delay\n", played, silent, buffer.packetsLate());
+  printf("delay      %u ms clean, %u ms at most when congested, %u ms after settling\n", cleanDelayMs, maxDelayMs, settledDelayMs);
+  printf("worst gap  %.1f ms between packets played\n", worstGapUs / 1000.0);
+  if (played + (int)buffer.packetsLate() < expected - 2 || played < expected * 9 / 10) {
+    printf("FAIL: %d of %d packets played\n", played, expected);
+    passed = false;
+  }
+  if (cleanDelayMs > RTSP_JITTER_MIN_DELAY_MS + 5 || maxDelayMs <= cleanDelayMs || settledDelayMs > cleanDelayMs + 2 * HOST_PACKET_MS) {
+    printf("FAIL: delay doesn't follow the jitter\n");
+    passed = false;
+  }
+  if (lastPcmu != pcmuPackets - 1) {
+    printf("FAIL: second talkspurt ended at packet %d\n", lastPcmu);
+    passed = false;
+  }
+  printf(passed ? "PASS\n" : "FAIL\n");
+  return passed ? 0 : 1;
+}
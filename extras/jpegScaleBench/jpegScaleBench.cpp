@@ -0,0 +1,113 @@
+/**
+ * Host benchmark for the preview scaler, see RTSPServer::setPreviewScale().
+ *
+ * Scales each JPEG given on the command line at 1/2, 1/4 and 1/8 and prints the time per frame
+ * and the output size. Use frames saved from the camera at the resolutions you stream.
+ *
+ * Build and run from the library folder:
+ *   g++ -O2 -Isrc -o jpegScaleBench extras/jpegScaleBench/jpegScaleBench.cpp src/jpegScale.cpp
+ *   ./jpegScaleBench vga.jpg svga.jpg uxga.jpg
+ *
+ * Pass -w to also write each scaled frame next to its input as <name>_<scale>.jpg.
+ */
+
+#include "jpegScale.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_RUNS 20
+#define BENCH_MIN_NS 500000000LL // Keep scaling a frame for at least half a second
+
+static long long nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static uint8_t* readFile(const char* path, size_t& len) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return NULL;
+  }
+  fseek(file, 0, SEEK_END);
+  len = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t* data = (uint8_t*)malloc(len);
+  if (data && fread(data, 1, len, file) != len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(file);
+  return data;
+}
+
+static void writeScaled(const char* path, uint8_t scale, const uint8_t* data, size_t len) {
+  char name[512];
+  const char* dot = strrchr(path, '.');
+  int stem = dot ? (int)(dot - path) : (int)strlen(path);
+  snprintf(name, sizeof(name), "%.*s_%u.jpg", stem, path, scale);
+  FILE* file = fopen(name, "wb");
+  if (file) {
+    fwrite(data, 1, len, file);
+    fclose(file);
+  }
+}
+
+int main(int argc, char** argv) {
+  bool write = false;
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0) {
+      write = true;
+    } else {
+      files++;
+    }
+  }
+  if (files == 0) {
+    fprintf(stderr, "usage: %s [-w] frame.jpg...\n", argv[0]);
+    return 1;
+  }
+
+  const uint8_t scales[] = { 2, 4, 8 };
+  RTSP_JpegScaler scaler;
+  printf("%-24s %9s %6s %11s %9s %10s\n", "frame", "bytes", "scale", "output", "bytes", "ms/frame");
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-w") == 0) {
+      continue;
+    }
+    size_t len = 0;
+    uint8_t* jpeg = readFile(argv[i], len);
+    if (!jpeg) {
+      fprintf(stderr, "%s: can't read\n", argv[i]);
+      continue;
+    }
+    for (uint8_t scale : scales) {
+      scaler.setScale(scale);
+      uint16_t width = 0;
+      uint16_t height = 0;
+      size_t outLen = scaler.scale(jpeg, len, width, height); // Also sizes the buffers
+      if (outLen == 0) {
+        printf("%-24s not a baseline JPEG the scaler can handle\n", argv[i]);
+        break;
+      }
+      int runs = 0;
+      long long start = nowNs();
+      long long elapsed = 0;
+      while (runs < BENCH_MIN_RUNS || elapsed < BENCH_MIN_NS) {
+        scaler.scale(jpeg, len, width, height);
+        runs++;
+        elapsed = nowNs() - start;
+      }
+      char outSize[16];
+      snprintf(outSize, sizeof(outSize), "%ux%u", width, height);
+      printf("%-24s %9zu %6s %11s %9zu %10.3f\n", argv[i], len, scale == 2 ? "1/2" : (scale == 4 ? "1/4" : "1/8"), outSize, outLen, elapsed / 1e6 / runs);
+      if (write) {
+        writeScaled(argv[i], scale, scaler.output(), outLen);
+      }
+    }
+    free(jpeg);
+  }
+  return 0;
+}
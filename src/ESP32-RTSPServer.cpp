@@ -6,6 +6,7 @@ RTSPServer::RTSPServer()
   : rtpFps(0),
     // User can change these settings
     transport(VIDEO_ONLY), // Default transport 
+    videoCodec(VIDEO_MJPEG), // Default video payload
     sampleRate(0),
     rtspPort(554),
     rtpIp(IPAddress(239, 255, 0, 1)), // Default RTP IP 
@@ -16,17 +17,28 @@ RTSPServer::RTSPServer()
     maxRTSPClients(3),
     //
     rtspSocket(-1),
+    httpSocket(-1),
+    httpPort(0),
     videoUnicastSocket(-1),
     audioUnicastSocket(-1), 
     subtitlesUnicastSocket(-1),
     videoMulticastSocket(-1),
     audioMulticastSocket(-1),
     subtitlesMulticastSocket(-1),
+    videoRtcpSocket(-1),
+    audioRtcpSocket(-1),
+    subtitlesRtcpSocket(-1),
     activeRTSPClients(0),
     maxClients(1),
     rtpVideoTaskHandle(NULL),
     rtspTaskHandle(NULL),
+    mediaSchedulerTaskHandle(NULL),
+    videoQueue{},
+    audioQueue{},
+    subtitlesQueue{},
     rtspStreamBuffer(NULL),
+    rtspRequestBuffer(NULL),
+    packetPool{},
     rtspStreamBufferSize(0),
     rtpFrameSent(true),
     rtpAudioSent(true),
@@ -34,17 +46,33 @@ RTSPServer::RTSPServer()
     vQuality(0),
     vWidth(0),
     vHeight(0),
+    vTimestampUs(0),
     videoSequenceNumber(0),
     videoTimestamp(0),
     audioSequenceNumber(0),
     audioTimestamp(0),
     subtitlesSequenceNumber(0),
     subtitlesTimestamp(0),
+    videoClockOffset(0),
+    audioClockOffset(0),
+    subtitlesClockOffset(0),
+    audioClockAnchored(false),
+    lastVideoSRTime(0),
+    lastAudioSRTime(0),
+    lastSubtitlesSRTime(0),
     rtpFrameCount(0),
+    sliceLen(0),
+    sliceOffset(0),
+    sliceFragmentSize(MAX_VIDEO_FRAGMENT_SIZE),
+    sliceQuality(0),
+    sliceWidth(0),
+    sliceHeight(0),
+    sliceSendUs(0),
+    sliceStreams(0),
+    sliceActive(false),
+    h264ParameterSets(false),
+    h265ParameterSets(true),
     lastRtpFPSUpdateTime(0),
-    videoCh(0),
-    audioCh(0),
-    subtitlesCh(0),
     isVideo(false),
     isAudio(false),
     isSubtitles(false),
@@ -52,11 +80,86 @@ RTSPServer::RTSPServer()
     firstClientConnected(false),
     firstClientIsMulticast(false),
     firstClientIsTCP(false),
-    authEnabled(false) // Initialize authEnabled to false
+    authEnabled(false), // Initialize authEnabled to false
+    socketOptions{0, RTSP_DSCP_DEFAULT, RTSP_DSCP_DEFAULT, RTSP_DSCP_DEFAULT, RTSP_DSCP_DEFAULT, IPAddress(), false},
+    mtu(RTSP_DEFAULT_MTU),
+    udpVideoPayloadSize(MAX_VIDEO_FRAGMENT_SIZE),
+    udpAudioPayloadSize(MAX_AUDIO_FRAGMENT_SIZE),
+    tcpFragmentSize(RTSP_TCP_FRAGMENT_SIZE),
+    tcpPriorityWaiting(0),
+    tcpVideoWaiting(0),
+    multicastVideoStats{},
+    multicastAudioStats{},
+    multicastSubtitlesStats{},
+    closedVideoStats{},
+    closedAudioStats{},
+    closedSubtitlesStats{},
+    videoFrameCount(0),
+    videoFramesDropped(0),
+    audioBlockCount(0),
+    audioBlocksDropped(0),
+    subtitlesCount(0),
+    subtitlesDropped(0),
+    rtspRequestCount(0),
+    rejectedClientCount(0),
+    timedOutSessionCount(0),
+    sessionTimeout(RTSP_SESSION_TIMEOUT),
+    sessionTimers{},
+    uplinkBudget(0),
+    cpuBudget(0),
+    videoFrameBytesAvg(0),
+    videoSendUsAvg(0),
+    previewScale(0),
+    previewLen(0),
+    previewWidth(0),
+    previewHeight(0),
+    staticKeepaliveFps(0),
+    staticSizeTolerance(0),
+    frameChangedHint(-1),
+    staticFrameLen(0),
+    staticFrameChecksum(0),
+    staticFrameDueUs(0),
+    videoFramesSuppressed(0),
+    httpFrames{},
+    httpClients{},
+    httpNewestFrame(-1),
+    httpFrameSequence(0),
+    httpClientCount(0),
+    wakeSocket(-1),
+    wakePort(0),
+    httpProbeSock(-1),
+    httpFramesSent(0),
+    httpFramesDropped(0),
+    recordTaskHandle(NULL),
+    recordStopping(false),
+    recordResult(false),
+    players{},
+    playbackTaskHandle(NULL),
+    playbackSending(false),
+    playbackWaiters(0),
+    playbackDirectory{},
+    backchannelTaskHandle(NULL),
+    backchannelStopping(false),
+    backchannelCallback(NULL),
+    backchannelTalker(0),
+    backchannelLastUs(0)
 {
     isPlayingMutex = xSemaphoreCreateMutex(); // Initialize the mutex
+    sessionsMutex = xSemaphoreCreateMutex();
+    sessionsIdle = xSemaphoreCreateBinary();
+    sessionReaders = 0;
     sendTcpMutex = xSemaphoreCreateMutex(); // Initialize the mutex
+    tcpPriorityIdle = xSemaphoreCreateCounting(RTSP_TCP_VIDEO_WRITERS, 0);
     maxClientsMutex = xSemaphoreCreateMutex();
+    httpFrameMutex = xSemaphoreCreateMutex();
+    recordMutex = xSemaphoreCreateMutex();
+    playbackMutex = xSemaphoreCreateMutex();
+    backchannelMutex = xSemaphoreCreateMutex();
+#ifdef RTSP_PROFILING
+    traceHook = NULL;
+    videoHandoffCycles = 0;
+    resetProfile();
+#endif
 #ifdef RTSP_LOGGING_ENABLED
     esp_log_level_set(LOG_TAG, ESP_LOG_DEBUG); // Set log level to DEBUG
 #endif
@@ -66,8 +169,15 @@ RTSPServer::~RTSPServer() {
   // Clean up resources
   deinit();
   vSemaphoreDelete(this->isPlayingMutex);
+  vSemaphoreDelete(this->sessionsMutex);
+  vSemaphoreDelete(this->sessionsIdle);
   vSemaphoreDelete(this->sendTcpMutex);
+  vSemaphoreDelete(this->tcpPriorityIdle);
   vSemaphoreDelete(this->maxClientsMutex);
+  vSemaphoreDelete(this->httpFrameMutex);
+  vSemaphoreDelete(this->recordMutex);
+  vSemaphoreDelete(this->playbackMutex);
+  vSemaphoreDelete(this->backchannelMutex);
 }
 
 bool RTSPServer::init(TransportType transport, uint16_t rtspPort, uint32_t sampleRate, uint16_t port1, uint16_t port2, uint16_t port3, IPAddress rtpIp, uint8_t rtpTTL) {
@@ -139,6 +249,7 @@ bool RTSPServer::init(TransportType transport, uint16_t rtspPort, uint32_t sampl
 }
 
 void RTSPServer::deinit() {
+  stopRecording();
   if (this->rtspTaskHandle != NULL) {
     vTaskDelete(this->rtspTaskHandle);
     this->rtspTaskHandle = NULL;
@@ -147,15 +258,36 @@ void RTSPServer::deinit() {
     vTaskDelete(this->rtpVideoTaskHandle);
     this->rtpVideoTaskHandle = NULL;
   }
+  stopMediaScheduler();
+  closePlaybacks();
+  stopBackchannel();
   if (this->rtspSocket >= 0) {
     close(this->rtspSocket);
     this->rtspSocket = -1;
   }
+  if (this->httpSocket >= 0) {
+    close(this->httpSocket);
+    this->httpSocket = -1;
+  }
   
   closeSockets();
+  closeHttpClients();
   
   if (this->rtspStreamBuffer) {
     free(this->rtspStreamBuffer);
+    this->rtspStreamBuffer = NULL;
+  }
+
+  if (this->rtspRequestBuffer) {
+    free(this->rtspRequestBuffer);
+    this->rtspRequestBuffer = NULL;
+  }
+  packetPoolFree();
+  this->previewScaler.release();
+
+  if (this->frameCache.buffer()) {
+    free(this->frameCache.buffer());
+    this->frameCache.setBuffer(NULL, 0);
   }
 
   RTSP_LOGI(LOG_TAG, "RTSP server deinitialized.");
@@ -191,6 +323,19 @@ void RTSPServer::closeSockets() {
     close(subtitlesMulticastSocket);
     subtitlesMulticastSocket = -1;
   }
+  if (videoRtcpSocket != -1) {
+    close(videoRtcpSocket);
+    videoRtcpSocket = -1;
+  }
+  if (audioRtcpSocket != -1) {
+    close(audioRtcpSocket);
+    audioRtcpSocket = -1;
+  }
+  if (subtitlesRtcpSocket != -1) {
+    close(subtitlesRtcpSocket);
+    subtitlesRtcpSocket = -1;
+  }
+  this->audioClockAnchored = false;
 }
 
 bool RTSPServer::prepRTSP() {
@@ -199,162 +344,407 @@ bool RTSPServer::prepRTSP() {
   this->audioSSRC = static_cast<uint32_t>((mac >> 32) & 0xFFFFFFFF);
   this->subtitlesSSRC = static_cast<uint32_t>((mac >> 48) & 0xFFFFFFFF);
 
-  this->rtspSocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (this->rtspSocket < 0) {
-    RTSP_LOGE(LOG_TAG, "Failed to create RTSP socket.");
-    return false;
-  }
+  // Random RTP timestamp origins on the shared media clock (RFC 3550 5.1)
+  this->videoClockOffset = esp_random();
+  this->audioClockOffset = esp_random();
+  this->subtitlesClockOffset = esp_random();
 
-  if (!setNonBlocking(this->rtspSocket)) {
-    RTSP_LOGE(LOG_TAG, "Failed to set RTSP socket to non-blocking mode.");
-    close(this->rtspSocket);
+  // All buffers the server sends from are allocated once here, nothing is allocated per packet or request
+  if (!packetPoolInit()) {
+    RTSP_LOGE(LOG_TAG, "Failed to allocate packet buffers.");
     return false;
   }
+  if (this->rtspRequestBuffer == NULL) {
+    this->rtspRequestBuffer = (char*)(psramFound() ? ps_malloc(RTSP_BUFFER_SIZE) : malloc(RTSP_BUFFER_SIZE));
+    if (this->rtspRequestBuffer == NULL) {
+      RTSP_LOGE(LOG_TAG, "Failed to allocate RTSP request buffer.");
+      return false;
+    }
+  }
 
-  struct sockaddr_in serverAddr;
-  serverAddr.sin_family = AF_INET;
-  serverAddr.sin_addr.s_addr = INADDR_ANY;
-  serverAddr.sin_port = htons(this->rtspPort);
+  // A multicast interface that isn't one of ours would silently send nowhere
+  if (this->socketOptions.multicastInterface != IPAddress() &&
+      this->socketOptions.multicastInterface != WiFi.localIP() && this->socketOptions.multicastInterface != WiFi.softAPIP()) {
+    RTSP_LOGW(LOG_TAG, "Multicast interface %s is not a local address, using the default interface", this->socketOptions.multicastInterface.toString().c_str());
+    this->socketOptions.multicastInterface = IPAddress();
+  }
 
-  if (bind(this->rtspSocket, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
-    RTSP_LOGE(LOG_TAG, "Failed to bind RTSP socket: %d", this->rtspSocket);
-    close(this->rtspSocket);
+  this->rtspSocket = createListenSocket(this->rtspPort);
+  if (this->rtspSocket < 0) {
     return false;
   }
-  
-  if (listen(this->rtspSocket, 5) < 0) {
-    RTSP_LOGE(LOG_TAG, "Failed to listen on RTSP socket.");
-    close(this->rtspSocket);
-    return false;
+
+  // Only for RTSP-over-HTTP tunnels, the RTSP port takes them as well so a failure here isn't fatal
+  if (this->httpPort && this->httpPort != this->rtspPort && this->httpSocket < 0) {
+    this->httpSocket = createListenSocket(this->httpPort);
   }
+  openWakeSocket();
 
   if (this->rtspTaskHandle == NULL) {
-    if (xTaskCreate(rtspTaskWrapper, "rtspTask", RTSP_STACK_SIZE, this, RTSP_PRI, &this->rtspTaskHandle) != pdPASS) {
+    if (xTaskCreatePinnedToCore(rtspTaskWrapper, "rtspTask", RTSP_STACK_SIZE, this, RTSP_PRI, &this->rtspTaskHandle, RTSP_CORE) != pdPASS) {
       RTSP_LOGE(LOG_TAG, "Failed to create RTSP task.");
       close(this->rtspSocket);
       return false;
     }
   }
 
+#ifdef RTSP_MEDIA_SCHEDULER
+  startMediaScheduler();
+#endif
+
   RTSP_LOGI(LOG_TAG, "RTSP server setup completed, listening on port: %d", this->rtspPort);
   return true;
 }
 
+/**
+ * @brief Opens a non-blocking listening TCP socket.
+ *
+ * @param port Port to listen on.
+ * @return The socket, -1 on failure.
+ */
+int RTSPServer::createListenSocket(uint16_t port) {
+  int sock = socket(AF_INET, SOCK_STREAM, 0);
+  if (sock < 0) {
+    RTSP_LOGE(LOG_TAG, "Failed to create RTSP socket.");
+    return -1;
+  }
+
+  if (!setNonBlocking(sock)) {
+    RTSP_LOGE(LOG_TAG, "Failed to set RTSP socket to non-blocking mode.");
+    close(sock);
+    return -1;
+  }
+
+  applySocketOptions(sock, this->socketOptions.rtspDscp, false);
+
+  struct sockaddr_in serverAddr;
+  serverAddr.sin_family = AF_INET;
+  serverAddr.sin_addr.s_addr = INADDR_ANY;
+  serverAddr.sin_port = htons(port);
+
+  if (bind(sock, (struct sockaddr *)&serverAddr, sizeof(serverAddr)) < 0) {
+    RTSP_LOGE(LOG_TAG, "Failed to bind RTSP socket to port %d", port);
+    close(sock);
+    return -1;
+  }
+  
+  if (listen(sock, 5) < 0) {
+    RTSP_LOGE(LOG_TAG, "Failed to listen on RTSP socket.");
+    close(sock);
+    return -1;
+  }
+  return sock;
+}
+
 void RTSPServer::rtspTaskWrapper(void* pvParameters) {
   RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
   server->rtspTask();
 }
 
 void RTSPServer::rtspTask() {
-  struct sockaddr_in clientAddr;
-  socklen_t addr_len = sizeof(clientAddr);
   fd_set read_fds;
+  fd_set write_fds;
   int client_sockets[MAX_CLIENTS] = {0};
-  int max_sd, activity, client_sock;
+  int max_sd, activity;
+  int expired[MAX_CLIENTS];
+  sessionTimerInit(esp_timer_get_time() / 1000000);
 
   while (true) {
     FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
     FD_SET(this->rtspSocket, &read_fds);
     max_sd = this->rtspSocket;
+    if (this->httpSocket >= 0) {
+      FD_SET(this->httpSocket, &read_fds);
+      if (this->httpSocket > max_sd) max_sd = this->httpSocket;
+    }
 
-    uint8_t currentMaxClients = getMaxClients();
-
-    for (int i = 0; i < currentMaxClients; i++) {
+    // Every slot is looked at, the POST connections of tunnels aren't counted in getMaxClients()
+    for (int i = 0; i < MAX_CLIENTS; i++) {
       int sd = client_sockets[i];
       if (sd > 0) FD_SET(sd, &read_fds);
       if (sd > max_sd) max_sd = sd;
     }
 
-    activity = select(max_sd + 1, &read_fds, NULL, NULL, NULL);
+    // Receiver reports from UDP clients keep their sessions alive
+    const int rtcpSockets[3] = { this->videoRtcpSocket, this->audioRtcpSocket, this->subtitlesRtcpSocket };
+    for (int r = 0; r < 3; r++) {
+      if (rtcpSockets[r] >= 0) {
+        FD_SET(rtcpSockets[r], &read_fds);
+        if (rtcpSockets[r] > max_sd) max_sd = rtcpSockets[r];
+      }
+    }
+
+    // Audio clients send back on the audio socket, see setBackchannelCallback()
+    const int backchannelSocket = this->backchannelCallback || this->backchannelTaskHandle ? this->audioUnicastSocket : -1;
+    if (backchannelSocket >= 0) {
+      FD_SET(backchannelSocket, &read_fds);
+      if (backchannelSocket > max_sd) max_sd = backchannelSocket;
+    }
+
+    // Browser clients wait for frames to be published, the wake socket ends select when one is
+    max_sd = prepareHttpClients(read_fds, write_fds, max_sd, esp_timer_get_time() / 1000000);
+
+    // Wake at least once a second to turn the session timer wheel
+    struct timeval timeout;
+    timeout.tv_sec = 1;
+    timeout.tv_usec = 0;
+    if (this->wakeSocket < 0 && this->httpClientCount > 0) {
+      timeout.tv_sec = 0;
+      timeout.tv_usec = 20000; // No wake socket, poll for new frames instead
+    }
+    activity = select(max_sd + 1, &read_fds, &write_fds, NULL, &timeout);
 
     if (activity < 0 && errno != EINTR) {
       RTSP_LOGE(LOG_TAG, "Select error");
       continue;
     }
 
-    if (FD_ISSET(this->rtspSocket, &read_fds)) {
-      if (getActiveRTSPClients() >= currentMaxClients) {
-        client_sock = accept(this->rtspSocket, (struct sockaddr *)&clientAddr, &addr_len);
-        if (client_sock < 0) {
-          RTSP_LOGE(LOG_TAG, "Accept error");
-          continue;
-        }
+    uint32_t now = esp_timer_get_time() / 1000000;
+    if (activity < 0) {
+      FD_ZERO(&read_fds); // Interrupted, the sets say nothing
+      FD_ZERO(&write_fds);
+    }
 
-        const char* response = "RTSP/1.0 503 Service Unavailable\r\n\r\n";
-        write(client_sock, response, strlen(response));
-        close(client_sock);
-        RTSP_LOGE(LOG_TAG, "Max clients reached. Sent 503 error to new client.");
-        continue;
-      }
+    serviceHttpClients(read_fds, write_fds);
 
-      client_sock = accept(this->rtspSocket, (struct sockaddr *)&clientAddr, &addr_len);
-      if (client_sock < 0) {
-        RTSP_LOGE(LOG_TAG, "Accept error");
-        continue;
+    for (int r = 0; r < 3; r++) {
+      if (rtcpSockets[r] >= 0 && FD_ISSET(rtcpSockets[r], &read_fds)) {
+        receiveRtcp(rtcpSockets[r], client_sockets, MAX_CLIENTS, now);
       }
+    }
 
-      if (!setNonBlocking(client_sock)) {
-        RTSP_LOGE(LOG_TAG, "Failed to set RTSP socket to non-blocking mode.");
-        close(client_sock);
-        continue;
-      }
+    if (backchannelSocket >= 0 && FD_ISSET(backchannelSocket, &read_fds)) {
+      receiveBackchannel(backchannelSocket, client_sockets, MAX_CLIENTS, now);
+    }
 
-      RTSP_LOGI(LOG_TAG, "New client connected");
-
-      // Create a new session for the new client
-      RTSP_Session session = {
-        esp_random(),
-        client_sock,
-        0,
-        0,
-        0,
-        0,
-        false,
-        false,
-        false
-      };
-      sessions[session.sessionID] = session;
-
-      for (int i = 0; i < currentMaxClients; i++) {
-        if (client_sockets[i] == 0) {
-          client_sockets[i] = client_sock;
-          incrementActiveRTSPClients();
-          RTSP_LOGI(LOG_TAG, "Added to list of sockets as %d", i);
-          break;
-        }
-      }
+    if (FD_ISSET(this->rtspSocket, &read_fds)) {
+      acceptRTSPClient(this->rtspSocket, client_sockets, now);
+    }
+    if (this->httpSocket >= 0 && FD_ISSET(this->httpSocket, &read_fds)) {
+      acceptRTSPClient(this->httpSocket, client_sockets, now);
     }
 
-    for (int i = 0; i < currentMaxClients; i++) {
+    for (int i = 0; i < MAX_CLIENTS; i++) {
       int sd = client_sockets[i];
 
-      if (FD_ISSET(sd, &read_fds)) {
+      if (sd > 0 && FD_ISSET(sd, &read_fds)) {
         // Get the session for this client
         RTSP_Session* session = nullptr;
         for (auto& sess : sessions) {
-          if (sess.second.sock == sd) {
+          if (sess.second.sock == sd || sess.second.tunnelSock == sd) {
             session = &sess.second;
             break;
           }
         }
-        if (session) {
-          bool keepConnection = handleRTSPRequest(*session);
+        if (session && session->tunnelSock == sd) {
+          // Tunnelled requests arrive on the POST connection, the session's timer belongs to the GET connection
+          for (int j = 0; j < MAX_CLIENTS; j++) {
+            if (client_sockets[j] == session->sock) {
+              sessionTimerTouch(j, now);
+            }
+          }
+          RTSP_PROFILE_START(requestStart);
+          bool tunnelClosed;
+          bool keepConnection = handleTunnelRequest(*session, tunnelClosed);
+          RTSP_PROFILE_END(PROFILE_RTSP_REQUEST, requestStart);
           if (!keepConnection) {
-            if (getActiveRTSPClients() == 1) {
-              setIsPlaying(false);
-              closeSockets();
-              RTSP_LOGD(LOG_TAG, "All clients disconnected. Resetting firstClientConnected flag."); 
-              this->firstClientConnected = false; 
-              this->firstClientIsMulticast = false; 
-              this->firstClientIsTCP = false; 
+            closeTunnel(*session, client_sockets);
+            for (int j = 0; j < MAX_CLIENTS; j++) {
+              if (client_sockets[j] == session->sock) {
+                sessionTimerCancel(j);
+                removeRTSPClient(client_sockets[j], *session);
+                break;
+              }
             }
-            close(sd);
+          } else if (tunnelClosed) {
+            closeTunnel(*session, client_sockets); // Clients may open a new POST for later requests
+          }
+        } else if (session) {
+          // Requests and interleaved RTCP both arrive here, either is a sign of life
+          sessionTimerTouch(i, now);
+          RTSP_PROFILE_START(requestStart);
+          bool keepConnection = handleRTSPRequest(*session);
+          RTSP_PROFILE_END(PROFILE_RTSP_REQUEST, requestStart);
+          if (!keepConnection) {
+            sessionTimerCancel(i);
+            closeTunnel(*session, client_sockets);
+            removeRTSPClient(client_sockets[i], *session);
+          } else if (findHttpClient(sd) >= 0) {
+            // Now a browser client, its session is gone and serviceHttpClients() looks after the socket
+            sessionTimerCancel(i);
             client_sockets[i] = 0;
-            sessions.erase(session->sessionID); // Remove session when client disconnects
-            decrementActiveRTSPClients();
           }
         }
       }
     }
+
+    int expiredCount = sessionTimerExpire(now, expired, MAX_CLIENTS);
+    for (int e = 0; e < expiredCount; e++) {
+      int i = expired[e];
+      for (auto& sess : sessions) {
+        if (sess.second.sock == client_sockets[i]) {
+          RTSP_LOGW(LOG_TAG, "Session %u timed out after %d seconds without activity", sess.second.sessionID, this->sessionTimeout);
+          RTSP_STAT_ADD(this->timedOutSessionCount, 1);
+          sess.second.isPlaying = false;
+          updateIsPlayingStatus();
+          closeTunnel(sess.second, client_sockets);
+          removeRTSPClient(client_sockets[i], sess.second);
+          break;
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Accepts a connection on the RTSP or HTTP port and gives it a session.
+ *
+ * What the connection is, RTSP or one half of an HTTP tunnel, is only known from its first
+ * request. While a tunnel waits for its POST connection one more connection than the client
+ * limit is let in for it. One more again is let in while a browser client slot is free, it is
+ * turned away if its first request isn't a browser's, see handleRTSPRequest().
+ *
+ * @param listenSocket The listening socket with a connection waiting.
+ * @param clientSockets The RTSP task's socket list.
+ * @param now Seconds since boot.
+ */
+void RTSPServer::acceptRTSPClient(int listenSocket, int* clientSockets, uint32_t now) {
+  struct sockaddr_in clientAddr;
+  socklen_t addr_len = sizeof(clientAddr);
+  uint8_t currentMaxClients = getMaxClients();
+  uint8_t tunnelsWaiting = 0;
+  for (const auto& sess : sessions) {
+    if (sess.second.isTunnel && sess.second.tunnelSock < 0) {
+      tunnelsWaiting++;
+    }
+  }
+  int freeSlot = -1;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (clientSockets[i] == 0) {
+      freeSlot = i;
+      break;
+    }
+  }
+
+  int client_sock = accept(listenSocket, (struct sockaddr *)&clientAddr, &addr_len);
+  if (client_sock < 0) {
+    RTSP_LOGE(LOG_TAG, "Accept error");
+    return;
+  }
+
+  bool overLimit = getActiveRTSPClients() - countPlaybacks() >= currentMaxClients + tunnelsWaiting;
+  bool canProbe = this->httpProbeSock < 0 && (this->httpClientCount < RTSP_MAX_HTTP_CLIENTS || this->playbackDirectory[0]);
+  if ((overLimit && !canProbe) || freeSlot < 0) {
+    char response[64];
+    int len = snprintf(response, sizeof(response), "RTSP/1.0 503 Service Unavailable\r\nRetry-After: %d\r\n\r\n", RTSP_RETRY_AFTER);
+    write(client_sock, response, len);
+    close(client_sock);
+    RTSP_STAT_ADD(this->rejectedClientCount, 1);
+    RTSP_LOGE(LOG_TAG, "Max clients reached. Sent 503 error to new client.");
+    return;
+  }
+
+  if (!setNonBlocking(client_sock)) {
+    RTSP_LOGE(LOG_TAG, "Failed to set RTSP socket to non-blocking mode.");
+    close(client_sock);
+    return;
+  }
+
+  // Interleaved video is already written in frame sized batches, Nagle would only hold the last one back
+  int noDelay = 1;
+  setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+  applySocketOptions(client_sock, this->socketOptions.rtspDscp, false);
+
+  if (overLimit) {
+    this->httpProbeSock = client_sock;
+  }
+
+  RTSP_LOGI(LOG_TAG, "New client connected");
+
+  // Create a new session for the new client
+  RTSP_Session session{};
+  session.sessionID = esp_random();
+  session.sock = client_sock;
+  session.videoPayloadSize = MAX_VIDEO_FRAGMENT_SIZE;
+  session.audioPayloadSize = MAX_AUDIO_FRAGMENT_SIZE;
+  session.playback = -1;
+  session.tunnelSock = -1;
+  session.videoSequenceNumber = (uint16_t)esp_random();
+  session.audioSequenceNumber = (uint16_t)esp_random();
+  session.subtitlesSequenceNumber = (uint16_t)esp_random();
+  writeLockSessions();
+  sessions[session.sessionID] = session;
+  writeUnlockSessions();
+
+  clientSockets[freeSlot] = client_sock;
+  sessionTimerTouch(freeSlot, now);
+  incrementActiveRTSPClients();
+  RTSP_LOGI(LOG_TAG, "Added to list of sockets as %d", freeSlot);
+}
+
+/**
+ * @brief Closes a client connection and forgets its session.
+ *
+ * @param clientSocket The client's entry in the RTSP task's socket list, cleared.
+ * @param session The client's session, erased from sessions.
+ */
+void RTSPServer::removeRTSPClient(int& clientSocket, RTSP_Session& session) {
+  // Players of recordings stay on after the last live client, and the next one picks the transport again
+  bool lastLive = session.playback < 0 && getActiveRTSPClients() - countPlaybacks() == 1;
+  closePlayback(session);
+  if (lastLive) {
+    setIsPlaying(false);
+    RTSP_LOGD(LOG_TAG, "All clients disconnected. Resetting firstClientConnected flag."); 
+    this->firstClientConnected = false; 
+    this->firstClientIsMulticast = false; 
+    this->firstClientIsTCP = false; 
+  }
+  if (getActiveRTSPClients() == 1) {
+    closeSockets();
+  }
+  if (clientSocket == this->httpProbeSock) {
+    this->httpProbeSock = -1;
+  }
+  close(clientSocket);
+  clientSocket = 0;
+  retireSessionStats(session);
+  writeLockSessions();
+  sessions.erase(session.sessionID); // Remove session when client disconnects
+  writeUnlockSessions();
+  decrementActiveRTSPClients();
+}
+
+/**
+ * @brief Reads RTCP arriving on a UDP RTCP socket and counts it as activity of the sender.
+ *
+ * Reports are matched to clients by address, the contents aren't used.
+ *
+ * @param rtcpSocket Socket with data waiting.
+ * @param clientSockets The RTSP task's socket list.
+ * @param clientCount Entries in clientSockets.
+ * @param now Seconds since boot.
+ */
+void RTSPServer::receiveRtcp(int rtcpSocket, const int* clientSockets, uint8_t clientCount, uint32_t now) {
+  uint8_t packet[64]; // Only the common header is looked at, the rest is discarded
+  struct sockaddr_in fromAddr;
+  socklen_t fromLen = sizeof(fromAddr);
+  while (recvfrom(rtcpSocket, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr*)&fromAddr, &fromLen) >= 2) {
+    uint8_t packetType = packet[1];
+    fromLen = sizeof(fromAddr);
+    if ((packet[0] >> 6) != 2 || packetType < 200 || packetType > 204) {
+      continue;
+    }
+    for (int i = 0; i < clientCount; i++) {
+      if (clientSockets[i] <= 0) {
+        continue;
+      }
+      struct sockaddr_in peerAddr;
+      socklen_t peerLen = sizeof(peerAddr);
+      if (getpeername(clientSockets[i], (struct sockaddr*)&peerAddr, &peerLen) == 0 &&
+          peerAddr.sin_addr.s_addr == fromAddr.sin_addr.s_addr) {
+        sessionTimerTouch(i, now);
+      }
+    }
   }
 }
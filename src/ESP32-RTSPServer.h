@@ -5,15 +5,89 @@
 #include "lwip/sockets.h"
 #include <esp_log.h>
 #include <map>
+#include "jpegScale.h"
+#include "aviRecorder.h"
+#include "jitterBuffer.h"
+#include "nalUnits.h"
+#include "libb64/cdecode.h"
 
 #define MAX_RTSP_BUFFER (512 * 1024)
-#define RTP_STACK_SIZE (1024 * 4)
+#define RTP_STACK_SIZE (1024 * 4) // Room for scaling preview frames, see rtpStackFree in getStats()
 #define RTP_PRI 10
-#define RTSP_STACK_SIZE (1024 * 8)
+#define RTSP_STACK_SIZE (1024 * 8) // See rtspStackFree in getStats() before lowering
 #define RTSP_PRI 10
+#define RTSP_CORE tskNO_AFFINITY // Core for rtspTask
+#define RTP_CORE tskNO_AFFINITY // Core for rtpVideoTask
 #define MAX_CLIENTS 10 // max rtsp clients
 
+#define RTSP_SCHEDULER_STACK_SIZE (1024 * 6) // See schedulerStackFree in getStats() before lowering
+#define RTSP_SCHEDULER_PRI 10
+#define RTSP_SCHEDULER_CORE (portNUM_PROCESSORS > 1 ? 1 : tskNO_AFFINITY) // WiFi runs on core 0
+#define RTSP_VIDEO_QUEUE_LEN 2 // Frames waiting for the scheduler, MAX_RTSP_BUFFER of PSRAM each, power of 2
+#define RTSP_AUDIO_QUEUE_LEN 8 // Audio blocks waiting for the scheduler, power of 2
+#define RTSP_AUDIO_SLOT_SIZE 4096 // Largest audio block in bytes that can be queued
+#define RTSP_SUBTITLES_QUEUE_LEN 4 // Subtitles waiting for the scheduler, power of 2
+#define RTSP_SUBTITLES_SLOT_SIZE 256 // Longest subtitle that can be queued
+
+#define RTSP_RECORD_BUFFER_SIZE (512 * 1024) // Write-behind buffer in PSRAM, rides out this much of card stalls, multiple of RTSP_AVI_WRITE_SIZE
+#define RTSP_RECORD_FLUSH_MS 1000 // Most recording lost on a power cut, see repairRecording()
+#define RTSP_RECORD_STACK_SIZE (1024 * 4)
+#define RTSP_RECORD_PRI 5 // Below the sending tasks so card writes never hold up the live stream
+#define RTSP_RECORD_CORE tskNO_AFFINITY
+#define RTSP_PLAYBACK_STACK_SIZE (1024 * 4)
+#define RTSP_PLAYBACK_PRI 5 // Below the sending tasks so card reads never hold up the live stream
+#define RTSP_PLAYBACK_CORE tskNO_AFFINITY
+#define RTSP_BACKCHANNEL_STACK_SIZE (1024 * 4)
+#define RTSP_BACKCHANNEL_PRI 10 // With the sending tasks, the speaker runs dry if playout waits
+#define RTSP_BACKCHANNEL_CORE tskNO_AFFINITY
+#define RTSP_BACKCHANNEL_IDLE_MS 1000 // Silence after which another client may talk
+#define RTSP_INTERLEAVED_TIMEOUT_MS 200 // Longest wait for the rest of an interleaved packet from a client
+
 #define RTSP_BUFFER_SIZE 8092
+#define RTSP_PENDING_SIZE 512 // Bytes read past a request, or of a request cut off at the end of a read, kept for the next one
+
+#define RTSP_PACKET_POOL_SIZE 8 // Preallocated packet buffers shared by all sending tasks, at most 65535
+#define RTSP_PACKET_BUFFER_SIZE 1536 // Interleaved and RTP headers plus the largest payload, multiple of RTSP_CACHE_LINE_SIZE
+#define RTSP_CACHE_LINE_SIZE 64
+#define RTSP_VIDEO_AGGREGATE_SIZE (RTSP_PACKET_BUFFER_SIZE - 4 - 12) // Largest STAP-A or AP, built in one packet buffer and copied behind the headers of another
+
+#define RTCP_SR_INTERVAL 5000 // ms between RTCP sender reports per stream
+#define MAX_VIDEO_FRAGMENT_SIZE 1438 // JPEG payload bytes per UDP packet at RTSP_DEFAULT_MTU
+#define MAX_AUDIO_FRAGMENT_SIZE 1446 // L16 payload bytes per UDP packet at RTSP_DEFAULT_MTU
+#define RTSP_DEFAULT_MTU 1500 // IP MTU UDP packets are sized for, see setMTU()
+#define RTSP_MIN_MTU 576 // Smallest MTU every IPv4 path carries
+#define RTSP_TCP_FRAGMENT_SIZE 8192 // Video payload bytes per interleaved packet on TCP sessions, see setTcpFragmentSize()
+#define RTSP_MAX_TCP_FRAGMENT_SIZE (65535 - 24) // Interleaved length is 16 bits and covers the RTP and payload headers
+#define RTSP_TCP_BATCH_PACKETS 16 // Video packets written to a TCP client with one writev, the rest of the frame follows at its end
+#define RTSP_TCP_BATCH_BYTES (1024 * 16) // Batches are written early once this big, audio waits for at most one batch
+#define RTSP_TCP_VIDEO_WRITERS 4 // Tasks that may write video to TCP clients at once, see lockTcpSend()
+
+#define RTSP_SESSION_TIMEOUT 60 // Seconds a client may stay silent before its session is dropped, see setSessionTimeout()
+#define RTSP_RETRY_AFTER 10 // Seconds a client turned away with 503 is asked to wait
+#define RTSP_TIMER_WHEEL_SLOTS 64 // One second per slot, power of 2
+
+#define RTSP_TUNNEL_COOKIE_SIZE 48 // Longest x-sessioncookie of an RTSP-over-HTTP tunnel that is matched in full
+#define RTSP_PREVIEW_MOUNT "preview" // Path of the downscaled MJPEG stream, e.g. rtsp://camera/preview, see setPreviewScale()
+#define RTSP_PLAYBACK_MOUNT "recordings" // Recordings are played from rtsp://camera/recordings/<file>, see setPlaybackDirectory()
+#define RTSP_MAX_PLAYBACKS 2 // Recordings open at once, each holds RTSP_AVI_READ_SIZE of PSRAM
+#define RTSP_PLAYBACK_NAME_SIZE 64 // Longest file name that can be played
+#define RTSP_PLAYBACK_MAX_SCALE 8 // Fastest fast forward a client can ask for with the Scale header
+#define RTSP_PLAYBACK_MAX_LATE 250 // ms a frame may fall behind before it is skipped to catch up
+#define RTSP_PLAYBACK_WRITE_TIMEOUT_MS 500 // Longest a TCP write of the playback task waits for a client that doesn't read
+#define RTSP_HTTP_STREAM_PATH "/stream" // multipart MJPEG for browsers, on the RTSP port and the setHttpPort() port
+#define RTSP_HTTP_SNAPSHOT_PATH "/snapshot" // The next or newest frame as a single JPEG
+#define RTSP_HTTP_BOUNDARY "rtspframe" // multipart boundary between frames
+#define RTSP_MAX_HTTP_CLIENTS 4 // Browser clients of the two paths at once, they don't count against the RTSP client limit
+#define RTSP_HTTP_FRAME_SLOTS 3 // Frames kept for browser clients, the newest plus any still being written to slow clients
+#define RTSP_HTTP_SNAPSHOT_TIMEOUT 5 // Seconds a snapshot waits for a frame before 503
+
+#define RTSP_DSCP_DEFAULT 0 // Best effort, the socket's TOS is left alone
+#define RTSP_DSCP_AF41 34 // Interactive video, WMM video access category
+#define RTSP_DSCP_EF 46 // Expedited forwarding for audio, WMM voice access category
+#define VIDEO_CLOCK_RATE 90000 // RTP clock for all video payloads
+#define RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO 96 // Payload type for H.264 and H.265
+#define MAX_NALS_PER_FRAME 32 // NAL units handled per access unit
+#define SUBTITLES_CLOCK_RATE 1000 // RTP clock for t140 subtitles
 
 // Define ESP32_RTSP_LOGGING_ENABLED to enable logging
 //#define RTSP_LOGGING_ENABLED // save 7.7kb of flash
@@ -30,9 +104,155 @@
   #define RTSP_LOGD(tag, format, ...)
 #endif
 
+// Define RTSP_PROFILING to record hot path latency histograms, see getProfile() and formatProfile()
+//#define RTSP_PROFILING
+
+#ifdef RTSP_PROFILING
+  #ifdef ESP_PLATFORM
+    #include <esp_cpu.h>
+    #define RTSP_CYCLE_COUNT() ((uint32_t)esp_cpu_get_cycle_count())
+    #define RTSP_CYCLES_PER_US() getCpuFrequencyMhz()
+  #else
+    // Host builds count nanoseconds instead of cycles
+    #include <time.h>
+    static inline uint32_t rtspHostCycleCount() {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return (uint32_t)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+    }
+    #define RTSP_CYCLE_COUNT() rtspHostCycleCount()
+    #define RTSP_CYCLES_PER_US() 1000
+  #endif
+  #define RTSP_PROFILE_START(name) uint32_t name = RTSP_CYCLE_COUNT()
+  #define RTSP_PROFILE_MARK(name) name = RTSP_CYCLE_COUNT()
+  #define RTSP_PROFILE_END(point, name) recordProfile(point, RTSP_CYCLE_COUNT() - (name))
+#else
+  #define RTSP_PROFILE_START(name)
+  #define RTSP_PROFILE_MARK(name)
+  #define RTSP_PROFILE_END(point, name)
+#endif
+#define RTSP_PROFILE_BUCKETS 32 // log2 buckets, enough for any uint32_t cycle count
+
+// Relaxed atomics, counters are written by the sending tasks and read by getStats() without locking
+#define RTSP_STAT_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#define RTSP_STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+
 // User defined options in sketch
 //#define OVERRIDE_RTSP_SINGLE_CLIENT_MODE // Override the default behavior of allowing only one client for unicast or TCP
 //#define RTSP_VIDEO_NONBLOCK // Enable non-blocking video streaming by creating a separate task for video streaming, preventing it from blocking the main sketch.
+//#define RTSP_MEDIA_SCHEDULER // Send all media from one task pinned to RTSP_SCHEDULER_CORE, fed by lock-free queues. Audio and subtitles go ahead of video. Replaces RTSP_VIDEO_NONBLOCK.
+struct RTSP_MediaQueueCell {
+  uint32_t sequence; // Ring position the cell is ready for, see mediaQueuePush()
+  uint8_t* data; // Slot buffer owned by the cell, producers copy into it
+  size_t len;
+  int64_t timestampUs;
+  uint8_t codec;
+  uint8_t frameType;
+  uint8_t quality;
+  uint16_t width;
+  uint16_t height;
+};
+struct RTSP_MediaQueue {
+  RTSP_MediaQueueCell* cells;
+  uint32_t capacity;
+  size_t slotSize;
+  uint32_t enqueuePos;
+  uint32_t dequeuePos;
+};
+struct RTSP_PacketPool {
+  uint8_t* buffers; // RTSP_PACKET_POOL_SIZE buffers in one cache line aligned block
+  uint16_t next[RTSP_PACKET_POOL_SIZE]; // Free list link of each buffer
+  uint32_t head; // Index of the first free buffer in the low 16 bits, a change count against ABA in the high 16
+  uint32_t inUse;
+  uint32_t highWater; // Most buffers ever in use at once
+  uint32_t exhausted; // Packets dropped because no buffer was free
+  bool inPsram; // Internal RAM was short and the pool fell back to PSRAM
+};
+struct RTSP_StreamStats {
+  uint32_t packetsSent;
+  uint32_t bytesSent;
+  uint32_t sendErrors; // sendto/send failures
+  uint32_t tcpStalls; // TCP sends that had to wait for socket space
+  uint32_t rtpPackets; // RTP packets and their payload octets, the sender counts of RTCP sender reports
+  uint32_t rtpOctets;
+};
+struct RTSP_TcpBatch {
+  struct iovec iov[RTSP_TCP_BATCH_PACKETS * 2]; // Headers and payload of each packet
+  int iovCount;
+  uint8_t* headers; // Packet buffer the headers are copied into, payloads stay where they are
+  size_t headersLen;
+  int packets;
+  size_t bytes;
+  int sock;
+  RTSP_StreamStats* stats;
+};
+class RTSPServer;
+struct RTSP_VideoTarget { // Where a packetizer's packets go, see videoPacketSink()
+  RTSPServer* server;
+  int sock;
+  uint16_t port;
+  uint8_t channel;
+  bool useTCP;
+  bool isMulticast;
+  uint16_t* sequenceNumber;
+  RTSP_StreamStats* stats;
+  RTSP_TcpBatch* batch;
+};
+struct RTSP_TimerWheel {
+  int8_t head[RTSP_TIMER_WHEEL_SLOTS]; // First client due in each second, -1 when none
+  int8_t next[MAX_CLIENTS];
+  int8_t prev[MAX_CLIENTS];
+  uint8_t slot[MAX_CLIENTS];
+  uint32_t deadline[MAX_CLIENTS]; // Seconds since boot
+  bool armed[MAX_CLIENTS];
+  uint32_t now; // Last second the wheel was advanced to
+};
+struct RTSP_SocketOptions {
+  int sendBufferSize; // SO_SNDBUF in bytes for the RTSP and RTP sockets, 0 keeps the lwIP default
+  uint8_t videoDscp; // DSCP of video RTP and RTCP, e.g. RTSP_DSCP_AF41
+  uint8_t audioDscp; // e.g. RTSP_DSCP_EF
+  uint8_t subtitlesDscp;
+  uint8_t rtspDscp; // RTSP connections, which also carry TCP interleaved media
+  IPAddress multicastInterface; // Local address multicast is sent from, IPAddress() for the default interface
+  bool multicastLoop; // Deliver multicast back to this device
+};
+enum RTSP_ProfilePoint {
+  PROFILE_SEND_FRAME,     // sendRTSPFrame, the whole fan-out or the NONBLOCK hand off
+  PROFILE_RTP_FRAGMENT,   // One JPEG fragment packetized and sent to one session
+  PROFILE_TCP_SEND,       // One TCP write, a packet or a batch, including waiting for the mutex
+  PROFILE_TCP_BLOCKED,    // Time a TCP write spent in select waiting for socket space
+  PROFILE_RTSP_REQUEST,   // handleRTSPRequest
+  PROFILE_VIDEO_HANDOFF,  // NONBLOCK frame hand off until rtpVideoTask wakes up
+  PROFILE_PREVIEW_SCALE,  // Scaling one frame for preview sessions
+  PROFILE_POINT_COUNT
+};
+struct RTSP_Histogram {
+  uint32_t count;
+  uint32_t maxCycles;
+  uint64_t totalCycles;
+  uint32_t buckets[RTSP_PROFILE_BUCKETS]; // Bucket n counts durations of 2^n up to 2^(n+1) - 1 cycles
+};
+struct RTSP_HttpFrame {
+  uint8_t* data; // PSRAM, grown to the largest frame so far
+  size_t size;
+  size_t len;
+  int64_t timestampUs;
+  uint32_t sequence; // Counts every frame offered, gaps are frames a client skipped
+  uint8_t refs; // One for the newest frame, one per client writing it, free when 0
+};
+struct RTSP_HttpClient {
+  int sock; // 0 when free
+  bool isSnapshot;
+  bool responseSent; // The response head went out with the first frame
+  int8_t frame; // Slot being written, -1 while waiting for a newer frame
+  uint32_t lastSequence; // Last frame written, 0 before the first
+  uint32_t openedAt; // Seconds since boot
+  size_t offset; // Bytes of header, frame and part trailer written so far
+  uint16_t headerLen;
+  char header[320]; // Response head and/or part header of the frame being written
+};
+typedef void (*RTSP_TraceHook)(RTSP_ProfilePoint point, uint32_t cycles);
+typedef void (*RTSP_BackchannelCallback)(const int16_t* samples, size_t count, uint32_t sampleRate);
 struct RTSP_Session {
   uint32_t sessionID;
   int sock;
@@ -43,6 +263,97 @@ struct RTSP_Session {
   bool isMulticast;
   bool isPlaying;
   bool isTCP;
+  bool awaitingKeyframe; // Inter-coded video is held back until the next keyframe after PLAY
+  uint16_t videoPayloadSize; // Bytes per packet, set by SETUP from the transport, MTU and Blocksize header
+  uint16_t audioPayloadSize;
+  uint8_t maxFps; // Video frame rate cap, 0 sends every frame
+  bool skipFrame; // Not sent the frame begun with beginFrame(), decimated or not yet playing when it began
+  int64_t nextFrameUs; // Capture time the next frame is due at when capped
+  bool isPreview; // Opened on RTSP_PREVIEW_MOUNT, gets the downscaled frame
+  int8_t playback; // Slot in players when opened on RTSP_PLAYBACK_MOUNT, -1 for the live stream
+  bool isTunnel; // RTSP over HTTP, sock is the GET connection
+  int tunnelSock; // POST connection the requests arrive on, -1 while there is none
+  uint8_t videoCh; // Interleaved RTP channels the client asked for in SETUP, RTCP goes on the next one
+  uint8_t audioCh;
+  uint8_t subtitlesCh;
+  uint16_t videoSequenceNumber; // Per session so every client sees a gapless sequence
+  uint16_t audioSequenceNumber;
+  uint16_t subtitlesSequenceNumber;
+  uint32_t rtspRequests;
+  RTSP_StreamStats videoStats;
+  RTSP_StreamStats audioStats;
+  RTSP_StreamStats subtitlesStats;
+  char tunnelCookie[RTSP_TUNNEL_COOKIE_SIZE];
+  base64_decodestate tunnelDecoder; // Base64 state carried between reads of the POST connection
+  uint16_t pendingLen;
+  char pending[RTSP_PENDING_SIZE]; // What came after the last request, read ahead of the socket, for a tunnel the decoded start of a request the next POST read finishes
+};
+struct RTSP_Player {
+  RTSP_AviReader reader;
+  RTSP_Session* session; // NULL when the slot is free
+  char name[RTSP_PLAYBACK_NAME_SIZE]; // File name as in the URL
+  bool videoSetup; // Streams the client has set up
+  bool audioSetup;
+  bool isPlaying;
+  uint16_t scale; // Speed in thousandths, 1000 for normal
+  int64_t startUs; // Position in the file playing started from
+  int64_t endUs; // Position to stop at
+  int64_t wallStartUs; // esp_timer time startUs is played at
+  int64_t positionUs; // Position of the next chunk, PLAY without a Range resumes from it
+  int64_t nextFrameUs; // Send time the next frame is due at, frames are skipped at fast forward
+  uint32_t startSample; // Audio sample at startUs
+  uint32_t videoClockOffset; // Random origins of the RTP timestamps, they follow the esp_timer clock like the live stream's
+  uint32_t audioClockOffset;
+  RTSP_AviChunk chunk; // Read ahead, waiting until it is due
+  bool hasChunk;
+  uint32_t lastSRTime;
+};
+struct RTSP_SessionStats {
+  uint32_t sessionID;
+  bool isPlaying;
+  bool isTCP;
+  bool isMulticast;
+  bool isTunnel;
+  uint8_t maxFps;
+  uint32_t rtspRequests;
+  RTSP_StreamStats video;
+  RTSP_StreamStats audio;
+  RTSP_StreamStats subtitles;
+};
+struct RTSP_Stats {
+  RTSP_StreamStats video; // Totals over all sessions, past and present, and multicast
+  RTSP_StreamStats audio;
+  RTSP_StreamStats subtitles;
+  uint32_t videoFrames;
+  uint32_t videoFramesDropped; // Frames skipped because the video task or scheduler queue was busy
+  uint32_t videoFramesSuppressed; // Unchanged frames left out, see setStaticFrameSuppression()
+  uint32_t audioBlocks;
+  uint32_t audioBlocksDropped; // Audio the scheduler queue had no room for (RTSP_MEDIA_SCHEDULER)
+  uint32_t subtitlesSent;
+  uint32_t subtitlesDropped;
+  uint32_t rtspRequests;
+  uint32_t rejectedClients;
+  uint32_t timedOutSessions; // Sessions dropped after RTSP_SESSION_TIMEOUT without a request or RTCP report
+  uint8_t httpClients; // Browsers on RTSP_HTTP_STREAM_PATH or waiting for RTSP_HTTP_SNAPSHOT_PATH
+  uint32_t httpFramesSent;
+  uint32_t httpFramesDropped; // Frames browser clients skipped because they were still writing an older one
+  bool recording;
+  uint8_t playbackSessions; // Clients playing recordings, see setPlaybackDirectory()
+  uint32_t recordedFrames; // Video chunks of the current or last recording, including repeats filling gaps
+  uint32_t recordDropped; // Frames and audio blocks left out of the recording because the card fell behind
+  uint32_t backchannelPackets; // Audio packets received from the talking client, see setBackchannelCallback()
+  uint32_t backchannelLost; // Played as silence
+  uint32_t backchannelLate; // Arrived after their turn or dropped to bring the delay down
+  uint32_t backchannelDelayMs; // Current playout delay
+  uint32_t packetBuffers; // Size of the packet buffer pool, 0 before init()
+  uint32_t packetBuffersInUse;
+  uint32_t packetBuffersHighWater; // Most packet buffers in use at once, RTSP_PACKET_POOL_SIZE can be lowered to this
+  uint32_t packetBuffersExhausted; // Packets dropped because every buffer was in use
+  uint32_t rtspStackFree; // Least stack in bytes rtspTask has had left, RTSP_STACK_SIZE can be lowered by most of it
+  uint32_t rtpStackFree; // Same for rtpVideoTask (RTSP_VIDEO_NONBLOCK) and RTP_STACK_SIZE, 0 without the task
+  uint32_t schedulerStackFree; // Same for the media scheduler (RTSP_MEDIA_SCHEDULER) and RTSP_SCHEDULER_STACK_SIZE
+  uint8_t sessionCount;
+  RTSP_SessionStats sessions[MAX_CLIENTS];
 };
 class RTSPServer {
 public:
@@ -57,6 +368,18 @@ public:
     NONE,
   };
 
+  enum VideoCodec {
+    VIDEO_MJPEG,
+    VIDEO_H264,
+    VIDEO_H265,
+  };
+
+  enum FrameType {
+    FRAME_AUTO,
+    FRAME_KEY,
+    FRAME_DELTA,
+  };
+
   RTSPServer();  // Defined in ESP32-RTSPServer.cpp
   ~RTSPServer();  // Destructor, defined in ESP32-RTSPServer.cpp
 
@@ -66,11 +389,25 @@ public:
 
   bool reinit();  // Defined in ESP32-RTSPServer.cpp
 
-  void sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height);  // Defined in rtp.cpp
+  // timestampUs is the capture time on the esp_timer clock (eg. fb->timestamp or I2S DMA time), 0 uses the time of the call
+  void sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs = 0);  // Defined in rtp.cpp
+
+  // Streaming alternative to sendRTSPFrame, fragments go out as soon as each MTU sized chunk is appended
+  bool beginFrame(int quality, int width, int height, int64_t timestampUs = 0);  // Defined in rtpPackets.cpp
 
-  void sendRTSPAudio(int16_t* data, size_t len);  // Defined in rtp.cpp
+  void appendFrameData(const uint8_t* data, size_t len);  // Defined in rtpPackets.cpp
 
-  void sendRTSPSubtitles(char* data, size_t len);  // Defined in rtp.cpp
+  void endFrame();  // Defined in rtpPackets.cpp
+
+  // data is one Annex-B access unit, set videoCodec to VIDEO_H264 before init
+  void sendRTSPH264(const uint8_t* data, size_t len, int64_t timestampUs = 0, FrameType frameType = FRAME_AUTO);  // Defined in rtpH264.cpp
+
+  // data is one Annex-B access unit, set videoCodec to VIDEO_H265 before init
+  void sendRTSPH265(const uint8_t* data, size_t len, int64_t timestampUs = 0, FrameType frameType = FRAME_AUTO);  // Defined in rtpH265.cpp
+
+  void sendRTSPAudio(int16_t* data, size_t len, int64_t timestampUs = 0);  // Defined in rtp.cpp
+
+  void sendRTSPSubtitles(char* data, size_t len, int64_t timestampUs = 0);  // Defined in rtp.cpp
 
   void startSubtitlesTimer(esp_timer_cb_t userCallback);  // Defined in utils.cpp
 
@@ -82,8 +419,55 @@ public:
 
   bool setCredentials(const char* username, const char* password); // Add method to set credentials
 
+  void setMTU(uint16_t mtu);  // Defined in netUtils.cpp
+
+  void setTcpFragmentSize(uint16_t size);  // Defined in netUtils.cpp
+
+  bool setSocketOptions(const RTSP_SocketOptions& options);  // Defined in netUtils.cpp
+
+  void getSocketOptions(RTSP_SocketOptions& effective);  // Defined in netUtils.cpp
+
+  void setSessionTimeout(uint16_t seconds);  // Defined in sessionTimers.cpp
+
+  void setAdmissionBudget(uint32_t uplinkKbps, uint8_t cpuPercent = 0);  // Defined in admission.cpp
+
+  bool setSessionFrameRate(uint32_t sessionID, uint8_t fps);  // Defined in rtpPackets.cpp
+
+  bool setPreviewScale(uint8_t denominator);  // Defined in preview.cpp
+
+  void setHttpPort(uint16_t port);  // Defined in httpTunnel.cpp
+
+  void setStaticFrameSuppression(uint8_t keepaliveFps, uint8_t sizeTolerance = 0);  // Defined in staticFrames.cpp
+
+  void setFrameChanged(bool changed);  // Defined in staticFrames.cpp
+
+  bool startRecording(const char* path, uint8_t fps);  // Defined in recording.cpp
+
+  bool stopRecording();  // Defined in recording.cpp
+
+  static bool repairRecording(const char* path);  // Defined in recording.cpp
+
+  void setPlaybackDirectory(const char* directory);  // Defined in playback.cpp
+
+  void setBackchannelCallback(RTSP_BackchannelCallback callback);  // Defined in backchannel.cpp
+
+  void getStats(RTSP_Stats& stats);  // Defined in stats.cpp
+
+  size_t formatStats(char* buffer, size_t size);  // Defined in stats.cpp
+
+#ifdef RTSP_PROFILING
+  void getProfile(RTSP_ProfilePoint point, RTSP_Histogram& histogram);  // Defined in profiling.cpp
+
+  size_t formatProfile(char* buffer, size_t size);  // Defined in profiling.cpp
+
+  void resetProfile();  // Defined in profiling.cpp
+
+  void setTraceHook(RTSP_TraceHook hook);  // Defined in profiling.cpp
+#endif
+
   uint32_t rtpFps;
   TransportType transport;
+  VideoCodec videoCodec;
   uint32_t sampleRate;
   int rtspPort;
   IPAddress rtpIp;
@@ -95,18 +479,29 @@ public:
 
 private:
   int rtspSocket;
+  int httpSocket;
+  uint16_t httpPort;
   int videoUnicastSocket; 
   int audioUnicastSocket; 
   int subtitlesUnicastSocket; 
   int videoMulticastSocket; 
   int audioMulticastSocket; 
   int subtitlesMulticastSocket;
+  int videoRtcpSocket;
+  int audioRtcpSocket;
+  int subtitlesRtcpSocket;
   uint8_t activeRTSPClients; 
   uint8_t maxClients;
   TaskHandle_t rtpVideoTaskHandle;
   TaskHandle_t rtspTaskHandle;
+  TaskHandle_t mediaSchedulerTaskHandle;
+  RTSP_MediaQueue videoQueue;
+  RTSP_MediaQueue audioQueue;
+  RTSP_MediaQueue subtitlesQueue;
   std::map<uint32_t, RTSP_Session> sessions;
   byte* rtspStreamBuffer;
+  char* rtspRequestBuffer; // Reused for every request, only rtspTask reads requests
+  RTSP_PacketPool packetPool;
   size_t rtspStreamBufferSize;
   bool rtpFrameSent;
   bool rtpAudioSent;
@@ -114,7 +509,8 @@ private:
   uint8_t vQuality;
   uint16_t vWidth;
   uint16_t vHeight;
-  uint16_t videoSequenceNumber;
+  int64_t vTimestampUs;
+  uint16_t videoSequenceNumber; // Multicast, unicast sessions keep their own
   uint32_t videoTimestamp;
   uint32_t videoSSRC;
   uint16_t audioSequenceNumber;
@@ -123,11 +519,30 @@ private:
   uint16_t subtitlesSequenceNumber;
   uint32_t subtitlesTimestamp;
   uint32_t subtitlesSSRC;
+  uint32_t videoClockOffset;
+  uint32_t audioClockOffset;
+  uint32_t subtitlesClockOffset;
+  bool audioClockAnchored;
+  uint32_t lastVideoSRTime;
+  uint32_t lastAudioSRTime;
+  uint32_t lastSubtitlesSRTime;
   uint32_t rtpFrameCount;
+  uint8_t sliceBuffer[MAX_VIDEO_FRAGMENT_SIZE];
+  size_t sliceLen;
+  size_t sliceOffset;
+  size_t sliceFragmentSize; // JPEG bytes per packet of the frame being sent with beginFrame()
+  uint8_t sliceQuality;
+  uint16_t sliceWidth;
+  uint16_t sliceHeight;
+  int64_t sliceSendUs; // Time spent sending the frame so far, waits for appendFrameData() not counted
+  uint8_t sliceStreams;
+  bool sliceActive;
+  RTSP_ParameterSets h264ParameterSets;
+  RTSP_ParameterSets h265ParameterSets;
+  RTSP_FrameCache frameCache; // MAX_RTSP_BUFFER of PSRAM from the first keyframe
+  RTP_NalUnit accessUnitNals[RTSP_PARAMETER_SET_SLOTS + MAX_NALS_PER_FRAME]; // Kept off the stack of the task sending video
+  RTP_NalUnit replayNals[RTSP_PARAMETER_SET_SLOTS + MAX_NALS_PER_FRAME];
   uint32_t lastRtpFPSUpdateTime;
-  uint8_t videoCh;
-  uint8_t audioCh;
-  uint8_t subtitlesCh;
   bool isVideo;
   bool isAudio;
   bool isSubtitles;
@@ -139,25 +554,280 @@ private:
   char base64Credentials[128]; // Store base64 encoded credentials
   esp_timer_handle_t sendSubtitlesTimer;
   SemaphoreHandle_t isPlayingMutex;  // Mutex for protecting access
+  SemaphoreHandle_t sessionsMutex; // Held by rtspTask to add or remove sessions, and briefly by senders to count themselves in
+  SemaphoreHandle_t sessionsIdle; // Given when the last sender is done with sessions, rtspTask waits on it
+  uint8_t sessionReaders; // Senders going through sessions, under sessionsMutex
   SemaphoreHandle_t sendTcpMutex;  // Mutex for protecting TCP send access
+  RTSP_SocketOptions socketOptions;
+  uint16_t mtu;
+  uint16_t udpVideoPayloadSize; // Derived from mtu, used for multicast and UDP sessions
+  uint16_t udpAudioPayloadSize;
+  uint16_t tcpFragmentSize;
+  uint32_t tcpPriorityWaiting; // Audio and subtitle packets waiting for or holding sendTcpMutex, video steps aside while non-zero
+  SemaphoreHandle_t tcpPriorityIdle; // Counting, given once per waiting video writer when tcpPriorityWaiting drops to 0
+  uint8_t tcpVideoWaiting; // Video writers asleep on tcpPriorityIdle, under sendTcpMutex
   SemaphoreHandle_t maxClientsMutex; // FreeRTOS mutex for maxClients
+  RTSP_StreamStats multicastVideoStats;
+  RTSP_StreamStats multicastAudioStats;
+  RTSP_StreamStats multicastSubtitlesStats;
+  RTSP_StreamStats closedVideoStats; // Counters of sessions that have gone, so totals never go backwards
+  RTSP_StreamStats closedAudioStats;
+  RTSP_StreamStats closedSubtitlesStats;
+  uint32_t videoFrameCount;
+  uint32_t videoFramesDropped;
+  uint32_t audioBlockCount;
+  uint32_t audioBlocksDropped;
+  uint32_t subtitlesCount;
+  uint32_t subtitlesDropped;
+  uint32_t rtspRequestCount;
+  uint32_t rejectedClientCount;
+  uint32_t timedOutSessionCount;
+  uint16_t sessionTimeout;
+  RTSP_TimerWheel sessionTimers; // Only rtspTask touches it
+  uint32_t uplinkBudget; // Bytes per second, 0 for no limit
+  uint8_t cpuBudget; // Percent of the sending core, 0 for no limit
+  uint32_t videoFrameBytesAvg;
+  uint32_t videoSendUsAvg; // Time to send one frame to one stream
+  RTSP_JpegScaler previewScaler; // Only the video sending task uses it
+  uint8_t previewScale; // Denominator, 0 when the preview mount is off
+  size_t previewLen;
+  uint16_t previewWidth;
+  uint16_t previewHeight;
+  uint8_t staticKeepaliveFps; // 0 when static frames aren't suppressed
+  uint8_t staticSizeTolerance; // Percent
+  int8_t frameChangedHint; // From setFrameChanged() for the next frame, -1 to use the detector
+  size_t staticFrameLen; // Last frame that counted as changed
+  uint32_t staticFrameChecksum;
+  int64_t staticFrameDueUs; // Capture time the next unchanged frame may go out at
+  uint32_t videoFramesSuppressed;
+  RTSP_HttpFrame httpFrames[RTSP_HTTP_FRAME_SLOTS];
+  RTSP_HttpClient httpClients[RTSP_MAX_HTTP_CLIENTS]; // Only rtspTask touches them
+  SemaphoreHandle_t httpFrameMutex; // Guards httpNewestFrame and the refs of httpFrames
+  int8_t httpNewestFrame; // -1 when there is none
+  uint32_t httpFrameSequence;
+  uint8_t httpClientCount; // Written by rtspTask, frames are only copied for browsers while non-zero
+  int wakeSocket; // Loopback UDP socket that wakes rtspTask when a frame is published
+  uint16_t wakePort;
+  int httpProbeSock; // Connection let in over the client limit in case it's a browser, -1 when none
+  uint32_t httpFramesSent;
+  uint32_t httpFramesDropped;
+  RTSP_AviRecorder recorder; // Fed by the sending tasks under recordMutex, written out by recordTask
+  TaskHandle_t recordTaskHandle; // NULL when not recording
+  SemaphoreHandle_t recordMutex;
+  bool recordStopping;
+  bool recordResult; // Whether the last recording was completed
+  RTSP_Player players[RTSP_MAX_PLAYBACKS];
+  SemaphoreHandle_t playbackMutex; // Guards players between rtspTask and playbackTask
+  TaskHandle_t playbackTaskHandle;
+  bool playbackSending; // playbackTask is sending without playbackMutex, the players' readers and sessions must stay as they are
+  uint8_t playbackWaiters; // rtspTask calls waiting for playbackSending to clear, no new send starts meanwhile
+  char playbackDirectory[RTSP_AVI_PATH_SIZE - RTSP_PLAYBACK_NAME_SIZE]; // Empty while playback is off
+  RTSP_JitterBuffer backchannel; // Filled by rtspTask, played out by backchannelTask, under backchannelMutex
+  SemaphoreHandle_t backchannelMutex;
+  TaskHandle_t backchannelTaskHandle; // Started by the first packet
+  bool backchannelStopping; // Set by stopBackchannel(), the task ends itself
+  RTSP_BackchannelCallback backchannelCallback; // NULL while the backchannel is off
+  uint32_t backchannelTalker; // Session the audio is taken from, 0 for none
+  int64_t backchannelLastUs; // Arrival of the talker's last packet
 
   void closeSockets();  // Defined in ESP32-RTSPServer.cpp
+
+  void removeRTSPClient(int& clientSocket, RTSP_Session& session);  // Defined in ESP32-RTSPServer.cpp
+
+  void receiveRtcp(int rtcpSocket, const int* clientSockets, uint8_t clientCount, uint32_t now);  // Defined in ESP32-RTSPServer.cpp
+
+  int createListenSocket(uint16_t port);  // Defined in ESP32-RTSPServer.cpp
+
+  void acceptRTSPClient(int listenSocket, int* clientSockets, uint32_t now);  // Defined in ESP32-RTSPServer.cpp
+
+  bool handleHttpRequest(RTSP_Session& session, int len);  // Defined in httpTunnel.cpp
+
+  bool handleTunnelRequest(RTSP_Session& session, bool& tunnelClosed);  // Defined in httpTunnel.cpp
+
+  bool dispatchTunnelRequests(RTSP_Session& session, int len);  // Defined in httpTunnel.cpp
+
+  void closeTunnel(RTSP_Session& session, int* clientSockets);  // Defined in httpTunnel.cpp
+
+  bool openHttpClient(RTSP_Session& session, char* request);  // Defined in httpMjpeg.cpp
+
+  int findHttpClient(int sock);  // Defined in httpMjpeg.cpp
+
+  void publishHttpFrame(const uint8_t* data, size_t len, int64_t timestampUs);  // Defined in httpMjpeg.cpp
+
+  void releaseHttpFrame(RTSP_HttpClient& client);  // Defined in httpMjpeg.cpp
+
+  int prepareHttpClients(fd_set& readFds, fd_set& writeFds, int maxSd, uint32_t now);  // Defined in httpMjpeg.cpp
+
+  void buildHttpFrameHeader(RTSP_HttpClient& client, const RTSP_HttpFrame& frame);  // Defined in httpMjpeg.cpp
+
+  bool writeHttpClient(RTSP_HttpClient& client);  // Defined in httpMjpeg.cpp
+
+  void serviceHttpClients(fd_set& readFds, fd_set& writeFds);  // Defined in httpMjpeg.cpp
+
+  void closeHttpClient(RTSP_HttpClient& client);  // Defined in httpMjpeg.cpp
+
+  void closeHttpClients();  // Defined in httpMjpeg.cpp
+
+  bool openWakeSocket();  // Defined in httpMjpeg.cpp
+
+  void wakeRtspTask();  // Defined in httpMjpeg.cpp
+
+  void recordFrame(const uint8_t* data, size_t len, int width, int height, int64_t timestampUs);  // Defined in recording.cpp
+
+  void recordAudio(const int16_t* data, size_t len);  // Defined in recording.cpp
+
+  static void recordTaskWrapper(void* pvParameters);  // Defined in recording.cpp
+
+  void recordTask();  // Defined in recording.cpp
+
+  const char* findPlaybackName(const char* request);  // Defined in playback.cpp
+
+  uint8_t countPlaybacks();  // Defined in playback.cpp
+
+  bool openPlayback(const char* request, RTSP_Session& session);  // Defined in playback.cpp
+
+  void describePlayback(const RTSP_Session& session);  // Defined in playback.cpp
+
+  void setupPlayback(char* request, RTSP_Session& session);  // Defined in playback.cpp
+
+  void startPlayback(const char* request, RTSP_Session& session);  // Defined in playback.cpp
+
+  void pausePlayback(RTSP_Session& session);  // Defined in playback.cpp
+
+  void closePlayback(RTSP_Session& session);  // Defined in playback.cpp
+
+  void closePlaybacks();  // Defined in playback.cpp
+
+  static void playbackTaskWrapper(void* pvParameters);  // Defined in playback.cpp
+
+  void playbackTask();  // Defined in playback.cpp
+
+  int64_t servicePlayer(RTSP_Player& player);  // Defined in playback.cpp
+
+  void sendPlaybackReports(RTSP_Player& player);  // Defined in playback.cpp
+
+  void sendPlayerChunk(RTSP_Player& player, int64_t dueUs);  // Defined in playback.cpp
+
+  void lockIdlePlayback();  // Defined in playback.cpp
+
+  bool startBackchannel();  // Defined in backchannel.cpp
+
+  void stopBackchannel();  // Defined in backchannel.cpp
+
+  bool claimBackchannel(const RTSP_Session& session, int64_t now);  // Defined in backchannel.cpp
+
+  void commitBackchannel(size_t len, int64_t now);  // Defined in backchannel.cpp
+
+  void receiveBackchannel(int rtpSocket, const int* clientSockets, uint8_t clientCount, uint32_t now);  // Defined in backchannel.cpp
+
+  bool receiveInterleaved(RTSP_Session& session);  // Defined in backchannel.cpp
+
+  static void backchannelTaskWrapper(void* pvParameters);  // Defined in backchannel.cpp
+
+  void backchannelTask();  // Defined in backchannel.cpp
+
+  void updateVideoCost(size_t frameLen, int64_t sendUs, uint8_t streams);  // Defined in admission.cpp
+
+  void estimateSessionCost(const RTSP_Session& session, uint32_t& bytesPerSecond, uint32_t& cpuPermille);  // Defined in admission.cpp
+
+  bool admitSession(const RTSP_Session& session);  // Defined in admission.cpp
+
+  void sessionTimerInit(uint32_t now);  // Defined in sessionTimers.cpp
+
+  void sessionTimerTouch(int client, uint32_t now);  // Defined in sessionTimers.cpp
+
+  void sessionTimerCancel(int client);  // Defined in sessionTimers.cpp
+
+  int sessionTimerExpire(uint32_t now, int* expired, int maxExpired);  // Defined in sessionTimers.cpp
   
-  void sendTcpPacket(const uint8_t* packet, size_t packetSize, int sock);  // Defined in network.cpp
+  bool sendTcpPacket(const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen, int sock, bool priority, RTSP_StreamStats* stats);  // Defined in netUtils.cpp
+
+  bool recvFully(int sock, uint8_t* buffer, size_t len);  // Defined in netUtils.cpp
+
+  bool recvSession(RTSP_Session& session, uint8_t* buffer, size_t len);  // Defined in netUtils.cpp
+
+  bool writeTcpVectors(int sock, struct iovec* iov, int iovCount, bool priority, RTSP_StreamStats* stats);  // Defined in netUtils.cpp
+
+  void lockTcpSend(bool priority);  // Defined in netUtils.cpp
+
+  void unlockTcpSend(bool priority);  // Defined in netUtils.cpp
+
+  RTSP_TcpBatch* beginTcpBatch(RTSP_TcpBatch& batch, int sock, RTSP_StreamStats* stats);  // Defined in netUtils.cpp
+
+  bool addTcpBatch(RTSP_TcpBatch& batch, const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen);  // Defined in netUtils.cpp
+
+  bool flushTcpBatch(RTSP_TcpBatch& batch);  // Defined in netUtils.cpp
+
+  void endTcpBatch(RTSP_TcpBatch* batch);  // Defined in netUtils.cpp
+
+  bool sendRtpPacket(uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen, int sock, int udpSocket, uint16_t sendPort, bool useTCP, bool isMulticast, bool priority, RTSP_StreamStats* stats, RTSP_TcpBatch* batch);  // Defined in netUtils.cpp
+
+  void checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtpPort, uint8_t dscp, IPAddress rtpIp = IPAddress());  // Defined in network.cpp
+
+  void applySocketOptions(int sock, uint8_t dscp, bool isMulticast);  // Defined in netUtils.cpp
+
+  void sendRtpSubtitles(const char* data, size_t len, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats);  // Defined in rtp.cpp
+
+  void sendRtpAudio(const int16_t* data, size_t len, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats);  // Defined in rtp.cpp
+
+  void sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats);  // Defined in rtp.cpp
+
+  bool sendRtpFrameFragment(const uint8_t* fragment, size_t fragmentLen, size_t fragmentOffset, bool isLastFragment, uint8_t quality, uint16_t width, uint16_t height, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch);  // Defined in rtpPackets.cpp
+
+  void sendFrameFragmentToSessions(const uint8_t* fragment, size_t fragmentLen, bool isLastFragment);  // Defined in rtpPackets.cpp
+
+  void updateRtpFps();  // Defined in rtpPackets.cpp
+
+  bool sessionWantsFrame(RTSP_Session& session, int64_t timestampUs);  // Defined in rtpPackets.cpp
+
+  bool scalePreview(const uint8_t* data, size_t len, int8_t& state);  // Defined in preview.cpp
+
+  static uint32_t sampleFrameChecksum(const uint8_t* data, size_t len);  // Defined in staticFrames.cpp
+
+  bool suppressStaticFrame(const uint8_t* data, size_t len, int64_t timestampUs);  // Defined in staticFrames.cpp
+
+  static size_t splitAnnexB(const uint8_t* data, size_t len, RTP_NalUnit* nals, size_t maxNals);  // Defined in rtpH264.cpp
+
+  void sendRtpH264(const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch);  // Defined in rtpH264.cpp
+
+  static bool videoPacketSink(void* context, const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker);  // Defined in rtpH264.cpp
+
+  bool sendRtpVideoPacket(const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch);  // Defined in rtpH264.cpp
 
-  void checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtpPort, IPAddress rtpIp = IPAddress());  // Defined in network.cpp
+  int h264Fmtp(char* buffer, size_t size);  // Defined in rtpH264.cpp
 
-  void sendRtpSubtitles(const char* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  void sendRtpH265(const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch);  // Defined in rtpH265.cpp
 
-  void sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  int h265Fmtp(char* buffer, size_t size);  // Defined in rtpH265.cpp
 
-  void sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast);  // Defined in rtp.cpp
+  void sendRTSPAccessUnit(VideoCodec codec, const uint8_t* data, size_t len, int64_t timestampUs, FrameType frameType);  // Defined in frameCache.cpp
+
+  RTSP_ParameterSets& parameterSets(VideoCodec codec);  // Defined in frameCache.cpp
+
+  void sendRtpAccessUnit(VideoCodec codec, const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats);  // Defined in frameCache.cpp
+
+  void cacheFrame(VideoCodec codec, const uint8_t* data, size_t len, bool isKeyframe);  // Defined in frameCache.cpp
+
+  void replayFrameCache(RTSP_Session& session);  // Defined in frameCache.cpp
+
+  void countRtpPacket(RTSP_StreamStats* stats, size_t payloadLen);  // Defined in rtpPackets.cpp
+
+  void sendRtcpSenderReport(uint32_t ssrc, uint32_t clockRate, uint32_t clockOffset, uint32_t packetCount, uint32_t octetCount, uint8_t channel, int sock, int rtcpSocket, uint16_t sendRtcpPort, bool useTCP, bool isMulticast, RTSP_StreamStats* stats);  // Defined in rtpPackets.cpp
+
+  void sendVideoSenderReports();  // Defined in rtpPackets.cpp
+
+  void sendAudioSenderReports();  // Defined in rtpPackets.cpp
+
+  void sendSubtitlesSenderReports();  // Defined in rtpPackets.cpp
+
+  void sendSenderReports(uint32_t& lastSRTime, uint32_t ssrc, uint32_t clockRate, uint32_t clockOffset, uint8_t RTSP_Session::* channel, int multicastSocket, int rtcpSocket, uint16_t multicastPort, uint16_t RTSP_Session::* clientPort, RTSP_StreamStats* multicastStats, RTSP_StreamStats RTSP_Session::* sessionStats);  // Defined in rtpPackets.cpp
 
   static void rtpVideoTaskWrapper(void* pvParameters);  // Defined in rtp.cpp
 
   void rtpVideoTask();  // Defined in rtp.cpp
 
+  uint32_t mediaClockToRtp(int64_t timestampUs, uint32_t clockRate, uint32_t clockOffset) const;  // Defined in genUtils.cpp
+
   void setMaxClients(uint8_t newMaxClients);  // Defined in utils.cpp
 
   uint8_t getMaxClients();  // Defined in utils.cpp
@@ -176,8 +846,18 @@ private:
   
   bool getIsPlaying() const;  // Defined in utils.cpp
 
+  void readLockSessions();  // Defined in genUtils.cpp
+
+  void readUnlockSessions();  // Defined in genUtils.cpp
+
+  void writeLockSessions();  // Defined in genUtils.cpp
+
+  void writeUnlockSessions();  // Defined in genUtils.cpp
+
   int captureCSeq(char* request);  // Defined in utils.cpp
 
+  int findRequestEnd(const char* buffer, int len);  // Defined in genUtils.cpp
+
   uint32_t generateSessionID();  // Defined in utils.cpp
 
   uint32_t extractSessionID(char* request);  // Defined in utils.cpp
@@ -196,16 +876,82 @@ private:
 
   void handleTeardown(RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
+  void handleParameter(char* request, RTSP_Session& session, bool isSet);  // Defined in rtspHandles.cpp
+
+  void parseFrameRate(const char* request, RTSP_Session& session);  // Defined in rtspHandles.cpp
+
+  void parseMount(const char* request, RTSP_Session& session);  // Defined in rtspHandles.cpp
+
+  static bool isSetupFor(const char* request, const char* control);  // Defined in rtspHandles.cpp
+
   bool handleRTSPRequest(RTSP_Session& session);  // Defined in rtsp_requests.cpp
 
+  bool processRTSPRequest(RTSP_Session& session, char* buffer);  // Defined in rtspHandles.cpp
+
   bool setNonBlocking(int sockfd);  // Defined in network.cpp
 
+  void setSessionPayloadSizes(RTSP_Session& session, uint32_t blocksize);  // Defined in netUtils.cpp
+
   bool prepRTSP();  // Defined in ESP32-RTSPServer.cpp
 
   static void rtspTaskWrapper(void* pvParameters);  // Defined in ESP32-RTSPServer.cpp
 
   void rtspTask();  // Defined in ESP32-RTSPServer.cpp
 
+  void addStreamStats(RTSP_StreamStats& total, const RTSP_StreamStats& add);  // Defined in stats.cpp
+
+  void retireSessionStats(const RTSP_Session& session);  // Defined in stats.cpp
+
+  static uint32_t taskStackFree(TaskHandle_t task);  // Defined in stats.cpp
+
+  bool startMediaScheduler();  // Defined in mediaScheduler.cpp
+
+  void stopMediaScheduler();  // Defined in mediaScheduler.cpp
+
+  static void mediaSchedulerTaskWrapper(void* pvParameters);  // Defined in mediaScheduler.cpp
+
+  void mediaSchedulerTask();  // Defined in mediaScheduler.cpp
+
+  bool sendPriorityMedia();  // Defined in mediaScheduler.cpp
+
+  bool queueVideoFrame(VideoCodec codec, const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs, FrameType frameType);  // Defined in mediaScheduler.cpp
+
+  void sendQueuedVideo(const RTSP_MediaQueueCell& cell);  // Defined in mediaScheduler.cpp
+
+  static bool mediaQueueInit(RTSP_MediaQueue& queue, uint32_t capacity, size_t slotSize);  // Defined in mediaScheduler.cpp
+
+  static void mediaQueueFree(RTSP_MediaQueue& queue);  // Defined in mediaScheduler.cpp
+
+  static bool mediaQueuePush(RTSP_MediaQueue& queue, const void* data, size_t len, const RTSP_MediaQueueCell& meta);  // Defined in mediaScheduler.cpp
+
+  static RTSP_MediaQueueCell* mediaQueuePeek(RTSP_MediaQueue& queue);  // Defined in mediaScheduler.cpp
+
+  static void mediaQueuePop(RTSP_MediaQueue& queue);  // Defined in mediaScheduler.cpp
+
+  static bool mediaQueueHasRoom(const RTSP_MediaQueue& queue);  // Defined in mediaScheduler.cpp
+
+  bool packetPoolInit();  // Defined in packetPool.cpp
+
+  void packetPoolFree();  // Defined in packetPool.cpp
+
+  uint8_t* allocPacket();  // Defined in packetPool.cpp
+
+  void freePacket(uint8_t* packet);  // Defined in packetPool.cpp
+
+  void sendFrameToSessions(const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs);  // Defined in rtpPackets.cpp
+
+  void sendAudioToSessions(const int16_t* data, size_t len, int64_t timestampUs);  // Defined in rtpPackets.cpp
+
+  void sendSubtitlesToSessions(const char* data, size_t len, int64_t timestampUs);  // Defined in rtpPackets.cpp
+
+#ifdef RTSP_PROFILING
+  void recordProfile(RTSP_ProfilePoint point, uint32_t cycles);  // Defined in profiling.cpp
+
+  RTSP_Histogram profileHistograms[PROFILE_POINT_COUNT];
+  RTSP_TraceHook traceHook;
+  uint32_t videoHandoffCycles; // Cycle count when the last frame was handed to rtpVideoTask
+#endif
+
   static const char* LOG_TAG;  // Define a log tag for the class
 
   void sendUnauthorizedResponse(RTSP_Session& session); // Add method to send 401 Unauthorized response
@@ -0,0 +1,125 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Limits clients by what the device can sustain instead of a fixed count.
+ *
+ * Each PLAY is admitted only if the estimated cost of the new session fits in what is left of the
+ * budgets, otherwise the client gets 503 with Retry-After. With a budget set, up to MAX_CLIENTS
+ * clients of any transport are let in instead of maxRTSPClients of the first client's transport.
+ * Multicast is shared, so only the first multicast session costs anything.
+ *
+ * @param uplinkKbps Uplink budget in kbit/s, 0 for no limit.
+ * @param cpuPercent Share of the sending core media may use, 0 for no limit.
+ */
+void RTSPServer::setAdmissionBudget(uint32_t uplinkKbps, uint8_t cpuPercent) {
+  if (cpuPercent > 100) {
+    cpuPercent = 100;
+  }
+  this->uplinkBudget = uplinkKbps * 1000 / 8;
+  this->cpuBudget = cpuPercent;
+  if (this->uplinkBudget || this->cpuBudget) {
+    setMaxClients(MAX_CLIENTS);
+  }
+}
+
+/**
+ * @brief Tracks the average frame size and the time to send a frame to one stream.
+ *
+ * @param frameLen Bytes in the frame.
+ * @param sendUs Time spent sending it to all streams, 0 if not measured.
+ * @param streams Streams the frame went to, multicast counting once.
+ */
+void RTSPServer::updateVideoCost(size_t frameLen, int64_t sendUs, uint8_t streams) {
+  // Exponential moving averages over about 8 frames, only the video sending task writes them
+  if (this->videoFrameBytesAvg == 0) {
+    this->videoFrameBytesAvg = frameLen;
+  } else {
+    this->videoFrameBytesAvg += ((int32_t)frameLen - (int32_t)this->videoFrameBytesAvg) / 8;
+  }
+  if (streams && sendUs > 0) {
+    uint32_t perStream = sendUs / streams;
+    if (this->videoSendUsAvg == 0) {
+      this->videoSendUsAvg = perStream;
+    } else {
+      this->videoSendUsAvg += ((int32_t)perStream - (int32_t)this->videoSendUsAvg) / 8;
+    }
+  }
+}
+
+/**
+ * @brief Estimates the uplink bytes per second and CPU share a playing session adds.
+ *
+ * Video is the average frame plus RTP, UDP/TCP and IP headers per packet at the current frame
+ * rate or the session's cap, audio is 16-bit PCM at the sample rate. For a multicast session this
+ * is the cost of the shared stream, which the caller counts once.
+ *
+ * @param session The session.
+ * @param bytesPerSecond Estimated uplink use.
+ * @param cpuPermille Estimated share of the sending core in tenths of a percent.
+ */
+void RTSPServer::estimateSessionCost(const RTSP_Session& session, uint32_t& bytesPerSecond, uint32_t& cpuPermille) {
+  bytesPerSecond = 0;
+  cpuPermille = 0;
+  const uint32_t headerSize = session.isTCP ? 4 + 12 + 40 : 12 + 28; // Interleaved + RTP + TCP/IP or RTP + UDP/IP
+  uint32_t fps = this->rtpFps;
+  if (session.maxFps && session.maxFps < fps && !session.isMulticast) {
+    fps = session.maxFps;
+  }
+  if (this->isVideo && fps) {
+    uint32_t payloadSize = session.isMulticast ? this->udpVideoPayloadSize : session.videoPayloadSize;
+    uint32_t packets = this->videoFrameBytesAvg / payloadSize + 1;
+    bytesPerSecond += (this->videoFrameBytesAvg + packets * headerSize) * fps;
+    cpuPermille += this->videoSendUsAvg * fps / 1000;
+  }
+  if (this->isAudio && this->sampleRate) {
+    uint32_t audioBytes = this->sampleRate * 2;
+    uint32_t payloadSize = session.isMulticast ? this->udpAudioPayloadSize : session.audioPayloadSize;
+    bytesPerSecond += audioBytes + (audioBytes / payloadSize + 1) * headerSize;
+  }
+}
+
+/**
+ * @brief Decides whether a session may start playing within the budgets.
+ *
+ * @param session The session asking to play.
+ * @return true if it fits, or no budget is set.
+ */
+bool RTSPServer::admitSession(const RTSP_Session& session) {
+  if (this->uplinkBudget == 0 && this->cpuBudget == 0) {
+    return true;
+  }
+  uint32_t usedBytes = 0;
+  uint32_t usedPermille = 0;
+  bool multicastPlaying = false;
+  for (const auto& sessionPair : this->sessions) {
+    const RTSP_Session& other = sessionPair.second;
+    if (!other.isPlaying || sessionPair.first == session.sessionID) {
+      continue;
+    }
+    if (other.isMulticast) {
+      if (multicastPlaying) {
+        continue; // The multicast stream is sent once however many sessions watch it
+      }
+      multicastPlaying = true;
+    }
+    uint32_t bytes, permille;
+    estimateSessionCost(other, bytes, permille);
+    usedBytes += bytes;
+    usedPermille += permille;
+  }
+  // Joining a multicast stream that is already being sent costs nothing
+  uint32_t bytes = 0;
+  uint32_t permille = 0;
+  if (!session.isMulticast || !multicastPlaying) {
+    estimateSessionCost(session, bytes, permille);
+  }
+  if (this->uplinkBudget && usedBytes + bytes > this->uplinkBudget) {
+    RTSP_LOGW(LOG_TAG, "Session %u needs %u kbit/s, %u of %u kbit/s in use", session.sessionID, bytes * 8 / 1000, usedBytes * 8 / 1000, this->uplinkBudget * 8 / 1000);
+    return false;
+  }
+  if (this->cpuBudget && usedPermille + permille > this->cpuBudget * 10u) {
+    RTSP_LOGW(LOG_TAG, "Session %u needs %u.%u%% CPU, %u.%u%% of %u%% in use", session.sessionID, permille / 10, permille % 10, usedPermille / 10, usedPermille % 10, this->cpuBudget);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,1057 @@
+#include "aviRecorder.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#endif
+
+#define AVIIF_KEYFRAME 0x10
+#define AVIF_HASINDEX 0x10
+#define AVIF_ISINTERLEAVED 0x100
+#define AVI_INDEX_MAGIC 0x58444952 // "RIDX", start of the sidecar
+#define AVI_INDEX_HEADER_SIZE 16 // Magic, fps, width, height and sample rate ahead of the entries
+
+static inline uint32_t fourcc(const char* id) {
+  return (uint32_t)id[0] | ((uint32_t)id[1] << 8) | ((uint32_t)id[2] << 16) | ((uint32_t)id[3] << 24);
+}
+
+static inline void put16(uint8_t*& p, uint16_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p += 2;
+}
+
+static inline void put32(uint8_t*& p, uint32_t value) {
+  p[0] = value;
+  p[1] = value >> 8;
+  p[2] = value >> 16;
+  p[3] = value >> 24;
+  p += 4;
+}
+
+static inline uint16_t get16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t get32(const uint8_t* p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void* allocBuffer(size_t size) {
+#ifdef ARDUINO
+  // Only ever copied through, PSRAM keeps internal RAM for the network stack
+  void* buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (buffer) {
+    return buffer;
+  }
+#endif
+  return malloc(size);
+}
+
+static bool writeFully(int fd, uint32_t position, const void* data, size_t len) {
+  if (lseek(fd, position, SEEK_SET) != (off_t)position) {
+    return false;
+  }
+  const uint8_t* p = (const uint8_t*)data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool readFully(int fd, uint32_t position, void* data, size_t len) {
+  if (lseek(fd, position, SEEK_SET) != (off_t)position) {
+    return false;
+  }
+  uint8_t* p = (uint8_t*)data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n <= 0) {
+      return false;
+    }
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+RTSP_AviRecorder::RTSP_AviRecorder()
+  : fd(-1),
+    indexFd(-1),
+    path{},
+    fps(0),
+    sampleRate(0),
+    width(0),
+    height(0),
+    ring(NULL),
+    ringSize(0),
+    pushed(0),
+    written(0),
+    index(NULL),
+    indexNext(0),
+    indexPushed(0),
+    indexScanned(0),
+    indexFlushed(0),
+    dropped(0),
+    startUs(0),
+    nextFrame(0),
+    videoStarted(false),
+    dataEnd(0),
+    videoFrames(0),
+    audioBytes(0),
+    maxChunk(0) {
+}
+
+RTSP_AviRecorder::~RTSP_AviRecorder() {
+  release();
+}
+
+/**
+ * @brief Creates the AVI file and its sidecar index and allocates the write-behind ring.
+ *
+ * @param path File to create, replaced if it exists. The sidecar is path + ".idx".
+ * @param fps Frame rate the video is stored at.
+ * @param sampleRate Audio sample rate, 0 for a file without audio.
+ * @param bufferSize Size of the write-behind ring, rounded down to a multiple of RTSP_AVI_WRITE_SIZE.
+ * @return false if the files can't be created or there isn't enough memory.
+ */
+bool RTSP_AviRecorder::open(const char* path, uint8_t fps, uint32_t sampleRate, size_t bufferSize) {
+  if (isOpen() || fps == 0 || strlen(path) + 5 > sizeof(this->path)) {
+    return false;
+  }
+  bufferSize -= bufferSize % RTSP_AVI_WRITE_SIZE;
+  if (bufferSize < 2 * RTSP_AVI_WRITE_SIZE) {
+    bufferSize = 2 * RTSP_AVI_WRITE_SIZE;
+  }
+  if (this->ring == NULL || this->ringSize != bufferSize) {
+    free(this->ring);
+    this->ring = (uint8_t*)allocBuffer(bufferSize);
+    this->ringSize = this->ring ? bufferSize : 0;
+  }
+  if (this->index == NULL) {
+    this->index = (RTSP_AviIndexEntry*)allocBuffer(RTSP_AVI_INDEX_ENTRIES * sizeof(RTSP_AviIndexEntry));
+  }
+  if (this->ring == NULL || this->index == NULL) {
+    release();
+    return false;
+  }
+
+  strcpy(this->path, path);
+  char indexPath[RTSP_AVI_PATH_SIZE];
+  snprintf(indexPath, sizeof(indexPath), "%s.idx", path);
+  this->fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  this->indexFd = ::open(indexPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (this->fd < 0 || this->indexFd < 0) {
+    release();
+    return false;
+  }
+
+  this->fps = fps;
+  this->sampleRate = sampleRate;
+  this->width = 0;
+  this->height = 0;
+  this->pushed = 0;
+  this->written = 0;
+  this->indexNext = 0;
+  this->indexPushed = 0;
+  this->indexScanned = 0;
+  this->indexFlushed = 0;
+  this->dropped = 0;
+  this->startUs = 0;
+  this->nextFrame = 0;
+  this->videoStarted = false;
+  this->dataEnd = 0;
+  this->videoFrames = 0;
+  this->audioBytes = 0;
+  this->maxChunk = 0;
+
+  // The whole header block once, later flushes only rewrite the sizes and counts in it
+  memset(this->ring, 0, RTSP_AVI_HEADER_SIZE);
+  buildHeader(this->ring, false, 0);
+  uint8_t* movi = this->ring + RTSP_AVI_HEADER_SIZE - 12;
+  put32(movi, fourcc("LIST"));
+  put32(movi, 4);
+  put32(movi, fourcc("movi"));
+  if (!writeFully(this->fd, 0, this->ring, RTSP_AVI_HEADER_SIZE)) {
+    release();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Makes room for chunks in the ring and the index, without waiting for the writer.
+ *
+ * @return false, counting the chunk as dropped, if the writer hasn't caught up or the file is full.
+ */
+bool RTSP_AviRecorder::reserve(size_t bytes, uint32_t entries) {
+  uint32_t freedBytes = __atomic_load_n(&this->written, __ATOMIC_ACQUIRE);
+  uint32_t freedEntries = __atomic_load_n(&this->indexFlushed, __ATOMIC_ACQUIRE);
+  if (this->pushed - freedBytes + bytes > this->ringSize || this->indexNext - freedEntries + entries > RTSP_AVI_INDEX_ENTRIES ||
+      this->pushed + bytes > RTSP_AVI_MAX_SIZE - RTSP_AVI_HEADER_SIZE) {
+    __atomic_fetch_add(&this->dropped, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  return true;
+}
+
+void RTSP_AviRecorder::ringWrite(uint32_t position, const void* data, size_t len) {
+  size_t at = position % this->ringSize;
+  size_t first = len < this->ringSize - at ? len : this->ringSize - at;
+  memcpy(this->ring + at, data, first);
+  if (first < len) {
+    memcpy(this->ring, (const uint8_t*)data + first, len - first);
+  }
+}
+
+/**
+ * @brief Lays out one chunk in the ring as it will be in the file and adds its index entry.
+ *
+ * Entries reach the writer when the caller publishes indexNext.
+ */
+void RTSP_AviRecorder::putChunk(uint32_t chunkId, uint32_t flags, const void* data, size_t len) {
+  uint8_t header[8];
+  uint8_t* p = header;
+  put32(p, chunkId);
+  put32(p, len);
+  ringWrite(this->pushed, header, sizeof(header));
+  if (len) {
+    ringWrite(this->pushed + 8, data, len);
+  }
+  if (len & 1) {
+    const uint8_t pad = 0;
+    ringWrite(this->pushed + 8 + len, &pad, 1);
+  }
+  RTSP_AviIndexEntry& entry = this->index[this->indexNext & (RTSP_AVI_INDEX_ENTRIES - 1)];
+  entry.chunkId = chunkId;
+  entry.flags = flags;
+  entry.offset = this->pushed + 4; // The movi fourcc is 4 bytes before the first chunk
+  entry.size = len;
+  this->indexNext++;
+  this->pushed += 8 + len + (len & 1);
+}
+
+/**
+ * @brief Adds a frame, and empty chunks for the frame slots since the last one.
+ *
+ * @param jpeg The JPEG.
+ * @param len Length of the JPEG.
+ * @param width Frame width, the first frame's is stored in the header.
+ * @param height Frame height.
+ * @param timestampUs Capture time, places the frame on the constant rate timeline.
+ * @return false if the frame was dropped for lack of buffer space.
+ */
+bool RTSP_AviRecorder::pushVideo(const uint8_t* jpeg, size_t len, uint16_t width, uint16_t height, int64_t timestampUs) {
+  if (!isOpen()) {
+    return false;
+  }
+  uint32_t empties = 0;
+  if (this->videoStarted) {
+    int64_t slot = ((timestampUs - this->startUs) * this->fps + 500000) / 1000000;
+    if (slot < (int64_t)this->nextFrame) {
+      return true; // Faster than the recording rate
+    }
+    empties = slot - this->nextFrame;
+    if (empties > RTSP_AVI_INDEX_ENTRIES / 4) {
+      // A long pause, restart the timeline here rather than fill it
+      this->startUs = timestampUs - (int64_t)this->nextFrame * 1000000 / this->fps;
+      empties = 0;
+    }
+  }
+  if (!reserve(empties * 8 + 8 + len + (len & 1), empties + 1)) {
+    return false;
+  }
+  if (!this->videoStarted) {
+    this->startUs = timestampUs;
+    this->width = width;
+    this->height = height;
+    this->videoStarted = true;
+  }
+  for (uint32_t i = 0; i < empties; i++) {
+    putChunk(fourcc("00dc"), 0, NULL, 0);
+  }
+  putChunk(fourcc("00dc"), AVIIF_KEYFRAME, jpeg, len);
+  this->nextFrame += empties + 1;
+  __atomic_store_n(&this->indexPushed, this->indexNext, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Adds a block of 16 bit mono samples.
+ *
+ * @param samples The samples.
+ * @param len Length in bytes.
+ * @return false if the block was dropped for lack of buffer space.
+ */
+bool RTSP_AviRecorder::pushAudio(const int16_t* samples, size_t len) {
+  if (!isOpen() || this->sampleRate == 0) {
+    return false;
+  }
+  len &= ~(size_t)1;
+  if (!reserve(8 + len, 1)) {
+    return false;
+  }
+  putChunk(fourcc("01wb"), AVIIF_KEYFRAME, samples, len);
+  __atomic_store_n(&this->indexPushed, this->indexNext, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Bytes in the ring not yet written out in full blocks, for the producer to decide when to wake the writer.
+ */
+uint32_t RTSP_AviRecorder::bytesPending() const {
+  return this->pushed - __atomic_load_n(&this->written, __ATOMIC_ACQUIRE);
+}
+
+void RTSP_AviRecorder::countEntry(const RTSP_AviIndexEntry& entry) {
+  this->dataEnd = entry.offset - 4 + 8 + entry.size + (entry.size & 1);
+  if (entry.chunkId == fourcc("00dc")) {
+    this->videoFrames++;
+  } else {
+    this->audioBytes += entry.size;
+  }
+  if (entry.size > this->maxChunk) {
+    this->maxChunk = entry.size;
+  }
+}
+
+/**
+ * @brief Writes out what the producer has added, called from the writer task.
+ *
+ * Full RTSP_AVI_WRITE_SIZE blocks are written as soon as they are complete. With flush, the
+ * partial block, the new index entries and the header follow and both files are synced. The data
+ * is synced before the index entries that point at it are written, so the sidecar never refers
+ * to data that isn't on the card.
+ *
+ * @param flush Make everything added so far survive a power cut.
+ * @return false if a write failed, e.g. the card is full or was removed.
+ */
+bool RTSP_AviRecorder::service(bool flush) {
+  if (!isOpen()) {
+    return false;
+  }
+  uint32_t published = __atomic_load_n(&this->indexPushed, __ATOMIC_ACQUIRE);
+  for (; this->indexScanned != published; this->indexScanned++) {
+    countEntry(this->index[this->indexScanned & (RTSP_AVI_INDEX_ENTRIES - 1)]);
+  }
+  while (this->dataEnd - this->written >= RTSP_AVI_WRITE_SIZE) {
+    if (!writeFully(this->fd, RTSP_AVI_HEADER_SIZE + this->written, this->ring + this->written % this->ringSize, RTSP_AVI_WRITE_SIZE)) {
+      return false;
+    }
+    __atomic_store_n(&this->written, this->written + RTSP_AVI_WRITE_SIZE, __ATOMIC_RELEASE);
+  }
+  if (!flush) {
+    return true;
+  }
+  // Rewritten in full once the rest of its block arrives, so file writes stay aligned
+  if (this->dataEnd > this->written &&
+      !writeFully(this->fd, RTSP_AVI_HEADER_SIZE + this->written, this->ring + this->written % this->ringSize, this->dataEnd - this->written)) {
+    return false;
+  }
+  if (!writeHeader(false, 0) || fsync(this->fd) != 0) {
+    return false;
+  }
+  return writeIndexEntries() && fsync(this->indexFd) == 0;
+}
+
+/**
+ * @brief Appends the scanned index entries to the sidecar and frees their slots.
+ */
+bool RTSP_AviRecorder::writeIndexEntries() {
+  uint8_t header[AVI_INDEX_HEADER_SIZE] = {};
+  uint8_t* p = header;
+  put32(p, AVI_INDEX_MAGIC);
+  *p++ = this->fps;
+  p += 3;
+  put16(p, this->width);
+  put16(p, this->height);
+  put32(p, this->sampleRate);
+  if (!writeFully(this->indexFd, 0, header, sizeof(header))) {
+    return false;
+  }
+  while (this->indexFlushed != this->indexScanned) {
+    uint32_t at = this->indexFlushed & (RTSP_AVI_INDEX_ENTRIES - 1);
+    uint32_t count = this->indexScanned - this->indexFlushed;
+    if (count > RTSP_AVI_INDEX_ENTRIES - at) {
+      count = RTSP_AVI_INDEX_ENTRIES - at;
+    }
+    if (!writeFully(this->indexFd, AVI_INDEX_HEADER_SIZE + this->indexFlushed * sizeof(RTSP_AviIndexEntry), this->index + at, count * sizeof(RTSP_AviIndexEntry))) {
+      return false;
+    }
+    __atomic_store_n(&this->indexFlushed, this->indexFlushed + count, __ATOMIC_RELEASE);
+  }
+  return true;
+}
+
+/**
+ * @brief Fills in RIFF, hdrl and the JUNK chunk header that pads to the movi list.
+ *
+ * @param out At least 512 bytes.
+ * @param hasIndex An idx1 chunk of indexSize bytes follows the movi list.
+ * @return Bytes written.
+ */
+size_t RTSP_AviRecorder::buildHeader(uint8_t* out, bool hasIndex, uint32_t indexSize) {
+  bool hasAudio = this->sampleRate != 0;
+  uint32_t videoStrlSize = 4 + (8 + 56) + (8 + 40);
+  uint32_t audioStrlSize = 4 + (8 + 56) + (8 + 18);
+  uint32_t hdrlSize = 4 + (8 + 56) + (8 + videoStrlSize) + (hasAudio ? 8 + audioStrlSize : 0);
+  uint32_t audioLength = this->audioBytes / 2;
+  uint8_t* p = out;
+
+  put32(p, fourcc("RIFF"));
+  put32(p, RTSP_AVI_HEADER_SIZE - 8 + this->dataEnd + (hasIndex ? 8 + indexSize : 0));
+  put32(p, fourcc("AVI "));
+  put32(p, fourcc("LIST"));
+  put32(p, hdrlSize);
+  put32(p, fourcc("hdrl"));
+
+  put32(p, fourcc("avih"));
+  put32(p, 56);
+  put32(p, 1000000 / this->fps);
+  put32(p, this->maxChunk * this->fps + this->sampleRate * 2); // Max bytes per second
+  put32(p, 0); // Padding granularity
+  put32(p, (hasIndex ? AVIF_HASINDEX : 0) | AVIF_ISINTERLEAVED);
+  put32(p, this->videoFrames);
+  put32(p, 0); // Initial frames
+  put32(p, hasAudio ? 2 : 1);
+  put32(p, this->maxChunk + 8); // Suggested buffer size
+  put32(p, this->width);
+  put32(p, this->height);
+  for (int i = 0; i < 4; i++) {
+    put32(p, 0);
+  }
+
+  put32(p, fourcc("LIST"));
+  put32(p, videoStrlSize);
+  put32(p, fourcc("strl"));
+  put32(p, fourcc("strh"));
+  put32(p, 56);
+  put32(p, fourcc("vids"));
+  put32(p, fourcc("MJPG"));
+  put32(p, 0); // Flags
+  put16(p, 0); // Priority
+  put16(p, 0); // Language
+  put32(p, 0); // Initial frames
+  put32(p, 1); // Scale
+  put32(p, this->fps); // Rate, frames per second is rate / scale
+  put32(p, 0); // Start
+  put32(p, this->videoFrames);
+  put32(p, this->maxChunk + 8);
+  put32(p, 0xFFFFFFFF); // Default quality
+  put32(p, 0); // Sample size, varies
+  put16(p, 0);
+  put16(p, 0);
+  put16(p, this->width);
+  put16(p, this->height);
+  put32(p, fourcc("strf"));
+  put32(p, 40);
+  put32(p, 40); // BITMAPINFOHEADER
+  put32(p, this->width);
+  put32(p, this->height);
+  put16(p, 1); // Planes
+  put16(p, 24); // Bits per pixel
+  put32(p, fourcc("MJPG"));
+  put32(p, (uint32_t)this->width * this->height * 3);
+  for (int i = 0; i < 4; i++) {
+    put32(p, 0);
+  }
+
+  if (hasAudio) {
+    put32(p, fourcc("LIST"));
+    put32(p, audioStrlSize);
+    put32(p, fourcc("strl"));
+    put32(p, fourcc("strh"));
+    put32(p, 56);
+    put32(p, fourcc("auds"));
+    put32(p, 0); // Handler
+    put32(p, 0); // Flags
+    put16(p, 0);
+    put16(p, 0);
+    put32(p, 0);
+    put32(p, 2); // Scale, one block is one 16 bit sample
+    put32(p, this->sampleRate * 2); // Rate in bytes per second
+    put32(p, 0);
+    put32(p, audioLength);
+    put32(p, this->sampleRate); // Suggested buffer size, half a second
+    put32(p, 0xFFFFFFFF);
+    put32(p, 2); // Sample size
+    for (int i = 0; i < 4; i++) {
+      put16(p, 0);
+    }
+    put32(p, fourcc("strf"));
+    put32(p, 18);
+    put16(p, 1); // WAVE_FORMAT_PCM
+    put16(p, 1); // Mono
+    put32(p, this->sampleRate);
+    put32(p, this->sampleRate * 2);
+    put16(p, 2); // Block align
+    put16(p, 16); // Bits per sample
+    put16(p, 0);
+  }
+
+  put32(p, fourcc("JUNK"));
+  put32(p, RTSP_AVI_HEADER_SIZE - 12 - (p - out) - 4);
+  return p - out;
+}
+
+/**
+ * @brief Rewrites the header sizes and counts for the data written so far.
+ */
+bool RTSP_AviRecorder::writeHeader(bool hasIndex, uint32_t indexSize) {
+  uint8_t header[512];
+  size_t len = buildHeader(header, hasIndex, indexSize);
+  uint8_t moviSize[4];
+  uint8_t* p = moviSize;
+  put32(p, 4 + this->dataEnd);
+  return writeFully(this->fd, 0, header, len) && writeFully(this->fd, RTSP_AVI_HEADER_SIZE - 8, moviSize, sizeof(moviSize));
+}
+
+/**
+ * @brief Copies the first entries of the sidecar into an idx1 chunk after the movi data and
+ * rewrites the header to include it.
+ *
+ * @param entries Entries to copy.
+ * @param scratch Buffer to copy through.
+ * @param scratchSize Its size, a multiple of sizeof(RTSP_AviIndexEntry).
+ */
+bool RTSP_AviRecorder::writeIdx1(uint32_t entries, uint8_t* scratch, size_t scratchSize) {
+  uint32_t indexSize = entries * sizeof(RTSP_AviIndexEntry);
+  uint32_t position = RTSP_AVI_HEADER_SIZE + this->dataEnd;
+  uint8_t header[8];
+  uint8_t* p = header;
+  put32(p, fourcc("idx1"));
+  put32(p, indexSize);
+  if (!writeFully(this->fd, position, header, sizeof(header))) {
+    return false;
+  }
+  position += sizeof(header);
+  for (uint32_t copied = 0; copied < indexSize;) {
+    size_t len = indexSize - copied < scratchSize ? indexSize - copied : scratchSize;
+    if (!readFully(this->indexFd, AVI_INDEX_HEADER_SIZE + copied, scratch, len) || !writeFully(this->fd, position, scratch, len)) {
+      return false;
+    }
+    copied += len;
+    position += len;
+  }
+  // Anything after idx1, e.g. a chunk cut off by a power cut, is outside the RIFF size and ignored
+  return writeHeader(true, indexSize) && fsync(this->fd) == 0;
+}
+
+/**
+ * @brief Flushes what is left, adds idx1 and closes the file. The sidecar is deleted once the
+ * file is complete, and kept for repair() if something failed.
+ *
+ * @return false if a write failed.
+ */
+bool RTSP_AviRecorder::close() {
+  if (!isOpen()) {
+    return false;
+  }
+  bool ok = service(true) && writeIdx1(this->indexFlushed, this->ring, this->ringSize);
+  ::close(this->fd);
+  ::close(this->indexFd);
+  this->fd = -1;
+  this->indexFd = -1;
+  if (ok) {
+    char indexPath[RTSP_AVI_PATH_SIZE + 4];
+    snprintf(indexPath, sizeof(indexPath), "%s.idx", this->path);
+    unlink(indexPath);
+  }
+  return ok;
+}
+
+/**
+ * @brief Closes the files as they are, without an index, and frees the buffers.
+ */
+void RTSP_AviRecorder::release() {
+  if (this->fd >= 0) {
+    ::close(this->fd);
+    this->fd = -1;
+  }
+  if (this->indexFd >= 0) {
+    ::close(this->indexFd);
+    this->indexFd = -1;
+  }
+  free(this->ring);
+  this->ring = NULL;
+  this->ringSize = 0;
+  free(this->index);
+  this->index = NULL;
+}
+
+/**
+ * @brief Completes a recording that was never closed, e.g. after a power cut.
+ *
+ * The sidecar's entries are checked against the file, from the first one that runs past the end
+ * of the file or out of sequence on they are dropped. idx1 is then written as close() would.
+ *
+ * @param path The AVI file, with its path + ".idx" sidecar next to it.
+ * @return false if there is no sidecar or the file can't be written.
+ */
+bool RTSP_AviRecorder::repair(const char* path) {
+  RTSP_AviRecorder recorder;
+  char indexPath[RTSP_AVI_PATH_SIZE];
+  if (snprintf(indexPath, sizeof(indexPath), "%s.idx", path) >= (int)sizeof(indexPath)) {
+    return false;
+  }
+  recorder.fd = ::open(path, O_RDWR);
+  recorder.indexFd = ::open(indexPath, O_RDONLY);
+  uint8_t header[AVI_INDEX_HEADER_SIZE];
+  const size_t scratchSize = 256 * sizeof(RTSP_AviIndexEntry);
+  uint8_t* scratch = (uint8_t*)malloc(scratchSize);
+  if (recorder.fd < 0 || recorder.indexFd < 0 || scratch == NULL || !readFully(recorder.indexFd, 0, header, sizeof(header)) || get32(header) != AVI_INDEX_MAGIC) {
+    free(scratch);
+    return false;
+  }
+  recorder.fps = header[4];
+  recorder.width = header[8] | (header[9] << 8);
+  recorder.height = header[10] | (header[11] << 8);
+  recorder.sampleRate = get32(header + 12);
+  off_t fileLen = lseek(recorder.fd, 0, SEEK_END);
+  off_t indexLen = lseek(recorder.indexFd, 0, SEEK_END);
+  if (recorder.fps == 0 || fileLen < RTSP_AVI_HEADER_SIZE || indexLen < AVI_INDEX_HEADER_SIZE) {
+    free(scratch);
+    return false;
+  }
+  uint32_t available = fileLen - RTSP_AVI_HEADER_SIZE;
+  uint32_t stored = (indexLen - AVI_INDEX_HEADER_SIZE) / sizeof(RTSP_AviIndexEntry);
+  uint32_t valid = 0;
+  bool intact = true;
+  while (intact && valid < stored) {
+    uint32_t count = stored - valid < scratchSize / sizeof(RTSP_AviIndexEntry) ? stored - valid : scratchSize / sizeof(RTSP_AviIndexEntry);
+    if (!readFully(recorder.indexFd, AVI_INDEX_HEADER_SIZE + valid * sizeof(RTSP_AviIndexEntry), scratch, count * sizeof(RTSP_AviIndexEntry))) {
+      break;
+    }
+    const RTSP_AviIndexEntry* entries = (const RTSP_AviIndexEntry*)scratch;
+    for (uint32_t i = 0; i < count; i++) {
+      const RTSP_AviIndexEntry& entry = entries[i];
+      if (entry.offset != recorder.dataEnd + 4 || (uint64_t)entry.offset - 4 + 8 + entry.size > available) {
+        intact = false;
+        break;
+      }
+      recorder.countEntry(entry);
+      valid++;
+    }
+  }
+  // idx1 replaces whatever follows the last intact chunk
+  bool ok = recorder.writeIdx1(valid, scratch, scratchSize);
+  free(scratch);
+  recorder.release();
+  if (ok) {
+    unlink(indexPath);
+  }
+  return ok;
+}
+
+RTSP_AviReader::RTSP_AviReader()
+  : fd(-1),
+    dataEnd(0),
+    indexStart(0),
+    indexEntries(0),
+    indexBase(0),
+    videoStream(-1),
+    audioStream(-1),
+    videoScale(0),
+    videoRate(0),
+    sampleRate(0),
+    width(0),
+    height(0),
+    duration(0),
+    window(NULL),
+    windowSize(0),
+    windowStart(0),
+    windowLen(0),
+    entries(NULL),
+    entriesStart(0),
+    entriesCount(0),
+    points(NULL),
+    pointCount(0),
+    pointInterval(0),
+    scanned{},
+    scanDone(false),
+    cursor(0),
+    cursorVideo(0),
+    cursorAudio(0) {
+}
+
+RTSP_AviReader::~RTSP_AviReader() {
+  close();
+}
+
+/**
+ * @brief Opens an AVI file for playing from the start and allocates the read buffers.
+ *
+ * Only the headers are read, idx1 is read as playing and seeking need it.
+ *
+ * @param path The file, e.g. one written by RTSP_AviRecorder.
+ * @return false if it can't be read, has no idx1 (see RTSP_AviRecorder::repair()) or has neither
+ *         MJPEG video nor 16 bit mono PCM audio.
+ */
+bool RTSP_AviReader::open(const char* path) {
+  if (isOpen()) {
+    return false;
+  }
+  this->fd = ::open(path, O_RDONLY);
+  this->entries = (RTSP_AviIndexEntry*)allocBuffer(RTSP_AVI_READ_ENTRIES * sizeof(RTSP_AviIndexEntry));
+  this->points = (RTSP_AviSeekPoint*)allocBuffer(RTSP_AVI_SEEK_POINTS * sizeof(RTSP_AviSeekPoint));
+  this->window = (uint8_t*)allocBuffer(RTSP_AVI_READ_SIZE);
+  this->windowSize = this->window ? RTSP_AVI_READ_SIZE : 0;
+  uint8_t head[12];
+  if (this->fd < 0 || this->entries == NULL || this->points == NULL || this->window == NULL ||
+      !readFully(this->fd, 0, head, sizeof(head)) || get32(head) != fourcc("RIFF") || get32(head + 8) != fourcc("AVI ")) {
+    close();
+    return false;
+  }
+  off_t fileLen = lseek(this->fd, 0, SEEK_END);
+  uint32_t riffEnd = 8 + get32(head + 4);
+  if (fileLen < 0 || riffEnd > (uint64_t)fileLen) {
+    riffEnd = fileLen < 0 ? 0 : fileLen;
+  }
+
+  // Top level chunks, the header list is parsed in the idx1 buffer
+  uint32_t moviStart = 0;
+  bool hasHeader = false;
+  uint32_t position = 12;
+  while (position + 12 <= riffEnd && readFully(this->fd, position, head, sizeof(head))) {
+    uint32_t id = get32(head);
+    uint32_t size = get32(head + 4);
+    if (id == fourcc("LIST") && size >= 4 && get32(head + 8) == fourcc("hdrl")) {
+      uint8_t* hdrl = (uint8_t*)this->entries;
+      if (size - 4 > RTSP_AVI_READ_ENTRIES * sizeof(RTSP_AviIndexEntry) || !readFully(this->fd, position + 12, hdrl, size - 4)) {
+        break;
+      }
+      hasHeader = parseHeader(hdrl, size - 4);
+    } else if (id == fourcc("LIST") && size >= 4 && get32(head + 8) == fourcc("movi")) {
+      moviStart = position + 8;
+      this->dataEnd = (uint64_t)position + 8 + size > riffEnd ? riffEnd : position + 8 + size;
+    } else if (id == fourcc("idx1")) {
+      this->indexStart = position + 8;
+      this->indexEntries = ((uint64_t)position + 8 + size > riffEnd ? riffEnd - position - 8 : size) / sizeof(RTSP_AviIndexEntry);
+    }
+    position += 8 + size + (size & 1);
+  }
+  RTSP_AviIndexEntry first;
+  if (!hasHeader || moviStart == 0 || this->indexEntries == 0 || (!hasVideo() && !hasAudio()) || !readEntry(0, first)) {
+    close();
+    return false;
+  }
+  // idx1 offsets count from the movi fourcc, in a few writers' files from the start of the file
+  this->indexBase = moviStart;
+  if (!readFully(this->fd, moviStart + first.offset, head, 4) || get32(head) != first.chunkId) {
+    this->indexBase = 0;
+  }
+
+  this->windowLen = 0;
+  this->pointCount = 0;
+  this->pointInterval = this->duration / (RTSP_AVI_SEEK_POINTS - 1);
+  if (this->pointInterval < 1000000) {
+    this->pointInterval = 1000000;
+  }
+  this->scanned = {};
+  this->scanDone = false;
+  this->cursor = 0;
+  this->cursorVideo = 0;
+  this->cursorAudio = 0;
+  return true;
+}
+
+/**
+ * @brief Finds the first MJPEG video and 16 bit mono PCM audio streams in the hdrl list.
+ */
+bool RTSP_AviReader::parseHeader(const uint8_t* hdrl, uint32_t len) {
+  this->videoStream = -1;
+  this->audioStream = -1;
+  this->duration = 0;
+  int stream = -1;
+  for (uint32_t at = 0; at + 8 <= len;) {
+    uint32_t size = get32(hdrl + at + 4);
+    const uint8_t* list = hdrl + at + 8;
+    if (size > len - at - 8) {
+      break;
+    }
+    if (get32(hdrl + at) == fourcc("LIST") && size >= 4 && get32(list) == fourcc("strl") && ++stream < 100) {
+      uint32_t type = 0;
+      uint32_t scale = 0;
+      uint32_t rate = 0;
+      uint32_t length = 0;
+      for (uint32_t in = 4; in + 8 <= size;) {
+        uint32_t chunkSize = get32(list + in + 4);
+        const uint8_t* chunk = list + in + 8;
+        if (chunkSize > size - in - 8) {
+          break;
+        }
+        if (get32(list + in) == fourcc("strh") && chunkSize >= 36) {
+          type = get32(chunk);
+          scale = get32(chunk + 20);
+          rate = get32(chunk + 24);
+          length = get32(chunk + 32);
+        } else if (get32(list + in) == fourcc("strf") && rate != 0 && scale != 0) {
+          int64_t streamDuration = (int64_t)length * scale * 1000000 / rate;
+          if (type == fourcc("vids") && this->videoStream < 0 && chunkSize >= 40 && get32(chunk + 16) == fourcc("MJPG")) {
+            this->videoStream = stream;
+            this->videoScale = scale;
+            this->videoRate = rate;
+            this->width = get32(chunk + 4);
+            this->height = abs((int32_t)get32(chunk + 8));
+          } else if (type == fourcc("auds") && this->audioStream < 0 && chunkSize >= 16 && get16(chunk) == 1 && get16(chunk + 2) == 1 && get16(chunk + 14) == 16) {
+            this->audioStream = stream;
+            this->sampleRate = get32(chunk + 4);
+          } else {
+            streamDuration = 0;
+          }
+          if (streamDuration > this->duration) {
+            this->duration = streamDuration;
+          }
+        }
+        in += 8 + chunkSize + (chunkSize & 1);
+      }
+    }
+    at += 8 + size + (size & 1);
+  }
+  if (this->sampleRate == 0) {
+    this->audioStream = -1;
+  }
+  return true;
+}
+
+/**
+ * @brief Closes the file and frees the buffers.
+ */
+void RTSP_AviReader::close() {
+  if (this->fd >= 0) {
+    ::close(this->fd);
+    this->fd = -1;
+  }
+  free(this->window);
+  this->window = NULL;
+  this->windowSize = 0;
+  this->windowLen = 0;
+  free(this->entries);
+  this->entries = NULL;
+  this->entriesCount = 0;
+  free(this->points);
+  this->points = NULL;
+  this->pointCount = 0;
+  this->indexEntries = 0;
+  this->videoStream = -1;
+  this->audioStream = -1;
+}
+
+/**
+ * @brief Reads an idx1 entry, through a block of RTSP_AVI_READ_ENTRIES.
+ */
+bool RTSP_AviReader::readEntry(uint32_t entry, RTSP_AviIndexEntry& out) {
+  if (entry < this->entriesStart || entry >= this->entriesStart + this->entriesCount) {
+    uint32_t count = this->indexEntries - entry < RTSP_AVI_READ_ENTRIES ? this->indexEntries - entry : RTSP_AVI_READ_ENTRIES;
+    this->entriesCount = 0;
+    if (entry >= this->indexEntries ||
+        !readFully(this->fd, this->indexStart + entry * sizeof(RTSP_AviIndexEntry), this->entries, count * sizeof(RTSP_AviIndexEntry))) {
+      return false;
+    }
+    this->entriesStart = entry;
+    this->entriesCount = count;
+  }
+  out = this->entries[entry - this->entriesStart];
+  return true;
+}
+
+/**
+ * @brief Returns part of the movi data from the read-ahead window, refilling it from position on
+ * when the part isn't all in it.
+ *
+ * @return NULL if it can't be read.
+ */
+const uint8_t* RTSP_AviReader::readData(uint32_t position, uint32_t len) {
+  if (this->windowLen == 0 || position < this->windowStart || (uint64_t)position + len > (uint64_t)this->windowStart + this->windowLen) {
+    uint32_t start = position & ~511u; // Sector aligned reads
+    uint64_t need = (uint64_t)position + len - start;
+    this->windowLen = 0;
+    if (need > this->windowSize) {
+      // A frame bigger than the window, grow it to fit
+      free(this->window);
+      this->windowSize = (need + 4095) & ~(uint64_t)4095;
+      this->window = (uint8_t*)allocBuffer(this->windowSize);
+      if (this->window == NULL) {
+        this->windowSize = 0;
+        return NULL;
+      }
+    }
+    uint32_t readLen = this->dataEnd - start < this->windowSize ? this->dataEnd - start : this->windowSize;
+    if (start >= this->dataEnd || readLen < need || !readFully(this->fd, start, this->window, readLen)) {
+      return NULL;
+    }
+    this->windowStart = start;
+    this->windowLen = readLen;
+  }
+  return this->window + (position - this->windowStart);
+}
+
+/**
+ * @return 0 for a chunk of the video stream, 1 for the audio stream, -1 for anything else.
+ */
+int RTSP_AviReader::classify(const RTSP_AviIndexEntry& entry) const {
+  const uint8_t id[4] = { (uint8_t)entry.chunkId, (uint8_t)(entry.chunkId >> 8), (uint8_t)(entry.chunkId >> 16), (uint8_t)(entry.chunkId >> 24) };
+  if (id[0] < '0' || id[0] > '9' || id[1] < '0' || id[1] > '9') {
+    return -1;
+  }
+  int stream = (id[0] - '0') * 10 + (id[1] - '0');
+  if (stream == this->videoStream && id[2] == 'd' && (id[3] == 'c' || id[3] == 'b')) {
+    return 0;
+  }
+  if (stream == this->audioStream && id[2] == 'w' && id[3] == 'b') {
+    return 1;
+  }
+  return -1;
+}
+
+/**
+ * @brief Whether playing can start at the chunk: any MJPEG frame, audio only when there is no video.
+ */
+bool RTSP_AviReader::isSeekPoint(const RTSP_AviIndexEntry& entry, int kind) const {
+  return kind == 0 ? entry.size > 0 : kind == 1 && !hasVideo();
+}
+
+int64_t RTSP_AviReader::videoTime(uint32_t chunks) const {
+  return (int64_t)chunks * this->videoScale * 1000000 / this->videoRate;
+}
+
+int64_t RTSP_AviReader::audioTime(uint32_t bytes) const {
+  return (int64_t)bytes * 1000000 / (2 * this->sampleRate);
+}
+
+/**
+ * @brief Scans idx1 on from where it got to, adding seek points, until there is one past timeUs.
+ */
+bool RTSP_AviReader::scanTo(int64_t timeUs) {
+  while (!this->scanDone && (this->pointCount == 0 || this->points[this->pointCount - 1].timeUs <= timeUs)) {
+    if (this->scanned.entry >= this->indexEntries) {
+      this->scanDone = true;
+      break;
+    }
+    RTSP_AviIndexEntry entry;
+    if (!readEntry(this->scanned.entry, entry)) {
+      return false;
+    }
+    int kind = classify(entry);
+    if (isSeekPoint(entry, kind)) {
+      int64_t time = kind == 0 ? videoTime(this->scanned.videoChunks) : audioTime(this->scanned.audioBytes);
+      if (this->pointCount < RTSP_AVI_SEEK_POINTS &&
+          (this->pointCount == 0 || time >= this->points[this->pointCount - 1].timeUs + this->pointInterval)) {
+        this->scanned.timeUs = time;
+        this->points[this->pointCount++] = this->scanned;
+      }
+    }
+    if (kind == 0) {
+      this->scanned.videoChunks++;
+    } else if (kind == 1) {
+      this->scanned.audioBytes += entry.size;
+    }
+    this->scanned.entry++;
+  }
+  return true;
+}
+
+/**
+ * @brief Moves the playing position to the last keyframe at or before a time.
+ *
+ * @param timeUs Time from the start of the file.
+ * @param landedUs Set to the time of the keyframe, playing starts there.
+ * @return false if the file can't be read or has nothing to play.
+ */
+bool RTSP_AviReader::seek(int64_t timeUs, int64_t& landedUs) {
+  if (!isOpen() || !scanTo(timeUs) || this->pointCount == 0) {
+    return false;
+  }
+  uint32_t low = 0;
+  uint32_t high = this->pointCount - 1;
+  while (low < high) {
+    uint32_t middle = (low + high + 1) / 2;
+    if (this->points[middle].timeUs <= timeUs) {
+      low = middle;
+    } else {
+      high = middle - 1;
+    }
+  }
+  // Read on from the seek point to the last keyframe that isn't past the time
+  RTSP_AviSeekPoint best = this->points[low];
+  RTSP_AviSeekPoint at = best;
+  for (; at.entry < this->indexEntries; at.entry++) {
+    RTSP_AviIndexEntry entry;
+    if (!readEntry(at.entry, entry)) {
+      return false;
+    }
+    int kind = classify(entry);
+    if (isSeekPoint(entry, kind)) {
+      int64_t time = kind == 0 ? videoTime(at.videoChunks) : audioTime(at.audioBytes);
+      if (time > timeUs) {
+        break;
+      }
+      best = at;
+      best.timeUs = time;
+    }
+    if (kind == 0) {
+      at.videoChunks++;
+    } else if (kind == 1) {
+      at.audioBytes += entry.size;
+    }
+  }
+  this->cursor = best.entry;
+  this->cursorVideo = best.videoChunks;
+  this->cursorAudio = best.audioBytes;
+  landedUs = best.timeUs;
+  return true;
+}
+
+/**
+ * @brief Reads the next video or audio chunk in file order, chunks of other streams are skipped.
+ *
+ * @param chunk Filled in, its data stays valid until the next call.
+ * @return 1 for a chunk, 0 at the end of the file, -1 if the file can't be read.
+ */
+int RTSP_AviReader::next(RTSP_AviChunk& chunk) {
+  while (this->cursor < this->indexEntries) {
+    RTSP_AviIndexEntry entry;
+    if (!readEntry(this->cursor, entry)) {
+      return -1;
+    }
+    this->cursor++;
+    int kind = classify(entry);
+    if (kind < 0) {
+      continue;
+    }
+    chunk.isVideo = kind == 0;
+    chunk.size = entry.size;
+    chunk.data = NULL;
+    if (chunk.isVideo) {
+      chunk.position = this->cursorVideo;
+      chunk.timeUs = videoTime(this->cursorVideo);
+      this->cursorVideo++;
+    } else {
+      chunk.size &= ~1u;
+      chunk.position = this->cursorAudio / 2;
+      chunk.timeUs = audioTime(this->cursorAudio);
+      this->cursorAudio += entry.size;
+    }
+    if (entry.size) {
+      const uint8_t* header = readData(this->indexBase + entry.offset, 8 + entry.size);
+      if (header == NULL || get32(header) != entry.chunkId) {
+        return -1;
+      }
+      chunk.data = header + 8;
+      if (!chunk.isVideo && ((uintptr_t)chunk.data & 1)) {
+        continue; // Samples must be aligned, only badly padded files get here
+      }
+    }
+    return 1;
+  }
+  return 0;
+}
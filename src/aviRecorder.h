@@ -0,0 +1,209 @@
+#ifndef ESP32_RTSP_AVI_RECORDER_H
+#define ESP32_RTSP_AVI_RECORDER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of Arduino headers so extras/aviRecordHost can build it on a PC. Files are opened with
+// POSIX calls, on the ESP32 through the VFS, e.g. /sdcard/... once SD_MMC.begin() has mounted it.
+
+#define RTSP_AVI_HEADER_SIZE 4096 // Headers padded with JUNK so the movi data starts sector and cluster aligned
+#define RTSP_AVI_WRITE_SIZE (32 * 1024) // Bytes per file write, the write-behind buffer is a multiple of it
+#define RTSP_AVI_INDEX_ENTRIES 2048 // Index entries waiting for the next flush, power of 2
+#define RTSP_AVI_MAX_SIZE (1024UL * 1024 * 1024) // AVI 1.0 players don't go beyond 1 GB, chunks after it are dropped
+#define RTSP_AVI_PATH_SIZE 128
+#define RTSP_AVI_READ_SIZE (64 * 1024) // Bytes per file read while playing, chunks are served from this window
+#define RTSP_AVI_READ_ENTRIES 256 // idx1 entries read at once
+#define RTSP_AVI_SEEK_POINTS 256 // Keyframes kept in memory for seeking, spread evenly over the file
+
+struct RTSP_AviIndexEntry { // As stored in idx1
+  uint32_t chunkId;
+  uint32_t flags;
+  uint32_t offset; // From the movi fourcc
+  uint32_t size;
+};
+
+struct RTSP_AviChunk {
+  bool isVideo; // Otherwise audio
+  const uint8_t* data; // Valid until the next call of next() or seek()
+  uint32_t size; // 0 for a video chunk that repeats the previous frame
+  uint32_t position; // Video frame number, or audio sample number
+  int64_t timeUs; // From the start of the file
+};
+
+struct RTSP_AviSeekPoint {
+  uint32_t entry; // idx1 entry of the keyframe
+  uint32_t videoChunks; // Video chunks before it
+  uint32_t audioBytes; // Audio bytes before it
+  int64_t timeUs;
+};
+
+/**
+ * Writes MJPEG and 16 bit mono PCM into an AVI file from behind a live stream.
+ *
+ * Producers copy each frame or audio block once into a write-behind ring, already laid out as
+ * the file's chunk, and return. service() writes the ring out in RTSP_AVI_WRITE_SIZE blocks at
+ * aligned offsets. A flush also writes the partial block, which the next full write overwrites,
+ * appends the new index entries to a sidecar file (path + ".idx"), rewrites the header sizes and
+ * syncs both files. close() turns the sidecar into the idx1 chunk. After a power cut repair() does
+ * the same with whatever was flushed, so only the data since the last flush is lost.
+ *
+ * Video is stored at a constant rate: a gap between frames is filled with empty chunks, which
+ * players show as a repeat of the last frame, and frames faster than the rate are skipped.
+ *
+ * One producer at a time, pushVideo() and pushAudio() must not run concurrently with each other.
+ * service() may run in another task.
+ */
+class RTSP_AviRecorder {
+public:
+  RTSP_AviRecorder();
+  ~RTSP_AviRecorder();
+
+  bool open(const char* path, uint8_t fps, uint32_t sampleRate, size_t bufferSize);
+
+  bool isOpen() const { return this->fd >= 0; }
+
+  bool pushVideo(const uint8_t* jpeg, size_t len, uint16_t width, uint16_t height, int64_t timestampUs);
+
+  bool pushAudio(const int16_t* samples, size_t len);
+
+  bool service(bool flush);
+
+  bool close();
+
+  void release();
+
+  static bool repair(const char* path);
+
+  uint32_t framesRecorded() const { return this->videoFrames; }
+
+  uint32_t chunksDropped() const { return __atomic_load_n(&this->dropped, __ATOMIC_RELAXED); }
+
+  uint32_t bytesPending() const;
+
+private:
+  bool reserve(size_t bytes, uint32_t entries);
+  void putChunk(uint32_t chunkId, uint32_t flags, const void* data, size_t len);
+  void ringWrite(uint32_t position, const void* data, size_t len);
+  void countEntry(const RTSP_AviIndexEntry& entry);
+  bool writeIndexEntries();
+  bool writeHeader(bool hasIndex, uint32_t indexSize);
+  size_t buildHeader(uint8_t* out, bool hasIndex, uint32_t indexSize);
+  bool writeIdx1(uint32_t entries, uint8_t* scratch, size_t scratchSize);
+
+  int fd;
+  int indexFd; // Sidecar holding the flushed index entries
+  char path[RTSP_AVI_PATH_SIZE];
+  uint8_t fps;
+  uint32_t sampleRate; // 0 for video only
+  uint16_t width;
+  uint16_t height;
+
+  // Write-behind ring, offsets count bytes of movi data since open()
+  uint8_t* ring;
+  size_t ringSize;
+  uint32_t pushed; // Producer
+  uint32_t written; // Consumer, bytes written out in full blocks, the ring below it is free
+  RTSP_AviIndexEntry* index;
+  uint32_t indexNext; // Producer, entries filled in
+  uint32_t indexPushed; // Producer, entries handed to the consumer, with their data
+  uint32_t indexScanned; // Consumer
+  uint32_t indexFlushed; // Consumer, entries in the sidecar, their ring slots are free
+  uint32_t dropped;
+
+  // Producer
+  int64_t startUs; // Capture time of the first frame
+  uint32_t nextFrame; // Frame slots filled, including empty ones
+  bool videoStarted;
+
+  // Consumer
+  uint32_t dataEnd; // End of the last scanned chunk
+  uint32_t videoFrames; // Including empty chunks
+  uint32_t audioBytes;
+  uint32_t maxChunk;
+};
+
+/**
+ * Reads MJPEG and 16 bit mono PCM back from an indexed AVI file, such as RTSP_AviRecorder writes.
+ *
+ * Chunks come out in file order through a window of RTSP_AVI_READ_SIZE bytes read ahead in one
+ * go, and are handed out in place without copying. idx1 is read in blocks as playback goes and is
+ * never held in memory. For seeking, keyframes at most RTSP_AVI_SEEK_POINTS apart are remembered
+ * while idx1 is scanned, only as far as the furthest seek so far, and looked up by binary search.
+ * From the nearest one the seek reads on to the target, so it costs one idx1 block or two however
+ * long the file.
+ */
+class RTSP_AviReader {
+public:
+  RTSP_AviReader();
+  ~RTSP_AviReader();
+
+  bool open(const char* path);
+
+  bool isOpen() const { return this->fd >= 0; }
+
+  void close();
+
+  bool seek(int64_t timeUs, int64_t& landedUs);
+
+  int next(RTSP_AviChunk& chunk);
+
+  bool hasVideo() const { return this->videoStream >= 0; }
+
+  bool hasAudio() const { return this->audioStream >= 0; }
+
+  uint16_t videoWidth() const { return this->width; }
+
+  uint16_t videoHeight() const { return this->height; }
+
+  uint32_t audioSampleRate() const { return this->sampleRate; }
+
+  int64_t frameIntervalUs() const { return this->videoRate ? (int64_t)this->videoScale * 1000000 / this->videoRate : 0; }
+
+  int64_t durationUs() const { return this->duration; }
+
+private:
+  bool parseHeader(const uint8_t* hdrl, uint32_t len);
+  bool readEntry(uint32_t entry, RTSP_AviIndexEntry& out);
+  const uint8_t* readData(uint32_t position, uint32_t len);
+  int classify(const RTSP_AviIndexEntry& entry) const;
+  bool isSeekPoint(const RTSP_AviIndexEntry& entry, int kind) const;
+  int64_t videoTime(uint32_t chunks) const;
+  int64_t audioTime(uint32_t bytes) const;
+  bool scanTo(int64_t timeUs);
+
+  int fd;
+  uint32_t dataEnd; // End of the movi list in the file
+  uint32_t indexStart; // File position of the first idx1 entry
+  uint32_t indexEntries;
+  uint32_t indexBase; // Added to idx1 offsets, the movi fourcc or 0 for files with absolute offsets
+  int8_t videoStream; // Stream numbers, -1 when the file has none that can be played
+  int8_t audioStream;
+  uint32_t videoScale;
+  uint32_t videoRate; // Frames per second is rate / scale
+  uint32_t sampleRate;
+  uint16_t width;
+  uint16_t height;
+  int64_t duration;
+
+  uint8_t* window; // Read-ahead window of the file
+  size_t windowSize;
+  uint32_t windowStart;
+  uint32_t windowLen;
+  RTSP_AviIndexEntry* entries; // Block of idx1
+  uint32_t entriesStart;
+  uint32_t entriesCount;
+
+  RTSP_AviSeekPoint* points;
+  uint32_t pointCount;
+  int64_t pointInterval;
+  RTSP_AviSeekPoint scanned; // Where scanning idx1 for seek points got to
+  bool scanDone;
+
+  // Playing position
+  uint32_t cursor; // Next idx1 entry
+  uint32_t cursorVideo; // Video chunks before it
+  uint32_t cursorAudio; // Audio bytes before it
+};
+
+#endif
@@ -0,0 +1,221 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Plays audio that clients send back on the audio stream, e.g. to an I2S speaker.
+ *
+ * With a callback set, DESCRIBE offers the audio stream as sendrecv and RTP audio a client sends
+ * to the server's audio port, or interleaved on its RTSP connection, is taken in: L16 at the
+ * server's sample rate on payload type 97, or PCMU at 8 kHz on payload type 0. One client talks at
+ * a time, another is taken once it has been silent for RTSP_BACKCHANNEL_IDLE_MS. Packets are
+ * reordered in a jitter buffer whose delay follows the network's jitter, and the callback gets
+ * each packet decoded to 16 bit PCM when it is due, from a task of its own, so it may block
+ * while the speaker's DMA buffers are full. Lost packets are given as silence.
+ *
+ * @param callback Gets the samples, their count and their sample rate. NULL turns the backchannel
+ *                 off, its buffer is freed once the next packet arrives or at deinit().
+ */
+void RTSPServer::setBackchannelCallback(RTSP_BackchannelCallback callback) {
+  this->backchannelCallback = callback;
+}
+
+/**
+ * @brief Starts the playout task for the first packet, or stops it once the callback is cleared.
+ *
+ * Only called from rtspTask, which alone fills the jitter buffer.
+ *
+ * @return true if packets can be taken.
+ */
+bool RTSPServer::startBackchannel() {
+  if (this->backchannelCallback == NULL) {
+    stopBackchannel();
+    return false;
+  }
+  if (this->backchannelTaskHandle != NULL) {
+    return true;
+  }
+  if (!this->backchannel.begin(this->sampleRate)) {
+    RTSP_LOGE(LOG_TAG, "No memory for the backchannel jitter buffer");
+    return false;
+  }
+  this->backchannelTalker = 0;
+  this->backchannelStopping = false;
+  if (xTaskCreatePinnedToCore(backchannelTaskWrapper, "rtspBackchannel", RTSP_BACKCHANNEL_STACK_SIZE, this, RTSP_BACKCHANNEL_PRI, &this->backchannelTaskHandle, RTSP_BACKCHANNEL_CORE) != pdPASS) {
+    RTSP_LOGE(LOG_TAG, "Failed to create backchannel task.");
+    this->backchannelTaskHandle = NULL;
+    this->backchannel.end();
+    return false;
+  }
+  return true;
+}
+
+/**
+ * @brief Stops the playout task and waits for it to free the jitter buffer.
+ *
+ * The task finishes the callback it may be in and ends itself, see backchannelTask().
+ */
+void RTSPServer::stopBackchannel() {
+  if (this->backchannelTaskHandle == NULL) {
+    return;
+  }
+  xSemaphoreTake(this->backchannelMutex, portMAX_DELAY);
+  this->backchannelStopping = true;
+  if (this->backchannelTaskHandle != NULL) {
+    xTaskNotifyGive(this->backchannelTaskHandle);
+  }
+  xSemaphoreGive(this->backchannelMutex);
+  while (this->backchannelTaskHandle != NULL) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+}
+
+/**
+ * @brief Lets a session's packet in if it is the talking client, or nobody has talked for a while.
+ */
+bool RTSPServer::claimBackchannel(const RTSP_Session& session, int64_t now) {
+  if (this->backchannelTalker != session.sessionID) {
+    if (this->backchannelTalker != 0 && now - this->backchannelLastUs < RTSP_BACKCHANNEL_IDLE_MS * 1000LL) {
+      return false;
+    }
+    this->backchannelTalker = session.sessionID;
+    RTSP_LOGI(LOG_TAG, "Session %lu is talking on the backchannel", session.sessionID);
+  }
+  this->backchannelLastUs = now;
+  return true;
+}
+
+/**
+ * @brief Hands the packet received into the jitter buffer's receive buffer to playout.
+ */
+void RTSPServer::commitBackchannel(size_t len, int64_t now) {
+  xSemaphoreTake(this->backchannelMutex, portMAX_DELAY);
+  bool taken = this->backchannel.commit(len, now);
+  xSemaphoreGive(this->backchannelMutex);
+  if (taken) {
+    xTaskNotifyGive(this->backchannelTaskHandle);
+  }
+}
+
+/**
+ * @brief Reads RTP arriving on the UDP audio socket, the backchannel of UDP clients.
+ *
+ * Packets are taken from clients with a session that set up audio over unicast UDP, matched by
+ * address, and count as activity like their RTCP reports. Anything else is discarded.
+ *
+ * @param rtpSocket The audio socket, with data waiting.
+ * @param clientSockets The RTSP task's socket list.
+ * @param clientCount Entries in clientSockets.
+ * @param now Seconds since boot.
+ */
+void RTSPServer::receiveBackchannel(int rtpSocket, const int* clientSockets, uint8_t clientCount, uint32_t now) {
+  uint8_t discard[4];
+  struct sockaddr_in fromAddr;
+  socklen_t fromLen = sizeof(fromAddr);
+  while (true) {
+    bool ready = startBackchannel();
+    uint8_t* buffer = ready ? this->backchannel.receiveBuffer() : discard; // Received in place, no copy
+    int len = recvfrom(rtpSocket, buffer, ready ? RTSP_JITTER_PACKET_SIZE : sizeof(discard), MSG_DONTWAIT, (struct sockaddr*)&fromAddr, &fromLen);
+    fromLen = sizeof(fromAddr);
+    if (len < 0) {
+      break;
+    }
+    if (!ready) {
+      continue;
+    }
+    int64_t arrivalUs = esp_timer_get_time();
+    for (auto& sess : this->sessions) {
+      const RTSP_Session& session = sess.second;
+      struct sockaddr_in peerAddr;
+      socklen_t peerLen = sizeof(peerAddr);
+      if (session.isTCP || session.isMulticast || session.cAudioPort == 0 ||
+          getpeername(session.sock, (struct sockaddr*)&peerAddr, &peerLen) != 0 || peerAddr.sin_addr.s_addr != fromAddr.sin_addr.s_addr) {
+        continue;
+      }
+      for (int i = 0; i < clientCount; i++) {
+        if (clientSockets[i] == session.sock) {
+          sessionTimerTouch(i, now);
+        }
+      }
+      if (claimBackchannel(session, arrivalUs)) {
+        commitBackchannel(len, arrivalUs);
+      }
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Reads the interleaved packets waiting on a client's RTSP connection.
+ *
+ * Audio on the audio stream's channel is the backchannel of TCP clients and is received straight
+ * into the jitter buffer. RTCP and anything else is read past. Packets read along with the last
+ * request are taken first, see recvSession().
+ *
+ * @return false if the connection broke off in the middle of a packet.
+ */
+bool RTSPServer::receiveInterleaved(RTSP_Session& session) {
+  uint8_t header[4];
+  while ((session.pendingLen > 0 && !session.isTunnel) ? session.pending[0] == '$' :
+         (recv(session.sock, header, 1, MSG_PEEK | MSG_DONTWAIT) == 1 && header[0] == '$')) {
+    if (!recvSession(session, header, sizeof(header))) {
+      return false;
+    }
+    size_t len = (header[2] << 8) | header[3];
+    int64_t arrivalUs = esp_timer_get_time();
+    if (header[1] == session.audioCh && session.isTCP && len <= RTSP_JITTER_PACKET_SIZE &&
+        startBackchannel() && claimBackchannel(session, arrivalUs)) {
+      if (!recvSession(session, this->backchannel.receiveBuffer(), len)) {
+        return false;
+      }
+      commitBackchannel(len, arrivalUs);
+      continue;
+    }
+    while (len > 0) {
+      size_t chunk = len < RTSP_BUFFER_SIZE ? len : RTSP_BUFFER_SIZE;
+      if (!recvSession(session, (uint8_t*)this->rtspRequestBuffer, chunk)) {
+        return false;
+      }
+      len -= chunk;
+    }
+  }
+  return true;
+}
+
+void RTSPServer::backchannelTaskWrapper(void* pvParameters) {
+  RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
+  server->backchannelTask();
+}
+
+/**
+ * @brief Plays the backchannel out to the callback, each packet when it is due.
+ *
+ * Sleeps until the next packet is due, or until a packet arrives while the buffer is empty.
+ * The callback runs outside backchannelMutex, receiving never waits for it. Once stopBackchannel()
+ * asks, the task frees the jitter buffer and ends itself between callbacks.
+ */
+void RTSPServer::backchannelTask() {
+  while (!this->backchannelStopping) {
+    RTSP_JitterPacket packet;
+    xSemaphoreTake(this->backchannelMutex, portMAX_DELAY);
+    RTSP_JitterResult result = this->backchannel.pop(esp_timer_get_time(), packet);
+    xSemaphoreGive(this->backchannelMutex);
+
+    RTSP_BackchannelCallback callback = this->backchannelCallback;
+    if (result == RTSP_JITTER_PACKET || result == RTSP_JITTER_LOST) {
+      if (callback != NULL) {
+        callback(packet.samples, packet.count, packet.sampleRate);
+      }
+    } else if (result == RTSP_JITTER_WAIT) {
+      TickType_t ticks = pdMS_TO_TICKS(packet.waitUs / 1000);
+      ulTaskNotifyTake(pdTRUE, ticks > 0 ? ticks : 1);
+    } else {
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+  }
+
+  xSemaphoreTake(this->backchannelMutex, portMAX_DELAY);
+  this->backchannel.end();
+  this->backchannelTalker = 0;
+  this->backchannelTaskHandle = NULL;
+  xSemaphoreGive(this->backchannelMutex);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,147 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Sends one H.264 or H.265 access unit to all playing sessions.
+ * 
+ * New sessions start on the cached keyframe and the frames that followed it so they don't
+ * have to wait for the encoder's next keyframe.
+ * 
+ * @param codec VIDEO_H264 or VIDEO_H265.
+ * @param data Annex-B byte stream of one access unit.
+ * @param len Length of the data.
+ * @param timestampUs Capture time on the esp_timer clock, 0 uses the time of the call.
+ * @param frameType FRAME_KEY or FRAME_DELTA, FRAME_AUTO detects it from the NAL unit types.
+ */
+void RTSPServer::sendRTSPAccessUnit(VideoCodec codec, const uint8_t* data, size_t len, int64_t timestampUs, FrameType frameType) {
+  this->rtpFrameSent = false;
+  if (timestampUs == 0) {
+    timestampUs = esp_timer_get_time();
+  }
+  updateRtpFps();
+  this->videoTimestamp = mediaClockToRtp(timestampUs, VIDEO_CLOCK_RATE, this->videoClockOffset);
+
+  // Room is left in front for the cached parameter sets
+  RTP_NalUnit* nals = this->accessUnitNals + RTSP_PARAMETER_SET_SLOTS;
+  size_t nalCount = splitAnnexB(data, len, nals, MAX_NALS_PER_FRAME);
+  bool hasParameterSets = false;
+  bool isKeyframe = parameterSets(codec).scan(nals, nalCount, hasParameterSets);
+  if (frameType != FRAME_AUTO) {
+    isKeyframe = (frameType == FRAME_KEY);
+  }
+
+  // Keyframes without in-band parameter sets get the cached ones in front for decoders that just joined
+  size_t prepended = (isKeyframe && !hasParameterSets) ? parameterSets(codec).prepend(nals) : 0;
+  const RTP_NalUnit* keyNals = nals - prepended;
+  size_t keyNalCount = nalCount + prepended;
+
+  int64_t sendStart = esp_timer_get_time();
+  uint8_t streams = 0;
+  bool multicastSent = false;
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second; 
+    if (session.isPlaying) {
+      if (session.isMulticast) {
+        if (!multicastSent) { 
+          sendRtpAccessUnit(codec, keyNals, keyNalCount, session.sock, this->rtpVideoPort, session.videoCh, false, true, this->udpVideoPayloadSize, this->videoSequenceNumber, &this->multicastVideoStats);
+          multicastSent = true; 
+          streams++;
+        }
+      } else if (session.maxFps) {
+        // Dropping inter-coded frames would break the ones after them, capped sessions get keyframes only
+        if (isKeyframe && sessionWantsFrame(session, timestampUs)) {
+          sendRtpAccessUnit(codec, keyNals, keyNalCount, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+          session.awaitingKeyframe = false;
+          streams++;
+        }
+      } else if (session.awaitingKeyframe) {
+        if (isKeyframe) {
+          sendRtpAccessUnit(codec, keyNals, keyNalCount, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+          session.awaitingKeyframe = false;
+        } else if (this->frameCache.count() && this->frameCache.codec() == codec) {
+          replayFrameCache(session);
+          sendRtpAccessUnit(codec, nals, nalCount, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+          session.awaitingKeyframe = false;
+        }
+        // Otherwise nothing before the next keyframe is decodable for this session
+      } else {
+        sendRtpAccessUnit(codec, nals, nalCount, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+        streams++;
+      }
+    }
+  }
+  readUnlockSessions();
+  updateVideoCost(len, esp_timer_get_time() - sendStart, streams);
+  // Cache after sending so a replay never repeats the live frame
+  cacheFrame(codec, data, len, isKeyframe);
+  RTSP_STAT_ADD(this->videoFrameCount, 1);
+  sendVideoSenderReports();
+  this->rtpFrameSent = true;
+}
+
+/**
+ * @brief The parameter sets kept for a codec.
+ */
+RTSP_ParameterSets& RTSPServer::parameterSets(VideoCodec codec) {
+  return codec == VIDEO_H264 ? this->h264ParameterSets : this->h265ParameterSets;
+}
+
+void RTSPServer::sendRtpAccessUnit(VideoCodec codec, const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats) {
+  // TCP packets are gathered and written together, the last ones when the access unit is done
+  RTSP_TcpBatch batch;
+  RTSP_TcpBatch* tcpBatch = useTCP ? beginTcpBatch(batch, sock, stats) : NULL;
+  if (codec == VIDEO_H264) {
+    sendRtpH264(nals, nalCount, sock, sendRtpPort, channel, useTCP, isMulticast, payloadSize, sequenceNumber, stats, tcpBatch);
+  } else {
+    sendRtpH265(nals, nalCount, sock, sendRtpPort, channel, useTCP, isMulticast, payloadSize, sequenceNumber, stats, tcpBatch);
+  }
+  endTcpBatch(tcpBatch);
+}
+
+/**
+ * @brief Keeps the last keyframe and the frames since it for sessions that start playing.
+ * 
+ * The PSRAM for the cache is taken at the first keyframe. If a group of pictures outgrows the
+ * cache it is dropped and new sessions wait for the next keyframe instead.
+ */
+void RTSPServer::cacheFrame(VideoCodec codec, const uint8_t* data, size_t len, bool isKeyframe) {
+  if (isKeyframe && this->frameCache.buffer() == NULL) {
+    uint8_t* buffer = psramFound() ? (uint8_t*)ps_malloc(MAX_RTSP_BUFFER) : NULL;
+    if (buffer == NULL) {
+      RTSP_LOGW(LOG_TAG, "No PSRAM for the frame cache, new sessions will wait for a keyframe");
+      return;
+    }
+    this->frameCache.setBuffer(buffer, MAX_RTSP_BUFFER);
+  }
+  if (!this->frameCache.add(codec, data, len, isKeyframe)) {
+    RTSP_LOGD(LOG_TAG, "Group of pictures too large to cache");
+  }
+}
+
+/**
+ * @brief Sends the cached keyframe and following frames to one session ahead of the live frame.
+ * 
+ * Timestamps are rebased to end just before the live frame so the player decodes the backlog
+ * immediately instead of treating it as late.
+ */
+void RTSPServer::replayFrameCache(RTSP_Session& session) {
+  VideoCodec codec = (VideoCodec)this->frameCache.codec();
+  uint32_t liveTimestamp = this->videoTimestamp;
+  for (size_t i = 0; i < this->frameCache.count(); i++) {
+    this->videoTimestamp = this->frameCache.replayTimestamp(i, liveTimestamp);
+
+    size_t frameLen = 0;
+    const uint8_t* frame = this->frameCache.frame(i, frameLen);
+    RTP_NalUnit* nals = this->replayNals + RTSP_PARAMETER_SET_SLOTS; // The live frame's are still in accessUnitNals
+    size_t nalCount = splitAnnexB(frame, frameLen, nals, MAX_NALS_PER_FRAME);
+    size_t prepended = 0;
+    if (i == 0) {
+      bool hasParameterSets = false;
+      parameterSets(codec).scan(nals, nalCount, hasParameterSets);
+      prepended = hasParameterSets ? 0 : parameterSets(codec).prepend(nals);
+    }
+    sendRtpAccessUnit(codec, nals - prepended, nalCount + prepended, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+  }
+  this->videoTimestamp = liveTimestamp;
+  RTSP_LOGD(LOG_TAG, "Replayed %d cached frames to session %u", (int)this->frameCache.count(), session.sessionID);
+}
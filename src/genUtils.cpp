@@ -14,6 +14,24 @@ void RTSPServer::startSubtitlesTimer(esp_timer_cb_t userCallback) {
     esp_timer_start_periodic(sendSubtitlesTimer, 1000000); 
 }
 
+/**
+ * @brief Maps a capture time on the esp_timer clock to an RTP timestamp.
+ * 
+ * All streams share this clock so their timestamps stay in sync regardless of when the frame is sent.
+ * 
+ * @param timestampUs Capture time in microseconds since boot.
+ * @param clockRate RTP clock rate of the stream.
+ * @param clockOffset Random origin of the stream's RTP timestamps.
+ * @return The RTP timestamp.
+ */
+uint32_t RTSPServer::mediaClockToRtp(int64_t timestampUs, uint32_t clockRate, uint32_t clockOffset) const {
+  // Split seconds and remainder so the multiply can't overflow on long uptimes
+  int64_t seconds = timestampUs / 1000000;
+  int64_t remainder = timestampUs % 1000000;
+  uint64_t ticks = (uint64_t)seconds * clockRate + (uint64_t)(remainder * clockRate / 1000000);
+  return clockOffset + (uint32_t)ticks;
+}
+
 void RTSPServer::setMaxClients(uint8_t newMaxClients) {
   if (xSemaphoreTake(maxClientsMutex, portMAX_DELAY) == pdTRUE) {
     if (newMaxClients <= MAX_CLIENTS) {
@@ -87,15 +105,64 @@ bool RTSPServer::getIsPlaying() const {
     return playing;
 }
 
+/**
+ * @brief Lets a sending task go through sessions, which only rtspTask adds to or removes from.
+ *
+ * Any number of senders can be in at once, and a sender may take it again inside, e.g. for the
+ * sender reports after a frame. Call readUnlockSessions() when done.
+ */
+void RTSPServer::readLockSessions() {
+  xSemaphoreTake(this->sessionsMutex, portMAX_DELAY);
+  this->sessionReaders++;
+  xSemaphoreGive(this->sessionsMutex);
+}
+
+void RTSPServer::readUnlockSessions() {
+  xSemaphoreTake(this->sessionsMutex, portMAX_DELAY);
+  if (--this->sessionReaders == 0) {
+    xSemaphoreGive(this->sessionsIdle);
+  }
+  xSemaphoreGive(this->sessionsMutex);
+}
+
+/**
+ * @brief Waits for the senders to be done with sessions and keeps new ones out, so rtspTask can
+ * add or remove a session.
+ *
+ * The count is checked again under the mutex, a give left over from an earlier reader only costs
+ * another look.
+ */
+void RTSPServer::writeLockSessions() {
+  xSemaphoreTake(this->sessionsMutex, portMAX_DELAY);
+  while (this->sessionReaders > 0) {
+    xSemaphoreGive(this->sessionsMutex);
+    xSemaphoreTake(this->sessionsIdle, portMAX_DELAY);
+    xSemaphoreTake(this->sessionsMutex, portMAX_DELAY);
+  }
+}
+
+void RTSPServer::writeUnlockSessions() {
+  xSemaphoreGive(this->sessionsMutex);
+}
+
 bool RTSPServer::readyToSendFrame() const {
+  if (this->mediaSchedulerTaskHandle) {
+    return getIsPlaying() && mediaQueueHasRoom(this->videoQueue);
+  }
   return getIsPlaying() && this->rtpFrameSent;
 }
 
 bool RTSPServer::readyToSendAudio() const {
+  if (this->mediaSchedulerTaskHandle) {
+    return getIsPlaying() && mediaQueueHasRoom(this->audioQueue);
+  }
   return getIsPlaying() && this->rtpAudioSent;
 }
 
 bool RTSPServer::readyToSendSubtitles() const {
+  if (this->mediaSchedulerTaskHandle) {
+    return getIsPlaying() && mediaQueueHasRoom(this->subtitlesQueue);
+  }
   return getIsPlaying() && this->rtpSubtitlesSent;
 }
 
@@ -116,6 +183,28 @@ int RTSPServer::captureCSeq(char* request) {
   return cseq;
 }
 
+/**
+ * @brief Finds where the request at the start of a buffer ends.
+ *
+ * An RTSP request runs to the blank line plus its Content-Length. An HTTP POST's body is a
+ * tunnel's base64 stream, so it ends with its headers.
+ *
+ * @param buffer The request, null terminated at len.
+ * @return Length of the request, 0 if it isn't all there.
+ */
+int RTSPServer::findRequestEnd(const char* buffer, int len) {
+  const char* end = strstr(buffer, "\r\n\r\n");
+  if (end == NULL) {
+    return 0;
+  }
+  end += 4;
+  const char* contentLength = strstr(buffer, "Content-Length:");
+  if (contentLength && contentLength < end && strncmp(buffer, "POST ", 5) != 0) {
+    end += strtoul(contentLength + 15, NULL, 10);
+  }
+  return end - buffer <= len ? end - buffer : 0;
+}
+
 uint32_t RTSPServer::generateSessionID() {
   return esp_random();
 }
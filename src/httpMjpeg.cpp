@@ -0,0 +1,423 @@
+#include "ESP32-RTSPServer.h"
+
+static const char httpPartTrailer[] = "\r\n";
+
+/**
+ * @brief Turns a plain HTTP GET into a browser client of RTSP_HTTP_STREAM_PATH or RTSP_HTTP_SNAPSHOT_PATH.
+ *
+ * The connection leaves the RTSP client list for httpClients, rtspTask writes frames to it from
+ * then on. Nothing is written here, the response head goes out in front of the first frame.
+ *
+ * @param session The session of the connection the GET came in on, dropped on success.
+ * @param request The request, headers complete.
+ * @return false to close the connection.
+ */
+bool RTSPServer::openHttpClient(RTSP_Session& session, char* request) {
+  char response[160];
+  int responseLen;
+  const char* path = request + 4;
+  size_t pathLen = strcspn(path, " ?\r\n");
+  bool isStream = pathLen == strlen(RTSP_HTTP_STREAM_PATH) && strncmp(path, RTSP_HTTP_STREAM_PATH, pathLen) == 0;
+  bool isSnapshot = pathLen == strlen(RTSP_HTTP_SNAPSHOT_PATH) && strncmp(path, RTSP_HTTP_SNAPSHOT_PATH, pathLen) == 0;
+  if (!isStream && !isSnapshot) {
+    const char* notFound = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+    write(session.sock, notFound, strlen(notFound));
+    return false;
+  }
+
+  if (this->authEnabled) {
+    char* authHeader = strstr(request, "Authorization: Basic ");
+    size_t credentialsLen = strlen(this->base64Credentials);
+    if (!authHeader || strncmp(authHeader + 21, this->base64Credentials, credentialsLen) != 0 || (authHeader[21 + credentialsLen] != '\r' && authHeader[21 + credentialsLen] != 0)) {
+      responseLen = snprintf(response, sizeof(response),
+                             "HTTP/1.1 401 Unauthorized\r\n"
+                             "WWW-Authenticate: Basic realm=\"ESP32\"\r\n"
+                             "Content-Length: 0\r\n"
+                             "Connection: close\r\n\r\n");
+      write(session.sock, response, responseLen);
+      return false;
+    }
+  }
+
+  RTSP_HttpClient* client = nullptr;
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->httpClients[i].sock == 0) {
+      client = &this->httpClients[i];
+      break;
+    }
+  }
+  if (client == nullptr) {
+    responseLen = snprintf(response, sizeof(response), "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", RTSP_RETRY_AFTER);
+    write(session.sock, response, responseLen);
+    RTSP_STAT_ADD(this->rejectedClientCount, 1);
+    RTSP_LOGW(LOG_TAG, "Max HTTP clients reached. Sent 503 error to new client.");
+    return false;
+  }
+
+  client->sock = session.sock;
+  client->isSnapshot = isSnapshot;
+  client->responseSent = false;
+  client->frame = -1;
+  client->lastSequence = 0;
+  client->offset = 0;
+  client->headerLen = 0;
+  client->openedAt = esp_timer_get_time() / 1000000;
+  this->httpClientCount++;
+  RTSP_LOGD(LOG_TAG, "HTTP client on socket %d for %s", client->sock, isSnapshot ? RTSP_HTTP_SNAPSHOT_PATH : RTSP_HTTP_STREAM_PATH);
+
+  writeLockSessions();
+  this->sessions.erase(session.sessionID);
+  writeUnlockSessions();
+  decrementActiveRTSPClients();
+  return true;
+}
+
+/**
+ * @brief Finds the browser client a socket belongs to.
+ *
+ * @return Index into httpClients, -1 if the socket isn't one.
+ */
+int RTSPServer::findHttpClient(int sock) {
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->httpClients[i].sock == sock && sock > 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Keeps a reference to a frame from sendRTSPFrame() for browser clients.
+ *
+ * The frame is copied once into a free slot however many clients there are, the caller's buffer
+ * is only valid for the call. Clients then write from the slot at their own pace. A client that
+ * is still busy with an older frame skips to the newest one when done, so a slow browser drops
+ * frames instead of holding up the camera or the RTSP sessions. With every slot held the frame
+ * is skipped for all browser clients. Nothing is copied while no browser is connected.
+ *
+ * @param data The JPEG.
+ * @param len Length of the JPEG.
+ * @param timestampUs Capture time of the frame.
+ */
+void RTSPServer::publishHttpFrame(const uint8_t* data, size_t len, int64_t timestampUs) {
+  if (this->httpClientCount == 0) {
+    return;
+  }
+  int8_t slot = -1;
+  xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+  uint32_t sequence = ++this->httpFrameSequence;
+  for (int i = 0; i < RTSP_HTTP_FRAME_SLOTS; i++) {
+    if (this->httpFrames[i].refs == 0) {
+      this->httpFrames[i].refs = 1; // Ours while copying, then the newest frame's reference
+      slot = i;
+      break;
+    }
+  }
+  xSemaphoreGive(this->httpFrameMutex);
+  if (slot < 0) {
+    return;
+  }
+
+  RTSP_HttpFrame& frame = this->httpFrames[slot];
+  if (frame.size < len) {
+    // Grown with headroom so frames of a similar size don't reallocate every time
+    size_t size = len + len / 4;
+    free(frame.data);
+    frame.data = (uint8_t*)(psramFound() ? ps_malloc(size) : malloc(size));
+    frame.size = frame.data ? size : 0;
+  }
+  if (frame.data == NULL) {
+    RTSP_LOGE(LOG_TAG, "Failed to allocate HTTP frame buffer.");
+    xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+    frame.refs = 0;
+    xSemaphoreGive(this->httpFrameMutex);
+    return;
+  }
+  memcpy(frame.data, data, len);
+  frame.len = len;
+  frame.timestampUs = timestampUs;
+  frame.sequence = sequence;
+
+  xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+  if (this->httpNewestFrame >= 0) {
+    this->httpFrames[this->httpNewestFrame].refs--;
+  }
+  this->httpNewestFrame = slot;
+  xSemaphoreGive(this->httpFrameMutex);
+  wakeRtspTask();
+}
+
+/**
+ * @brief Drops a client's reference to the frame it has finished or given up on.
+ */
+void RTSPServer::releaseHttpFrame(RTSP_HttpClient& client) {
+  if (client.frame < 0) {
+    return;
+  }
+  xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+  this->httpFrames[client.frame].refs--;
+  xSemaphoreGive(this->httpFrameMutex);
+  client.frame = -1;
+}
+
+/**
+ * @brief Hands each waiting browser client the newest frame and adds the clients to the select sets.
+ *
+ * Runs in rtspTask before select. A client gets a frame only when it has finished the last one,
+ * the frames published in between are counted as dropped for it.
+ *
+ * @param readFds Clients are always watched for closing.
+ * @param writeFds Clients with a frame to write are watched for socket space.
+ * @param maxSd Highest socket in the sets so far.
+ * @param now Seconds since boot.
+ * @return The highest socket in the sets.
+ */
+int RTSPServer::prepareHttpClients(fd_set& readFds, fd_set& writeFds, int maxSd, uint32_t now) {
+  if (this->wakeSocket >= 0) {
+    FD_SET(this->wakeSocket, &readFds);
+    if (this->wakeSocket > maxSd) maxSd = this->wakeSocket;
+  }
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    RTSP_HttpClient& client = this->httpClients[i];
+    if (client.sock == 0) {
+      continue;
+    }
+    if (client.frame < 0) {
+      xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+      int8_t newest = this->httpNewestFrame;
+      if (newest >= 0 && this->httpFrames[newest].sequence != client.lastSequence) {
+        this->httpFrames[newest].refs++;
+        client.frame = newest;
+      }
+      xSemaphoreGive(this->httpFrameMutex);
+      if (client.frame >= 0) {
+        const RTSP_HttpFrame& frame = this->httpFrames[client.frame];
+        if (client.lastSequence != 0 && frame.sequence - client.lastSequence > 1) {
+          RTSP_STAT_ADD(this->httpFramesDropped, frame.sequence - client.lastSequence - 1);
+        }
+        buildHttpFrameHeader(client, frame);
+      } else if (client.isSnapshot && now - client.openedAt >= RTSP_HTTP_SNAPSHOT_TIMEOUT) {
+        char response[96];
+        int responseLen = snprintf(response, sizeof(response), "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Length: 0\r\nConnection: close\r\n\r\n", RTSP_RETRY_AFTER);
+        write(client.sock, response, responseLen);
+        RTSP_LOGW(LOG_TAG, "No frame for snapshot within %d seconds", RTSP_HTTP_SNAPSHOT_TIMEOUT);
+        closeHttpClient(client);
+        continue;
+      }
+    }
+    FD_SET(client.sock, &readFds);
+    if (client.frame >= 0) {
+      FD_SET(client.sock, &writeFds);
+    }
+    if (client.sock > maxSd) maxSd = client.sock;
+  }
+  return maxSd;
+}
+
+/**
+ * @brief Writes the response head, for a client's first frame, and the frame's part header.
+ */
+void RTSPServer::buildHttpFrameHeader(RTSP_HttpClient& client, const RTSP_HttpFrame& frame) {
+  int len = 0;
+  if (client.isSnapshot) {
+    len = snprintf(client.header, sizeof(client.header),
+                   "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: image/jpeg\r\n"
+                   "Content-Length: %u\r\n"
+                   "Content-Disposition: inline; filename=snapshot.jpg\r\n"
+                   "Cache-Control: no-store\r\n"
+                   "Access-Control-Allow-Origin: *\r\n"
+                   "Connection: close\r\n\r\n",
+                   (unsigned)frame.len);
+  } else {
+    if (!client.responseSent) {
+      len = snprintf(client.header, sizeof(client.header),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: multipart/x-mixed-replace; boundary=" RTSP_HTTP_BOUNDARY "\r\n"
+                     "Cache-Control: no-store\r\n"
+                     "Access-Control-Allow-Origin: *\r\n"
+                     "Connection: close\r\n\r\n");
+    }
+    len += snprintf(client.header + len, sizeof(client.header) - len,
+                    "--" RTSP_HTTP_BOUNDARY "\r\n"
+                    "Content-Type: image/jpeg\r\n"
+                    "Content-Length: %u\r\n"
+                    "X-Timestamp: %lld.%06lld\r\n\r\n",
+                    (unsigned)frame.len, (long long)(frame.timestampUs / 1000000), (long long)(frame.timestampUs % 1000000));
+  }
+  client.responseSent = true;
+  client.headerLen = len;
+  client.offset = 0;
+}
+
+/**
+ * @brief Writes as much of a client's frame as the socket takes without blocking.
+ *
+ * @return false if the connection failed.
+ */
+bool RTSPServer::writeHttpClient(RTSP_HttpClient& client) {
+  const RTSP_HttpFrame& frame = this->httpFrames[client.frame];
+  size_t trailerLen = client.isSnapshot ? 0 : sizeof(httpPartTrailer) - 1;
+  size_t total = client.headerLen + frame.len + trailerLen;
+  while (client.offset < total) {
+    struct iovec iov[3];
+    int iovCount = 0;
+    size_t offset = client.offset;
+    if (offset < client.headerLen) {
+      iov[iovCount].iov_base = client.header + offset;
+      iov[iovCount++].iov_len = client.headerLen - offset;
+      offset = 0;
+    } else {
+      offset -= client.headerLen;
+    }
+    if (offset < frame.len) {
+      iov[iovCount].iov_base = frame.data + offset;
+      iov[iovCount++].iov_len = frame.len - offset;
+      offset = 0;
+    } else {
+      offset -= frame.len;
+    }
+    if (offset < trailerLen) {
+      iov[iovCount].iov_base = (void*)(httpPartTrailer + offset);
+      iov[iovCount++].iov_len = trailerLen - offset;
+    }
+    ssize_t sent = writev(client.sock, iov, iovCount);
+    if (sent < 0) {
+      return errno == EWOULDBLOCK || errno == EAGAIN;
+    }
+    client.offset += sent;
+  }
+  return true;
+}
+
+/**
+ * @brief Reads from and writes to the browser clients select found ready.
+ *
+ * Browsers send nothing after the GET, a readable client has closed or sent something that is
+ * ignored. A snapshot client is closed once its frame is written.
+ */
+void RTSPServer::serviceHttpClients(fd_set& readFds, fd_set& writeFds) {
+  if (this->wakeSocket >= 0 && FD_ISSET(this->wakeSocket, &readFds)) {
+    uint8_t wake[8];
+    while (recv(this->wakeSocket, wake, sizeof(wake), MSG_DONTWAIT) > 0) {
+    }
+  }
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    RTSP_HttpClient& client = this->httpClients[i];
+    if (client.sock == 0) {
+      continue;
+    }
+    if (FD_ISSET(client.sock, &readFds)) {
+      char discard[64];
+      int len = recv(client.sock, discard, sizeof(discard), MSG_DONTWAIT);
+      if (len == 0 || (len < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+        RTSP_LOGD(LOG_TAG, "HTTP client closed the connection");
+        closeHttpClient(client);
+        continue;
+      }
+    }
+    if (client.frame >= 0 && FD_ISSET(client.sock, &writeFds)) {
+      if (!writeHttpClient(client)) {
+        RTSP_LOGD(LOG_TAG, "HTTP client write failed, error: %d", errno);
+        closeHttpClient(client);
+        continue;
+      }
+      size_t trailerLen = client.isSnapshot ? 0 : sizeof(httpPartTrailer) - 1;
+      if (client.offset == client.headerLen + this->httpFrames[client.frame].len + trailerLen) {
+        client.lastSequence = this->httpFrames[client.frame].sequence;
+        releaseHttpFrame(client);
+        RTSP_STAT_ADD(this->httpFramesSent, 1);
+        if (client.isSnapshot) {
+          closeHttpClient(client);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Closes a browser client. The newest frame is let go with the last one, so a later
+ * snapshot never gets a frame from before it connected.
+ */
+void RTSPServer::closeHttpClient(RTSP_HttpClient& client) {
+  releaseHttpFrame(client);
+  close(client.sock);
+  client.sock = 0;
+  this->httpClientCount--;
+  if (this->httpClientCount == 0) {
+    xSemaphoreTake(this->httpFrameMutex, portMAX_DELAY);
+    if (this->httpNewestFrame >= 0) {
+      this->httpFrames[this->httpNewestFrame].refs--;
+      this->httpNewestFrame = -1;
+    }
+    xSemaphoreGive(this->httpFrameMutex);
+  }
+}
+
+/**
+ * @brief Closes all browser clients and frees the frame slots, for deinit().
+ */
+void RTSPServer::closeHttpClients() {
+  for (int i = 0; i < RTSP_MAX_HTTP_CLIENTS; i++) {
+    if (this->httpClients[i].sock != 0) {
+      closeHttpClient(this->httpClients[i]);
+    }
+  }
+  for (int i = 0; i < RTSP_HTTP_FRAME_SLOTS; i++) {
+    free(this->httpFrames[i].data);
+    memset(&this->httpFrames[i], 0, sizeof(this->httpFrames[i]));
+  }
+  this->httpNewestFrame = -1;
+  if (this->wakeSocket >= 0) {
+    close(this->wakeSocket);
+    this->wakeSocket = -1;
+  }
+}
+
+/**
+ * @brief Opens the loopback UDP socket other tasks wake rtspTask's select with.
+ *
+ * lwIP's select can't be interrupted from another task, a datagram to a socket in the read set
+ * is the usual way. Without it rtspTask polls browser clients instead.
+ *
+ * @return true if the socket is open.
+ */
+bool RTSPServer::openWakeSocket() {
+  if (this->wakeSocket >= 0) {
+    return true;
+  }
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0) {
+    return false;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addrLen = sizeof(addr);
+  if (bind(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0 || getsockname(sock, (struct sockaddr*)&addr, &addrLen) < 0 || !setNonBlocking(sock)) {
+    RTSP_LOGW(LOG_TAG, "Failed to open wake socket, HTTP clients are polled");
+    close(sock);
+    return false;
+  }
+  this->wakePort = ntohs(addr.sin_port);
+  this->wakeSocket = sock;
+  return true;
+}
+
+/**
+ * @brief Wakes rtspTask out of select, safe to call from any task.
+ */
+void RTSPServer::wakeRtspTask() {
+  if (this->wakeSocket < 0) {
+    return;
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(this->wakePort);
+  uint8_t wake = 0;
+  sendto(this->wakeSocket, &wake, sizeof(wake), MSG_DONTWAIT, (struct sockaddr*)&addr, sizeof(addr));
+}
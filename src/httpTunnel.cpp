@@ -0,0 +1,211 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Also listens for RTSP-over-HTTP tunnels on an HTTP port, e.g. 80 or 8080.
+ *
+ * Tunnels are always accepted on the RTSP port too, this is for proxies and firewalls that only
+ * let HTTP ports through. Call before init().
+ *
+ * @param port HTTP port, 0 to only use the RTSP port.
+ */
+void RTSPServer::setHttpPort(uint16_t port) {
+  this->httpPort = port;
+}
+
+/**
+ * @brief Handles the GET or POST that opens one half of an RTSP-over-HTTP tunnel.
+ *
+ * The client opens a GET and a POST connection with the same x-sessioncookie. The GET connection
+ * becomes the session's socket, responses and interleaved media are written to it as on a plain
+ * RTSP connection. The POST connection carries the requests base64 encoded and is attached to the
+ * session as tunnelSock. Its own session is dropped, it doesn't count as a client. A GET without
+ * x-sessioncookie is a browser, see openHttpClient().
+ *
+ * @param session The session of the connection the request came in on.
+ * @param len Length of the request in rtspRequestBuffer.
+ * @return false to close the connection.
+ */
+bool RTSPServer::handleHttpRequest(RTSP_Session& session, int len) {
+  char* buffer = this->rtspRequestBuffer;
+  char* headersEnd = strstr(buffer, "\r\n\r\n");
+  if (headersEnd == NULL) {
+    return false;
+  }
+  char cookie[RTSP_TUNNEL_COOKIE_SIZE] = "";
+  const char* cookieStart = strstr(buffer, "x-sessioncookie:");
+  if (cookieStart) {
+    cookieStart += 16;
+    while (*cookieStart == ' ') {
+      cookieStart++;
+    }
+    size_t cookieLen = strcspn(cookieStart, "\r\n");
+    if (cookieLen >= sizeof(cookie)) {
+      cookieLen = sizeof(cookie) - 1;
+    }
+    memcpy(cookie, cookieStart, cookieLen);
+    cookie[cookieLen] = 0;
+  }
+
+  if (strncmp(buffer, "GET ", 4) == 0) {
+    if (cookie[0] == 0 && !session.isTunnel) {
+      return openHttpClient(session, buffer); // A browser, not a tunnel
+    }
+    if (session.isTunnel) {
+      const char* response = "HTTP/1.0 400 Bad Request\r\nConnection: close\r\n\r\n";
+      write(session.sock, response, strlen(response));
+      return false;
+    }
+    session.isTunnel = true;
+    session.tunnelSock = -1;
+    strcpy(session.tunnelCookie, cookie);
+    char response[256];
+    int responseLen = snprintf(response, sizeof(response),
+                               "HTTP/1.0 200 OK\r\n"
+                               "%s\r\n"
+                               "Connection: close\r\n"
+                               "Cache-Control: no-store\r\n"
+                               "Pragma: no-cache\r\n"
+                               "Content-Type: application/x-rtsp-tunnelled\r\n\r\n",
+                               dateHeader());
+    write(session.sock, response, responseLen);
+    RTSP_LOGD(LOG_TAG, "Session %u tunnelled over HTTP", session.sessionID);
+    return true;
+  }
+
+  // POST, find the GET half
+  RTSP_Session* tunnel = nullptr;
+  for (auto& sess : this->sessions) {
+    if (sess.second.isTunnel && sess.second.tunnelSock < 0 && sess.second.sock != session.sock && strcmp(sess.second.tunnelCookie, cookie) == 0) {
+      tunnel = &sess.second;
+      break;
+    }
+  }
+  if (cookie[0] == 0 || tunnel == nullptr) {
+    RTSP_LOGW(LOG_TAG, "HTTP POST without a matching tunnel GET");
+    return false;
+  }
+  tunnel->tunnelSock = session.sock;
+  base64_init_decodestate(&tunnel->tunnelDecoder);
+  tunnel->pendingLen = 0;
+  writeLockSessions();
+  this->sessions.erase(session.sessionID);
+  writeUnlockSessions();
+  decrementActiveRTSPClients();
+
+  // Requests may follow the headers in the same segment
+  char* body = headersEnd + 4;
+  int bodyLen = len - (body - buffer);
+  int decodedLen = bodyLen > 0 ? base64_decode_block(body, bodyLen, buffer, &tunnel->tunnelDecoder) : 0;
+  dispatchTunnelRequests(*tunnel, decodedLen); // A TEARDOWN here ends with the client closing the GET connection
+  return true;
+}
+
+/**
+ * @brief Reads base64 encoded requests arriving on a tunnel's POST connection.
+ *
+ * libb64 keeps the state of a quad split between reads in the session, and the decoded start of a
+ * request cut off by the last read goes ahead of what this one decodes. Characters outside the
+ * base64 alphabet, such as line breaks, are skipped.
+ *
+ * @param session The tunnel's session.
+ * @param tunnelClosed Set when the POST connection has closed, the client may open another.
+ * @return false after TEARDOWN.
+ */
+bool RTSPServer::handleTunnelRequest(RTSP_Session& session, bool& tunnelClosed) {
+  char* buffer = this->rtspRequestBuffer;
+  tunnelClosed = false;
+  int decodedLen = session.pendingLen;
+  memcpy(buffer, session.pending, decodedLen);
+  session.pendingLen = 0;
+  int len;
+  // Decoding in place is safe, output never gets ahead of the input it comes from
+  while ((len = recv(session.tunnelSock, buffer + decodedLen, RTSP_BUFFER_SIZE - decodedLen - 1, 0)) > 0) {
+    decodedLen += base64_decode_block(buffer + decodedLen, len, buffer + decodedLen, &session.tunnelDecoder);
+    buffer[decodedLen] = 0;
+    if (decodedLen >= 4 && strcmp(buffer + decodedLen - 4, "\r\n\r\n") == 0) {
+      break;
+    }
+    if (decodedLen >= RTSP_BUFFER_SIZE - 4) {
+      RTSP_LOGE(LOG_TAG, "Tunnelled request too large for buffer");
+      break;
+    }
+  }
+  if (len == 0 || (len < 0 && errno != EWOULDBLOCK && errno != EAGAIN)) {
+    tunnelClosed = true;
+  }
+  return dispatchTunnelRequests(session, decodedLen);
+}
+
+/**
+ * @brief Hands each complete request in the decoded tunnel data to processRTSPRequest().
+ *
+ * Interleaved RTCP from the client is skipped. A request or packet cut off at the end is kept in
+ * the session for the next read of the POST connection, unless it is longer than RTSP_PENDING_SIZE.
+ *
+ * @param session The tunnel's session.
+ * @param len Decoded bytes in rtspRequestBuffer.
+ * @return false after TEARDOWN.
+ */
+bool RTSPServer::dispatchTunnelRequests(RTSP_Session& session, int len) {
+  char* buffer = this->rtspRequestBuffer;
+  buffer[len] = 0;
+  int offset = 0;
+  while (offset < len) {
+    char* request = buffer + offset;
+    char* end = NULL;
+    if (request[0] == '$') {
+      if (len - offset >= 4) {
+        end = request + 4 + (((uint8_t)request[2] << 8) | (uint8_t)request[3]);
+      }
+    } else {
+      int requestEnd = findRequestEnd(request, len - offset);
+      if (requestEnd > 0) {
+        end = request + requestEnd;
+      }
+    }
+    if (end == NULL || end > buffer + len) {
+      if (len - offset > RTSP_PENDING_SIZE) {
+        RTSP_LOGW(LOG_TAG, "Incomplete tunnelled request too large, dropped");
+        break;
+      }
+      memcpy(session.pending, request, len - offset);
+      session.pendingLen = len - offset;
+      break;
+    }
+    if (request[0] == '$') {
+      offset = end - buffer;
+      continue;
+    }
+    int requestLen = end - request;
+    char next = *end;
+    *end = 0; // Handlers treat the request as a string
+    bool keep = processRTSPRequest(session, request);
+    *end = next;
+    if (!keep) {
+      return false;
+    }
+    offset += requestLen;
+  }
+  return true;
+}
+
+/**
+ * @brief Closes the POST connection of a tunnel whose session is going away.
+ *
+ * @param session The session, a plain RTSP session is left alone.
+ * @param clientSockets The RTSP task's socket list.
+ */
+void RTSPServer::closeTunnel(RTSP_Session& session, int* clientSockets) {
+  if (session.tunnelSock < 0) {
+    return;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (clientSockets[i] == session.tunnelSock) {
+      sessionTimerCancel(i);
+      clientSockets[i] = 0;
+      break;
+    }
+  }
+  close(session.tunnelSock);
+  session.tunnelSock = -1;
+}
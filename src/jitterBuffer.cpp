@@ -0,0 +1,271 @@
+#include "jitterBuffer.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RTSP_JITTER_MASK (RTSP_JITTER_SLOTS - 1)
+
+static inline uint32_t get32be(const uint8_t* p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * @brief Decodes a G.711 mu-law sample.
+ */
+static inline int16_t decodeUlaw(uint8_t code) {
+  code = ~code;
+  int magnitude = ((((code & 0x0F) << 3) + 0x84) << ((code >> 4) & 0x07)) - 0x84;
+  return (code & 0x80) ? -magnitude : magnitude;
+}
+
+RTSP_JitterBuffer::RTSP_JitterBuffer()
+  : memory(NULL), buffers{}, slots{}, spare(NULL), playing(NULL), pcm(NULL), l16Rate(0),
+    haveSource(false), ssrc(0), haveSeq(false), started(false), played(false), nextSeq(0), highestSeq(0), playUs(0),
+    lastPayloadType(0), lastCount(0), packetUs(0), haveTransit(false), lastArrivalUs(0), lastTimestamp(0), jitterUs(0), delayUs(0),
+    received(0), lost(0), late(0) {}
+
+RTSP_JitterBuffer::~RTSP_JitterBuffer() {
+  end();
+}
+
+/**
+ * @brief Allocates the slots.
+ *
+ * @param l16Rate Sample rate of L16 packets, PCMU is always 8 kHz.
+ * @return false if out of memory.
+ */
+bool RTSP_JitterBuffer::begin(uint32_t l16Rate) {
+  end();
+  size_t pcmSize = RTSP_JITTER_PACKET_SIZE * sizeof(int16_t);
+  this->memory = (uint8_t*)malloc((RTSP_JITTER_SLOTS + 2) * RTSP_JITTER_PACKET_SIZE + pcmSize);
+  if (this->memory == NULL) {
+    return false;
+  }
+  for (int i = 0; i < RTSP_JITTER_SLOTS; i++) {
+    this->buffers[i] = this->memory + i * RTSP_JITTER_PACKET_SIZE;
+  }
+  this->spare = this->memory + RTSP_JITTER_SLOTS * RTSP_JITTER_PACKET_SIZE;
+  this->playing = this->spare + RTSP_JITTER_PACKET_SIZE;
+  this->pcm = (int16_t*)(this->playing + RTSP_JITTER_PACKET_SIZE);
+  this->l16Rate = l16Rate;
+  this->received = 0;
+  this->lost = 0;
+  this->late = 0;
+  reset();
+  return true;
+}
+
+/**
+ * @brief Frees the slots.
+ */
+void RTSP_JitterBuffer::end() {
+  free(this->memory);
+  this->memory = NULL;
+  this->spare = NULL;
+  this->playing = NULL;
+  this->pcm = NULL;
+  memset(this->buffers, 0, sizeof(this->buffers));
+  clearSlots();
+}
+
+/**
+ * @brief Drops the packets held and forgets the sender, the next packet starts playout afresh.
+ */
+void RTSP_JitterBuffer::reset() {
+  clearSlots();
+  this->haveSource = false;
+  this->haveSeq = false;
+  this->started = false;
+  this->played = false;
+  this->haveTransit = false;
+  this->jitterUs = 0;
+  this->packetUs = 0;
+  this->lastCount = 0;
+}
+
+void RTSP_JitterBuffer::clearSlots() {
+  for (int i = 0; i < RTSP_JITTER_SLOTS; i++) {
+    this->slots[i].full = false;
+  }
+}
+
+int64_t RTSP_JitterBuffer::targetDelayUs() const {
+  int64_t delay = this->packetUs + 4 * this->jitterUs;
+  if (delay < RTSP_JITTER_MIN_DELAY_MS * 1000LL) {
+    return RTSP_JITTER_MIN_DELAY_MS * 1000LL;
+  }
+  return delay > RTSP_JITTER_MAX_DELAY_MS * 1000LL ? RTSP_JITTER_MAX_DELAY_MS * 1000LL : delay;
+}
+
+/**
+ * @brief Takes the packet received into receiveBuffer().
+ *
+ * @param len Bytes received.
+ * @param arrivalUs When it arrived, on the clock pop() is given.
+ * @return false if it isn't RTP audio that can be played, receiveBuffer() can then be reused as it is.
+ */
+bool RTSP_JitterBuffer::commit(size_t len, int64_t arrivalUs) {
+  const uint8_t* packet = this->spare;
+  if (packet == NULL || len < 12 || len > RTSP_JITTER_PACKET_SIZE || (packet[0] >> 6) != 2) {
+    return false;
+  }
+  size_t offset = 12 + (packet[0] & 0x0F) * 4; // CSRCs
+  if ((packet[0] & 0x10) && offset + 4 <= len) {
+    offset += 4 + ((packet[offset + 2] << 8) | packet[offset + 3]) * 4; // Header extension
+  }
+  size_t end = len;
+  if (packet[0] & 0x20) {
+    end = packet[len - 1] <= len ? len - packet[len - 1] : 0; // Padding
+  }
+  uint8_t payloadType = packet[1] & 0x7F;
+  if (offset >= end || !(payloadType == RTSP_JITTER_PT_PCMU || (payloadType == RTSP_JITTER_PT_L16 && this->l16Rate))) {
+    return false;
+  }
+  size_t count = sampleCount(payloadType, end - offset);
+  if (count == 0) {
+    return false;
+  }
+  uint16_t seq = (packet[2] << 8) | packet[3];
+  uint32_t timestamp = get32be(packet + 4);
+  uint32_t ssrc = get32be(packet + 8);
+  if (!this->haveSource || ssrc != this->ssrc) {
+    reset();
+    this->haveSource = true;
+    this->ssrc = ssrc;
+  }
+
+  // J += (|D| - J) / 16 over the packets in arrival order
+  uint32_t rate = clockRate(payloadType);
+  if (this->haveTransit) {
+    int64_t difference = (arrivalUs - this->lastArrivalUs) - (int64_t)(int32_t)(timestamp - this->lastTimestamp) * 1000000 / rate;
+    if (difference < 0) {
+      difference = -difference;
+    }
+    this->jitterUs += (difference - this->jitterUs) / 16;
+  }
+  this->haveTransit = true;
+  this->lastArrivalUs = arrivalUs;
+  this->lastTimestamp = timestamp;
+  this->packetUs = (int64_t)count * 1000000 / rate;
+  this->lastPayloadType = payloadType;
+  this->lastCount = count;
+
+  int16_t ahead = (int16_t)(seq - this->nextSeq);
+  if (this->haveSeq && ahead < 0 && ahead > -RTSP_JITTER_SLOTS &&
+      (this->played || !this->started || (int16_t)(this->highestSeq - seq) >= RTSP_JITTER_SLOTS)) {
+    __atomic_store_n(&this->late, this->late + 1, __ATOMIC_RELAXED);
+    return true;
+  }
+  if (!this->started || ahead >= RTSP_JITTER_SLOTS || ahead <= -RTSP_JITTER_SLOTS) {
+    // Start of a talkspurt, or so far from the last one that it's as good as one
+    clearSlots();
+    this->started = true;
+    this->played = false;
+    this->haveSeq = true;
+    this->nextSeq = seq;
+    this->highestSeq = seq;
+    __atomic_store_n(&this->delayUs, (uint32_t)targetDelayUs(), __ATOMIC_RELAXED);
+    this->playUs = arrivalUs + this->delayUs;
+  } else if (ahead < 0) {
+    this->nextSeq = seq; // Overtaken by the packet that started playout, which hasn't played yet
+  }
+
+  uint32_t index = seq & RTSP_JITTER_MASK;
+  Slot& slot = this->slots[index];
+  if (slot.full && slot.seq == seq) {
+    return true; // Duplicate
+  }
+  this->spare = this->buffers[index];
+  this->buffers[index] = (uint8_t*)packet;
+  slot.full = true;
+  slot.payloadType = payloadType;
+  slot.seq = seq;
+  slot.offset = offset;
+  slot.len = end - offset;
+  slot.timestamp = timestamp;
+  if ((int16_t)(seq - this->highestSeq) > 0) {
+    this->highestSeq = seq;
+  }
+  __atomic_store_n(&this->received, this->received + 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+/**
+ * @brief Hands out the next packet once it is due.
+ *
+ * @param nowUs The current time.
+ * @param packet The decoded samples, or how long to wait.
+ */
+RTSP_JitterResult RTSP_JitterBuffer::pop(int64_t nowUs, RTSP_JitterPacket& packet) {
+  packet.samples = NULL;
+  packet.count = 0;
+  packet.sampleRate = 0;
+  packet.waitUs = 0;
+  if (!this->started) {
+    return RTSP_JITTER_EMPTY;
+  }
+  if (nowUs < this->playUs) {
+    packet.waitUs = this->playUs - nowUs;
+    return RTSP_JITTER_WAIT;
+  }
+
+  // The jitter has calmed down since playout started, drop a packet to bring the delay down
+  int64_t target = targetDelayUs();
+  int64_t bufferedUs = ((uint16_t)(this->highestSeq - this->nextSeq) + 1) * this->packetUs;
+  if (this->played && bufferedUs > target + 2 * this->packetUs) {
+    Slot& dropped = this->slots[this->nextSeq & RTSP_JITTER_MASK];
+    if (dropped.full && dropped.seq == this->nextSeq) {
+      dropped.full = false;
+      __atomic_store_n(&this->late, this->late + 1, __ATOMIC_RELAXED);
+    }
+    this->nextSeq++;
+    __atomic_store_n(&this->delayUs, (uint32_t)target, __ATOMIC_RELAXED);
+  }
+
+  uint32_t index = this->nextSeq & RTSP_JITTER_MASK;
+  Slot& slot = this->slots[index];
+  if (slot.full && slot.seq == this->nextSeq) {
+    uint8_t* buffer = this->buffers[index];
+    this->buffers[index] = this->playing;
+    this->playing = buffer;
+    slot.full = false;
+
+    const uint8_t* payload = buffer + slot.offset;
+    packet.count = sampleCount(slot.payloadType, slot.len);
+    packet.sampleRate = clockRate(slot.payloadType);
+    if (slot.payloadType == RTSP_JITTER_PT_PCMU) {
+      for (size_t i = 0; i < packet.count; i++) {
+        this->pcm[i] = decodeUlaw(payload[i]);
+      }
+      packet.samples = this->pcm;
+    } else {
+      // Network to host order where it lies, the payload offset is a multiple of 4
+      int16_t* samples = (int16_t*)(buffer + slot.offset);
+      for (size_t i = 0; i < packet.count; i++) {
+        samples[i] = (int16_t)((payload[2 * i] << 8) | payload[2 * i + 1]);
+      }
+      packet.samples = samples;
+    }
+    this->played = true;
+    this->nextSeq++;
+    this->playUs += (int64_t)packet.count * 1000000 / packet.sampleRate;
+    return RTSP_JITTER_PACKET;
+  }
+
+  if ((int16_t)(this->highestSeq - this->nextSeq) > 0) {
+    // Later packets are here, this one is lost
+    packet.count = this->lastCount;
+    packet.sampleRate = clockRate(this->lastPayloadType);
+    memset(this->pcm, 0, packet.count * sizeof(int16_t));
+    packet.samples = this->pcm;
+    __atomic_store_n(&this->lost, this->lost + 1, __ATOMIC_RELAXED);
+    this->played = true;
+    this->nextSeq++;
+    this->playUs += (int64_t)packet.count * 1000000 / packet.sampleRate;
+    return RTSP_JITTER_LOST;
+  }
+
+  // Ran dry, the talkspurt ended or its next packet is late. The next packet to arrive starts
+  // playout again with the delay the jitter calls for by then.
+  this->started = false;
+  return RTSP_JITTER_EMPTY;
+}
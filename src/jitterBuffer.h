@@ -0,0 +1,115 @@
+#ifndef ESP32_RTSP_JITTER_BUFFER_H
+#define ESP32_RTSP_JITTER_BUFFER_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of Arduino headers so extras/jitterBufferHost can build it on a PC.
+
+#define RTSP_JITTER_SLOTS 16 // Packets held at most, power of 2
+#define RTSP_JITTER_PACKET_SIZE 1472 // Largest RTP packet taken, a full UDP datagram on Ethernet MTU
+#define RTSP_JITTER_MIN_DELAY_MS 40 // Bounds of the playout delay, which follows the measured jitter
+#define RTSP_JITTER_MAX_DELAY_MS 200
+#define RTSP_JITTER_PT_PCMU 0 // Static payload type of G.711 mu-law, 8 kHz
+#define RTSP_JITTER_PT_L16 97 // Dynamic payload type the server offers L16 audio on
+
+enum RTSP_JitterResult {
+  RTSP_JITTER_EMPTY, // Nothing to play until more packets arrive
+  RTSP_JITTER_WAIT, // The next packet isn't due yet, see waitUs
+  RTSP_JITTER_PACKET, // samples holds the next packet, decoded
+  RTSP_JITTER_LOST, // samples holds silence in place of a lost packet
+};
+
+struct RTSP_JitterPacket {
+  const int16_t* samples; // Valid until the next call of pop()
+  size_t count;
+  uint32_t sampleRate;
+  int64_t waitUs;
+};
+
+/**
+ * Reorders RTP audio from one sender and plays it out with an adaptive delay.
+ *
+ * Packets are received straight into a free slot from receiveBuffer() and placed by sequence
+ * number by swapping slot pointers, so nothing is copied on the way in, and L16 is byte swapped
+ * in place on the way out. The delay from arrival to playout follows the interarrival jitter
+ * estimate of RFC 3550. It is set when playout starts, at the start of a talkspurt or after the
+ * buffer ran dry, and brought down by dropping a packet when more than a packet above the target
+ * has built up. Lost packets are played as silence.
+ *
+ * Not thread safe, the producer and consumer have to share a lock. receiveBuffer() may be
+ * filled outside of it, only by the producer.
+ */
+class RTSP_JitterBuffer {
+public:
+  RTSP_JitterBuffer();
+  ~RTSP_JitterBuffer();
+
+  bool begin(uint32_t l16Rate);
+
+  void end();
+
+  void reset();
+
+  uint8_t* receiveBuffer() const { return this->spare; }
+
+  bool commit(size_t len, int64_t arrivalUs);
+
+  RTSP_JitterResult pop(int64_t nowUs, RTSP_JitterPacket& packet);
+
+  uint32_t packetsReceived() const { return __atomic_load_n(&this->received, __ATOMIC_RELAXED); }
+
+  uint32_t packetsLost() const { return __atomic_load_n(&this->lost, __ATOMIC_RELAXED); }
+
+  uint32_t packetsLate() const { return __atomic_load_n(&this->late, __ATOMIC_RELAXED); }
+
+  uint32_t delayMs() const { return __atomic_load_n(&this->delayUs, __ATOMIC_RELAXED) / 1000; }
+
+private:
+  struct Slot {
+    bool full;
+    uint8_t payloadType;
+    uint16_t seq;
+    uint16_t offset; // Of the payload in the slot's buffer
+    uint16_t len;
+    uint32_t timestamp;
+  };
+
+  uint32_t clockRate(uint8_t payloadType) const { return payloadType == RTSP_JITTER_PT_PCMU ? 8000 : this->l16Rate; }
+  size_t sampleCount(uint8_t payloadType, size_t len) const { return payloadType == RTSP_JITTER_PT_PCMU ? len : len / 2; }
+  int64_t targetDelayUs() const;
+  void clearSlots();
+
+  uint8_t* memory; // Slot buffers, the spare and the one being played, in one block
+  uint8_t* buffers[RTSP_JITTER_SLOTS];
+  Slot slots[RTSP_JITTER_SLOTS];
+  uint8_t* spare; // Producer's, the next packet is received into it
+  uint8_t* playing; // Consumer's, the packet handed out by pop()
+  int16_t* pcm; // Decoded PCMU and silence
+  uint32_t l16Rate;
+
+  bool haveSource;
+  uint32_t ssrc;
+  bool haveSeq; // nextSeq is known, packets before it are late
+  bool started; // Playout anchored for the current talkspurt
+  bool played; // A packet of the talkspurt has been played, the start can't move back any more
+  uint16_t nextSeq;
+  uint16_t highestSeq;
+  int64_t playUs; // Time nextSeq is due
+  uint8_t lastPayloadType;
+  size_t lastCount; // Samples of the last packet, the length of silence for a lost one
+  int64_t packetUs;
+
+  // RFC 3550 6.4.1 interarrival jitter, in microseconds
+  bool haveTransit;
+  int64_t lastArrivalUs;
+  uint32_t lastTimestamp;
+  int64_t jitterUs;
+  uint32_t delayUs; // Playout delay of the current talkspurt
+
+  uint32_t received;
+  uint32_t lost;
+  uint32_t late; // Arrived after their turn, or dropped to bring the delay down
+};
+
+#endif
@@ -0,0 +1,849 @@
+#include "jpegScale.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#ifdef ARDUINO
+#include <esp_heap_caps.h>
+#endif
+
+// Natural order position of each zigzag index
+static const uint8_t zigzag[64] = {
+   0,  1,  8, 16,  9,  2,  3, 10,
+  17, 24, 32, 25, 18, 11,  4,  5,
+  12, 19, 26, 33, 40, 48, 41, 34,
+  27, 20, 13,  6,  7, 14, 21, 28,
+  35, 42, 49, 56, 57, 50, 43, 36,
+  29, 22, 15, 23, 30, 37, 44, 51,
+  58, 59, 52, 45, 38, 31, 39, 46,
+  53, 60, 61, 54, 47, 55, 62, 63
+};
+
+// Standard Huffman tables (ITU T.81 Annex K.3), which RFC 2435 receivers assume
+static const uint8_t dcLuminanceBits[16] = { 0, 1, 5, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0, 0 };
+static const uint8_t dcChrominanceBits[16] = { 0, 3, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0 };
+static const uint8_t dcValues[12] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11 };
+static const uint8_t acLuminanceBits[16] = { 0, 2, 1, 3, 3, 2, 4, 3, 5, 5, 4, 4, 0, 0, 1, 0x7d };
+static const uint8_t acLuminanceValues[162] = {
+  0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07,
+  0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0,
+  0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+  0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49,
+  0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69,
+  0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+  0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+  0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5,
+  0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+  0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+static const uint8_t acChrominanceBits[16] = { 0, 2, 1, 2, 4, 4, 3, 4, 7, 5, 4, 4, 0, 1, 2, 0x77 };
+static const uint8_t acChrominanceValues[162] = {
+  0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71,
+  0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0,
+  0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+  0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48,
+  0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+  0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5,
+  0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3,
+  0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+  0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8,
+  0xf9, 0xfa
+};
+
+// Encoder codes for the standard tables: DC luminance, DC chrominance, AC luminance, AC chrominance
+static uint16_t encodeCodes[4][256];
+static uint8_t encodeSizes[4][256];
+static bool encodeTablesBuilt = false;
+
+static void buildEncodeTable(const uint8_t* bits, const uint8_t* values, uint16_t* codes, uint8_t* sizes) {
+  uint16_t code = 0;
+  int k = 0;
+  for (int len = 1; len <= 16; len++) {
+    for (int i = 0; i < bits[len - 1]; i++) {
+      codes[values[k]] = code;
+      sizes[values[k]] = len;
+      code++;
+      k++;
+    }
+    code <<= 1;
+  }
+}
+
+static void* allocOutput(size_t size) {
+#ifdef ARDUINO
+  // The output is written once and sent, PSRAM keeps internal RAM for the network stack
+  void* buffer = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  if (buffer) {
+    return buffer;
+  }
+#endif
+  return malloc(size);
+}
+
+static inline uint8_t clampPixel(int32_t value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
+
+static inline int bitLength(int value) {
+  int magnitude = value < 0 ? -value : value;
+  int bits = 0;
+  while (magnitude) {
+    bits++;
+    magnitude >>= 1;
+  }
+  return bits;
+}
+
+RTSP_JpegScaler::RTSP_JpegScaler()
+  : denominator(1),
+    blockSize(8),
+    width(0),
+    height(0),
+    componentCount(0),
+    maxH(1),
+    maxV(1),
+    restartInterval(0),
+    in(NULL),
+    inEnd(NULL),
+    bitBuffer(0),
+    bitCount(0),
+    hitMarker(false),
+    out(NULL),
+    outSize(0),
+    outLen(0),
+    putBuffer(0),
+    putCount(0),
+    overflow(false),
+    strips(NULL),
+    stripAllocatedSize(0)
+{
+  memset(this->idctTable, 0, sizeof(this->idctTable));
+  memset(this->components, 0, sizeof(this->components));
+  memset(this->quantDefined, 0, sizeof(this->quantDefined));
+  memset(this->dcTables, 0, sizeof(this->dcTables));
+  memset(this->acTables, 0, sizeof(this->acTables));
+  for (int u = 0; u < 8; u++) {
+    double cu = u == 0 ? sqrt(0.5) : 1.0;
+    for (int x = 0; x < 8; x++) {
+      this->fdctTable[u][x] = (int32_t)lround(cu * cos((2 * x + 1) * u * M_PI / 16) / 2 * 8192);
+    }
+  }
+  if (!encodeTablesBuilt) {
+    buildEncodeTable(dcLuminanceBits, dcValues, encodeCodes[0], encodeSizes[0]);
+    buildEncodeTable(dcChrominanceBits, dcValues, encodeCodes[1], encodeSizes[1]);
+    buildEncodeTable(acLuminanceBits, acLuminanceValues, encodeCodes[2], encodeSizes[2]);
+    buildEncodeTable(acChrominanceBits, acChrominanceValues, encodeCodes[3], encodeSizes[3]);
+    encodeTablesBuilt = true;
+  }
+}
+
+RTSP_JpegScaler::~RTSP_JpegScaler() {
+  release();
+}
+
+/**
+ * @brief Sets the scale, 1/denominator of the input's width and height.
+ *
+ * @param denominator 2, 4 or 8, or 1 to turn scaling off.
+ * @return false for any other value.
+ */
+bool RTSP_JpegScaler::setScale(uint8_t denominator) {
+  if (denominator != 1 && denominator != 2 && denominator != 4 && denominator != 8) {
+    return false;
+  }
+  this->denominator = denominator;
+  this->blockSize = 8 / denominator;
+  // N point IDCT from the N x N lowest coefficients, each output pixel stands for a denominator^2 area
+  const int n = this->blockSize;
+  for (int x = 0; x < 4; x++) {
+    for (int u = 0; u < 4; u++) {
+      double cu = u == 0 ? sqrt(0.5) : 1.0;
+      this->idctTable[x][u] = (x < n && u < n) ? (int32_t)lround(cu * cos((2 * x + 1) * u * M_PI / (2 * n)) / 2 * 8192) : 0;
+    }
+  }
+  return true;
+}
+
+void RTSP_JpegScaler::release() {
+  free(this->out);
+  this->out = NULL;
+  this->outSize = 0;
+  free(this->strips);
+  this->strips = NULL;
+  this->stripAllocatedSize = 0;
+  for (int c = 0; c < RTSP_JPEG_MAX_COMPONENTS; c++) {
+    this->components[c].strip = NULL;
+  }
+}
+
+/**
+ * @brief Scales one baseline JPEG.
+ *
+ * @param jpeg The JPEG, as handed to sendRTSPFrame().
+ * @param len Length of the JPEG.
+ * @param width Set to the width of the scaled image.
+ * @param height Set to the height of the scaled image.
+ * @return Length of the scaled JPEG at output(), 0 if the input isn't a baseline JPEG this can scale.
+ */
+size_t RTSP_JpegScaler::scale(const uint8_t* jpeg, size_t len, uint16_t& width, uint16_t& height) {
+  if (this->denominator < 2) {
+    return 0;
+  }
+  const uint8_t* scan = NULL;
+  if (!parseHeaders(jpeg, len, scan)) {
+    return 0;
+  }
+  const int s = this->denominator;
+  const int n = this->blockSize;
+  const uint16_t outWidth = (this->width + s - 1) / s;
+  const uint16_t outHeight = (this->height + s - 1) / s;
+  const uint16_t mcusAcross = (this->width + 8 * this->maxH - 1) / (8 * this->maxH);
+  const uint16_t mcusDown = (this->height + 8 * this->maxV - 1) / (8 * this->maxV);
+  const uint16_t outMcusAcross = (outWidth + 8 * this->maxH - 1) / (8 * this->maxH);
+  const uint16_t outMcusDown = (outHeight + 8 * this->maxV - 1) / (8 * this->maxV);
+
+  for (int c = 0; c < this->componentCount; c++) {
+    this->components[c].stripWidth = outMcusAcross * this->components[c].h * 8;
+  }
+  if (!allocate(len)) {
+    return 0;
+  }
+
+  this->outLen = 0;
+  this->putBuffer = 0;
+  this->putCount = 0;
+  this->overflow = false;
+  writeHeaders(outWidth, outHeight);
+
+  this->in = scan;
+  this->inEnd = jpeg + len;
+  this->bitBuffer = 0;
+  this->bitCount = 0;
+  this->hitMarker = false;
+  for (int c = 0; c < this->componentCount; c++) {
+    this->components[c].dcPredictor = 0;
+    this->components[c].dcPrevious = 0;
+  }
+
+  int32_t coefficients[64];
+  uint32_t mcuCount = 0;
+  uint16_t outRow = 0;
+  for (uint16_t my = 0; my < mcusDown; my++) {
+    const int band = my % s; // Which of the input MCU rows making up an output MCU row this is
+    for (uint16_t mx = 0; mx < mcusAcross; mx++) {
+      if (this->restartInterval && mcuCount && mcuCount % this->restartInterval == 0) {
+        if (!restart()) {
+          return 0;
+        }
+      }
+      for (int c = 0; c < this->componentCount; c++) {
+        RTSP_JpegComponent& component = this->components[c];
+        for (int by = 0; by < component.v; by++) {
+          for (int bx = 0; bx < component.h; bx++) {
+            if (!decodeBlock(component, coefficients)) {
+              return 0;
+            }
+            uint8_t* dst = component.strip + (band * component.v * n + by * n) * component.stripWidth + (mx * component.h + bx) * n;
+            inverseTransform(coefficients, dst, component.stripWidth);
+          }
+        }
+      }
+      mcuCount++;
+    }
+
+    // Repeat the last column out to the edge of the output MCUs
+    for (int c = 0; c < this->componentCount; c++) {
+      RTSP_JpegComponent& component = this->components[c];
+      const int produced = mcusAcross * component.h * n;
+      for (int y = band * component.v * n; y < (band + 1) * component.v * n; y++) {
+        uint8_t* row = component.strip + y * component.stripWidth;
+        if (produced < component.stripWidth) {
+          memset(row + produced, row[produced - 1], component.stripWidth - produced);
+        }
+      }
+    }
+
+    if ((band == s - 1 || my == mcusDown - 1) && outRow < outMcusDown) {
+      // The image may end part way through an output MCU row, repeat its last line
+      for (int c = 0; c < this->componentCount; c++) {
+        RTSP_JpegComponent& component = this->components[c];
+        const int filled = (band + 1) * component.v * n;
+        for (int y = filled; y < component.v * 8; y++) {
+          memcpy(component.strip + y * component.stripWidth, component.strip + (filled - 1) * component.stripWidth, component.stripWidth);
+        }
+      }
+      encodeMcuRow(outMcusAcross);
+      outRow++;
+    }
+  }
+
+  flushBits();
+  putByte(0xFF);
+  putByte(0xD9); // EOI
+  if (this->overflow) {
+    return 0;
+  }
+  width = outWidth;
+  height = outHeight;
+  return this->outLen;
+}
+
+/**
+ * @brief Reads the tables and frame header up to the start of the entropy coded data.
+ *
+ * Only baseline (SOF0/SOF1, 8-bit, Huffman) JPEGs with one interleaved scan are accepted.
+ */
+bool RTSP_JpegScaler::parseHeaders(const uint8_t* jpeg, size_t len, const uint8_t*& scan) {
+  if (len < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8) {
+    return false;
+  }
+  this->componentCount = 0;
+  this->restartInterval = 0;
+  const uint8_t* p = jpeg + 2;
+  const uint8_t* end = jpeg + len;
+  while (p + 4 <= end) {
+    if (p[0] != 0xFF) {
+      return false;
+    }
+    uint8_t marker = p[1];
+    if (marker == 0xFF) {
+      p++; // Fill byte
+      continue;
+    }
+    size_t segmentLen = (p[2] << 8) | p[3];
+    const uint8_t* segment = p + 4;
+    if (segmentLen < 2 || segment + segmentLen - 2 > end) {
+      return false;
+    }
+    size_t dataLen = segmentLen - 2;
+    switch (marker) {
+      case 0xDB: { // DQT
+        size_t offset = 0;
+        while (offset + 65 <= dataLen) {
+          uint8_t table = segment[offset] & 0x0F;
+          if ((segment[offset] >> 4) != 0 || table > 3) {
+            return false; // 16-bit tables are not baseline
+          }
+          for (int k = 0; k < 64; k++) {
+            this->quantTables[table][zigzag[k]] = segment[offset + 1 + k];
+          }
+          this->quantDefined[table] = true;
+          offset += 65;
+        }
+        break;
+      }
+      case 0xC0:
+      case 0xC1: { // SOF0/SOF1
+        if (dataLen < 6 || segment[0] != 8) {
+          return false;
+        }
+        this->height = (segment[1] << 8) | segment[2];
+        this->width = (segment[3] << 8) | segment[4];
+        this->componentCount = segment[5];
+        if (this->width == 0 || this->height == 0 || (this->componentCount != 1 && this->componentCount != 3) || dataLen < (size_t)(6 + 3 * this->componentCount)) {
+          return false;
+        }
+        this->maxH = 1;
+        this->maxV = 1;
+        for (int c = 0; c < this->componentCount; c++) {
+          RTSP_JpegComponent& component = this->components[c];
+          component.id = segment[6 + 3 * c];
+          component.h = segment[7 + 3 * c] >> 4;
+          component.v = segment[7 + 3 * c] & 0x0F;
+          component.quantTable = segment[8 + 3 * c];
+          if (component.h < 1 || component.h > 2 || component.v < 1 || component.v > 2 || component.quantTable > 3) {
+            return false;
+          }
+          if (this->componentCount == 1) {
+            component.h = 1; // A single component scan is not interleaved, its MCU is one block
+            component.v = 1;
+          }
+          if (component.h > this->maxH) this->maxH = component.h;
+          if (component.v > this->maxV) this->maxV = component.v;
+        }
+        break;
+      }
+      case 0xC4: // DHT
+        if (!parseHuffman(segment, dataLen)) {
+          return false;
+        }
+        break;
+      case 0xDD: // DRI
+        if (dataLen < 2) {
+          return false;
+        }
+        this->restartInterval = (segment[0] << 8) | segment[1];
+        break;
+      case 0xDA: { // SOS
+        if (this->componentCount == 0 || dataLen < 1 || segment[0] != this->componentCount || dataLen < (size_t)(4 + 2 * this->componentCount)) {
+          return false;
+        }
+        for (int i = 0; i < this->componentCount; i++) {
+          uint8_t id = segment[1 + 2 * i];
+          uint8_t tables = segment[2 + 2 * i];
+          RTSP_JpegComponent* component = NULL;
+          for (int c = 0; c < this->componentCount; c++) {
+            if (this->components[c].id == id) {
+              component = &this->components[c];
+            }
+          }
+          if (component == NULL || (tables >> 4) > 1 || (tables & 0x0F) > 1 ||
+              !this->dcTables[tables >> 4].defined || !this->acTables[tables & 0x0F].defined || !this->quantDefined[component->quantTable]) {
+            return false;
+          }
+          component->dcTable = tables >> 4;
+          component->acTable = tables & 0x0F;
+        }
+        const uint8_t* spectral = segment + 1 + 2 * this->componentCount;
+        if (spectral[0] != 0 || spectral[1] != 63 || spectral[2] != 0) {
+          return false; // Progressive
+        }
+        scan = segment + dataLen;
+        return true;
+      }
+      case 0xC2:
+      case 0xC3:
+      case 0xC9:
+      case 0xCA:
+      case 0xCB:
+        return false; // Progressive, lossless or arithmetic coded
+      default:
+        break; // APPn, COM and the like
+    }
+    p = segment + dataLen;
+  }
+  return false;
+}
+
+bool RTSP_JpegScaler::parseHuffman(const uint8_t* segment, size_t len) {
+  size_t offset = 0;
+  while (offset + 17 <= len) {
+    uint8_t tableClass = segment[offset] >> 4;
+    uint8_t tableId = segment[offset] & 0x0F;
+    if (tableClass > 1 || tableId > 1) {
+      return false; // Baseline has two tables of each class
+    }
+    const uint8_t* bits = segment + offset + 1;
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+      total += bits[i];
+    }
+    if (total > 256 || offset + 17 + total > len) {
+      return false;
+    }
+    RTSP_JpegHuffman& table = tableClass == 0 ? this->dcTables[tableId] : this->acTables[tableId];
+    memcpy(table.values, segment + offset + 17, total);
+    memset(table.lookup, 0, sizeof(table.lookup));
+    int32_t code = 0;
+    int k = 0;
+    for (int length = 1; length <= 16; length++) {
+      table.valueOffset[length] = k - code;
+      for (int i = 0; i < bits[length - 1]; i++) {
+        if (length <= RTSP_JPEG_HUFFMAN_LOOKAHEAD) {
+          // Every lookahead value starting with this code decodes to it
+          int shift = RTSP_JPEG_HUFFMAN_LOOKAHEAD - length;
+          for (int j = 0; j < (1 << shift); j++) {
+            table.lookup[(code << shift) | j] = (length << 8) | table.values[k];
+          }
+        }
+        code++;
+        k++;
+      }
+      table.maxCode[length] = bits[length - 1] ? code - 1 : -1;
+      code <<= 1;
+    }
+    table.maxCode[17] = 0x7FFFFFFF;
+    table.defined = true;
+    offset += 17 + total;
+  }
+  return true;
+}
+
+bool RTSP_JpegScaler::allocate(size_t jpegLen) {
+  // The scaled JPEG is smaller than the input in practice, anything larger fails the frame
+  size_t needed = jpegLen + 1024;
+  if (this->outSize < needed) {
+    free(this->out);
+    this->out = (uint8_t*)allocOutput(needed);
+    this->outSize = this->out ? needed : 0;
+    if (this->out == NULL) {
+      return false;
+    }
+  }
+  size_t total = 0;
+  for (int c = 0; c < this->componentCount; c++) {
+    total += this->components[c].stripWidth * this->components[c].v * 8;
+  }
+  if (this->stripAllocatedSize < total) {
+    free(this->strips);
+    // Internal RAM, every pixel is written once and read once per frame
+    this->strips = (uint8_t*)malloc(total);
+    this->stripAllocatedSize = this->strips ? total : 0;
+    if (this->strips == NULL) {
+      return false;
+    }
+  }
+  uint8_t* strip = this->strips;
+  for (int c = 0; c < this->componentCount; c++) {
+    this->components[c].strip = strip;
+    strip += this->components[c].stripWidth * this->components[c].v * 8;
+  }
+  return true;
+}
+
+void RTSP_JpegScaler::fillBits() {
+  while (this->bitCount <= 24) {
+    uint32_t byte = 0;
+    if (!this->hitMarker && this->in < this->inEnd) {
+      byte = *this->in;
+      if (byte == 0xFF) {
+        uint8_t next = (this->in + 1 < this->inEnd) ? this->in[1] : 0xD9;
+        if (next == 0x00) {
+          this->in += 2; // Stuffed zero
+        } else {
+          this->hitMarker = true; // Feed zeros until restart() moves past the marker
+          byte = 0;
+        }
+      } else {
+        this->in++;
+      }
+    }
+    this->bitBuffer |= byte << (24 - this->bitCount);
+    this->bitCount += 8;
+  }
+}
+
+int RTSP_JpegScaler::getBits(int count) {
+  if (count == 0) {
+    return 0;
+  }
+  fillBits();
+  int value = this->bitBuffer >> (32 - count);
+  this->bitBuffer <<= count;
+  this->bitCount -= count;
+  return value;
+}
+
+int RTSP_JpegScaler::decodeHuffman(const RTSP_JpegHuffman& table) {
+  fillBits();
+  uint16_t entry = table.lookup[this->bitBuffer >> (32 - RTSP_JPEG_HUFFMAN_LOOKAHEAD)];
+  if (entry) {
+    int length = entry >> 8;
+    this->bitBuffer <<= length;
+    this->bitCount -= length;
+    return entry & 0xFF;
+  }
+  for (int length = RTSP_JPEG_HUFFMAN_LOOKAHEAD + 1; length <= 16; length++) {
+    int32_t code = this->bitBuffer >> (32 - length);
+    if (code <= table.maxCode[length]) {
+      this->bitBuffer <<= length;
+      this->bitCount -= length;
+      return table.values[code + table.valueOffset[length]];
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Skips to the data after the next RSTn marker and resets the DC predictors.
+ */
+bool RTSP_JpegScaler::restart() {
+  this->bitBuffer = 0;
+  this->bitCount = 0;
+  this->hitMarker = false;
+  while (this->in + 1 < this->inEnd && !(this->in[0] == 0xFF && this->in[1] >= 0xD0 && this->in[1] <= 0xD7)) {
+    this->in++;
+  }
+  if (this->in + 1 >= this->inEnd) {
+    return false;
+  }
+  this->in += 2;
+  for (int c = 0; c < this->componentCount; c++) {
+    this->components[c].dcPredictor = 0;
+  }
+  return true;
+}
+
+/**
+ * @brief Huffman decodes one block, keeping only the coefficients the scaled IDCT uses.
+ *
+ * @param coefficients Set to the dequantized low frequency coefficients in natural order.
+ */
+bool RTSP_JpegScaler::decodeBlock(RTSP_JpegComponent& component, int32_t* coefficients) {
+  const uint16_t* quant = this->quantTables[component.quantTable];
+  const int n = this->blockSize;
+  for (int v = 0; v < n; v++) {
+    for (int u = 0; u < n; u++) {
+      coefficients[v * 8 + u] = 0;
+    }
+  }
+
+  int size = decodeHuffman(this->dcTables[component.dcTable]);
+  if (size < 0 || size > 11) {
+    return false;
+  }
+  int diff = getBits(size);
+  if (size && diff < (1 << (size - 1))) {
+    diff -= (1 << size) - 1;
+  }
+  component.dcPredictor += diff;
+  coefficients[0] = component.dcPredictor * quant[0];
+
+  const RTSP_JpegHuffman& ac = this->acTables[component.acTable];
+  for (int k = 1; k < 64; ) {
+    int symbol = decodeHuffman(ac);
+    if (symbol < 0) {
+      return false;
+    }
+    int run = symbol >> 4;
+    size = symbol & 0x0F;
+    if (size == 0) {
+      if (run != 15) {
+        break; // EOB
+      }
+      k += 16;
+      continue;
+    }
+    k += run;
+    if (k > 63) {
+      return false;
+    }
+    int value = getBits(size);
+    if (value < (1 << (size - 1))) {
+      value -= (1 << size) - 1;
+    }
+    int position = zigzag[k];
+    if ((position >> 3) < n && (position & 7) < n) {
+      coefficients[position] = value * quant[position];
+    }
+    k++;
+  }
+  return true;
+}
+
+/**
+ * @brief Turns the kept coefficients into a blockSize x blockSize block of pixels.
+ */
+void RTSP_JpegScaler::inverseTransform(const int32_t* coefficients, uint8_t* dst, int stride) {
+  const int n = this->blockSize;
+  if (n == 1) {
+    int32_t dc = coefficients[0];
+    dst[0] = clampPixel(((dc + (dc >= 0 ? 4 : -4)) / 8) + 128);
+    return;
+  }
+  // Rows first, the intermediate drops back to whole units so the columns can't overflow
+  int32_t rows[4][4];
+  for (int v = 0; v < n; v++) {
+    for (int x = 0; x < n; x++) {
+      int32_t sum = 0;
+      for (int u = 0; u < n; u++) {
+        sum += this->idctTable[x][u] * coefficients[v * 8 + u];
+      }
+      rows[v][x] = (sum + 4096) >> 13;
+    }
+  }
+  for (int y = 0; y < n; y++) {
+    for (int x = 0; x < n; x++) {
+      int32_t sum = 0;
+      for (int v = 0; v < n; v++) {
+        sum += this->idctTable[y][v] * rows[v][x];
+      }
+      dst[y * stride + x] = clampPixel(((sum + 4096) >> 13) + 128);
+    }
+  }
+}
+
+void RTSP_JpegScaler::encodeMcuRow(uint16_t mcusAcross) {
+  for (uint16_t mx = 0; mx < mcusAcross; mx++) {
+    for (int c = 0; c < this->componentCount; c++) {
+      RTSP_JpegComponent& component = this->components[c];
+      for (int by = 0; by < component.v; by++) {
+        for (int bx = 0; bx < component.h; bx++) {
+          const uint8_t* src = component.strip + by * 8 * component.stripWidth + (mx * component.h + bx) * 8;
+          encodeBlock(component, src, component.stripWidth, c == 0 ? 0 : 1);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * @brief Forward transforms, quantizes and Huffman codes one 8x8 block of the output.
+ *
+ * @param index 0 for the luminance Huffman tables, 1 for chrominance.
+ */
+void RTSP_JpegScaler::encodeBlock(RTSP_JpegComponent& component, const uint8_t* src, int stride, int index) {
+  const uint16_t* quant = this->quantTables[component.quantTable];
+  int32_t rows[8][8]; // [y][u], Q6
+  for (int y = 0; y < 8; y++) {
+    const uint8_t* line = src + y * stride;
+    for (int u = 0; u < 8; u++) {
+      int32_t sum = 0;
+      for (int x = 0; x < 8; x++) {
+        sum += this->fdctTable[u][x] * (line[x] - 128);
+      }
+      rows[y][u] = (sum + 64) >> 7;
+    }
+  }
+  int32_t quantized[64]; // Zigzag order
+  for (int k = 0; k < 64; k++) {
+    const int v = zigzag[k] >> 3;
+    const int u = zigzag[k] & 7;
+    int32_t sum = 0;
+    for (int y = 0; y < 8; y++) {
+      sum += this->fdctTable[v][y] * rows[y][u];
+    }
+    const int32_t divisor = (int32_t)quant[zigzag[k]] << 19; // Undoes Q13 and Q6
+    int32_t value = sum >= 0 ? (sum + divisor / 2) / divisor : -((-sum + divisor / 2) / divisor);
+    quantized[k] = value > 1023 ? 1023 : (value < -1023 ? -1023 : value); // Largest baseline AC category
+  }
+
+  // DC difference
+  int diff = quantized[0] - component.dcPrevious;
+  component.dcPrevious = quantized[0];
+  int size = bitLength(diff);
+  putBits(encodeCodes[index][size], encodeSizes[index][size]);
+  if (size) {
+    putBits((diff < 0 ? diff - 1 : diff) & ((1 << size) - 1), size);
+  }
+
+  // AC run lengths
+  const uint16_t* acCodes = encodeCodes[2 + index];
+  const uint8_t* acSizes = encodeSizes[2 + index];
+  int run = 0;
+  for (int k = 1; k < 64; k++) {
+    int value = quantized[k];
+    if (value == 0) {
+      run++;
+      continue;
+    }
+    while (run > 15) {
+      putBits(acCodes[0xF0], acSizes[0xF0]); // ZRL
+      run -= 16;
+    }
+    size = bitLength(value);
+    int symbol = (run << 4) | size;
+    putBits(acCodes[symbol], acSizes[symbol]);
+    putBits((value < 0 ? value - 1 : value) & ((1 << size) - 1), size);
+    run = 0;
+  }
+  if (run) {
+    putBits(acCodes[0x00], acSizes[0x00]); // EOB
+  }
+}
+
+/**
+ * @brief Writes SOI, the input's quantization tables, the frame header, the standard Huffman
+ * tables and the scan header.
+ */
+size_t RTSP_JpegScaler::writeHeaders(uint16_t width, uint16_t height) {
+  putByte(0xFF);
+  putByte(0xD8);
+
+  bool written[4] = { false, false, false, false };
+  for (int c = 0; c < this->componentCount; c++) {
+    uint8_t table = this->components[c].quantTable;
+    if (written[table]) {
+      continue;
+    }
+    written[table] = true;
+    putByte(0xFF);
+    putByte(0xDB);
+    putByte(0);
+    putByte(67);
+    putByte(table);
+    for (int k = 0; k < 64; k++) {
+      putByte(this->quantTables[table][zigzag[k]]);
+    }
+  }
+
+  putByte(0xFF);
+  putByte(0xC0);
+  putByte(0);
+  putByte(8 + 3 * this->componentCount);
+  putByte(8);
+  putByte(height >> 8);
+  putByte(height & 0xFF);
+  putByte(width >> 8);
+  putByte(width & 0xFF);
+  putByte(this->componentCount);
+  for (int c = 0; c < this->componentCount; c++) {
+    putByte(this->components[c].id);
+    putByte((this->components[c].h << 4) | this->components[c].v);
+    putByte(this->components[c].quantTable);
+  }
+
+  const uint8_t* bits[4] = { dcLuminanceBits, acLuminanceBits, dcChrominanceBits, acChrominanceBits };
+  const uint8_t* values[4] = { dcValues, acLuminanceValues, dcValues, acChrominanceValues };
+  const uint8_t classes[4] = { 0x00, 0x10, 0x01, 0x11 };
+  const int tableCount = this->componentCount == 1 ? 2 : 4;
+  int dhtLen = 2;
+  for (int t = 0; t < tableCount; t++) {
+    dhtLen += 17;
+    for (int i = 0; i < 16; i++) {
+      dhtLen += bits[t][i];
+    }
+  }
+  putByte(0xFF);
+  putByte(0xC4);
+  putByte(dhtLen >> 8);
+  putByte(dhtLen & 0xFF);
+  for (int t = 0; t < tableCount; t++) {
+    putByte(classes[t]);
+    int total = 0;
+    for (int i = 0; i < 16; i++) {
+      putByte(bits[t][i]);
+      total += bits[t][i];
+    }
+    for (int i = 0; i < total; i++) {
+      putByte(values[t][i]);
+    }
+  }
+
+  putByte(0xFF);
+  putByte(0xDA);
+  putByte(0);
+  putByte(6 + 2 * this->componentCount);
+  putByte(this->componentCount);
+  for (int c = 0; c < this->componentCount; c++) {
+    putByte(this->components[c].id);
+    putByte(c == 0 ? 0x00 : 0x11);
+  }
+  putByte(0);
+  putByte(63);
+  putByte(0);
+  return this->outLen;
+}
+
+void RTSP_JpegScaler::putBits(uint32_t bits, int count) {
+  this->putBuffer = (this->putBuffer << count) | bits;
+  this->putCount += count;
+  while (this->putCount >= 8) {
+    uint8_t byte = (this->putBuffer >> (this->putCount - 8)) & 0xFF;
+    putByte(byte);
+    if (byte == 0xFF) {
+      putByte(0x00); // Stuffing, so data never looks like a marker
+    }
+    this->putCount -= 8;
+  }
+  this->putBuffer &= (1u << this->putCount) - 1;
+}
+
+void RTSP_JpegScaler::flushBits() {
+  if (this->putCount) {
+    int pad = 8 - this->putCount;
+    putBits((1u << pad) - 1, pad); // Pad with ones
+  }
+  this->putBuffer = 0;
+  this->putCount = 0;
+}
+
+void RTSP_JpegScaler::putByte(uint8_t value) {
+  if (this->outLen < this->outSize) {
+    this->out[this->outLen++] = value;
+  } else {
+    this->overflow = true;
+  }
+}
@@ -0,0 +1,108 @@
+#ifndef ESP32_RTSP_JPEG_SCALE_H
+#define ESP32_RTSP_JPEG_SCALE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of Arduino headers so extras/jpegScaleBench can build it on a PC
+
+#define RTSP_JPEG_MAX_COMPONENTS 3
+#define RTSP_JPEG_HUFFMAN_LOOKAHEAD 9 // Codes up to this many bits are decoded with one table lookup
+
+struct RTSP_JpegHuffman {
+  uint16_t lookup[1 << RTSP_JPEG_HUFFMAN_LOOKAHEAD]; // Code length << 8 | symbol, 0 for longer codes
+  int32_t maxCode[18]; // Largest code of each length, -1 if none
+  int32_t valueOffset[17];
+  uint8_t values[256];
+  bool defined;
+};
+
+struct RTSP_JpegComponent {
+  uint8_t id;
+  uint8_t h; // Sampling factors
+  uint8_t v;
+  uint8_t quantTable;
+  uint8_t dcTable;
+  uint8_t acTable;
+  int dcPredictor; // Decoder
+  int dcPrevious; // Encoder
+  uint8_t* strip; // One output MCU row of this component at the scaled size
+  uint16_t stripWidth;
+};
+
+/**
+ * Downscales baseline JPEGs by 1/2, 1/4 or 1/8 without a full decode.
+ *
+ * The entropy coded data is Huffman decoded, but only the low frequency coefficients of each
+ * block are kept and put through a 4x4, 2x2 or DC only IDCT. The small blocks are gathered
+ * into 8x8 blocks of the output, which are forward transformed, quantized with the input's
+ * tables and Huffman coded with the standard tables. There is no colour conversion or chroma
+ * upsampling, the output keeps the input's sampling.
+ */
+class RTSP_JpegScaler {
+public:
+  RTSP_JpegScaler();
+  ~RTSP_JpegScaler();
+
+  bool setScale(uint8_t denominator);
+
+  uint8_t getScale() const { return this->denominator; }
+
+  size_t scale(const uint8_t* jpeg, size_t len, uint16_t& width, uint16_t& height);
+
+  const uint8_t* output() const { return this->out; }
+
+  void release();
+
+private:
+  bool parseHeaders(const uint8_t* jpeg, size_t len, const uint8_t*& scan);
+  bool parseHuffman(const uint8_t* segment, size_t len);
+  bool allocate(size_t jpegLen);
+  bool decodeBlock(RTSP_JpegComponent& component, int32_t* coefficients);
+  void inverseTransform(const int32_t* coefficients, uint8_t* dst, int stride);
+  void encodeMcuRow(uint16_t mcusAcross);
+  void encodeBlock(RTSP_JpegComponent& component, const uint8_t* src, int stride, int index);
+  size_t writeHeaders(uint16_t width, uint16_t height);
+  void fillBits();
+  int getBits(int count);
+  int decodeHuffman(const RTSP_JpegHuffman& table);
+  bool restart();
+  void putBits(uint32_t bits, int count);
+  void flushBits();
+  void putByte(uint8_t value);
+
+  uint8_t denominator;
+  uint8_t blockSize; // Pixels across a scaled block, 8 / denominator
+  int32_t idctTable[4][4]; // Q13 basis for the reduced IDCT, [x][u]
+  int32_t fdctTable[8][8]; // Q13 basis for the forward DCT, [u][x]
+
+  // Input
+  uint16_t width;
+  uint16_t height;
+  uint8_t componentCount;
+  uint8_t maxH;
+  uint8_t maxV;
+  uint16_t restartInterval;
+  uint16_t quantTables[4][64]; // Natural order
+  bool quantDefined[4];
+  RTSP_JpegHuffman dcTables[2];
+  RTSP_JpegHuffman acTables[2];
+  RTSP_JpegComponent components[RTSP_JPEG_MAX_COMPONENTS];
+  const uint8_t* in;
+  const uint8_t* inEnd;
+  uint32_t bitBuffer; // Left aligned
+  int bitCount;
+  bool hitMarker;
+
+  // Output
+  uint8_t* out;
+  size_t outSize;
+  size_t outLen;
+  uint32_t putBuffer;
+  int putCount;
+  bool overflow;
+  uint8_t* strips; // One allocation holds every component's strip
+  size_t stripAllocatedSize;
+};
+
+#endif
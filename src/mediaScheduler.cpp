@@ -0,0 +1,243 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Allocates the queues and starts the media scheduler task.
+ *
+ * Only used with RTSP_MEDIA_SCHEDULER. Without PSRAM for the frame slots the server falls back to
+ * sending from the caller's task.
+ *
+ * @return true if the scheduler is running.
+ */
+bool RTSPServer::startMediaScheduler() {
+  if (this->mediaSchedulerTaskHandle != NULL) {
+    return true;
+  }
+  if (!psramFound()) {
+    RTSP_LOGW(LOG_TAG, "Media scheduler needs PSRAM for queued frames, sending from the caller's task");
+    return false;
+  }
+  if (!mediaQueueInit(this->videoQueue, RTSP_VIDEO_QUEUE_LEN, MAX_RTSP_BUFFER) ||
+      !mediaQueueInit(this->audioQueue, RTSP_AUDIO_QUEUE_LEN, RTSP_AUDIO_SLOT_SIZE) ||
+      !mediaQueueInit(this->subtitlesQueue, RTSP_SUBTITLES_QUEUE_LEN, RTSP_SUBTITLES_SLOT_SIZE)) {
+    RTSP_LOGE(LOG_TAG, "Failed to allocate media scheduler queues");
+    stopMediaScheduler();
+    return false;
+  }
+  if (xTaskCreatePinnedToCore(mediaSchedulerTaskWrapper, "rtpScheduler", RTSP_SCHEDULER_STACK_SIZE, this, RTSP_SCHEDULER_PRI, &this->mediaSchedulerTaskHandle, RTSP_SCHEDULER_CORE) != pdPASS) {
+    RTSP_LOGE(LOG_TAG, "Failed to create media scheduler task");
+    this->mediaSchedulerTaskHandle = NULL;
+    stopMediaScheduler();
+    return false;
+  }
+  RTSP_LOGI(LOG_TAG, "Media scheduler started on core %d", RTSP_SCHEDULER_CORE);
+  return true;
+}
+
+void RTSPServer::stopMediaScheduler() {
+  if (this->mediaSchedulerTaskHandle != NULL) {
+    vTaskDelete(this->mediaSchedulerTaskHandle);
+    this->mediaSchedulerTaskHandle = NULL;
+  }
+  mediaQueueFree(this->videoQueue);
+  mediaQueueFree(this->audioQueue);
+  mediaQueueFree(this->subtitlesQueue);
+}
+
+void RTSPServer::mediaSchedulerTaskWrapper(void* pvParameters) {
+  RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
+  server->mediaSchedulerTask();
+}
+
+/**
+ * @brief Sends everything the producers queued, audio and subtitles ahead of video.
+ *
+ * Frames sent with beginFrame() still go out from the caller's task, so sessions is gone through
+ * under readLockSessions() as without the scheduler. Recordings go out from the playback task,
+ * which only uses its players' sessions, see closePlayback().
+ */
+void RTSPServer::mediaSchedulerTask() {
+  while (true) {
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    bool sent = true;
+    while (sent) {
+      sent = sendPriorityMedia();
+      // Video packetizers call sendPriorityMedia() between packets, so audio never waits for a whole frame
+      RTSP_MediaQueueCell* cell = mediaQueuePeek(this->videoQueue);
+      if (cell != NULL) {
+        sendQueuedVideo(*cell);
+        mediaQueuePop(this->videoQueue);
+        sent = true;
+      }
+    }
+  }
+  vTaskDelete(NULL);
+}
+
+/**
+ * @brief Sends all queued audio and subtitles, called by the scheduler between video packets.
+ *
+ * Does nothing on other tasks, e.g. beginFrame()/appendFrameData() running on the caller's task.
+ *
+ * @return true if anything was sent.
+ */
+bool RTSPServer::sendPriorityMedia() {
+  if (this->mediaSchedulerTaskHandle == NULL || xTaskGetCurrentTaskHandle() != this->mediaSchedulerTaskHandle) {
+    return false;
+  }
+  bool sent = false;
+  RTSP_MediaQueueCell* cell;
+  // Audio blocks are small and gaps are heard, send all that are waiting first
+  while ((cell = mediaQueuePeek(this->audioQueue)) != NULL) {
+    sendAudioToSessions((const int16_t*)cell->data, cell->len, cell->timestampUs);
+    mediaQueuePop(this->audioQueue);
+    sent = true;
+  }
+  while ((cell = mediaQueuePeek(this->subtitlesQueue)) != NULL) {
+    sendSubtitlesToSessions((const char*)cell->data, cell->len, cell->timestampUs);
+    mediaQueuePop(this->subtitlesQueue);
+    sent = true;
+  }
+  return sent;
+}
+
+/**
+ * @brief Copies a frame into the video queue for the scheduler.
+ *
+ * @return false if the queue is full or the frame too large, the frame is then dropped.
+ */
+bool RTSPServer::queueVideoFrame(VideoCodec codec, const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs, FrameType frameType) {
+  RTSP_MediaQueueCell meta = {};
+  meta.timestampUs = timestampUs;
+  meta.codec = codec;
+  meta.frameType = frameType;
+  meta.quality = quality;
+  meta.width = width;
+  meta.height = height;
+  if (len > this->videoQueue.slotSize || !mediaQueuePush(this->videoQueue, data, len, meta)) {
+    RTSP_STAT_ADD(this->videoFramesDropped, 1);
+    return false;
+  }
+  RTSP_PROFILE_MARK(this->videoHandoffCycles);
+  xTaskNotifyGive(this->mediaSchedulerTaskHandle);
+  return true;
+}
+
+void RTSPServer::sendQueuedVideo(const RTSP_MediaQueueCell& cell) {
+  RTSP_PROFILE_END(PROFILE_VIDEO_HANDOFF, this->videoHandoffCycles);
+  if (cell.codec == VIDEO_MJPEG) {
+    sendFrameToSessions(cell.data, cell.len, cell.quality, cell.width, cell.height, cell.timestampUs);
+  } else {
+    sendRTSPAccessUnit((VideoCodec)cell.codec, cell.data, cell.len, cell.timestampUs, (FrameType)cell.frameType);
+  }
+}
+
+/**
+ * @brief Allocates a bounded queue with one data slot per cell.
+ *
+ * Slots are in PSRAM when available, internal RAM stays free for the network stack.
+ *
+ * @param capacity Number of cells, must be a power of 2.
+ * @param slotSize Largest item in bytes.
+ */
+bool RTSPServer::mediaQueueInit(RTSP_MediaQueue& queue, uint32_t capacity, size_t slotSize) {
+  memset(&queue, 0, sizeof(queue));
+  if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+    return false;
+  }
+  queue.cells = (RTSP_MediaQueueCell*)calloc(capacity, sizeof(RTSP_MediaQueueCell));
+  if (!queue.cells) {
+    return false;
+  }
+  queue.capacity = capacity;
+  queue.slotSize = slotSize;
+  for (uint32_t i = 0; i < capacity; i++) {
+    queue.cells[i].sequence = i;
+    queue.cells[i].data = (uint8_t*)(psramFound() ? ps_malloc(slotSize) : malloc(slotSize));
+    if (!queue.cells[i].data) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void RTSPServer::mediaQueueFree(RTSP_MediaQueue& queue) {
+  if (queue.cells) {
+    for (uint32_t i = 0; i < queue.capacity; i++) {
+      free(queue.cells[i].data);
+    }
+    free(queue.cells);
+  }
+  memset(&queue, 0, sizeof(queue));
+}
+
+/**
+ * @brief Copies an item into the queue, safe to call from any number of tasks at once.
+ *
+ * Bounded MPMC ring after Dmitry Vyukov: each cell's sequence says which ring position it is
+ * free for, so a producer claims a position with one compare-and-swap and no locks.
+ *
+ * @param meta Item fields other than the data, copied into the cell.
+ * @return false if the queue is full.
+ */
+bool RTSPServer::mediaQueuePush(RTSP_MediaQueue& queue, const void* data, size_t len, const RTSP_MediaQueueCell& meta) {
+  if (!queue.cells || len > queue.slotSize) {
+    return false;
+  }
+  RTSP_MediaQueueCell* cell;
+  uint32_t pos = __atomic_load_n(&queue.enqueuePos, __ATOMIC_RELAXED);
+  while (true) {
+    cell = &queue.cells[pos & (queue.capacity - 1)];
+    uint32_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    int32_t diff = (int32_t)(sequence - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&queue.enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return false; // Consumer hasn't freed this cell yet
+    } else {
+      pos = __atomic_load_n(&queue.enqueuePos, __ATOMIC_RELAXED);
+    }
+  }
+  memcpy(cell->data, data, len);
+  cell->len = len;
+  cell->timestampUs = meta.timestampUs;
+  cell->codec = meta.codec;
+  cell->frameType = meta.frameType;
+  cell->quality = meta.quality;
+  cell->width = meta.width;
+  cell->height = meta.height;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+/**
+ * @brief Returns the oldest item without removing it, or NULL if the queue is empty.
+ *
+ * Single consumer, only the scheduler task calls this.
+ */
+RTSP_MediaQueueCell* RTSPServer::mediaQueuePeek(RTSP_MediaQueue& queue) {
+  if (!queue.cells) {
+    return NULL;
+  }
+  uint32_t pos = queue.dequeuePos;
+  RTSP_MediaQueueCell* cell = &queue.cells[pos & (queue.capacity - 1)];
+  uint32_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+  return sequence == pos + 1 ? cell : NULL;
+}
+
+/**
+ * @brief Hands the oldest item's cell back to the producers once it has been sent.
+ */
+void RTSPServer::mediaQueuePop(RTSP_MediaQueue& queue) {
+  uint32_t pos = queue.dequeuePos;
+  RTSP_MediaQueueCell* cell = &queue.cells[pos & (queue.capacity - 1)];
+  __atomic_store_n(&cell->sequence, pos + queue.capacity, __ATOMIC_RELEASE);
+  __atomic_store_n(&queue.dequeuePos, pos + 1, __ATOMIC_RELEASE);
+}
+
+bool RTSPServer::mediaQueueHasRoom(const RTSP_MediaQueue& queue) {
+  uint32_t enqueuePos = __atomic_load_n(&queue.enqueuePos, __ATOMIC_RELAXED);
+  uint32_t dequeuePos = __atomic_load_n(&queue.dequeuePos, __ATOMIC_ACQUIRE);
+  return queue.cells && enqueuePos - dequeuePos < queue.capacity;
+}
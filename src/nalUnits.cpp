@@ -0,0 +1,375 @@
+#include "nalUnits.h"
+#include <string.h>
+
+RTSP_NalPacketizer::RTSP_NalPacketizer(size_t maxPayload, uint8_t* aggregate, size_t aggregateSize, RTP_NalPacketSink sink, void* context)
+  : maxPayload(maxPayload), aggregate(aggregate), maxAggregate(aggregateSize < maxPayload ? aggregateSize : maxPayload),
+    sink(sink), context(context) {}
+
+/**
+ * @brief Finds the next Annex-B start code.
+ *
+ * memchr skips runs of non 0x01 bytes a word at a time, only candidates get the zero check.
+ *
+ * @param data Where to start searching.
+ * @param end End of the buffer.
+ * @return Pointer to the first byte after the start code, or end if there is none.
+ */
+const uint8_t* RTSP_NalPacketizer::findStartCode(const uint8_t* data, const uint8_t* end) {
+  if (end - data < 3) {
+    return end;
+  }
+  const uint8_t* p = data + 2;
+  while (p < end) {
+    p = (const uint8_t*)memchr(p, 0x01, end - p);
+    if (p == NULL) {
+      return end;
+    }
+    if (p[-1] == 0 && p[-2] == 0) {
+      return p + 1;
+    }
+    p += 3; // Neither of the next two bytes can end a start code
+  }
+  return end;
+}
+
+/**
+ * @brief Splits an Annex-B buffer into NAL units without copying.
+ *
+ * @param data Annex-B byte stream.
+ * @param len Length of the stream.
+ * @param nals Array to fill with the NAL units found.
+ * @param maxNals Size of the array.
+ * @param truncated Set if there were more NAL units than fit, may be NULL.
+ * @return Number of NAL units found.
+ */
+size_t RTSP_NalPacketizer::splitAnnexB(const uint8_t* data, size_t len, RTP_NalUnit* nals, size_t maxNals, bool* truncated) {
+  const uint8_t* end = data + len;
+  const uint8_t* nal = findStartCode(data, end);
+  size_t count = 0;
+  if (truncated) {
+    *truncated = false;
+  }
+  while (nal < end) {
+    const uint8_t* next = findStartCode(nal, end);
+    // A start code right at the end of the buffer is found as end too
+    bool startCodeAtEnd = end - nal >= 3 && end[-3] == 0 && end[-2] == 0 && end[-1] == 1;
+    const uint8_t* nalEnd = (next < end || startCodeAtEnd) ? next - 3 : end;
+    // Strip the leading zero of a 4 byte start code and any trailing_zero_8bits
+    while (nalEnd > nal && nalEnd[-1] == 0) {
+      nalEnd--;
+    }
+    if (nalEnd > nal) {
+      if (count == maxNals) {
+        if (truncated) {
+          *truncated = true;
+        }
+        break;
+      }
+      nals[count].data = nal;
+      nals[count].len = nalEnd - nal;
+      count++;
+    }
+    nal = next;
+  }
+  return count;
+}
+
+/**
+ * @brief Packetizes one access unit per RFC 6184 (single NAL, STAP-A and FU-A).
+ *
+ * Consecutive SPS/PPS are aggregated into one STAP-A, NAL units over the payload size are
+ * split into FU-A and the marker bit is set on the last packet of the access unit.
+ *
+ * @return false if the sink stopped the access unit.
+ */
+bool RTSP_NalPacketizer::packetizeH264(const RTP_NalUnit* nals, size_t nalCount) {
+  size_t i = 0;
+  while (i < nalCount) {
+    uint8_t type = nals[i].data[0] & 0x1F;
+
+    // STAP-A for runs of parameter sets
+    if ((type == 7 || type == 8) && i + 1 < nalCount && this->aggregate) {
+      uint8_t nextType = nals[i + 1].data[0] & 0x1F;
+      if ((nextType == 7 || nextType == 8) && 1 + 2 + nals[i].len + 2 + nals[i + 1].len <= this->maxAggregate) {
+        uint8_t* stap = this->aggregate;
+        uint8_t nri = 0;
+        size_t stapLen = 1;
+        while (i < nalCount) {
+          uint8_t t = nals[i].data[0] & 0x1F;
+          if ((t != 7 && t != 8) || stapLen + 2 + nals[i].len > this->maxAggregate) {
+            break;
+          }
+          if ((nals[i].data[0] & 0x60) > nri) {
+            nri = nals[i].data[0] & 0x60;
+          }
+          stap[stapLen++] = (nals[i].len >> 8) & 0xFF;
+          stap[stapLen++] = nals[i].len & 0xFF;
+          memcpy(stap + stapLen, nals[i].data, nals[i].len);
+          stapLen += nals[i].len;
+          i++;
+        }
+        stap[0] = nri | 24; // STAP-A
+        if (!this->sink(this->context, stap, stapLen, NULL, 0, i == nalCount)) {
+          return false;
+        }
+        continue;
+      }
+    }
+
+    bool isLastNal = (i + 1 == nalCount);
+    if (nals[i].len <= this->maxPayload) {
+      // Single NAL unit packet
+      if (!this->sink(this->context, NULL, 0, nals[i].data, nals[i].len, isLastNal)) {
+        return false;
+      }
+    } else {
+      // FU-A, the NAL header is carried in the FU indicator and header
+      uint8_t indicator = (nals[i].data[0] & 0xE0) | 28;
+      if (!sendFragmented(&indicator, 1, nals[i], 1, type, isLastNal)) {
+        return false;
+      }
+    }
+    i++;
+  }
+  return true;
+}
+
+/**
+ * @brief Packetizes one access unit per RFC 7798 (single NAL, AP and FU).
+ *
+ * Consecutive VPS/SPS/PPS are aggregated into one AP, NAL units over the payload size are
+ * split into FUs and the marker bit is set on the last packet of the access unit.
+ *
+ * @return false if the sink stopped the access unit.
+ */
+bool RTSP_NalPacketizer::packetizeH265(const RTP_NalUnit* nals, size_t nalCount) {
+  while (nalCount > 0 && nals[nalCount - 1].len < 2) {
+    nalCount--; // Too short for a header and skipped, the marker goes on the unit before
+  }
+  size_t i = 0;
+  while (i < nalCount) {
+    if (nals[i].len < 2) {
+      i++;
+      continue;
+    }
+    uint8_t type = (nals[i].data[0] >> 1) & 0x3F;
+
+    // AP for runs of parameter sets
+    if (type >= 32 && type <= 34 && i + 1 < nalCount && nals[i + 1].len >= 2 && this->aggregate) {
+      uint8_t nextType = (nals[i + 1].data[0] >> 1) & 0x3F;
+      if (nextType >= 32 && nextType <= 34 && 2 + 2 + nals[i].len + 2 + nals[i + 1].len <= this->maxAggregate) {
+        uint8_t* ap = this->aggregate;
+        uint8_t layerId = 0x3F;
+        uint8_t tid = 0x07;
+        size_t apLen = 2;
+        while (i < nalCount && nals[i].len >= 2) {
+          uint8_t t = (nals[i].data[0] >> 1) & 0x3F;
+          if (t < 32 || t > 34 || apLen + 2 + nals[i].len > this->maxAggregate) {
+            break;
+          }
+          // The AP header carries the lowest LayerId and TemporalId of its units
+          uint8_t nalLayerId = ((nals[i].data[0] & 0x01) << 5) | (nals[i].data[1] >> 3);
+          uint8_t nalTid = nals[i].data[1] & 0x07;
+          if (nalLayerId < layerId) {
+            layerId = nalLayerId;
+          }
+          if (nalTid < tid) {
+            tid = nalTid;
+          }
+          ap[apLen++] = (nals[i].len >> 8) & 0xFF;
+          ap[apLen++] = nals[i].len & 0xFF;
+          memcpy(ap + apLen, nals[i].data, nals[i].len);
+          apLen += nals[i].len;
+          i++;
+        }
+        ap[0] = (48 << 1) | (layerId >> 5); // AP
+        ap[1] = ((layerId & 0x1F) << 3) | tid;
+        if (!this->sink(this->context, ap, apLen, NULL, 0, i == nalCount)) {
+          return false;
+        }
+        continue;
+      }
+    }
+
+    bool isLastNal = (i + 1 == nalCount);
+    if (nals[i].len <= this->maxPayload) {
+      // Single NAL unit packet
+      if (!this->sink(this->context, NULL, 0, nals[i].data, nals[i].len, isLastNal)) {
+        return false;
+      }
+    } else {
+      // FU, the payload header keeps F, LayerId and TID with the type replaced
+      uint8_t header[2];
+      header[0] = (nals[i].data[0] & 0x81) | (49 << 1);
+      header[1] = nals[i].data[1];
+      if (!sendFragmented(header, sizeof(header), nals[i], 2, type, isLastNal)) {
+        return false;
+      }
+    }
+    i++;
+  }
+  return true;
+}
+
+/**
+ * @brief Sends a NAL unit as fragmentation units.
+ *
+ * @param header Payload header ahead of the FU header, the FU indicator of H.264 or the two byte
+ *               payload header of H.265.
+ * @param nalHeaderLen Bytes of NAL unit header the payload header replaces.
+ * @param type NAL unit type for the FU header, which also carries the start and end bits.
+ */
+bool RTSP_NalPacketizer::sendFragmented(const uint8_t* header, size_t headerLen, const RTP_NalUnit& nal, size_t nalHeaderLen, uint8_t type, bool isLastNal) {
+  uint8_t fu[3];
+  memcpy(fu, header, headerLen);
+  const uint8_t* payload = nal.data + nalHeaderLen;
+  size_t remaining = nal.len - nalHeaderLen;
+  bool first = true;
+  while (remaining > 0) {
+    size_t fragmentLen = this->maxPayload - (headerLen + 1);
+    if (fragmentLen > remaining) {
+      fragmentLen = remaining;
+    }
+    bool last = (fragmentLen == remaining);
+    fu[headerLen] = type | (first ? 0x80 : 0x00) | (last ? 0x40 : 0x00);
+    if (!this->sink(this->context, fu, headerLen + 1, payload, fragmentLen, last && isLastNal)) {
+      return false;
+    }
+    payload += fragmentLen;
+    remaining -= fragmentLen;
+    first = false;
+  }
+  return true;
+}
+
+RTSP_ParameterSets::RTSP_ParameterSets(bool hevc)
+  : vpsLen(0), spsLen(0), ppsLen(0), hevc(hevc) {}
+
+/**
+ * @brief Finds keyframes and caches the parameter sets of an access unit.
+ *
+ * @param hasParameterSets Set if the access unit carries its own SPS (and VPS for H.265).
+ * @return true if the access unit is an IDR/IRAP picture.
+ */
+bool RTSP_ParameterSets::scan(const RTP_NalUnit* nals, size_t nalCount, bool& hasParameterSets) {
+  bool isKeyframe = false;
+  for (size_t i = 0; i < nalCount; i++) {
+    if (!this->hevc) {
+      uint8_t type = nals[i].data[0] & 0x1F;
+      if (type == 7) {
+        cache(nals[i], this->sps, this->spsLen);
+        hasParameterSets = true;
+      } else if (type == 8) {
+        cache(nals[i], this->pps, this->ppsLen);
+      } else if (type == 5) {
+        isKeyframe = true;
+      }
+    } else if (nals[i].len >= 2) {
+      uint8_t type = (nals[i].data[0] >> 1) & 0x3F;
+      if (type == 32) {
+        cache(nals[i], this->vps, this->vpsLen);
+        hasParameterSets = true;
+      } else if (type == 33) {
+        cache(nals[i], this->sps, this->spsLen);
+      } else if (type == 34) {
+        cache(nals[i], this->pps, this->ppsLen);
+      } else if (type >= 16 && type <= 23) {
+        isKeyframe = true; // IRAP picture
+      }
+    }
+  }
+  return isKeyframe;
+}
+
+/**
+ * @brief Puts the cached parameter sets in front of an access unit's NAL units, without moving them.
+ *
+ * @param nals The access unit, with RTSP_PARAMETER_SET_SLOTS free entries before it.
+ * @return Number of entries filled in before nals, 0 if the parameter sets haven't been seen yet.
+ */
+size_t RTSP_ParameterSets::prepend(RTP_NalUnit* nals) {
+  if (!complete()) {
+    return 0;
+  }
+  nals[-1] = { this->pps, this->ppsLen };
+  nals[-2] = { this->sps, this->spsLen };
+  if (!this->hevc) {
+    return 2;
+  }
+  nals[-3] = { this->vps, this->vpsLen };
+  return 3;
+}
+
+void RTSP_ParameterSets::cache(const RTP_NalUnit& nal, uint8_t* cache, size_t& cacheLen) {
+  if (nal.len > MAX_PARAMETER_SET_SIZE) {
+    return;
+  }
+  if (cacheLen == nal.len && memcmp(cache, nal.data, nal.len) == 0) {
+    return;
+  }
+  memcpy(cache, nal.data, nal.len);
+  cacheLen = nal.len;
+}
+
+RTSP_FrameCache::RTSP_FrameCache()
+  : data(NULL), size(0), used(0), frameCount(0), frameCodec(0), entries{} {}
+
+/**
+ * @brief Gives the cache its buffer, or takes it away with NULL. Cached frames are dropped.
+ */
+void RTSP_FrameCache::setBuffer(uint8_t* buffer, size_t size) {
+  this->data = buffer;
+  this->size = buffer ? size : 0;
+  clear();
+}
+
+/**
+ * @brief Caches a frame that has been sent live.
+ *
+ * @param codec Codec of the frame, a keyframe of another codec restarts the cache like any keyframe.
+ * @return false if the group of pictures outgrew the cache and was dropped.
+ */
+bool RTSP_FrameCache::add(uint8_t codec, const uint8_t* frame, size_t len, bool isKeyframe) {
+  if (isKeyframe) {
+    clear();
+    this->frameCodec = codec;
+  } else if (this->frameCount == 0) {
+    return true; // No keyframe to build on
+  }
+  if (this->data == NULL) {
+    return true;
+  }
+  if (this->frameCount == MAX_CACHED_FRAMES || this->used + len > this->size) {
+    clear();
+    return false;
+  }
+  memcpy(this->data + this->used, frame, len);
+  this->entries[this->frameCount].offset = this->used;
+  this->entries[this->frameCount].len = len;
+  this->frameCount++;
+  this->used += len;
+  return true;
+}
+
+void RTSP_FrameCache::clear() {
+  this->frameCount = 0;
+  this->used = 0;
+}
+
+/**
+ * @brief Gets a cached frame, the keyframe is index 0.
+ */
+const uint8_t* RTSP_FrameCache::frame(size_t index, size_t& len) const {
+  len = this->entries[index].len;
+  return this->data + this->entries[index].offset;
+}
+
+/**
+ * @brief RTP timestamp to replay a cached frame with.
+ *
+ * The cached frames are rebased to end FRAME_CACHE_REPLAY_STEP before the live frame they are
+ * replayed ahead of, so the player decodes the backlog at once instead of treating it as late.
+ */
+uint32_t RTSP_FrameCache::replayTimestamp(size_t index, uint32_t liveTimestamp) const {
+  return liveTimestamp - (uint32_t)(this->frameCount - index) * FRAME_CACHE_REPLAY_STEP;
+}
@@ -0,0 +1,128 @@
+#ifndef ESP32_RTSP_NAL_UNITS_H
+#define ESP32_RTSP_NAL_UNITS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Kept free of Arduino headers so extras/h264Host, extras/h265Host and extras/frameCacheHost can
+// build it on a PC.
+
+#define MAX_PARAMETER_SET_SIZE 128 // Largest SPS/PPS cached for the SDP
+#define MAX_CACHED_FRAMES 64 // Frames kept from the last keyframe for new sessions
+#define FRAME_CACHE_REPLAY_STEP 90 // RTP ticks between replayed frames (1ms)
+#define RTSP_PARAMETER_SET_SLOTS 3 // NAL unit entries prepend() needs free ahead of an access unit, VPS, SPS and PPS
+
+struct RTP_NalUnit {
+  const uint8_t* data;
+  size_t len;
+};
+
+/**
+ * Takes each RTP packet the packetizer makes: a payload header it built (FU indicator and header,
+ * or a whole aggregation packet) followed by NAL unit data sent from where it lies, either may be
+ * empty. Returning false stops the access unit.
+ */
+typedef bool (*RTP_NalPacketSink)(void* context, const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker);
+
+/**
+ * Splits Annex-B access units into NAL units and packetizes them for RTP.
+ *
+ * H.264 follows RFC 6184 in non-interleaved mode: single NAL unit packets, STAP-A for runs of
+ * parameter sets and FU-A for NAL units larger than a packet. The marker bit is set on the last
+ * packet of the access unit. H.265 follows RFC 7798 without DONL: single NAL unit packets, APs
+ * for parameter sets and FUs. Nothing is copied except aggregates, which are built in the buffer
+ * given to the constructor.
+ */
+class RTSP_NalPacketizer {
+public:
+  RTSP_NalPacketizer(size_t maxPayload, uint8_t* aggregate, size_t aggregateSize, RTP_NalPacketSink sink, void* context);
+
+  bool packetizeH264(const RTP_NalUnit* nals, size_t nalCount);
+
+  bool packetizeH265(const RTP_NalUnit* nals, size_t nalCount);
+
+  static const uint8_t* findStartCode(const uint8_t* data, const uint8_t* end);
+
+  static size_t splitAnnexB(const uint8_t* data, size_t len, RTP_NalUnit* nals, size_t maxNals, bool* truncated = NULL);
+
+private:
+  bool sendFragmented(const uint8_t* header, size_t headerLen, const RTP_NalUnit& nal, size_t nalHeaderLen, uint8_t type, bool isLastNal);
+
+  size_t maxPayload;
+  uint8_t* aggregate; // Scratch buffer aggregation packets are built in, NULL sends parameter sets singly
+  size_t maxAggregate;
+  RTP_NalPacketSink sink;
+  void* context;
+};
+
+/**
+ * The latest parameter sets of an H.264 or H.265 stream.
+ *
+ * They are advertised in the SDP and put in front of keyframes that come without them, so a
+ * decoder that joins at such a keyframe can start. Parameter sets over MAX_PARAMETER_SET_SIZE
+ * aren't cached.
+ */
+class RTSP_ParameterSets {
+public:
+  explicit RTSP_ParameterSets(bool hevc);
+
+  bool scan(const RTP_NalUnit* nals, size_t nalCount, bool& hasParameterSets);
+
+  size_t prepend(RTP_NalUnit* nals);
+
+  bool complete() const { return this->spsLen && this->ppsLen && (this->vpsLen || !this->hevc); }
+
+  uint8_t vps[MAX_PARAMETER_SET_SIZE]; // H.265 only
+  size_t vpsLen;
+  uint8_t sps[MAX_PARAMETER_SET_SIZE];
+  size_t spsLen;
+  uint8_t pps[MAX_PARAMETER_SET_SIZE];
+  size_t ppsLen;
+
+private:
+  static void cache(const RTP_NalUnit& nal, uint8_t* cache, size_t& cacheLen);
+
+  bool hevc;
+};
+
+/**
+ * Keeps the last keyframe and the frames since it, for sessions that start playing between keyframes.
+ *
+ * A keyframe restarts the cache. If the group of pictures outgrows the buffer or MAX_CACHED_FRAMES
+ * it is dropped, and nothing is cached until the next keyframe. The buffer is the caller's.
+ */
+class RTSP_FrameCache {
+public:
+  RTSP_FrameCache();
+
+  void setBuffer(uint8_t* buffer, size_t size);
+
+  uint8_t* buffer() const { return this->data; }
+
+  bool add(uint8_t codec, const uint8_t* frame, size_t len, bool isKeyframe);
+
+  void clear();
+
+  size_t count() const { return this->frameCount; }
+
+  uint8_t codec() const { return this->frameCodec; }
+
+  const uint8_t* frame(size_t index, size_t& len) const;
+
+  uint32_t replayTimestamp(size_t index, uint32_t liveTimestamp) const;
+
+private:
+  struct Entry {
+    size_t offset;
+    size_t len;
+  };
+
+  uint8_t* data;
+  size_t size;
+  size_t used;
+  size_t frameCount;
+  uint8_t frameCodec;
+  Entry entries[MAX_CACHED_FRAMES];
+};
+
+#endif
@@ -1,6 +1,6 @@
 #include "ESP32-RTSPServer.h"
 
-void RTSPServer::checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtpPort, IPAddress rtpIp) {
+void RTSPServer::checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtpPort, uint8_t dscp, IPAddress rtpIp) {
   if (rtpSocket == -1) {
     rtpSocket = socket(AF_INET, SOCK_DGRAM, 0);
     if (rtpSocket < 0) {
@@ -16,6 +16,7 @@ void RTSPServer::checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtp
     memset(&rtpAddr, 0, sizeof(rtpAddr));
     rtpAddr.sin_family = AF_INET;
     rtpAddr.sin_port = htons(rtpPort);
+    applySocketOptions(rtpSocket, dscp, isMulticast);
     if (isMulticast) {
       inet_aton(rtpIp.toString().c_str(), &rtpAddr.sin_addr);
       setsockopt(rtpSocket, IPPROTO_IP, IP_MULTICAST_TTL, &this->rtpTTL, sizeof(this->rtpTTL));
@@ -29,38 +30,344 @@ void RTSPServer::checkAndSetupUDP(int& rtpSocket, bool isMulticast, uint16_t rtp
   }
 }
 
-void RTSPServer::sendTcpPacket(const uint8_t* packet, size_t packetSize, int sock) {
-  if (xSemaphoreTake(sendTcpMutex, portMAX_DELAY) == pdTRUE) {
-    ssize_t sent = 0;
-    while (sent < packetSize) {
-      ssize_t result = send(sock, packet + sent, packetSize - sent, 0);
+/**
+ * @brief Sends an interleaved packet on the RTSP connection.
+ *
+ * The payload is sent straight from the caller's buffer, so TCP packets can be far larger than
+ * a packet buffer.
+ *
+ * @param header Packet headers starting with the 4 byte interleaved header.
+ * @param headerSize Size of the headers.
+ * @param payload Payload following the headers, may be NULL.
+ * @param payloadLen Length of the payload.
+ * @param priority true for audio, subtitles and their RTCP, see writeTcpVectors().
+ * @return true if the whole packet was sent.
+ */
+bool RTSPServer::sendTcpPacket(const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen, int sock, bool priority, RTSP_StreamStats* stats) {
+  struct iovec iov[2];
+  iov[0].iov_base = (void*)header;
+  iov[0].iov_len = headerSize;
+  iov[1].iov_base = (void*)payload;
+  iov[1].iov_len = payload ? payloadLen : 0;
+  return writeTcpVectors(sock, iov, 2, priority, stats);
+}
+
+/**
+ * @brief Reads a given number of bytes from a client's RTSP connection.
+ *
+ * The socket is non-blocking, a packet split across TCP segments is waited for, for at most
+ * RTSP_INTERLEAVED_TIMEOUT_MS between segments.
+ *
+ * @return false if the connection closed, failed or stalled, it is then out of step.
+ */
+bool RTSPServer::recvFully(int sock, uint8_t* buffer, size_t len) {
+  size_t received = 0;
+  while (received < len) {
+    int ret = recv(sock, buffer + received, len - received, 0);
+    if (ret > 0) {
+      received += ret;
+      continue;
+    }
+    if (ret == 0 || (errno != EWOULDBLOCK && errno != EAGAIN)) {
+      return false;
+    }
+    fd_set read_fds;
+    FD_ZERO(&read_fds);
+    FD_SET(sock, &read_fds);
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = RTSP_INTERLEAVED_TIMEOUT_MS * 1000;
+    if (select(sock + 1, &read_fds, NULL, NULL, &timeout) <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Reads len bytes from a client's RTSP connection, those read past its last request first.
+ *
+ * A tunnel's kept bytes belong to its POST connection and are left alone.
+ *
+ * @return false if the connection broke off first.
+ */
+bool RTSPServer::recvSession(RTSP_Session& session, uint8_t* buffer, size_t len) {
+  size_t kept = session.isTunnel ? 0 : session.pendingLen;
+  if (kept > len) {
+    kept = len;
+  }
+  memcpy(buffer, session.pending, kept);
+  session.pendingLen -= kept;
+  memmove(session.pending, session.pending + kept, session.pendingLen);
+  return kept == len || recvFully(session.sock, buffer + kept, len - kept);
+}
+
+/**
+ * @brief Writes whole packets to the RTSP connection with as few writev calls as the socket allows.
+ *
+ * Audio and subtitle packets go ahead of video, see lockTcpSend(), so audio is held up by at
+ * most one video write whatever the frame size.
+ *
+ * A recording's connection is only written by the playback task, so its writes don't take
+ * sendTcpMutex. A playback client that stops reading then holds up only its own player, for at
+ * most RTSP_PLAYBACK_WRITE_TIMEOUT_MS per write, and never the live sessions.
+ *
+ * @param iov Buffers to write in order, changed to track partial writes.
+ * @param priority true for audio, subtitles and their RTCP.
+ * @return true if everything was written.
+ */
+bool RTSPServer::writeTcpVectors(int sock, struct iovec* iov, int iovCount, bool priority, RTSP_StreamStats* stats) {
+  bool success = false;
+  RTSP_PROFILE_START(sendStart);
+  // The playback task gives up on a client that stops reading, rather than keeping a player busy
+  bool capped = this->playbackTaskHandle != NULL && xTaskGetCurrentTaskHandle() == this->playbackTaskHandle;
+  int64_t deadline = capped ? esp_timer_get_time() + RTSP_PLAYBACK_WRITE_TIMEOUT_MS * 1000LL : 0;
+  if (!capped) {
+    lockTcpSend(priority);
+  }
+  {
+    bool stalled = false;
+    success = true;
+    while (iovCount > 0) {
+      ssize_t result = writev(sock, iov, iovCount);
       if (result < 0) {
         int err = errno;
         if (err == EAGAIN || err == EWOULDBLOCK) {
+          stalled = true;
           fd_set write_fds;
           FD_ZERO(&write_fds);
           FD_SET(sock, &write_fds);
-          //struct timeval tv = { .tv_sec = 0, .tv_usec = 100000 }; // 100ms
-          int ret = select(sock + 1, NULL, &write_fds, NULL, NULL);
+          struct timeval timeout;
+          int64_t remaining = capped ? deadline - esp_timer_get_time() : 0;
+          if (capped && remaining <= 0) {
+            RTSP_LOGW(LOG_TAG, "Playback client stopped reading, packet dropped");
+            success = false;
+            break;
+          }
+          timeout.tv_sec = remaining / 1000000;
+          timeout.tv_usec = remaining % 1000000;
+          RTSP_PROFILE_START(blockedStart);
+          int ret = select(sock + 1, NULL, &write_fds, NULL, capped ? &timeout : NULL);
+          RTSP_PROFILE_END(PROFILE_TCP_BLOCKED, blockedStart);
           if (ret <= 0) {
             RTSP_LOGE(LOG_TAG, "Failed to send TCP packet, select timeout or error");
+            success = false;
             break;
           }
           continue;
         } else if (err != EPIPE && err != ECONNRESET && err != ENOTCONN && err != EBADF) {
           RTSP_LOGE(LOG_TAG, "Failed to send TCP packet, errno: %d", err);
-          break;
-        } else {
-          break;
         }
-      } else {
-        sent += result;
+        success = false;
+        break;
+      }
+      // Skip what was written, the socket can stop part way through any buffer
+      size_t written = result;
+      while (iovCount > 0 && written >= iov->iov_len) {
+        written -= iov->iov_len;
+        iov++;
+        iovCount--;
+      }
+      if (iovCount > 0) {
+        iov->iov_base = (uint8_t*)iov->iov_base + written;
+        iov->iov_len -= written;
       }
     }
-    xSemaphoreGive(sendTcpMutex);
+    if (!capped) {
+      unlockTcpSend(priority);
+    }
+    if (stats && stalled) {
+      RTSP_STAT_ADD(stats->tcpStalls, 1);
+    }
+  }
+  RTSP_PROFILE_END(PROFILE_TCP_SEND, sendStart);
+  return success;
+}
+
+/**
+ * @brief Takes sendTcpMutex, with audio and subtitle packets ahead of video.
+ *
+ * Priority writers count themselves in tcpPriorityWaiting before they wait for the mutex. Video
+ * checks the count once it holds the mutex, and while it is non-zero lets the mutex go and sleeps
+ * on tcpPriorityIdle until the last priority writer wakes it in unlockTcpSend(). The count only
+ * drops under the mutex, so video can't miss the wake up.
+ *
+ * @param priority true for audio, subtitles and their RTCP.
+ */
+void RTSPServer::lockTcpSend(bool priority) {
+  if (priority) {
+    RTSP_STAT_ADD(this->tcpPriorityWaiting, 1);
+  }
+  xSemaphoreTake(this->sendTcpMutex, portMAX_DELAY);
+  while (!priority && RTSP_STAT_GET(this->tcpPriorityWaiting) > 0) {
+    this->tcpVideoWaiting++;
+    xSemaphoreGive(this->sendTcpMutex);
+    xSemaphoreTake(this->tcpPriorityIdle, portMAX_DELAY);
+    xSemaphoreTake(this->sendTcpMutex, portMAX_DELAY);
+  }
+}
+
+/**
+ * @brief Gives sendTcpMutex back, waking the video writers once no priority packet is left.
+ */
+void RTSPServer::unlockTcpSend(bool priority) {
+  if (priority && RTSP_STAT_ADD(this->tcpPriorityWaiting, (uint32_t)-1) == 1) {
+    for (; this->tcpVideoWaiting > 0; this->tcpVideoWaiting--) {
+      xSemaphoreGive(this->tcpPriorityIdle);
+    }
+  }
+  xSemaphoreGive(this->sendTcpMutex);
+}
+
+/**
+ * @brief Starts gathering a frame's video packets to one TCP client.
+ *
+ * @param batch Batch to set up, usually on the caller's stack.
+ * @return The batch, or NULL if no packet buffer was free for the headers and packets go out one by one.
+ */
+RTSP_TcpBatch* RTSPServer::beginTcpBatch(RTSP_TcpBatch& batch, int sock, RTSP_StreamStats* stats) {
+  batch.headers = allocPacket();
+  if (batch.headers == NULL) {
+    return NULL;
+  }
+  batch.headersLen = 0;
+  batch.iovCount = 0;
+  batch.packets = 0;
+  batch.bytes = 0;
+  batch.sock = sock;
+  batch.stats = stats;
+  return &batch;
+}
+
+/**
+ * @brief Adds one packet to a batch, writing the batch first or after if it is full.
+ *
+ * The headers are copied, the payload must stay in place until the batch is flushed.
+ *
+ * @return false if writing the batch failed.
+ */
+bool RTSPServer::addTcpBatch(RTSP_TcpBatch& batch, const uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen) {
+  if (batch.headersLen + headerSize > RTSP_PACKET_BUFFER_SIZE && !flushTcpBatch(batch)) {
+    return false;
+  }
+  memcpy(batch.headers + batch.headersLen, header, headerSize);
+  batch.iov[batch.iovCount].iov_base = batch.headers + batch.headersLen;
+  batch.iov[batch.iovCount].iov_len = headerSize;
+  batch.iovCount++;
+  batch.headersLen += headerSize;
+  if (payload && payloadLen) {
+    batch.iov[batch.iovCount].iov_base = (void*)payload;
+    batch.iov[batch.iovCount].iov_len = payloadLen;
+    batch.iovCount++;
+  }
+  batch.packets++;
+  batch.bytes += headerSize + payloadLen;
+  if (batch.packets == RTSP_TCP_BATCH_PACKETS || batch.bytes >= RTSP_TCP_BATCH_BYTES) {
+    return flushTcpBatch(batch);
+  }
+  return true;
+}
+
+/**
+ * @brief Writes the gathered packets with one writev.
+ *
+ * @return false if the connection failed, the packets are then counted as one send error.
+ */
+bool RTSPServer::flushTcpBatch(RTSP_TcpBatch& batch) {
+  if (batch.packets == 0) {
+    return true;
+  }
+  bool sent = writeTcpVectors(batch.sock, batch.iov, batch.iovCount, false, batch.stats);
+  if (batch.stats) {
+    if (sent) {
+      RTSP_STAT_ADD(batch.stats->packetsSent, batch.packets);
+      RTSP_STAT_ADD(batch.stats->bytesSent, batch.bytes);
+    } else {
+      RTSP_STAT_ADD(batch.stats->sendErrors, 1);
+    }
+  }
+  batch.headersLen = 0;
+  batch.iovCount = 0;
+  batch.packets = 0;
+  batch.bytes = 0;
+  return sent;
+}
+
+/**
+ * @brief Writes what is left of a batch at the end of a frame and frees its header buffer.
+ *
+ * @param batch Batch from beginTcpBatch(), NULL is ignored.
+ */
+void RTSPServer::endTcpBatch(RTSP_TcpBatch* batch) {
+  if (batch == NULL) {
+    return;
+  }
+  flushTcpBatch(*batch);
+  freePacket(batch->headers);
+  batch->headers = NULL;
+}
+
+/**
+ * @brief Sends an RTP or RTCP packet interleaved on the RTSP connection or as a UDP datagram.
+ * 
+ * @param header Packet buffer from allocPacket() starting with the 4 byte interleaved header, which is skipped for UDP.
+ * @param headerSize Size of the headers including the interleaved header.
+ * @param payload Payload following the headers, may be NULL. Sent from where it is on TCP, copied
+ *                after the headers for UDP, so UDP payloads must fit the packet buffer.
+ * @param payloadLen Length of the payload.
+ * @param sock The client's RTSP socket.
+ * @param udpSocket Socket to send UDP datagrams from.
+ * @param sendPort Destination UDP port.
+ * @param priority true for audio, subtitles and their RTCP, they go ahead of video on TCP.
+ * @param stats Counters to update, may be NULL.
+ * @param batch TCP batch from beginTcpBatch() to add the packet to, NULL to send it now.
+ * @return false if the client's address could not be found, the packet was too large or a batch
+ *         failed to write, other send errors are only counted.
+ */
+bool RTSPServer::sendRtpPacket(uint8_t* header, size_t headerSize, const uint8_t* payload, size_t payloadLen, int sock, int udpSocket, uint16_t sendPort, bool useTCP, bool isMulticast, bool priority, RTSP_StreamStats* stats, RTSP_TcpBatch* batch) {
+  bool sent;
+  size_t packetSize = headerSize + payloadLen;
+  if (useTCP && batch) {
+    // Counted when the batch is written
+    return addTcpBatch(*batch, header, headerSize, payload, payloadLen);
+  } else if (useTCP) {
+    sent = sendTcpPacket(header, headerSize, payload, payloadLen, sock, priority, stats);
   } else {
-    RTSP_LOGE(LOG_TAG, "Failed to acquire mutex");
+    if (packetSize > RTSP_PACKET_BUFFER_SIZE) {
+      RTSP_LOGE(LOG_TAG, "UDP packet of %d bytes larger than the packet buffer", (int)packetSize);
+      return false;
+    }
+    if (payloadLen) {
+      memcpy(header + headerSize, payload, payloadLen);
+    }
+
+    struct sockaddr_in client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    client_addr.sin_family = AF_INET;
+    // Determine IP address based on whether it's multicast or unicast
+    if (isMulticast) {
+      inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
+    } else {
+      socklen_t addrLen = sizeof(client_addr);
+      if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
+        RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
+        return false;
+      }
+    }
+    client_addr.sin_port = htons(sendPort);
+
+    packetSize -= 4;
+    sent = sendto(udpSocket, header + 4, packetSize, 0, (struct sockaddr*)&client_addr, sizeof(client_addr)) == (ssize_t)packetSize;
   }
+  if (stats) {
+    if (sent) {
+      RTSP_STAT_ADD(stats->packetsSent, 1);
+      RTSP_STAT_ADD(stats->bytesSent, packetSize);
+    } else {
+      RTSP_STAT_ADD(stats->sendErrors, 1);
+    }
+  }
+  return true;
 }
 
 bool RTSPServer::setNonBlocking(int sock) { 
@@ -76,3 +383,193 @@ bool RTSPServer::setNonBlocking(int sock) {
   RTSP_LOGI(LOG_TAG, "Socket set to non-blocking mode");
   return true;
 }
+
+/**
+ * @brief Sets the IP MTU that UDP packets are sized for, e.g. lower it for clients behind a VPN.
+ *
+ * Applies to multicast and to UDP sessions set up afterwards. A client can ask for smaller packets
+ * still with the RTSP Blocksize header.
+ *
+ * @param mtu MTU in bytes, RTSP_MIN_MTU to RTSP_DEFAULT_MTU.
+ */
+void RTSPServer::setMTU(uint16_t mtu) {
+  if (mtu < RTSP_MIN_MTU) {
+    mtu = RTSP_MIN_MTU;
+  } else if (mtu > RTSP_DEFAULT_MTU) {
+    mtu = RTSP_DEFAULT_MTU;
+  }
+  this->mtu = mtu;
+  this->udpVideoPayloadSize = mtu - (RTSP_DEFAULT_MTU - MAX_VIDEO_FRAGMENT_SIZE);
+  this->udpAudioPayloadSize = (mtu - (RTSP_DEFAULT_MTU - MAX_AUDIO_FRAGMENT_SIZE)) & ~1; // Whole samples
+  RTSP_LOGI(LOG_TAG, "MTU set to %d, %d byte video payloads", mtu, this->udpVideoPayloadSize);
+}
+
+/**
+ * @brief Sets the video payload size for TCP sessions set up afterwards.
+ *
+ * TCP isn't limited by the MTU, so larger packets cut the RTP headers and send calls per frame.
+ * Audio waits for at most one video packet on the connection, so very large sizes add audio latency.
+ *
+ * @param size Bytes per packet, up to RTSP_MAX_TCP_FRAGMENT_SIZE.
+ */
+void RTSPServer::setTcpFragmentSize(uint16_t size) {
+  if (size < MAX_VIDEO_FRAGMENT_SIZE) {
+    size = MAX_VIDEO_FRAGMENT_SIZE;
+  } else if (size > RTSP_MAX_TCP_FRAGMENT_SIZE) {
+    size = RTSP_MAX_TCP_FRAGMENT_SIZE;
+  }
+  this->tcpFragmentSize = size;
+}
+
+/**
+ * @brief Picks the packet sizes for a session from its transport, set up by SETUP.
+ *
+ * TCP sessions get tcpFragmentSize video packets, audio stays within one packet buffer as it is
+ * converted into it. UDP sessions get the MTU sized payloads, or the client's Blocksize if smaller.
+ *
+ * @param session The session being set up.
+ * @param blocksize Payload size requested with the Blocksize header, 0 if none.
+ */
+void RTSPServer::setSessionPayloadSizes(RTSP_Session& session, uint32_t blocksize) {
+  if (session.isTCP) {
+    session.videoPayloadSize = this->tcpFragmentSize;
+    session.audioPayloadSize = (RTSP_PACKET_BUFFER_SIZE - 4 - 12) & ~1;
+    return;
+  }
+  session.videoPayloadSize = this->udpVideoPayloadSize;
+  session.audioPayloadSize = this->udpAudioPayloadSize;
+  if (blocksize != 0 && !session.isMulticast) {
+    // The multicast stream is shared, so only unicast sessions follow the client
+    const uint32_t minBlocksize = RTSP_MIN_MTU - (RTSP_DEFAULT_MTU - MAX_VIDEO_FRAGMENT_SIZE);
+    if (blocksize < minBlocksize) {
+      blocksize = minBlocksize;
+    }
+    if (blocksize < session.videoPayloadSize) {
+      session.videoPayloadSize = blocksize;
+    }
+    if (blocksize < session.audioPayloadSize) {
+      session.audioPayloadSize = blocksize & ~1;
+    }
+  }
+}
+
+/**
+ * @brief Sets socket buffer sizes, QoS marking and the multicast interface.
+ *
+ * Applies to sockets created afterwards, call before init(). With WMM access points, marking audio
+ * RTSP_DSCP_EF and video RTSP_DSCP_AF41 puts them in the voice and video access categories.
+ *
+ * @param options The options, see RTSP_SocketOptions.
+ * @return false if a value is out of range, the options are then left unchanged.
+ */
+bool RTSPServer::setSocketOptions(const RTSP_SocketOptions& options) {
+  if (options.videoDscp > 63 || options.audioDscp > 63 || options.subtitlesDscp > 63 || options.rtspDscp > 63) {
+    RTSP_LOGE(LOG_TAG, "DSCP values must be 0 to 63");
+    return false;
+  }
+  if (options.sendBufferSize < 0 || options.sendBufferSize > 65535) {
+    RTSP_LOGE(LOG_TAG, "Send buffer size must be 0 to 65535");
+    return false;
+  }
+  this->socketOptions = options;
+  return true;
+}
+
+/**
+ * @brief Reports the options as the network stack applied them, read back from the open sockets.
+ *
+ * Options the stack doesn't support read back as 0, e.g. SO_SNDBUF when lwIP is built without it.
+ * Streams without an open socket report 0 too.
+ *
+ * @param effective Filled with the effective values.
+ */
+void RTSPServer::getSocketOptions(RTSP_SocketOptions& effective) {
+  effective.sendBufferSize = 0;
+  effective.videoDscp = 0;
+  effective.audioDscp = 0;
+  effective.subtitlesDscp = 0;
+  effective.rtspDscp = 0;
+  effective.multicastInterface = IPAddress();
+  effective.multicastLoop = false;
+
+  int tos;
+  socklen_t len = sizeof(tos);
+  if (this->rtspSocket >= 0) {
+    int sendBufferSize;
+    len = sizeof(sendBufferSize);
+    if (getsockopt(this->rtspSocket, SOL_SOCKET, SO_SNDBUF, &sendBufferSize, &len) == 0) {
+      effective.sendBufferSize = sendBufferSize;
+    }
+    len = sizeof(tos);
+    if (getsockopt(this->rtspSocket, IPPROTO_IP, IP_TOS, &tos, &len) == 0) {
+      effective.rtspDscp = tos >> 2;
+    }
+  }
+  const int videoSocket = this->videoUnicastSocket >= 0 ? this->videoUnicastSocket : this->videoMulticastSocket;
+  const int audioSocket = this->audioUnicastSocket >= 0 ? this->audioUnicastSocket : this->audioMulticastSocket;
+  const int subtitlesSocket = this->subtitlesUnicastSocket >= 0 ? this->subtitlesUnicastSocket : this->subtitlesMulticastSocket;
+  len = sizeof(tos);
+  if (videoSocket >= 0 && getsockopt(videoSocket, IPPROTO_IP, IP_TOS, &tos, &len) == 0) {
+    effective.videoDscp = tos >> 2;
+  }
+  len = sizeof(tos);
+  if (audioSocket >= 0 && getsockopt(audioSocket, IPPROTO_IP, IP_TOS, &tos, &len) == 0) {
+    effective.audioDscp = tos >> 2;
+  }
+  len = sizeof(tos);
+  if (subtitlesSocket >= 0 && getsockopt(subtitlesSocket, IPPROTO_IP, IP_TOS, &tos, &len) == 0) {
+    effective.subtitlesDscp = tos >> 2;
+  }
+
+  const int multicastSocket = this->videoMulticastSocket >= 0 ? this->videoMulticastSocket :
+                              (this->audioMulticastSocket >= 0 ? this->audioMulticastSocket : this->subtitlesMulticastSocket);
+  if (multicastSocket >= 0) {
+    struct in_addr interfaceAddr;
+    len = sizeof(interfaceAddr);
+    if (getsockopt(multicastSocket, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr, &len) == 0) {
+      effective.multicastInterface = IPAddress(interfaceAddr.s_addr);
+    }
+    uint8_t loop = 0;
+    len = sizeof(loop);
+    if (getsockopt(multicastSocket, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, &len) == 0) {
+      effective.multicastLoop = loop != 0;
+    }
+  }
+}
+
+/**
+ * @brief Applies the socket options to a newly created socket.
+ *
+ * Failures are logged and otherwise ignored, getSocketOptions() shows what took effect.
+ *
+ * @param sock The socket.
+ * @param dscp DSCP of the traffic it carries, RTSP_DSCP_DEFAULT leaves the TOS alone.
+ * @param isMulticast Also set the multicast interface and loopback.
+ */
+void RTSPServer::applySocketOptions(int sock, uint8_t dscp, bool isMulticast) {
+  const RTSP_SocketOptions& options = this->socketOptions;
+  if (options.sendBufferSize > 0) {
+    if (setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &options.sendBufferSize, sizeof(options.sendBufferSize)) < 0) {
+      RTSP_LOGW(LOG_TAG, "SO_SNDBUF not supported, errno: %d", errno);
+    }
+  }
+  if (dscp != RTSP_DSCP_DEFAULT) {
+    int tos = dscp << 2; // DSCP is the top 6 bits of the TOS byte
+    if (setsockopt(sock, IPPROTO_IP, IP_TOS, &tos, sizeof(tos)) < 0) {
+      RTSP_LOGW(LOG_TAG, "Failed to set IP_TOS, errno: %d", errno);
+    }
+  }
+  if (isMulticast) {
+    if (options.multicastInterface != IPAddress()) {
+      struct in_addr interfaceAddr;
+      interfaceAddr.s_addr = (uint32_t)options.multicastInterface;
+      if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, &interfaceAddr, sizeof(interfaceAddr)) < 0) {
+        RTSP_LOGW(LOG_TAG, "Failed to set IP_MULTICAST_IF, errno: %d", errno);
+      }
+    }
+    uint8_t loop = options.multicastLoop ? 1 : 0;
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+      RTSP_LOGW(LOG_TAG, "Failed to set IP_MULTICAST_LOOP, errno: %d", errno);
+    }
+  }
+}
@@ -0,0 +1,103 @@
+#include "ESP32-RTSPServer.h"
+#include <esp_heap_caps.h>
+
+#define PACKET_POOL_EMPTY 0xFFFF
+
+static_assert(RTSP_PACKET_BUFFER_SIZE % RTSP_CACHE_LINE_SIZE == 0, "RTSP_PACKET_BUFFER_SIZE must be a multiple of RTSP_CACHE_LINE_SIZE");
+static_assert(RTSP_PACKET_POOL_SIZE < PACKET_POOL_EMPTY, "RTSP_PACKET_POOL_SIZE too large");
+static_assert(4 + 20 + MAX_VIDEO_FRAGMENT_SIZE <= RTSP_PACKET_BUFFER_SIZE, "Video packets don't fit RTSP_PACKET_BUFFER_SIZE");
+static_assert(4 + 12 + MAX_AUDIO_FRAGMENT_SIZE <= RTSP_PACKET_BUFFER_SIZE, "Audio packets don't fit RTSP_PACKET_BUFFER_SIZE");
+
+/**
+ * @brief Allocates the packet buffers every RTP and RTCP packet is built in.
+ *
+ * One cache line aligned block in internal RAM, so building a packet never touches the heap or the
+ * task's stack. Falls back to PSRAM if internal RAM is short.
+ *
+ * @return true if the pool is ready.
+ */
+bool RTSPServer::packetPoolInit() {
+  RTSP_PacketPool& pool = this->packetPool;
+  if (pool.buffers != NULL) {
+    return true;
+  }
+  size_t size = (size_t)RTSP_PACKET_POOL_SIZE * RTSP_PACKET_BUFFER_SIZE;
+  pool.buffers = (uint8_t*)heap_caps_aligned_alloc(RTSP_CACHE_LINE_SIZE, size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+  pool.inPsram = false;
+  if (pool.buffers == NULL && psramFound()) {
+    RTSP_LOGW(LOG_TAG, "Not enough internal RAM for packet buffers, using PSRAM");
+    pool.buffers = (uint8_t*)heap_caps_aligned_alloc(RTSP_CACHE_LINE_SIZE, size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    pool.inPsram = true;
+  }
+  if (pool.buffers == NULL) {
+    return false;
+  }
+  for (uint16_t i = 0; i < RTSP_PACKET_POOL_SIZE; i++) {
+    pool.next[i] = (i + 1 < RTSP_PACKET_POOL_SIZE) ? i + 1 : PACKET_POOL_EMPTY;
+  }
+  pool.head = 0;
+  pool.inUse = 0;
+  pool.highWater = 0;
+  pool.exhausted = 0;
+  return true;
+}
+
+void RTSPServer::packetPoolFree() {
+  if (this->packetPool.buffers) {
+    heap_caps_free(this->packetPool.buffers);
+  }
+  memset(&this->packetPool, 0, sizeof(this->packetPool));
+}
+
+/**
+ * @brief Takes a buffer of RTSP_PACKET_BUFFER_SIZE bytes from the pool, safe to call from any task.
+ *
+ * Lock free stack of buffer indexes: one compare-and-swap on the head, whose change count stops a
+ * buffer freed and taken again meanwhile from corrupting the list.
+ *
+ * @return The buffer, or NULL if all are in use and the packet should be dropped.
+ */
+uint8_t* RTSPServer::allocPacket() {
+  RTSP_PacketPool& pool = this->packetPool;
+  if (pool.buffers == NULL) {
+    return NULL;
+  }
+  uint32_t head = __atomic_load_n(&pool.head, __ATOMIC_ACQUIRE);
+  uint16_t index;
+  while (true) {
+    index = head & 0xFFFF;
+    if (index == PACKET_POOL_EMPTY) {
+      RTSP_STAT_ADD(pool.exhausted, 1);
+      return NULL;
+    }
+    uint32_t newHead = ((head + 0x10000) & 0xFFFF0000) | __atomic_load_n(&pool.next[index], __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&pool.head, &head, newHead, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+  }
+  uint32_t inUse = RTSP_STAT_ADD(pool.inUse, 1) + 1;
+  uint32_t highWater = RTSP_STAT_GET(pool.highWater);
+  while (inUse > highWater && !__atomic_compare_exchange_n(&pool.highWater, &highWater, inUse, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  return pool.buffers + (size_t)index * RTSP_PACKET_BUFFER_SIZE;
+}
+
+/**
+ * @brief Returns a buffer from allocPacket() to the pool, NULL is ignored.
+ */
+void RTSPServer::freePacket(uint8_t* packet) {
+  RTSP_PacketPool& pool = this->packetPool;
+  if (packet == NULL) {
+    return;
+  }
+  uint16_t index = (packet - pool.buffers) / RTSP_PACKET_BUFFER_SIZE;
+  uint32_t head = __atomic_load_n(&pool.head, __ATOMIC_RELAXED);
+  while (true) {
+    __atomic_store_n(&pool.next[index], (uint16_t)(head & 0xFFFF), __ATOMIC_RELAXED);
+    uint32_t newHead = ((head + 0x10000) & 0xFFFF0000) | index;
+    if (__atomic_compare_exchange_n(&pool.head, &head, newHead, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+  RTSP_STAT_ADD(pool.inUse, (uint32_t)-1);
+}
@@ -0,0 +1,637 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Parses an npt time (RFC 2326 3.6), seconds ("12.5") or hours, minutes and seconds ("0:00:12.5").
+ *
+ * @param text Advanced past the time.
+ * @return Microseconds, -1 if there is no time at text.
+ */
+static int64_t parseNpt(const char*& text) {
+  int64_t seconds = 0;
+  while (true) {
+    int64_t field = 0;
+    int digits = 0;
+    while (*text >= '0' && *text <= '9') {
+      if (digits < 9) {
+        field = field * 10 + (*text - '0');
+      }
+      digits++;
+      text++;
+    }
+    if (digits == 0) {
+      return -1;
+    }
+    seconds = seconds * 60 + field;
+    if (*text != ':') {
+      break;
+    }
+    text++;
+  }
+  int64_t timeUs = seconds * 1000000;
+  if (*text == '.') {
+    text++;
+    for (int64_t place = 100000; *text >= '0' && *text <= '9'; place /= 10, text++) {
+      timeUs += (*text - '0') * place;
+    }
+  }
+  return timeUs;
+}
+
+/**
+ * @brief Formats a time as npt seconds with milliseconds.
+ */
+static void formatNpt(char* out, size_t size, int64_t timeUs) {
+  uint32_t ms = (uint32_t)(timeUs / 1000);
+  snprintf(out, size, "%lu.%03lu", (unsigned long)(ms / 1000), (unsigned long)(ms % 1000));
+}
+
+/**
+ * @brief Estimates the RTP/JPEG Q (RFC 2435) of a JPEG from its luminance quantization table.
+ *
+ * Inverts the IJG scaling of the standard table, as the camera did when it encoded the frame.
+ *
+ * @return 1 to 99, 50 if the JPEG has no 8 bit table 0.
+ */
+static uint8_t estimateJpegQuality(const uint8_t* jpeg, size_t len) {
+  const uint32_t standardSum = 3688; // Sum of the standard luminance table, which is quality 50
+  size_t at = 2;
+  while (at + 4 <= len && jpeg[at] == 0xFF && jpeg[at + 1] != 0xDA) {
+    size_t segmentLen = (jpeg[at + 2] << 8) | jpeg[at + 3];
+    if (jpeg[at + 1] == 0xDB && segmentLen >= 67 && at + 2 + segmentLen <= len && jpeg[at + 4] == 0) {
+      uint32_t sum = 0;
+      for (int i = 0; i < 64; i++) {
+        sum += jpeg[at + 5 + i];
+      }
+      uint32_t factor = (sum * 100 + standardSum / 2) / standardSum;
+      int quality = factor == 0 ? 99 : factor <= 100 ? (200 - factor) / 2 : 5000 / factor;
+      return quality < 1 ? 1 : quality > 99 ? 99 : quality;
+    }
+    at += 2 + segmentLen;
+  }
+  return 50;
+}
+
+/**
+ * @brief Sets the directory recordings are played from, at rtsp://<ip>/recordings/<file>.
+ *
+ * A client opening a file there gets the AVI played back, with seeking through the Range header of
+ * PLAY and fast forward or slow motion through Scale, next to the live stream. Only files directly
+ * in the directory can be opened, no subdirectories.
+ *
+ * @param directory e.g. "/sdcard", empty or NULL turns playback off.
+ */
+void RTSPServer::setPlaybackDirectory(const char* directory) {
+  if (directory == NULL) {
+    directory = "";
+  }
+  size_t len = strlen(directory);
+  while (len > 1 && directory[len - 1] == '/') {
+    len--;
+  }
+  if (len >= sizeof(this->playbackDirectory)) {
+    RTSP_LOGE(LOG_TAG, "Playback directory too long: %s", directory);
+    return;
+  }
+  memcpy(this->playbackDirectory, directory, len);
+  this->playbackDirectory[len] = 0;
+}
+
+/**
+ * @brief Finds the file name in a request's URL when it is on RTSP_PLAYBACK_MOUNT.
+ *
+ * @return The name, running to the end of the URL, or NULL for the live stream.
+ */
+const char* RTSPServer::findPlaybackName(const char* request) {
+  const char* urlStart = strstr(request, "rtsp://");
+  const char* lineEnd = strstr(request, "\r\n");
+  if (!urlStart || (lineEnd && urlStart > lineEnd)) {
+    return NULL;
+  }
+  const char* pathStart = strchr(urlStart + 7, '/');
+  const size_t mountLen = strlen(RTSP_PLAYBACK_MOUNT);
+  if (!pathStart || (lineEnd && pathStart > lineEnd) ||
+      strncmp(pathStart + 1, RTSP_PLAYBACK_MOUNT, mountLen) != 0 || pathStart[1 + mountLen] != '/') {
+    return NULL;
+  }
+  return pathStart + 2 + mountLen;
+}
+
+/**
+ * @brief Counts the clients playing recordings, they don't count against the client limit.
+ */
+uint8_t RTSPServer::countPlaybacks() {
+  uint8_t count = 0;
+  for (int i = 0; i < RTSP_MAX_PLAYBACKS; i++) {
+    if (this->players[i].session != NULL) {
+      count++;
+    }
+  }
+  return count;
+}
+
+/**
+ * @brief Opens the recording a request's URL names, when it is on RTSP_PLAYBACK_MOUNT.
+ *
+ * A session stays on the file it opened until TEARDOWN. Errors are answered here.
+ *
+ * @return false if the request was answered with an error.
+ */
+bool RTSPServer::openPlayback(const char* request, RTSP_Session& session) {
+  if (session.playback >= 0) {
+    return true;
+  }
+  const char* name = findPlaybackName(request);
+  if (!name) {
+    return true;
+  }
+
+  // No path components, hidden files or ".."
+  size_t nameLen = strcspn(name, "/\\ ?\r\n");
+  int status = 0;
+  int slot = -1;
+  if (this->playbackDirectory[0] == 0 || nameLen == 0 || nameLen >= RTSP_PLAYBACK_NAME_SIZE || name[0] == '.') {
+    status = 404;
+  }
+
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  for (int i = 0; status == 0 && i < RTSP_MAX_PLAYBACKS; i++) {
+    if (this->players[i].session == NULL) {
+      slot = i;
+      break;
+    }
+  }
+  if (status == 0 && slot < 0) {
+    status = 503;
+  }
+  if (status == 0 && this->playbackTaskHandle == NULL &&
+      xTaskCreatePinnedToCore(playbackTaskWrapper, "rtspPlayback", RTSP_PLAYBACK_STACK_SIZE, this, RTSP_PLAYBACK_PRI, &this->playbackTaskHandle, RTSP_PLAYBACK_CORE) != pdPASS) {
+    RTSP_LOGE(LOG_TAG, "Failed to create playback task.");
+    this->playbackTaskHandle = NULL;
+    status = 503;
+  }
+  if (status == 0) {
+    RTSP_Player& player = this->players[slot];
+    char path[RTSP_AVI_PATH_SIZE];
+    snprintf(path, sizeof(path), "%s/%.*s", this->playbackDirectory, (int)nameLen, name);
+    if (player.reader.open(path)) {
+      player.session = &session;
+      memcpy(player.name, name, nameLen);
+      player.name[nameLen] = 0;
+      player.videoSetup = false;
+      player.audioSetup = false;
+      player.isPlaying = false;
+      player.scale = 1000;
+      player.positionUs = 0;
+      player.hasChunk = false;
+      player.videoClockOffset = esp_random();
+      player.audioClockOffset = esp_random();
+      player.lastSRTime = 0;
+    } else {
+      status = 404;
+    }
+  }
+  xSemaphoreGive(this->playbackMutex);
+
+  if (status != 0) {
+    char response[192];
+    int len;
+    if (status == 503) {
+      len = snprintf(response, sizeof(response), "RTSP/1.0 503 Service Unavailable\r\nCSeq: %d\r\n%s\r\nRetry-After: %d\r\n\r\n",
+                     session.cseq, dateHeader(), RTSP_RETRY_AFTER);
+    } else {
+      len = snprintf(response, sizeof(response), "RTSP/1.0 404 Not Found\r\nCSeq: %d\r\n%s\r\n\r\n",
+                     session.cseq, dateHeader());
+    }
+    write(session.sock, response, len);
+    RTSP_LOGW(LOG_TAG, "Can't play %.*s, %d", (int)nameLen, name, status);
+    return false;
+  }
+  session.playback = slot;
+  RTSP_LOGI(LOG_TAG, "Session %lu plays %s", session.sessionID, this->players[slot].name);
+  return true;
+}
+
+/**
+ * @brief Answers DESCRIBE for a recording, with its streams and length.
+ */
+void RTSPServer::describePlayback(const RTSP_Session& session) {
+  RTSP_Player& player = this->players[session.playback];
+  String ip = WiFi.localIP().toString();
+  char duration[16];
+  formatNpt(duration, sizeof(duration), player.reader.durationUs());
+
+  char sdpDescription[512];
+  int sdpLen = snprintf(sdpDescription, sizeof(sdpDescription),
+                        "v=0\r\n"
+                        "o=- %ld 1 IN IP4 %s\r\n"
+                        "s=%s\r\n"
+                        "c=IN IP4 0.0.0.0\r\n"
+                        "t=0 0\r\n"
+                        "a=control:*\r\n"
+                        "a=range:npt=0-%s\r\n",
+                        session.sessionID, ip.c_str(), player.name, duration);
+  if (player.reader.hasVideo()) {
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "m=video 0 RTP/AVP 26\r\n"
+                       "a=control:video\r\n");
+  }
+  if (player.reader.hasAudio()) {
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "m=audio 0 RTP/AVP 97\r\n"
+                       "a=rtpmap:97 L16/%lu/1\r\n"
+                       "a=control:audio\r\n"
+                       "a=sendonly\r\n", player.reader.audioSampleRate());
+  }
+
+  char response[1024];
+  int responseLen = snprintf(response, sizeof(response),
+                             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nContent-Base: rtsp://%s:554/" RTSP_PLAYBACK_MOUNT "/%s/\r\nContent-Type: application/sdp\r\nContent-Length: %d\r\n\r\n"
+                             "%s",
+                             session.cseq, dateHeader(), ip.c_str(), player.name, sdpLen, sdpDescription);
+  write(session.sock, response, responseLen);
+}
+
+/**
+ * @brief Answers SETUP for a recording, noting which of its streams the client takes.
+ *
+ * The live stream's transport rules and client limit don't apply, players are limited by
+ * RTSP_MAX_PLAYBACKS.
+ */
+void RTSPServer::setupPlayback(char* request, RTSP_Session& session) {
+  if (strstr(request, "multicast") != NULL) {
+    char response[128];
+    int len = snprintf(response, sizeof(response), "RTSP/1.0 461 Unsupported Transport\r\nCSeq: %d\r\n%s\r\n\r\n",
+                       session.cseq, dateHeader());
+    write(session.sock, response, len);
+    return;
+  }
+  RTSP_Player& player = this->players[session.playback];
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  if (isSetupFor(request, "video")) {
+    player.videoSetup = player.reader.hasVideo();
+  } else if (isSetupFor(request, "audio")) {
+    player.audioSetup = player.reader.hasAudio();
+  }
+  xSemaphoreGive(this->playbackMutex);
+  handleSetup(request, session);
+}
+
+/**
+ * @brief Answers PLAY for a recording and starts sending it.
+ *
+ * Range picks the part to play, it starts at the keyframe at or before the start. Without a
+ * Range, playing resumes where PAUSE left off. Scale plays faster or slower, up to
+ * RTSP_PLAYBACK_MAX_SCALE times. Audio is only sent at normal speed, and video at most at the
+ * file's frame rate, the frames between are skipped.
+ */
+void RTSPServer::startPlayback(const char* request, RTSP_Session& session) {
+  RTSP_Player& player = this->players[session.playback];
+  int64_t duration = player.reader.durationUs();
+  int64_t startUs = -1; // Resume
+  int64_t endUs = duration;
+  bool rangeValid = true;
+  const char* range = strstr(request, "Range:");
+  if (range) {
+    range += 6;
+    while (*range == ' ') {
+      range++;
+    }
+    if (strncmp(range, "npt=", 4) == 0) {
+      range += 4;
+      if (strncmp(range, "now", 3) == 0) {
+        range += 3;
+      } else {
+        startUs = parseNpt(range);
+      }
+      if (*range == '-') {
+        range++;
+        int64_t rangeEndUs = parseNpt(range);
+        if (rangeEndUs >= 0 && rangeEndUs < endUs) {
+          endUs = rangeEndUs;
+        }
+      }
+      rangeValid = startUs <= duration && (startUs < 0 || startUs < endUs || duration == 0);
+    }
+  }
+
+  uint16_t scale = 1000;
+  const char* scaleHeader = strstr(request, "Scale:");
+  if (scaleHeader) {
+    double value = strtod(scaleHeader + 6, NULL);
+    if (value > 0) { // Reverse play isn't supported, it gets normal speed and the reply says so
+      value = value < 0.1 ? 0.1 : value > RTSP_PLAYBACK_MAX_SCALE ? RTSP_PLAYBACK_MAX_SCALE : value;
+      scale = (uint16_t)(value * 1000 + 0.5);
+    }
+  }
+
+  lockIdlePlayback();
+  int64_t landedUs = 0;
+  bool seeked = rangeValid && player.reader.seek(startUs < 0 ? player.positionUs : startUs, landedUs);
+  if (!seeked) {
+    xSemaphoreGive(this->playbackMutex);
+    char response[128];
+    int len = snprintf(response, sizeof(response), "RTSP/1.0 %s\r\nCSeq: %d\r\n%s\r\n\r\n",
+                       rangeValid ? "500 Internal Server Error" : "457 Invalid Range", session.cseq, dateHeader());
+    write(session.sock, response, len);
+    return;
+  }
+  uint32_t sampleRate = player.reader.audioSampleRate();
+  player.startUs = landedUs;
+  player.endUs = endUs;
+  player.scale = scale;
+  player.positionUs = landedUs;
+  player.wallStartUs = esp_timer_get_time();
+  player.nextFrameUs = 0;
+  player.startSample = (uint32_t)(landedUs * sampleRate / 1000000);
+  player.hasChunk = false;
+  player.isPlaying = true;
+
+  // RTP-Info tells the client which packet and timestamp the new position starts at
+  String ip = WiFi.localIP().toString();
+  char rtpInfo[384];
+  int infoLen = 0;
+  if (player.videoSetup) {
+    infoLen += snprintf(rtpInfo + infoLen, sizeof(rtpInfo) - infoLen, "url=rtsp://%s:554/" RTSP_PLAYBACK_MOUNT "/%s/video;seq=%u;rtptime=%lu",
+                        ip.c_str(), player.name, session.videoSequenceNumber,
+                        mediaClockToRtp(player.wallStartUs, VIDEO_CLOCK_RATE, player.videoClockOffset));
+  }
+  if (player.audioSetup && scale == 1000) {
+    infoLen += snprintf(rtpInfo + infoLen, sizeof(rtpInfo) - infoLen, "%surl=rtsp://%s:554/" RTSP_PLAYBACK_MOUNT "/%s/audio;seq=%u;rtptime=%lu",
+                        infoLen ? "," : "", ip.c_str(), player.name, session.audioSequenceNumber,
+                        mediaClockToRtp(player.wallStartUs, sampleRate, player.audioClockOffset));
+  }
+  xSemaphoreGive(this->playbackMutex);
+
+  char start[16];
+  char end[16];
+  formatNpt(start, sizeof(start), landedUs);
+  formatNpt(end, sizeof(end), endUs);
+  char response[640];
+  int len = snprintf(response, sizeof(response),
+                     "RTSP/1.0 200 OK\r\n"
+                     "CSeq: %d\r\n"
+                     "%s\r\n"
+                     "Range: npt=%s-%s\r\n"
+                     "Scale: %u.%03u\r\n"
+                     "Session: %lu\r\n"
+                     "%s%s%s\r\n",
+                     session.cseq, dateHeader(), start, end, scale / 1000, scale % 1000, session.sessionID,
+                     infoLen ? "RTP-Info: " : "", infoLen ? rtpInfo : "", infoLen ? "\r\n" : "");
+  write(session.sock, response, len);
+  RTSP_LOGD(LOG_TAG, "Session %lu plays %s from %s at scale %u", session.sessionID, player.name, start, scale);
+  xTaskNotifyGive(this->playbackTaskHandle);
+}
+
+/**
+ * @brief Stops sending a recording, PLAY without a Range resumes it.
+ */
+void RTSPServer::pausePlayback(RTSP_Session& session) {
+  if (session.playback < 0) {
+    return;
+  }
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  this->players[session.playback].isPlaying = false;
+  xSemaphoreGive(this->playbackMutex);
+}
+
+/**
+ * @brief Closes a session's recording and frees its player.
+ */
+void RTSPServer::closePlayback(RTSP_Session& session) {
+  if (session.playback < 0) {
+    return;
+  }
+  lockIdlePlayback();
+  RTSP_Player& player = this->players[session.playback];
+  player.isPlaying = false;
+  player.hasChunk = false;
+  player.reader.close();
+  player.session = NULL;
+  xSemaphoreGive(this->playbackMutex);
+  session.playback = -1;
+}
+
+/**
+ * @brief Stops the playback task and closes every recording being played.
+ */
+void RTSPServer::closePlaybacks() {
+  if (this->playbackTaskHandle == NULL) {
+    return;
+  }
+  lockIdlePlayback(); // The task is waiting for the mutex or its next chunk, never part way through a send
+  vTaskDelete(this->playbackTaskHandle);
+  this->playbackTaskHandle = NULL;
+  for (int i = 0; i < RTSP_MAX_PLAYBACKS; i++) {
+    RTSP_Player& player = this->players[i];
+    if (player.session != NULL) {
+      player.session->playback = -1;
+      player.session = NULL;
+    }
+    player.isPlaying = false;
+    player.hasChunk = false;
+    player.reader.close();
+  }
+  xSemaphoreGive(this->playbackMutex);
+}
+
+void RTSPServer::playbackTaskWrapper(void* pvParameters) {
+  RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
+  server->playbackTask();
+}
+
+/**
+ * @brief Sends the recordings being played, each chunk when it is due.
+ *
+ * Runs below the live stream's tasks, so a slow card or a busy player never delays live frames.
+ * Sleeps until the next chunk of any player is due, or until PLAY wakes it.
+ */
+void RTSPServer::playbackTask() {
+  while (true) {
+    int64_t waitUs = -1;
+    xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+    for (int i = 0; i < RTSP_MAX_PLAYBACKS; i++) {
+      RTSP_Player& player = this->players[i];
+      if (player.session == NULL || !player.isPlaying) {
+        continue;
+      }
+      int64_t playerWaitUs = servicePlayer(player);
+      if (player.isPlaying) {
+        sendPlaybackReports(player);
+      }
+      if (playerWaitUs >= 0 && (waitUs < 0 || playerWaitUs < waitUs)) {
+        waitUs = playerWaitUs;
+      }
+    }
+    xSemaphoreGive(this->playbackMutex);
+
+    TickType_t ticks = portMAX_DELAY;
+    if (waitUs >= 0) {
+      ticks = pdMS_TO_TICKS(waitUs / 1000);
+      if (ticks == 0) {
+        ticks = 1;
+      }
+    }
+    ulTaskNotifyTake(pdTRUE, ticks);
+  }
+}
+
+/**
+ * @brief Sends a player's chunks that are due.
+ *
+ * Each chunk is due when its time in the file, scaled, has passed since playing started. Video
+ * frames that are more than RTSP_PLAYBACK_MAX_LATE ms late are skipped to catch up.
+ *
+ * @return Microseconds until the next chunk is due, -1 once the player has stopped.
+ */
+int64_t RTSPServer::servicePlayer(RTSP_Player& player) {
+  int64_t frameInterval = player.reader.frameIntervalUs();
+  while (player.isPlaying) {
+    if (!player.hasChunk) {
+      int result = player.reader.next(player.chunk);
+      if (result <= 0) {
+        if (result < 0) {
+          RTSP_LOGE(LOG_TAG, "Reading %s failed, playback stopped", player.name);
+        }
+        player.isPlaying = false;
+        break;
+      }
+      player.hasChunk = true;
+    }
+    const RTSP_AviChunk& chunk = player.chunk;
+    if (chunk.timeUs >= player.endUs) {
+      player.isPlaying = false;
+      break;
+    }
+    int64_t dueUs = player.wallStartUs + (chunk.timeUs - player.startUs) * 1000 / player.scale;
+    int64_t now = esp_timer_get_time();
+    if (dueUs > now + 1000) {
+      return dueUs - now;
+    }
+
+    bool sendVideo = chunk.isVideo && player.videoSetup && chunk.size && dueUs >= player.nextFrameUs && now - dueUs < RTSP_PLAYBACK_MAX_LATE * 1000LL;
+    bool sendAudio = !chunk.isVideo && player.audioSetup && player.scale == 1000;
+    if (sendVideo || sendAudio) {
+      if (this->playbackWaiters) {
+        return 0; // PLAY or TEARDOWN is waiting for the player, the chunk goes after it
+      }
+      sendPlayerChunk(player, dueUs);
+      if (sendVideo) {
+        player.nextFrameUs = dueUs + frameInterval - frameInterval / 4; // No faster than the file's frame rate
+      }
+    }
+    player.positionUs = chunk.timeUs;
+    player.hasChunk = false;
+  }
+  return -1;
+}
+
+/**
+ * @brief Sends a player's current chunk with playbackMutex let go.
+ *
+ * A client that is slow to read then holds up only the playback task, each TCP write for at most
+ * RTSP_PLAYBACK_WRITE_TIMEOUT_MS. The chunk data and the session stay in place meanwhile, as
+ * seeking and closing wait for playbackSending to clear. Called and returns with the mutex held.
+ */
+void RTSPServer::sendPlayerChunk(RTSP_Player& player, int64_t dueUs) {
+  RTSP_Session& session = *player.session;
+  const RTSP_AviChunk chunk = player.chunk;
+  const int sock = session.sock;
+  const bool isTCP = session.isTCP;
+  RTSP_StreamStats* stats = chunk.isVideo ? &session.videoStats : &session.audioStats;
+  uint16_t port;
+  uint8_t channel;
+  uint16_t payloadSize;
+  uint16_t sequenceNumber;
+  uint32_t timestamp;
+  if (chunk.isVideo) {
+    port = session.cVideoPort;
+    channel = session.videoCh;
+    payloadSize = session.videoPayloadSize;
+    sequenceNumber = session.videoSequenceNumber;
+    timestamp = mediaClockToRtp(dueUs, VIDEO_CLOCK_RATE, player.videoClockOffset);
+  } else {
+    port = session.cAudioPort;
+    channel = session.audioCh;
+    payloadSize = session.audioPayloadSize;
+    sequenceNumber = session.audioSequenceNumber;
+    timestamp = mediaClockToRtp(player.wallStartUs, player.reader.audioSampleRate(), player.audioClockOffset) + (chunk.position - player.startSample);
+  }
+  const uint16_t width = (player.reader.videoWidth() + 7) & ~7;
+  const uint16_t height = (player.reader.videoHeight() + 7) & ~7;
+
+  this->playbackSending = true;
+  xSemaphoreGive(this->playbackMutex);
+  if (chunk.isVideo) {
+    sendRtpFrame(chunk.data, chunk.size, estimateJpegQuality(chunk.data, chunk.size), width, height, timestamp,
+                 sock, port, channel, isTCP, false, payloadSize, sequenceNumber, stats);
+  } else {
+    sendRtpAudio((const int16_t*)chunk.data, chunk.size, timestamp, sock, port, channel, isTCP, false, payloadSize, sequenceNumber, stats);
+  }
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  this->playbackSending = false;
+
+  if (chunk.isVideo) {
+    session.videoSequenceNumber = sequenceNumber;
+  } else {
+    session.audioSequenceNumber = sequenceNumber;
+  }
+}
+
+/**
+ * @brief Takes playbackMutex once playbackTask isn't sending, so a player can be sought or closed.
+ *
+ * The wait is bounded by RTSP_PLAYBACK_WRITE_TIMEOUT_MS per write, and no new send starts while a
+ * caller waits.
+ */
+void RTSPServer::lockIdlePlayback() {
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  if (!this->playbackSending) {
+    return;
+  }
+  this->playbackWaiters++;
+  while (this->playbackSending) {
+    xSemaphoreGive(this->playbackMutex);
+    vTaskDelay(1);
+    xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  }
+  this->playbackWaiters--;
+}
+
+/**
+ * @brief Sends RTCP sender reports for a player's streams every RTCP_SR_INTERVAL.
+ */
+void RTSPServer::sendPlaybackReports(RTSP_Player& player) {
+  uint32_t currentTime = millis();
+  if (currentTime - player.lastSRTime < RTCP_SR_INTERVAL || this->playbackWaiters) {
+    return;
+  }
+  player.lastSRTime = currentTime;
+  RTSP_Session& session = *player.session;
+  const int sock = session.sock;
+  const bool isTCP = session.isTCP;
+  const uint16_t videoPort = session.cVideoPort;
+  const uint16_t audioPort = session.cAudioPort;
+  const uint8_t videoCh = session.videoCh;
+  const uint8_t audioCh = session.audioCh;
+  const bool videoSetup = player.videoSetup;
+  const bool audioSetup = player.audioSetup;
+  const uint32_t sampleRate = player.reader.audioSampleRate();
+  const uint32_t videoClockOffset = player.videoClockOffset;
+  const uint32_t audioClockOffset = player.audioClockOffset;
+
+  // Sent without the mutex like the chunks, see sendPlayerChunk()
+  this->playbackSending = true;
+  xSemaphoreGive(this->playbackMutex);
+  if (videoSetup) {
+    sendRtcpSenderReport(this->videoSSRC, VIDEO_CLOCK_RATE, videoClockOffset,
+                         RTSP_STAT_GET(session.videoStats.rtpPackets), RTSP_STAT_GET(session.videoStats.rtpOctets),
+                         videoCh + 1, sock, this->videoRtcpSocket, videoPort + 1, isTCP, false, &session.videoStats);
+  }
+  if (audioSetup) {
+    sendRtcpSenderReport(this->audioSSRC, sampleRate, audioClockOffset,
+                         RTSP_STAT_GET(session.audioStats.rtpPackets), RTSP_STAT_GET(session.audioStats.rtpOctets),
+                         audioCh + 1, sock, this->audioRtcpSocket, audioPort + 1, isTCP, false, &session.audioStats);
+  }
+  xSemaphoreTake(this->playbackMutex, portMAX_DELAY);
+  this->playbackSending = false;
+}
@@ -0,0 +1,46 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Turns on the downscaled MJPEG stream at rtsp://<ip>/preview.
+ *
+ * Preview sessions get each frame from sendRTSPFrame() at 1/2, 1/4 or 1/8 of its width and
+ * height. The frame is scaled once, the first time a preview session wants it, by Huffman
+ * decoding only the low frequency coefficients and re-coding them, so there is no full decode
+ * or colour conversion. Multicast, beginFrame() frames and H.264/H.265 are sent at full size.
+ *
+ * @param denominator 2, 4 or 8, 0 to turn the preview off.
+ * @return false for any other value.
+ */
+bool RTSPServer::setPreviewScale(uint8_t denominator) {
+  if (denominator == 0) {
+    this->previewScale = 0;
+    return true;
+  }
+  if (denominator == 1 || !this->previewScaler.setScale(denominator)) {
+    RTSP_LOGE(LOG_TAG, "Preview scale must be 2, 4 or 8");
+    return false;
+  }
+  this->previewScale = denominator;
+  return true;
+}
+
+/**
+ * @brief Scales the frame being sent for preview sessions, once per frame.
+ *
+ * @param data The JPEG.
+ * @param len Length of the JPEG.
+ * @param state 0 before the first preview session of the frame, set to 1 once scaled or -1 if it can't be.
+ * @return true if the scaled frame is at previewScaler.output().
+ */
+bool RTSPServer::scalePreview(const uint8_t* data, size_t len, int8_t& state) {
+  if (state == 0) {
+    RTSP_PROFILE_START(scaleStart);
+    this->previewLen = this->previewScaler.scale(data, len, this->previewWidth, this->previewHeight);
+    RTSP_PROFILE_END(PROFILE_PREVIEW_SCALE, scaleStart);
+    state = this->previewLen ? 1 : -1;
+    if (state < 0) {
+      RTSP_LOGW(LOG_TAG, "Frame can't be scaled, preview sessions get it at full size");
+    }
+  }
+  return state > 0;
+}
@@ -0,0 +1,117 @@
+#include "ESP32-RTSPServer.h"
+
+#ifdef RTSP_PROFILING
+
+static const char* profilePointNames[PROFILE_POINT_COUNT] = {
+  "send_frame",
+  "rtp_fragment",
+  "tcp_send",
+  "tcp_blocked",
+  "rtsp_request",
+  "video_handoff",
+  "preview_scale"
+};
+
+/**
+ * @brief Records one duration into the histogram of an instrumentation point.
+ *
+ * Lock free, so it can be called from any task, and passes the duration on to the trace hook if one is set.
+ *
+ * @param point The instrumentation point.
+ * @param cycles Duration in CPU cycles (nanoseconds on host builds).
+ */
+void RTSPServer::recordProfile(RTSP_ProfilePoint point, uint32_t cycles) {
+  RTSP_Histogram& histogram = this->profileHistograms[point];
+  int bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+  RTSP_STAT_ADD(histogram.buckets[bucket], 1);
+  RTSP_STAT_ADD(histogram.count, 1);
+  RTSP_STAT_ADD(histogram.totalCycles, (uint64_t)cycles);
+  uint32_t maxCycles = RTSP_STAT_GET(histogram.maxCycles);
+  while (cycles > maxCycles && !__atomic_compare_exchange_n(&histogram.maxCycles, &maxCycles, cycles, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+  }
+  RTSP_TraceHook hook = this->traceHook;
+  if (hook) {
+    hook(point, cycles);
+  }
+}
+
+/**
+ * @brief Copies the histogram of one instrumentation point.
+ *
+ * @param point The instrumentation point.
+ * @param histogram Filled with the counts recorded since the last resetProfile().
+ */
+void RTSPServer::getProfile(RTSP_ProfilePoint point, RTSP_Histogram& histogram) {
+  const RTSP_Histogram& source = this->profileHistograms[point];
+  histogram.count = RTSP_STAT_GET(source.count);
+  histogram.maxCycles = RTSP_STAT_GET(source.maxCycles);
+  histogram.totalCycles = RTSP_STAT_GET(source.totalCycles);
+  for (int i = 0; i < RTSP_PROFILE_BUCKETS; i++) {
+    histogram.buckets[i] = RTSP_STAT_GET(source.buckets[i]);
+  }
+}
+
+/**
+ * @brief Writes all histograms as text in the same format as formatStats(), with durations in nanoseconds.
+ *
+ * Only buckets up to the largest recorded duration are written.
+ *
+ * @param buffer Output buffer, always null terminated.
+ * @param size Size of the buffer.
+ * @return Number of characters written, output is cut short if the buffer is too small.
+ */
+size_t RTSPServer::formatProfile(char* buffer, size_t size) {
+  if (!buffer || size == 0) {
+    return 0;
+  }
+  uint32_t cyclesPerUs = RTSP_CYCLES_PER_US();
+  size_t len = 0;
+  int written;
+#define RTSP_PROFILE_PRINTF(...) \
+  written = snprintf(buffer + len, size - len, __VA_ARGS__); \
+  if (written < 0 || (size_t)written >= size - len) { return size - 1; } \
+  len += written;
+
+  for (int p = 0; p < PROFILE_POINT_COUNT; p++) {
+    RTSP_Histogram histogram;
+    getProfile((RTSP_ProfilePoint)p, histogram);
+    int lastBucket = 0;
+    for (int i = 0; i < RTSP_PROFILE_BUCKETS; i++) {
+      if (histogram.buckets[i]) {
+        lastBucket = i;
+      }
+    }
+    uint32_t cumulative = 0;
+    for (int i = 0; i <= lastBucket && histogram.count; i++) {
+      cumulative += histogram.buckets[i];
+      uint64_t upperNs = ((1ULL << (i + 1)) * 1000) / cyclesPerUs;
+      RTSP_PROFILE_PRINTF("rtsp_latency_ns_bucket{point=\"%s\",le=\"%llu\"} %u\n", profilePointNames[p], (unsigned long long)upperNs, cumulative);
+    }
+    RTSP_PROFILE_PRINTF("rtsp_latency_ns_bucket{point=\"%s\",le=\"+Inf\"} %u\n", profilePointNames[p], histogram.count);
+    RTSP_PROFILE_PRINTF("rtsp_latency_ns_sum{point=\"%s\"} %llu\n", profilePointNames[p], (unsigned long long)(histogram.totalCycles * 1000 / cyclesPerUs));
+    RTSP_PROFILE_PRINTF("rtsp_latency_ns_count{point=\"%s\"} %u\n", profilePointNames[p], histogram.count);
+    RTSP_PROFILE_PRINTF("rtsp_latency_ns_max{point=\"%s\"} %llu\n", profilePointNames[p], (unsigned long long)histogram.maxCycles * 1000 / cyclesPerUs);
+  }
+#undef RTSP_PROFILE_PRINTF
+  return len;
+}
+
+/**
+ * @brief Clears all histograms.
+ */
+void RTSPServer::resetProfile() {
+  memset(this->profileHistograms, 0, sizeof(this->profileHistograms));
+}
+
+/**
+ * @brief Sets a function called with every recorded duration, e.g. to forward them to a tracer.
+ *
+ * The hook runs on the task being measured and inside the hot path, so it must be quick.
+ *
+ * @param hook Function to call, or NULL to remove it.
+ */
+void RTSPServer::setTraceHook(RTSP_TraceHook hook) {
+  this->traceHook = hook;
+}
+
+#endif // RTSP_PROFILING
@@ -0,0 +1,140 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Starts recording the MJPEG frames and audio given to the server into an AVI file.
+ *
+ * Frames from sendRTSPFrame() and audio from sendRTSPAudio() are copied once into a write-behind
+ * buffer of RTSP_RECORD_BUFFER_SIZE in PSRAM as they go out to the sessions. A task of lower
+ * priority than the sending tasks writes the buffer to the file in large aligned blocks, and
+ * every RTSP_RECORD_FLUSH_MS syncs the file and a sidecar index (path + ".idx"), so a power cut
+ * loses at most that much. If the card falls behind, frames are dropped from the recording
+ * rather than holding up the live stream. H.264/H.265 and beginFrame() frames aren't recorded.
+ *
+ * @param path File on a mounted filesystem, e.g. "/sdcard/clip.avi" after SD_MMC.begin().
+ * @param fps Frame rate of the recording. Frames faster than it are skipped, gaps, e.g. from
+ *            setStaticFrameSuppression(), repeat the last frame.
+ * @return false if already recording or the file can't be created.
+ */
+bool RTSPServer::startRecording(const char* path, uint8_t fps) {
+  if (this->recordTaskHandle != NULL) {
+    RTSP_LOGE(LOG_TAG, "Already recording");
+    return false;
+  }
+  uint32_t audioRate = this->isAudio ? this->sampleRate : 0;
+  if (!this->recorder.open(path, fps, audioRate, RTSP_RECORD_BUFFER_SIZE)) {
+    RTSP_LOGE(LOG_TAG, "Failed to start recording to %s", path);
+    return false;
+  }
+  this->recordStopping = false;
+  this->recordResult = false;
+  if (xTaskCreatePinnedToCore(recordTaskWrapper, "rtspRecord", RTSP_RECORD_STACK_SIZE, this, RTSP_RECORD_PRI, &this->recordTaskHandle, RTSP_RECORD_CORE) != pdPASS) {
+    RTSP_LOGE(LOG_TAG, "Failed to create recording task.");
+    this->recorder.release();
+    this->recordTaskHandle = NULL;
+    return false;
+  }
+  RTSP_LOGI(LOG_TAG, "Recording to %s at %d fps", path, fps);
+  return true;
+}
+
+/**
+ * @brief Stops recording and completes the file, waiting for the last writes.
+ *
+ * @return false if not recording or writing the file failed, its sidecar is then left for repairRecording().
+ */
+bool RTSPServer::stopRecording() {
+  if (this->recordTaskHandle == NULL) {
+    return false;
+  }
+  xSemaphoreTake(this->recordMutex, portMAX_DELAY);
+  this->recordStopping = true;
+  if (this->recordTaskHandle != NULL) {
+    xTaskNotifyGive(this->recordTaskHandle);
+  }
+  xSemaphoreGive(this->recordMutex);
+  while (this->recordTaskHandle != NULL) {
+    vTaskDelay(pdMS_TO_TICKS(10));
+  }
+  return this->recordResult;
+}
+
+/**
+ * @brief Completes a recording that was never stopped, e.g. after a power cut, from its sidecar index.
+ *
+ * @param path The AVI file.
+ * @return false if there is no sidecar or the file can't be written.
+ */
+bool RTSPServer::repairRecording(const char* path) {
+  return RTSP_AviRecorder::repair(path);
+}
+
+/**
+ * @brief Adds a frame being sent to the recording, without waiting for the card.
+ */
+void RTSPServer::recordFrame(const uint8_t* data, size_t len, int width, int height, int64_t timestampUs) {
+  if (this->recordTaskHandle == NULL) {
+    return;
+  }
+  xSemaphoreTake(this->recordMutex, portMAX_DELAY);
+  if (this->recordTaskHandle != NULL && !this->recordStopping &&
+      this->recorder.pushVideo(data, len, width, height, timestampUs) && this->recorder.bytesPending() >= RTSP_AVI_WRITE_SIZE) {
+    xTaskNotifyGive(this->recordTaskHandle);
+  }
+  xSemaphoreGive(this->recordMutex);
+}
+
+/**
+ * @brief Adds an audio block being sent to the recording, without waiting for the card.
+ */
+void RTSPServer::recordAudio(const int16_t* data, size_t len) {
+  if (this->recordTaskHandle == NULL) {
+    return;
+  }
+  xSemaphoreTake(this->recordMutex, portMAX_DELAY);
+  if (this->recordTaskHandle != NULL && !this->recordStopping &&
+      this->recorder.pushAudio(data, len) && this->recorder.bytesPending() >= RTSP_AVI_WRITE_SIZE) {
+    xTaskNotifyGive(this->recordTaskHandle);
+  }
+  xSemaphoreGive(this->recordMutex);
+}
+
+void RTSPServer::recordTaskWrapper(void* pvParameters) {
+  RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
+  server->recordTask();
+}
+
+/**
+ * @brief Writes the recording behind the live stream.
+ *
+ * Woken once a block is ready to write, and at least every RTSP_RECORD_FLUSH_MS to flush.
+ * recordMutex only keeps the producers out of the recorder while it is being closed, the
+ * writes themselves never wait for a producer or make one wait.
+ */
+void RTSPServer::recordTask() {
+  int64_t nextFlushUs = esp_timer_get_time() + RTSP_RECORD_FLUSH_MS * 1000LL;
+  bool ok = true;
+  while (ok && !this->recordStopping) {
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(RTSP_RECORD_FLUSH_MS));
+    int64_t now = esp_timer_get_time();
+    bool flush = now >= nextFlushUs;
+    if (flush) {
+      nextFlushUs = now + RTSP_RECORD_FLUSH_MS * 1000LL;
+    }
+    ok = this->recorder.service(flush);
+  }
+  if (!ok) {
+    RTSP_LOGE(LOG_TAG, "Writing the recording failed, recording stopped");
+  }
+
+  xSemaphoreTake(this->recordMutex, portMAX_DELAY);
+  this->recordStopping = true;
+  xSemaphoreGive(this->recordMutex);
+  bool closed = this->recorder.close();
+  this->recordResult = ok && closed;
+  RTSP_LOGI(LOG_TAG, "Recording stopped, %u frames, %u dropped", this->recorder.framesRecorded(), this->recorder.chunksDropped());
+
+  xSemaphoreTake(this->recordMutex, portMAX_DELAY);
+  this->recordTaskHandle = NULL;
+  xSemaphoreGive(this->recordMutex);
+  vTaskDelete(NULL);
+}
@@ -0,0 +1,126 @@
+#include "ESP32-RTSPServer.h"
+#include "libb64/cencode.h"
+
+/**
+ * @brief Splits an Annex-B buffer into NAL units without copying, see RTSP_NalPacketizer::splitAnnexB().
+ */
+size_t RTSPServer::splitAnnexB(const uint8_t* data, size_t len, RTP_NalUnit* nals, size_t maxNals) {
+  bool truncated;
+  size_t count = RTSP_NalPacketizer::splitAnnexB(data, len, nals, maxNals, &truncated);
+  if (truncated) {
+    RTSP_LOGW(LOG_TAG, "Access unit has more than %d NAL units, rest dropped", maxNals);
+  }
+  return count;
+}
+
+void RTSPServer::sendRTSPH264(const uint8_t* data, size_t len, int64_t timestampUs, FrameType frameType) {
+  if (this->mediaSchedulerTaskHandle) {
+    queueVideoFrame(VIDEO_H264, data, len, 0, 0, 0, timestampUs == 0 ? esp_timer_get_time() : timestampUs, frameType);
+    return;
+  }
+  sendRTSPAccessUnit(VIDEO_H264, data, len, timestampUs, frameType);
+}
+
+/**
+ * @brief Packetizes one access unit per RFC 6184, see RTSP_NalPacketizer::packetizeH264().
+ */
+void RTSPServer::sendRtpH264(const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch) {
+  uint8_t* stap = allocPacket(); // Without a buffer the parameter sets go singly
+  RTSP_VideoTarget target = { this, sock, sendRtpPort, channel, useTCP, isMulticast, &sequenceNumber, stats, batch };
+  RTSP_NalPacketizer packetizer(payloadSize, stap, RTSP_VIDEO_AGGREGATE_SIZE, videoPacketSink, &target);
+  packetizer.packetizeH264(nals, nalCount);
+  freePacket(stap);
+}
+
+/**
+ * @brief Sends a packet made by RTSP_NalPacketizer to the RTSP_VideoTarget given as context.
+ */
+bool RTSPServer::videoPacketSink(void* context, const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker) {
+  RTSP_VideoTarget* target = static_cast<RTSP_VideoTarget*>(context);
+  return target->server->sendRtpVideoPacket(prefix, prefixLen, payload, payloadLen, marker, target->sock, target->port, target->channel, target->useTCP,
+                                            target->isMulticast, *target->sequenceNumber, target->stats, target->batch);
+}
+
+/**
+ * @brief Sends one RTP packet on the video stream with a dynamic payload type.
+ * 
+ * @param prefix Payload header bytes (FU indicator/header or aggregated units), may be NULL.
+ * @param prefixLen Length of the prefix.
+ * @param payload Payload data following the prefix, may be NULL.
+ * @param payloadLen Length of the payload.
+ * @param marker Marker bit, set on the last packet of an access unit.
+ * @return false if the client address could not be resolved.
+ */
+bool RTSPServer::sendRtpVideoPacket(const uint8_t* prefix, size_t prefixLen, const uint8_t* payload, size_t payloadLen, bool marker, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch) {
+  const int RtpHeaderSize = 12;
+  int RtpPacketSize = prefixLen + payloadLen + RtpHeaderSize;
+
+  uint8_t* packet = allocPacket();
+  if (packet == NULL) {
+    return false;
+  }
+
+  // If TCP, we need these first 4 bytes
+  packet[0] = '$'; // Magic number 
+  packet[1] = channel; // Channel number for RTP
+  packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
+  packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
+
+  // RTP header
+  packet[4] = 0x80;
+  packet[5] = RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO | (marker ? 0x80 : 0x00);
+  packet[6] = (sequenceNumber >> 8) & 0xFF;
+  packet[7] = sequenceNumber & 0xFF;
+  packet[8] = (this->videoTimestamp >> 24) & 0xFF;
+  packet[9] = (this->videoTimestamp >> 16) & 0xFF;
+  packet[10] = (this->videoTimestamp >> 8) & 0xFF;
+  packet[11] = this->videoTimestamp & 0xFF;
+  packet[12] = (this->videoSSRC >> 24) & 0xFF;
+  packet[13] = (this->videoSSRC >> 16) & 0xFF;
+  packet[14] = (this->videoSSRC >> 8) & 0xFF;
+  packet[15] = this->videoSSRC & 0xFF;
+
+  int packetOffset = RtpHeaderSize + 4;
+  if (prefixLen) {
+    memcpy(packet + packetOffset, prefix, prefixLen);
+    packetOffset += prefixLen;
+  }
+
+  // Send packet using TCP or UDP, the payload follows the prefix
+  int rtpSocket = isMulticast ? this->videoMulticastSocket : this->videoUnicastSocket;
+  bool sent = sendRtpPacket(packet, packetOffset, payload, payloadLen, sock, rtpSocket, sendRtpPort, useTCP, isMulticast, false, stats, batch);
+  freePacket(packet);
+  if (!sent) {
+    return false;
+  }
+  sequenceNumber++;
+  countRtpPacket(stats, prefixLen + payloadLen);
+  sendPriorityMedia(); // Let queued audio and subtitles out between fragments
+  return true;
+}
+
+/**
+ * @brief Writes the H.264 fmtp attribute for the SDP from the cached parameter sets.
+ * 
+ * @param buffer Buffer to write to.
+ * @param size Size of the buffer.
+ * @return Number of characters written.
+ */
+int RTSPServer::h264Fmtp(char* buffer, size_t size) {
+  int len = snprintf(buffer, size, "a=fmtp:%d packetization-mode=1", RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO);
+  const RTSP_ParameterSets& sets = this->h264ParameterSets;
+  if (sets.spsLen >= 4) {
+    len += snprintf(buffer + len, size - len, ";profile-level-id=%02X%02X%02X", sets.sps[1], sets.sps[2], sets.sps[3]);
+  }
+  if (sets.complete()) {
+    char sps[MAX_PARAMETER_SET_SIZE * 4 / 3 + 4];
+    char pps[MAX_PARAMETER_SET_SIZE * 4 / 3 + 4];
+    int spsLen = base64_encode_chars((const char*)sets.sps, sets.spsLen, sps);
+    sps[spsLen] = '\0';
+    int ppsLen = base64_encode_chars((const char*)sets.pps, sets.ppsLen, pps);
+    pps[ppsLen] = '\0';
+    len += snprintf(buffer + len, size - len, ";sprop-parameter-sets=%s,%s", sps, pps);
+  }
+  len += snprintf(buffer + len, size - len, "\r\n");
+  return len;
+}
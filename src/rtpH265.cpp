@@ -0,0 +1,45 @@
+#include "ESP32-RTSPServer.h"
+#include "libb64/cencode.h"
+
+void RTSPServer::sendRTSPH265(const uint8_t* data, size_t len, int64_t timestampUs, FrameType frameType) {
+  if (this->mediaSchedulerTaskHandle) {
+    queueVideoFrame(VIDEO_H265, data, len, 0, 0, 0, timestampUs == 0 ? esp_timer_get_time() : timestampUs, frameType);
+    return;
+  }
+  sendRTSPAccessUnit(VIDEO_H265, data, len, timestampUs, frameType);
+}
+
+/**
+ * @brief Packetizes one access unit per RFC 7798, see RTSP_NalPacketizer::packetizeH265().
+ */
+void RTSPServer::sendRtpH265(const RTP_NalUnit* nals, size_t nalCount, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch) {
+  uint8_t* ap = allocPacket(); // Without a buffer the parameter sets go singly
+  RTSP_VideoTarget target = { this, sock, sendRtpPort, channel, useTCP, isMulticast, &sequenceNumber, stats, batch };
+  RTSP_NalPacketizer packetizer(payloadSize, ap, RTSP_VIDEO_AGGREGATE_SIZE, videoPacketSink, &target);
+  packetizer.packetizeH265(nals, nalCount);
+  freePacket(ap);
+}
+
+/**
+ * @brief Writes the H.265 fmtp attribute for the SDP from the cached parameter sets.
+ * 
+ * @param buffer Buffer to write to.
+ * @param size Size of the buffer.
+ * @return Number of characters written.
+ */
+int RTSPServer::h265Fmtp(char* buffer, size_t size) {
+  const RTSP_ParameterSets& sets = this->h265ParameterSets;
+  if (!sets.complete()) {
+    return 0; // Parameter sets only come in-band until the first IRAP has been seen
+  }
+  char vps[MAX_PARAMETER_SET_SIZE * 4 / 3 + 4];
+  char sps[MAX_PARAMETER_SET_SIZE * 4 / 3 + 4];
+  char pps[MAX_PARAMETER_SET_SIZE * 4 / 3 + 4];
+  int vpsLen = base64_encode_chars((const char*)sets.vps, sets.vpsLen, vps);
+  vps[vpsLen] = '\0';
+  int spsLen = base64_encode_chars((const char*)sets.sps, sets.spsLen, sps);
+  sps[spsLen] = '\0';
+  int ppsLen = base64_encode_chars((const char*)sets.pps, sets.ppsLen, pps);
+  pps[ppsLen] = '\0';
+  return snprintf(buffer, size, "a=fmtp:%d sprop-vps=%s;sprop-sps=%s;sprop-pps=%s\r\n", RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO, vps, sps, pps);
+}
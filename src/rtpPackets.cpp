@@ -1,4 +1,5 @@
 #include "ESP32-RTSPServer.h"
+#include <sys/time.h>
 
 void RTSPServer::rtpVideoTaskWrapper(void* pvParameters) {
   RTSPServer* server = static_cast<RTSPServer*>(pvParameters);
@@ -8,224 +9,574 @@ void RTSPServer::rtpVideoTaskWrapper(void* pvParameters) {
 void RTSPServer::rtpVideoTask() {
   while (true) {
     ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    RTSP_PROFILE_END(PROFILE_VIDEO_HANDOFF, this->videoHandoffCycles);
+    int64_t sendStart = esp_timer_get_time();
+    uint8_t streams = 0;
     bool multicastSent = false;
-    for (const auto& sessionPair : this->sessions) {
-      const RTSP_Session& session = sessionPair.second; 
+    int8_t previewState = 0;
+    readLockSessions();
+    for (auto& sessionPair : this->sessions) {
+      RTSP_Session& session = sessionPair.second; 
       if (session.isPlaying) {
         if (session.isMulticast) {
           if (!multicastSent) {
-            this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight, session.sock, this->rtpVideoPort, false, true);
+            this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight, this->videoTimestamp, session.sock, this->rtpVideoPort, session.videoCh, false, true, this->udpVideoPayloadSize, this->videoSequenceNumber, &this->multicastVideoStats);
             multicastSent = true;
+            streams++;
           }
-        } else {
-          this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight, session.sock, session.cVideoPort, session.isTCP, false);
+        } else if (sessionWantsFrame(session, this->vTimestampUs)) {
+          if (session.isPreview && this->previewScale && scalePreview(this->rtspStreamBuffer, this->rtspStreamBufferSize, previewState)) {
+            // The JPEG payload header counts 8 pixel units, the scaled JPEG's own header has the exact size
+            this->sendRtpFrame(this->previewScaler.output(), this->previewLen, this->vQuality, (this->previewWidth + 7) & ~7, (this->previewHeight + 7) & ~7, this->videoTimestamp, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+          } else {
+            this->sendRtpFrame(this->rtspStreamBuffer, this->rtspStreamBufferSize, this->vQuality, this->vWidth, this->vHeight, this->videoTimestamp, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+          }
+          streams++;
         }
       }
     }
+    readUnlockSessions();
+    updateVideoCost(this->rtspStreamBufferSize, esp_timer_get_time() - sendStart, streams);
+    this->sendVideoSenderReports();
     this->rtspStreamBufferSize = 0;
     this->rtpFrameSent = true;
   }
   vTaskDelete(NULL);
 }
 
-void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height) {
-  this->rtpFrameSent = false;
-  static uint32_t lastSendTime = millis(); // Track the last time a frame was sent
-  uint32_t currentTime = millis(); // Get the current time in milliseconds
-
-  // Calculate the actual time elapsed since the last frame was sent
-  uint32_t actualElapsedTime = currentTime - lastSendTime;
-  // Increment the timestamp based on the actual elapsed time
-  this->videoTimestamp += (actualElapsedTime * 90000) / 1000;   // Convert milliseconds to 90kHz units
-
-  // Work out the RTP sent FPS to use for subtitles
-  this->rtpFrameCount++; 
-  // Update FPS every second 
-  if (currentTime - this->lastRtpFPSUpdateTime >= 1000) { 
-    this->rtpFps = this->rtpFrameCount; // Store the current FPS 
-    this->rtpFrameCount = 0; // Reset the frame count for the next second 
-    this->lastRtpFPSUpdateTime = currentTime; // Update the last FPS update time 
+void RTSPServer::sendRTSPFrame(const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs) {
+  RTSP_PROFILE_START(frameStart);
+  if (timestampUs == 0) {
+    timestampUs = esp_timer_get_time();
+  }
+  if (suppressStaticFrame(data, len, timestampUs)) {
+    RTSP_PROFILE_END(PROFILE_SEND_FRAME, frameStart);
+    return;
+  }
+  publishHttpFrame(data, len, timestampUs);
+  recordFrame(data, len, width, height, timestampUs);
+  if (this->mediaSchedulerTaskHandle) {
+    queueVideoFrame(VIDEO_MJPEG, data, len, quality, width, height, timestampUs, FRAME_AUTO);
+    RTSP_PROFILE_END(PROFILE_SEND_FRAME, frameStart);
+    return;
   }
 #ifdef RTSP_VIDEO_NONBLOCK
-  this->vQuality = quality;
-  this->vWidth = width;
-  this->vHeight = height;
+  this->rtpFrameSent = false;
+  updateRtpFps();
   if (!this->rtspStreamBufferSize && this->rtspStreamBuffer != NULL) {
+    this->vQuality = quality;
+    this->vWidth = width;
+    this->vHeight = height;
+    this->vTimestampUs = timestampUs;
+    // Only stamp frames that are handed off, the video task may still be sending the previous one
+    this->videoTimestamp = mediaClockToRtp(timestampUs, VIDEO_CLOCK_RATE, this->videoClockOffset);
     memcpy(this->rtspStreamBuffer, data, len);
     this->rtspStreamBufferSize = len;
+    RTSP_STAT_ADD(this->videoFrameCount, 1);
+    RTSP_PROFILE_MARK(this->videoHandoffCycles);
     xTaskNotifyGive(rtpVideoTaskHandle);
+  } else {
+    // Video task is still sending the previous frame
+    RTSP_STAT_ADD(this->videoFramesDropped, 1);
   }
 #else
+  sendFrameToSessions(data, len, quality, width, height, timestampUs);
+#endif
+  RTSP_PROFILE_END(PROFILE_SEND_FRAME, frameStart);
+}
+
+void RTSPServer::sendFrameToSessions(const uint8_t* data, size_t len, int quality, int width, int height, int64_t timestampUs) {
+  this->rtpFrameSent = false;
+  updateRtpFps();
+  this->videoTimestamp = mediaClockToRtp(timestampUs, VIDEO_CLOCK_RATE, this->videoClockOffset);
+  int64_t sendStart = esp_timer_get_time();
+  uint8_t streams = 0;
   bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
+  int8_t previewState = 0;
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second; 
     if (session.isPlaying) {
       if (session.isMulticast) {
         if (!multicastSent) { 
-          sendRtpFrame(data, len, quality, width, height, session.sock, this->rtpVideoPort, false, true); 
+          sendRtpFrame(data, len, quality, width, height, this->videoTimestamp, session.sock, this->rtpVideoPort, session.videoCh, false, true, this->udpVideoPayloadSize, this->videoSequenceNumber, &this->multicastVideoStats); 
           multicastSent = true; 
+          streams++;
         }
-      } else {
-        sendRtpFrame(data, len, quality, width, height, session.sock, session.cVideoPort, session.isTCP, false);
+      } else if (sessionWantsFrame(session, timestampUs)) {
+        if (session.isPreview && this->previewScale && scalePreview(data, len, previewState)) {
+          sendRtpFrame(this->previewScaler.output(), this->previewLen, quality, (this->previewWidth + 7) & ~7, (this->previewHeight + 7) & ~7, this->videoTimestamp, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+        } else {
+          sendRtpFrame(data, len, quality, width, height, this->videoTimestamp, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoPayloadSize, session.videoSequenceNumber, &session.videoStats);
+        }
+        streams++;
       }
     }
   }
+  readUnlockSessions();
+  updateVideoCost(len, esp_timer_get_time() - sendStart, streams);
+  RTSP_STAT_ADD(this->videoFrameCount, 1);
+  sendVideoSenderReports();
   this->rtpFrameSent = true;
-  lastSendTime = currentTime;
-#endif
 }
 
-void RTSPServer::sendRTSPAudio(int16_t* data, size_t len) {
+/**
+ * @brief Starts a frame whose data follows in appendFrameData() calls.
+ *
+ * Static frame suppression, browsers, recording and preview scaling all need the whole frame
+ * before anything is sent, so while any of them is on the frame is refused and should be sent
+ * with sendRTSPFrame() instead.
+ *
+ * @return false if the frame was refused.
+ */
+bool RTSPServer::beginFrame(int quality, int width, int height, int64_t timestampUs) {
+  if (this->sliceActive) {
+    RTSP_LOGW(LOG_TAG, "beginFrame called before endFrame, previous frame dropped");
+    this->sliceActive = false;
+  }
+  bool wholeFrame = this->staticKeepaliveFps || this->httpClientCount || this->recordTaskHandle != NULL;
+  readLockSessions();
+  for (const auto& sessionPair : this->sessions) {
+    if (this->previewScale && sessionPair.second.isPreview && sessionPair.second.isPlaying) {
+      wholeFrame = true;
+    }
+  }
+  if (wholeFrame) {
+    readUnlockSessions();
+    RTSP_LOGD(LOG_TAG, "Frame needs sendRTSPFrame(), beginFrame refused");
+    return false;
+  }
+  this->rtpFrameSent = false;
+  if (timestampUs == 0) {
+    timestampUs = esp_timer_get_time();
+  }
+  updateRtpFps();
+  this->videoTimestamp = mediaClockToRtp(timestampUs, VIDEO_CLOCK_RATE, this->videoClockOffset);
+  this->sliceQuality = quality;
+  this->sliceWidth = width;
+  this->sliceHeight = height;
+  // The fragments are shared by all sessions, so they take the smallest Blocksize a client asked for
+  this->sliceFragmentSize = this->udpVideoPayloadSize;
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second;
+    // Sessions that start playing part way through wait for the next frame
+    session.skipFrame = !session.isPlaying || (!session.isMulticast && !sessionWantsFrame(session, timestampUs));
+    if (!session.skipFrame && session.videoPayloadSize < this->sliceFragmentSize) {
+      this->sliceFragmentSize = session.videoPayloadSize;
+    }
+  }
+  readUnlockSessions();
+  this->sliceOffset = 0;
+  this->sliceLen = 0;
+  this->sliceSendUs = 0;
+  this->sliceStreams = 0;
+  this->sliceActive = true;
+  return true;
+}
+
+void RTSPServer::appendFrameData(const uint8_t* data, size_t len) {
+  if (!this->sliceActive) {
+    RTSP_LOGE(LOG_TAG, "appendFrameData called without beginFrame");
+    return;
+  }
+  const size_t fragmentSize = this->sliceFragmentSize; // At most udpVideoPayloadSize, sliceBuffer holds up to MAX_VIDEO_FRAGMENT_SIZE
+  while (len > 0) {
+    // A full fragment is only sent once more data shows it isn't the last, so endFrame can set the marker
+    if (this->sliceLen >= fragmentSize) {
+      sendFrameFragmentToSessions(this->sliceBuffer, this->sliceLen, false);
+      this->sliceOffset += this->sliceLen;
+      this->sliceLen = 0;
+    }
+    // Send straight from the producer's buffer when a whole fragment is available
+    if (this->sliceLen == 0 && len > fragmentSize) {
+      sendFrameFragmentToSessions(data, fragmentSize, false);
+      this->sliceOffset += fragmentSize;
+      data += fragmentSize;
+      len -= fragmentSize;
+      continue;
+    }
+    size_t copyLen = fragmentSize - this->sliceLen;
+    if (copyLen > len) {
+      copyLen = len;
+    }
+    memcpy(this->sliceBuffer + this->sliceLen, data, copyLen);
+    this->sliceLen += copyLen;
+    data += copyLen;
+    len -= copyLen;
+  }
+}
+
+void RTSPServer::endFrame() {
+  if (!this->sliceActive) {
+    RTSP_LOGE(LOG_TAG, "endFrame called without beginFrame");
+    return;
+  }
+  if (this->sliceLen > 0) {
+    sendFrameFragmentToSessions(this->sliceBuffer, this->sliceLen, true);
+    this->sliceOffset += this->sliceLen;
+    this->sliceLen = 0;
+  }
+  this->sliceActive = false;
+  updateVideoCost(this->sliceOffset, this->sliceSendUs, this->sliceStreams);
+  RTSP_STAT_ADD(this->videoFrameCount, 1);
+  sendVideoSenderReports();
+  this->rtpFrameSent = true;
+}
+
+/**
+ * @brief Sends one fragment of a beginFrame() frame to the sessions playing since it began.
+ *
+ * The time spent sending adds up over the frame, for the cost estimates of admission control.
+ */
+void RTSPServer::sendFrameFragmentToSessions(const uint8_t* fragment, size_t fragmentLen, bool isLastFragment) {
+  int64_t sendStart = esp_timer_get_time();
+  uint8_t streams = 0;
+  bool multicastSent = false;
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second;
+    if (session.isPlaying && !session.skipFrame) {
+      if (session.isMulticast) {
+        if (!multicastSent) {
+          sendRtpFrameFragment(fragment, fragmentLen, this->sliceOffset, isLastFragment, this->sliceQuality, this->sliceWidth, this->sliceHeight, this->videoTimestamp, session.sock, this->rtpVideoPort, session.videoCh, false, true, this->videoSequenceNumber, &this->multicastVideoStats, NULL);
+          multicastSent = true;
+          streams++;
+        }
+      } else {
+        sendRtpFrameFragment(fragment, fragmentLen, this->sliceOffset, isLastFragment, this->sliceQuality, this->sliceWidth, this->sliceHeight, this->videoTimestamp, session.sock, session.cVideoPort, session.videoCh, session.isTCP, false, session.videoSequenceNumber, &session.videoStats, NULL);
+        streams++;
+      }
+    }
+  }
+  readUnlockSessions();
+  this->sliceSendUs += esp_timer_get_time() - sendStart;
+  if (streams > this->sliceStreams) {
+    this->sliceStreams = streams;
+  }
+}
+
+void RTSPServer::updateRtpFps() {
+  uint32_t currentTime = millis(); // Get the current time in milliseconds
+  // Work out the RTP sent FPS to use for subtitles
+  this->rtpFrameCount++; 
+  // Update FPS every second 
+  if (currentTime - this->lastRtpFPSUpdateTime >= 1000) { 
+    this->rtpFps = this->rtpFrameCount; // Store the current FPS 
+    this->rtpFrameCount = 0; // Reset the frame count for the next second 
+    this->lastRtpFPSUpdateTime = currentTime; // Update the last FPS update time 
+  }
+}
+
+/**
+ * @brief Decides whether a session with a frame rate cap gets this frame.
+ *
+ * Frames are picked by capture time, so the cap holds whatever rate the camera runs at. A frame
+ * up to a quarter interval early still counts as due, otherwise jitter would halve a cap that
+ * is close to the camera's rate.
+ *
+ * @param session The session.
+ * @param timestampUs Capture time of the frame on the esp_timer clock.
+ * @return true if the frame should be sent to the session.
+ */
+bool RTSPServer::sessionWantsFrame(RTSP_Session& session, int64_t timestampUs) {
+  if (session.maxFps == 0) {
+    return true;
+  }
+  const int64_t interval = 1000000 / session.maxFps;
+  if (timestampUs < session.nextFrameUs - interval / 4) {
+    return false;
+  }
+  session.nextFrameUs += interval;
+  if (session.nextFrameUs < timestampUs) {
+    session.nextFrameUs = timestampUs + interval; // First frame or far behind, restart the schedule
+  }
+  return true;
+}
+
+/**
+ * @brief Caps the video frame rate sent to one session.
+ *
+ * Clients can ask for a cap themselves with a fps=N query on the URL or a Frame-Rate header.
+ * MJPEG frames are skipped by capture time. H.264/H.265 frames depend on each other, so a capped
+ * session only gets keyframes, at most fps of them per second. Multicast is never capped.
+ *
+ * @param sessionID Session ID as listed by getStats().
+ * @param fps Frames per second, 0 sends every frame.
+ * @return false if there is no such session.
+ */
+bool RTSPServer::setSessionFrameRate(uint32_t sessionID, uint8_t fps) {
+  readLockSessions();
+  auto it = this->sessions.find(sessionID);
+  bool found = it != this->sessions.end();
+  if (found) {
+    it->second.maxFps = fps;
+    it->second.nextFrameUs = 0;
+  }
+  readUnlockSessions();
+  return found;
+}
+
+void RTSPServer::sendRTSPAudio(int16_t* data, size_t len, int64_t timestampUs) {
+  recordAudio(data, len);
+  if (this->mediaSchedulerTaskHandle) {
+    RTSP_MediaQueueCell meta = {};
+    meta.timestampUs = timestampUs;
+    if (len > this->audioQueue.slotSize || !mediaQueuePush(this->audioQueue, data, len, meta)) {
+      RTSP_STAT_ADD(this->audioBlocksDropped, 1);
+      return;
+    }
+    xTaskNotifyGive(this->mediaSchedulerTaskHandle);
+    return;
+  }
+  sendAudioToSessions(data, len, timestampUs);
+}
+
+void RTSPServer::sendAudioToSessions(const int16_t* data, size_t len, int64_t timestampUs) {
   this->rtpAudioSent = false;
+  if (timestampUs != 0) {
+    this->audioTimestamp = mediaClockToRtp(timestampUs, this->sampleRate, this->audioClockOffset);
+    this->audioClockAnchored = true;
+  } else if (!this->audioClockAnchored) {
+    // No capture time given, anchor the sample count to the media clock once
+    this->audioTimestamp = mediaClockToRtp(esp_timer_get_time(), this->sampleRate, this->audioClockOffset);
+    this->audioClockAnchored = true;
+  }
   bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second; 
     if (session.isPlaying) {
       if (session.isMulticast) {
         if (!multicastSent) {
-          this->sendRtpAudio(data, len, session.sock, this->rtpAudioPort, false, true);
+          this->sendRtpAudio(data, len, this->audioTimestamp, session.sock, this->rtpAudioPort, session.audioCh, false, true, this->udpAudioPayloadSize, this->audioSequenceNumber, &this->multicastAudioStats);
           multicastSent = true;
         }
       } else {
-        this->sendRtpAudio(data, len, session.sock, session.cAudioPort, session.isTCP, false);
+        this->sendRtpAudio(data, len, this->audioTimestamp, session.sock, session.cAudioPort, session.audioCh, session.isTCP, false, session.audioPayloadSize, session.audioSequenceNumber, &session.audioStats);
       }
     }
   }
+  readUnlockSessions();
+  this->audioTimestamp += len / 2; // Next block follows on by the number of samples sent
+  RTSP_STAT_ADD(this->audioBlockCount, 1);
+  sendAudioSenderReports();
   this->rtpAudioSent = true;
 }
 
-void RTSPServer::sendRTSPSubtitles(char* data, size_t len) {
+void RTSPServer::sendRTSPSubtitles(char* data, size_t len, int64_t timestampUs) {
+  if (timestampUs == 0) {
+    timestampUs = esp_timer_get_time();
+  }
+  if (this->mediaSchedulerTaskHandle) {
+    RTSP_MediaQueueCell meta = {};
+    meta.timestampUs = timestampUs;
+    if (len > this->subtitlesQueue.slotSize || !mediaQueuePush(this->subtitlesQueue, data, len, meta)) {
+      RTSP_STAT_ADD(this->subtitlesDropped, 1);
+      return;
+    }
+    xTaskNotifyGive(this->mediaSchedulerTaskHandle);
+    return;
+  }
+  sendSubtitlesToSessions(data, len, timestampUs);
+}
+
+void RTSPServer::sendSubtitlesToSessions(const char* data, size_t len, int64_t timestampUs) {
   this->rtpSubtitlesSent = false;
+  this->subtitlesTimestamp = mediaClockToRtp(timestampUs, SUBTITLES_CLOCK_RATE, this->subtitlesClockOffset);
   bool multicastSent = false;
-  for (const auto& sessionPair : this->sessions) {
-    const RTSP_Session& session = sessionPair.second; 
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second; 
     if (session.isPlaying) {
       if (session.isMulticast) {
           if (!multicastSent) {
-            this->sendRtpSubtitles(data, len, session.sock, this->rtpSubtitlesPort, false, true);
+            this->sendRtpSubtitles(data, len, this->subtitlesTimestamp, session.sock, this->rtpSubtitlesPort, session.subtitlesCh, false, true, this->subtitlesSequenceNumber, &this->multicastSubtitlesStats);
             multicastSent = true;
         }
       } else {
-        this->sendRtpSubtitles(data, len, session.sock, session.cSrtPort, session.isTCP, false);
+        this->sendRtpSubtitles(data, len, this->subtitlesTimestamp, session.sock, session.cSrtPort, session.subtitlesCh, session.isTCP, false, session.subtitlesSequenceNumber, &session.subtitlesStats);
       }
     }
   }
+  readUnlockSessions();
+  RTSP_STAT_ADD(this->subtitlesCount, 1);
+  sendSubtitlesSenderReports();
   this->rtpSubtitlesSent = true;
 }
 
-void RTSPServer::sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
-  const int RtpHeaderSize = 20;
-  const int MAX_FRAGMENT_SIZE = 1438;
+void RTSPServer::sendVideoSenderReports() {
+  sendSenderReports(this->lastVideoSRTime, this->videoSSRC, VIDEO_CLOCK_RATE, this->videoClockOffset, &RTSP_Session::videoCh,
+                    this->videoMulticastSocket, this->videoRtcpSocket, this->rtpVideoPort, &RTSP_Session::cVideoPort,
+                    &this->multicastVideoStats, &RTSP_Session::videoStats);
+}
+
+void RTSPServer::sendAudioSenderReports() {
+  sendSenderReports(this->lastAudioSRTime, this->audioSSRC, this->sampleRate, this->audioClockOffset, &RTSP_Session::audioCh,
+                    this->audioMulticastSocket, this->audioRtcpSocket, this->rtpAudioPort, &RTSP_Session::cAudioPort,
+                    &this->multicastAudioStats, &RTSP_Session::audioStats);
+}
+
+void RTSPServer::sendSubtitlesSenderReports() {
+  sendSenderReports(this->lastSubtitlesSRTime, this->subtitlesSSRC, SUBTITLES_CLOCK_RATE, this->subtitlesClockOffset, &RTSP_Session::subtitlesCh,
+                    this->subtitlesMulticastSocket, this->subtitlesRtcpSocket, this->rtpSubtitlesPort, &RTSP_Session::cSrtPort,
+                    &this->multicastSubtitlesStats, &RTSP_Session::subtitlesStats);
+}
+
+/**
+ * @brief Sends a stream's RTCP sender report to every playing session, every RTCP_SR_INTERVAL.
+ *
+ * The multicast group gets one report, from the multicast socket. Each receiver is told what was
+ * sent to it, multicast receivers what went to the group.
+ *
+ * @param lastSRTime millis() of the stream's last reports, updated.
+ * @param channel The session's interleaved RTP channel for the stream, RTCP goes on the next one.
+ * @param multicastSocket The stream's multicast RTP socket, receivers listen on port + 1 so it can carry the report.
+ * @param rtcpSocket The stream's unicast RTCP socket.
+ * @param multicastPort The stream's multicast RTP port.
+ * @param clientPort The session's client RTP port for the stream.
+ * @param multicastStats Counters of the multicast stream.
+ * @param sessionStats The session's counters for the stream.
+ */
+void RTSPServer::sendSenderReports(uint32_t& lastSRTime, uint32_t ssrc, uint32_t clockRate, uint32_t clockOffset, uint8_t RTSP_Session::* channel,
+                                   int multicastSocket, int rtcpSocket, uint16_t multicastPort, uint16_t RTSP_Session::* clientPort,
+                                   RTSP_StreamStats* multicastStats, RTSP_StreamStats RTSP_Session::* sessionStats) {
+  uint32_t currentTime = millis();
+  if (currentTime - lastSRTime < RTCP_SR_INTERVAL) {
+    return;
+  }
+  lastSRTime = currentTime;
+  bool multicastSent = false;
+  readLockSessions();
+  for (auto& sessionPair : this->sessions) {
+    RTSP_Session& session = sessionPair.second;
+    if (!session.isPlaying || (session.isMulticast && multicastSent)) {
+      continue;
+    }
+    RTSP_StreamStats* stats = session.isMulticast ? multicastStats : &(session.*sessionStats);
+    sendRtcpSenderReport(ssrc, clockRate, clockOffset, RTSP_STAT_GET(stats->rtpPackets), RTSP_STAT_GET(stats->rtpOctets),
+                         session.*channel + 1, session.sock, session.isMulticast ? multicastSocket : rtcpSocket,
+                         (session.isMulticast ? multicastPort : session.*clientPort) + 1, session.isTCP, session.isMulticast, stats);
+    multicastSent |= session.isMulticast;
+  }
+  readUnlockSessions();
+}
+
+void RTSPServer::sendRtpFrame(const uint8_t* data, size_t len, uint8_t quality, uint16_t width, uint16_t height, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats) {
   uint32_t jpegLen = len;
 
+  // TCP fragments are gathered and written together, the last ones when the frame is done
+  RTSP_TcpBatch batch;
+  RTSP_TcpBatch* tcpBatch = useTCP ? beginTcpBatch(batch, sock, stats) : NULL;
+
   size_t fragmentOffset = 0;
   while (fragmentOffset < jpegLen) {
-    int fragmentLen = MAX_FRAGMENT_SIZE;
+    int fragmentLen = payloadSize;
     if (fragmentLen + fragmentOffset > jpegLen) {
       fragmentLen = jpegLen - fragmentOffset;
     }
 
     bool isLastFragment = (fragmentOffset + fragmentLen) == jpegLen;
-    int RtpPacketSize = fragmentLen + RtpHeaderSize;
-
-    uint8_t packet[2048];
-    memset(packet, 0x00, sizeof(packet));
-
-    // If TCP, we need these first 4 bytes
-    packet[0] = '$'; // Magic number 
-    packet[1] = this->videoCh; // Channel number for RTP (0 for video)
-    packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
-    packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
-    
-    // RTP header
-    packet[4] = 0x80;
-    packet[5] = 0x1a | (isLastFragment ? 0x80 : 0x00);
-    packet[6] = (this->videoSequenceNumber >> 8) & 0xFF;
-    packet[7] = this->videoSequenceNumber & 0xFF;
-    packet[8] = (this->videoTimestamp >> 24) & 0xFF;
-    packet[9] = (this->videoTimestamp >> 16) & 0xFF;
-    packet[10] = (this->videoTimestamp >> 8) & 0xFF;
-    packet[11] = this->videoTimestamp & 0xFF;
-    packet[12] = (this->videoSSRC >> 24) & 0xFF;
-    packet[13] = (this->videoSSRC >> 16) & 0xFF;
-    packet[14] = (this->videoSSRC >> 8) & 0xFF;
-    packet[15] = this->videoSSRC & 0xFF;
-
-    // JPEG RTP header
-    packet[16] = 0x00;
-    packet[17] = (fragmentOffset >> 16) & 0xFF;
-    packet[18] = (fragmentOffset >> 8) & 0xFF;
-    packet[19] = fragmentOffset & 0xFF;
-    packet[20] = 0x00;
-    packet[21] = quality;
-    packet[22] = width / 8;
-    packet[23] = height / 8;
-
-    int packetOffset = 24;
-
-    // Copy JPEG data to the packet
-    memcpy(packet + packetOffset, data + fragmentOffset, fragmentLen);
-    packetOffset += fragmentLen;
+    RTSP_PROFILE_START(fragmentStart);
+    bool fragmentSent = sendRtpFrameFragment(data + fragmentOffset, fragmentLen, fragmentOffset, isLastFragment, quality, width, height, timestamp, sock, sendRtpPort, channel, useTCP, isMulticast, sequenceNumber, stats, tcpBatch);
+    RTSP_PROFILE_END(PROFILE_RTP_FRAGMENT, fragmentStart);
+    if (!fragmentSent) {
+      break;
+    }
+    fragmentOffset += fragmentLen;
+    sendPriorityMedia(); // Let queued audio and subtitles out between fragments
+  }
+  endTcpBatch(tcpBatch);
+}
 
-    // Send packet using TCP or UDP
-    if (useTCP) {
-      sendTcpPacket(packet, packetOffset, sock);
-    } else {
-      struct sockaddr_in client_addr;
-      memset(&client_addr, 0, sizeof(client_addr));
-      client_addr.sin_family = AF_INET;
-      // Determine IP address based on whether it's multicast or unicast
-      if (isMulticast) {
-        inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-      } else {
-        socklen_t addrLen = sizeof(client_addr);
-        if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-          RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-          return;
-        }
-      }
-      client_addr.sin_port = htons(sendRtpPort);
+bool RTSPServer::sendRtpFrameFragment(const uint8_t* fragment, size_t fragmentLen, size_t fragmentOffset, bool isLastFragment, uint8_t quality, uint16_t width, uint16_t height, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats, RTSP_TcpBatch* batch) {
+  const int RtpHeaderSize = 20;
+  int RtpPacketSize = fragmentLen + RtpHeaderSize;
 
-      int rtpSocket = isMulticast ? this->videoMulticastSocket : this->videoUnicastSocket;
+  // Only the headers are written, so the buffer isn't cleared
+  uint8_t* packet = allocPacket();
+  if (packet == NULL) {
+    return false;
+  }
 
-      sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
-    }
-    fragmentOffset += fragmentLen;
-    this->videoSequenceNumber++;
+  // If TCP, we need these first 4 bytes
+  packet[0] = '$'; // Magic number 
+  packet[1] = channel; // Channel number for RTP
+  packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
+  packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
+  
+  // RTP header
+  packet[4] = 0x80;
+  packet[5] = 0x1a | (isLastFragment ? 0x80 : 0x00);
+  packet[6] = (sequenceNumber >> 8) & 0xFF;
+  packet[7] = sequenceNumber & 0xFF;
+  packet[8] = (timestamp >> 24) & 0xFF;
+  packet[9] = (timestamp >> 16) & 0xFF;
+  packet[10] = (timestamp >> 8) & 0xFF;
+  packet[11] = timestamp & 0xFF;
+  packet[12] = (this->videoSSRC >> 24) & 0xFF;
+  packet[13] = (this->videoSSRC >> 16) & 0xFF;
+  packet[14] = (this->videoSSRC >> 8) & 0xFF;
+  packet[15] = this->videoSSRC & 0xFF;
+
+  // JPEG RTP header
+  packet[16] = 0x00;
+  packet[17] = (fragmentOffset >> 16) & 0xFF;
+  packet[18] = (fragmentOffset >> 8) & 0xFF;
+  packet[19] = fragmentOffset & 0xFF;
+  packet[20] = 0x00;
+  packet[21] = quality;
+  packet[22] = width / 8;
+  packet[23] = height / 8;
+
+  int packetOffset = 24;
+
+  // Send packet using TCP or UDP, the JPEG data follows the headers
+  int rtpSocket = isMulticast ? this->videoMulticastSocket : this->videoUnicastSocket;
+  bool sent = sendRtpPacket(packet, packetOffset, fragment, fragmentLen, sock, rtpSocket, sendRtpPort, useTCP, isMulticast, false, stats, batch);
+  freePacket(packet);
+  if (!sent) {
+    return false;
   }
+  sequenceNumber++;
+  countRtpPacket(stats, fragmentLen);
+  return true;
 }
 
-void RTSPServer::sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
+void RTSPServer::sendRtpAudio(const int16_t* data, size_t len, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t payloadSize, uint16_t& sequenceNumber, RTSP_StreamStats* stats) {
   const int RtpHeaderSize = 12; // RTP header size
-  const int MAX_FRAGMENT_SIZE = 1446; // Adjust based on your requirements
   uint32_t audioLen = len;
 
+  // One buffer for the whole block, each packet overwrites the previous one
+  uint8_t* packet = allocPacket();
+  if (packet == NULL) {
+    return;
+  }
+
   size_t fragmentOffset = 0;
   while (fragmentOffset < audioLen) {
-    int fragmentLen = MAX_FRAGMENT_SIZE;
+    int fragmentLen = payloadSize;
     if (fragmentLen + fragmentOffset > audioLen) {
       fragmentLen = audioLen - fragmentOffset;
     }
 
     int RtpPacketSize = fragmentLen + RtpHeaderSize;
-    uint8_t packet[2048];
-    memset(packet, 0x00, sizeof(packet));
+    uint32_t audioTimestamp = timestamp + fragmentOffset / 2; // Offset by the samples already sent
 
     // If TCP, we need these first 4 bytes
     packet[0] = '$'; // Magic number 
-    packet[1] = this->audioCh; // Channel number for RTP (1 for audio)
+    packet[1] = channel; // Channel number for RTP
     packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
     packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
 
     // RTP header
     packet[4] = 0x80; // Version: 2, Padding: 0, Extension: 0, CSRC Count: 0
     packet[5] = 0x61 | 0x80;  // Dynamic payload type (97) and marker bit
-    packet[6] = (this->audioSequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
-    packet[7] = this->audioSequenceNumber & 0xFF; // Sequence Number (low byte)
-    packet[8] = (this->audioTimestamp >> 24) & 0xFF; // Timestamp (high byte)
-    packet[9] = (this->audioTimestamp >> 16) & 0xFF; // Timestamp (next byte)
-    packet[10] = (this->audioTimestamp >> 8) & 0xFF; // Timestamp (next byte)
-    packet[11] = this->audioTimestamp & 0xFF; // Timestamp (low byte)
+    packet[6] = (sequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
+    packet[7] = sequenceNumber & 0xFF; // Sequence Number (low byte)
+    packet[8] = (audioTimestamp >> 24) & 0xFF; // Timestamp (high byte)
+    packet[9] = (audioTimestamp >> 16) & 0xFF; // Timestamp (next byte)
+    packet[10] = (audioTimestamp >> 8) & 0xFF; // Timestamp (next byte)
+    packet[11] = audioTimestamp & 0xFF; // Timestamp (low byte)
     packet[12] = (this->audioSSRC >> 24) & 0xFF; // SSRC (high byte)
     packet[13] = (this->audioSSRC >> 16) & 0xFF; // SSRC (next byte)
     packet[14] = (this->audioSSRC >> 8) & 0xFF; // SSRC (next byte)
@@ -240,56 +591,45 @@ void RTSPServer::sendRtpAudio(const int16_t* data, size_t len, int sock, uint16_
     }
 
     // Send packet using TCP or UDP
-    if (useTCP) {
-      sendTcpPacket(packet, packetOffset, sock);
-    } else {
-      struct sockaddr_in client_addr;
-      memset(&client_addr, 0, sizeof(client_addr));
-      client_addr.sin_family = AF_INET;
-      // Determine IP address based on whether it's multicast or unicast
-      if (isMulticast) {
-        inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-      } else {
-        socklen_t addrLen = sizeof(client_addr);
-        if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-          RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-          return;
-        }
-      }
-      client_addr.sin_port = htons(sendRtpPort);
-
-      int rtpSocket = isMulticast ? this->audioMulticastSocket : this->audioUnicastSocket;
-
-      sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
+    int rtpSocket = isMulticast ? this->audioMulticastSocket : this->audioUnicastSocket;
+    if (!sendRtpPacket(packet, packetOffset, NULL, 0, sock, rtpSocket, sendRtpPort, useTCP, isMulticast, true, stats, NULL)) {
+      break;
     }
     fragmentOffset += fragmentLen;
-    this->audioSequenceNumber++;
-    this->audioTimestamp += fragmentLen / 2; // Convert fragment length to number of samples
+    sequenceNumber++;
+    countRtpPacket(stats, fragmentLen);
   }
+  freePacket(packet);
 }
 
-void RTSPServer::sendRtpSubtitles(const char* data, size_t len, int sock, uint16_t sendRtpPort, bool useTCP, bool isMulticast) {
+void RTSPServer::sendRtpSubtitles(const char* data, size_t len, uint32_t timestamp, int sock, uint16_t sendRtpPort, uint8_t channel, bool useTCP, bool isMulticast, uint16_t& sequenceNumber, RTSP_StreamStats* stats) {
   const int RtpHeaderSize = 12; // RTP header size
   int RtpPacketSize = len + RtpHeaderSize;
 
-  uint8_t packet[512];
-  memset(packet, 0x00, sizeof(packet));
+  if (len > RTSP_PACKET_BUFFER_SIZE - RtpHeaderSize - 4) {
+    RTSP_LOGE(LOG_TAG, "Subtitle of %d bytes too long for one packet", (int)len);
+    return;
+  }
+  uint8_t* packet = allocPacket();
+  if (packet == NULL) {
+    return;
+  }
 
   // If TCP, we need these first 4 bytes
   packet[0] = '$'; // Magic number 
-  packet[1] = this->subtitlesCh; // Channel number for RTP (2 for subtitles)
+  packet[1] = channel; // Channel number for RTP
   packet[2] = (RtpPacketSize >> 8) & 0xFF; // Packet length high byte 
   packet[3] = RtpPacketSize & 0xFF; // Packet length low byte
   
   // RTP header
   packet[4] = 0x80; // Version: 2, Padding: 0, Extension: 0, CSRC Count: 0
   packet[5] = 0x80 | 0x62; // Marker bit set and payload type 98
-  packet[6] = (this->subtitlesSequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
-  packet[7] = this->subtitlesSequenceNumber & 0xFF; // Sequence Number (low byte)
-  packet[8] = (this->subtitlesTimestamp >> 24) & 0xFF; // Timestamp (high byte)
-  packet[9] = (this->subtitlesTimestamp >> 16) & 0xFF; // Timestamp (next byte)
-  packet[10] = (this->subtitlesTimestamp >> 8) & 0xFF; // Timestamp (next byte)
-  packet[11] = this->subtitlesTimestamp & 0xFF; // Timestamp (low byte)
+  packet[6] = (sequenceNumber >> 8) & 0xFF; // Sequence Number (high byte)
+  packet[7] = sequenceNumber & 0xFF; // Sequence Number (low byte)
+  packet[8] = (timestamp >> 24) & 0xFF; // Timestamp (high byte)
+  packet[9] = (timestamp >> 16) & 0xFF; // Timestamp (next byte)
+  packet[10] = (timestamp >> 8) & 0xFF; // Timestamp (next byte)
+  packet[11] = timestamp & 0xFF; // Timestamp (low byte)
   packet[12] = (this->subtitlesSSRC >> 24) & 0xFF; // SSRC (high byte)
   packet[13] = (this->subtitlesSSRC >> 16) & 0xFF; // SSRC (next byte)
   packet[14] = (this->subtitlesSSRC >> 8) & 0xFF; // SSRC (next byte)
@@ -297,33 +637,86 @@ void RTSPServer::sendRtpSubtitles(const char* data, size_t len, int sock, uint16
 
   int packetOffset = RtpHeaderSize + 4;
 
-  // Copy SRT data to the packet
-  memcpy(packet + packetOffset, data, len);
-  packetOffset += len;
+  // Send packet using TCP or UDP, the SRT data follows the header
+  int rtpSocket = isMulticast ? this->subtitlesMulticastSocket : this->subtitlesUnicastSocket;
+  bool sent = sendRtpPacket(packet, packetOffset, (const uint8_t*)data, len, sock, rtpSocket, sendRtpPort, useTCP, isMulticast, true, stats, NULL);
+  freePacket(packet);
+  if (!sent) {
+    return;
+  }
+  sequenceNumber++;
+  countRtpPacket(stats, len);
+}
 
-  // Send packet using TCP or UDP
-  if (useTCP) {
-    sendTcpPacket(packet, packetOffset, sock);
-  } else {
-    struct sockaddr_in client_addr;
-    memset(&client_addr, 0, sizeof(client_addr));
-    client_addr.sin_family = AF_INET;
-    // Determine IP address based on whether it's multicast or unicast
-    if (isMulticast) {
-      inet_aton(this->rtpIp.toString().c_str(), &client_addr.sin_addr);
-    } else {
-      socklen_t addrLen = sizeof(client_addr);
-      if (getpeername(sock, (struct sockaddr*)&client_addr, &addrLen) == -1) {
-        RTSP_LOGE(LOG_TAG, "Failed to get peer IP address");
-        return;
-      }
-    }
-    client_addr.sin_port = htons(sendRtpPort);  
+/**
+ * @brief Counts an RTP packet sent towards the sender counts of the stream's sender reports.
+ *
+ * @param payloadLen Payload octets, without the RTP header.
+ */
+void RTSPServer::countRtpPacket(RTSP_StreamStats* stats, size_t payloadLen) {
+  if (stats) {
+    RTSP_STAT_ADD(stats->rtpPackets, 1);
+    RTSP_STAT_ADD(stats->rtpOctets, payloadLen);
+  }
+}
 
-    int rtpSocket = isMulticast ? this->subtitlesMulticastSocket : this->subtitlesUnicastSocket;
+void RTSPServer::sendRtcpSenderReport(uint32_t ssrc, uint32_t clockRate, uint32_t clockOffset, uint32_t packetCount, uint32_t octetCount, uint8_t channel, int sock, int rtcpSocket, uint16_t sendRtcpPort, bool useTCP, bool isMulticast, RTSP_StreamStats* stats) {
+  const int RtcpSRSize = 28;
 
-    sendto(rtpSocket, packet + 4, packetOffset - 4, 0, (struct sockaddr*)&client_addr, sizeof(client_addr));
+  // Sample both clocks together so the report maps wallclock to the stream's RTP time
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  uint32_t rtpTimestamp = mediaClockToRtp(esp_timer_get_time(), clockRate, clockOffset);
+  uint32_t ntpSeconds = (uint32_t)now.tv_sec + 2208988800UL; // Seconds from 1900 to 1970
+  uint32_t ntpFraction = (uint32_t)(((uint64_t)now.tv_usec << 32) / 1000000);
+
+  if (!useTCP && rtcpSocket == -1) {
+    return;
+  }
+  uint8_t* packet = allocPacket();
+  if (packet == NULL) {
+    return;
   }
-  this->subtitlesSequenceNumber++;
-  this->subtitlesTimestamp += 1000; // Increment the timestamp
+
+  // If TCP, we need these first 4 bytes
+  packet[0] = '$'; // Magic number
+  packet[1] = channel; // Channel number for RTCP (RTP channel + 1)
+  packet[2] = (RtcpSRSize >> 8) & 0xFF; // Packet length high byte
+  packet[3] = RtcpSRSize & 0xFF; // Packet length low byte
+
+  // RTCP SR header
+  packet[4] = 0x80; // Version: 2, Padding: 0, Report Count: 0
+  packet[5] = 200; // Packet type SR
+  packet[6] = 0x00; // Length in 32-bit words minus one (high byte)
+  packet[7] = RtcpSRSize / 4 - 1; // Length (low byte)
+  packet[8] = (ssrc >> 24) & 0xFF;
+  packet[9] = (ssrc >> 16) & 0xFF;
+  packet[10] = (ssrc >> 8) & 0xFF;
+  packet[11] = ssrc & 0xFF;
+
+  // Sender info
+  packet[12] = (ntpSeconds >> 24) & 0xFF;
+  packet[13] = (ntpSeconds >> 16) & 0xFF;
+  packet[14] = (ntpSeconds >> 8) & 0xFF;
+  packet[15] = ntpSeconds & 0xFF;
+  packet[16] = (ntpFraction >> 24) & 0xFF;
+  packet[17] = (ntpFraction >> 16) & 0xFF;
+  packet[18] = (ntpFraction >> 8) & 0xFF;
+  packet[19] = ntpFraction & 0xFF;
+  packet[20] = (rtpTimestamp >> 24) & 0xFF;
+  packet[21] = (rtpTimestamp >> 16) & 0xFF;
+  packet[22] = (rtpTimestamp >> 8) & 0xFF;
+  packet[23] = rtpTimestamp & 0xFF;
+  packet[24] = (packetCount >> 24) & 0xFF;
+  packet[25] = (packetCount >> 16) & 0xFF;
+  packet[26] = (packetCount >> 8) & 0xFF;
+  packet[27] = packetCount & 0xFF;
+  packet[28] = (octetCount >> 24) & 0xFF;
+  packet[29] = (octetCount >> 16) & 0xFF;
+  packet[30] = (octetCount >> 8) & 0xFF;
+  packet[31] = octetCount & 0xFF;
+
+  // Send packet using TCP or UDP, video's reports don't go ahead of its packets
+  sendRtpPacket(packet, 4 + RtcpSRSize, NULL, 0, sock, rtcpSocket, sendRtcpPort, useTCP, isMulticast, ssrc != this->videoSSRC, stats, NULL);
+  freePacket(packet);
 }
@@ -21,7 +21,7 @@ void RTSPServer::handleOptions(char* request, RTSP_Session& session) {
            "RTSP/1.0 200 OK\r\n"
            "CSeq: %d\r\n"
            "%s\r\n"
-           "Public: DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN\r\n\r\n", 
+           "Public: DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, GET_PARAMETER, SET_PARAMETER\r\n\r\n", 
            session.cseq, 
            dateHeader());
   write(session.sock, response, strlen(response));
@@ -33,7 +33,7 @@ void RTSPServer::handleOptions(char* request, RTSP_Session& session) {
  * @param session The RTSP session.
  */
 void RTSPServer::handleDescribe(const RTSP_Session& session) {
-  char sdpDescription[512];
+  char sdpDescription[1024];
   int sdpLen = snprintf(sdpDescription, sizeof(sdpDescription),
                         "v=0\r\n"
                         "o=- %ld 1 IN IP4 %s\r\n"
@@ -43,17 +43,30 @@ void RTSPServer::handleDescribe(const RTSP_Session& session) {
                         "a=control:*\r\n",
                         session.sessionID, WiFi.localIP().toString().c_str());
 
-  if (isVideo) {
+  if (isVideo && videoCodec == VIDEO_H264) {
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "m=video 0 RTP/AVP %d\r\n"
+                       "a=rtpmap:%d H264/%d\r\n",
+                       RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO, RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO, VIDEO_CLOCK_RATE);
+    sdpLen += h264Fmtp(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen);
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "a=control:video\r\n");
+  } else if (isVideo && videoCodec == VIDEO_H265) {
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "m=video 0 RTP/AVP %d\r\n"
+                       "a=rtpmap:%d H265/%d\r\n",
+                       RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO, RTP_PAYLOAD_TYPE_DYNAMIC_VIDEO, VIDEO_CLOCK_RATE);
+    sdpLen += h265Fmtp(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen);
+    sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
+                       "a=control:video\r\n");
+  } else if (isVideo) {
     sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
                        "m=video 0 RTP/AVP 26\r\n"
                        "a=control:video\r\n");
   }
 
-  const char* mediaCondition = "sendrecv"; 
-  // if (haveMic && haveAmp) mediaCondition = "sendrecv"; 
-  // else if (haveMic) mediaCondition = "sendonly"; 
-  // else if (haveAmp) mediaCondition = "recvonly"; 
-  // else mediaCondition = "inactive"; 
+  // Clients may send audio back when there is somewhere to play it, see setBackchannelCallback()
+  const char* mediaCondition = this->backchannelCallback ? "sendrecv" : "sendonly";
 
   if (isAudio) {
     sdpLen += snprintf(sdpDescription + sdpLen, sizeof(sdpDescription) - sdpLen,
@@ -70,11 +83,11 @@ void RTSPServer::handleDescribe(const RTSP_Session& session) {
                        "a=control:subtitles\r\n");
   }
 
-  char response[1024];
+  char response[1536];
   int responseLen = snprintf(response, sizeof(response),
-                             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nContent-Base: rtsp://%s:554/\r\nContent-Type: application/sdp\r\nContent-Length: %d\r\n\r\n"
+                             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nContent-Base: rtsp://%s:554/%s\r\nContent-Type: application/sdp\r\nContent-Length: %d\r\n\r\n"
                              "%s",
-                             session.cseq, dateHeader(), WiFi.localIP().toString().c_str(), sdpLen, sdpDescription);
+                             session.cseq, dateHeader(), WiFi.localIP().toString().c_str(), session.isPreview ? RTSP_PREVIEW_MOUNT "/" : "", sdpLen, sdpDescription);
   write(session.sock, response, responseLen);
 }
 
@@ -88,41 +101,56 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   session.isMulticast = strstr(request, "multicast") != NULL;
   session.isTCP = strstr(request, "RTP/AVP/TCP") != NULL;
 
-#ifndef OVERRIDE_RTSP_SINGLE_CLIENT_MODE
-  // Track the first client's connection type
-  if (!firstClientConnected) {
-    firstClientConnected = true;
-    firstClientIsMulticast = session.isMulticast;
-    firstClientIsTCP = session.isTCP;
-
-    // Set max clients based on the first client's connection type
-    setMaxClients(firstClientIsMulticast ? this->maxRTSPClients : 1);
+  // Clients behind a tunnel can ask for smaller packets (RFC 2326 12.7)
+  uint32_t blocksize = 0;
+  char* blocksizeStart = strstr(request, "Blocksize:");
+  if (blocksizeStart) {
+    blocksize = strtoul(blocksizeStart + 10, NULL, 10);
+  }
+  setSessionPayloadSizes(session, blocksize);
+
+  if (session.playback >= 0) {
+    // Recordings don't share the live stream's sockets or client limit, see setupPlayback()
+  } else if (this->uplinkBudget || this->cpuBudget) {
+    // Admission control decides how many clients play, whatever their transports
+    setMaxClients(MAX_CLIENTS);
   } else {
-    // Determine if the connection should be rejected
-    bool rejectConnection = (firstClientIsMulticast && !session.isMulticast) ||
-                            (!firstClientIsMulticast && (session.isMulticast || session.isTCP != firstClientIsTCP));
-
-    if (rejectConnection) {
-      RTSP_LOGW(LOG_TAG, "Rejecting connection because it does not match the first client's connection type");
-      char response[512];
-      snprintf(response, sizeof(response),
-               "RTSP/1.0 461 Unsupported Transport\r\n"
-               "CSeq: %d\r\n"
-               "%s\r\n\r\n",
-               session.cseq, dateHeader());
-      if (write(session.sock, response, strlen(response)) < 0) {
-        RTSP_LOGE(LOG_TAG, "Failed to send rejection response to client.");
+#ifndef OVERRIDE_RTSP_SINGLE_CLIENT_MODE
+    // Track the first client's connection type
+    if (!firstClientConnected) {
+      firstClientConnected = true;
+      firstClientIsMulticast = session.isMulticast;
+      firstClientIsTCP = session.isTCP;
+
+      // Set max clients based on the first client's connection type
+      setMaxClients(firstClientIsMulticast ? this->maxRTSPClients : 1);
+    } else {
+      // Determine if the connection should be rejected
+      bool rejectConnection = (firstClientIsMulticast && !session.isMulticast) ||
+                              (!firstClientIsMulticast && (session.isMulticast || session.isTCP != firstClientIsTCP));
+
+      if (rejectConnection) {
+        RTSP_LOGW(LOG_TAG, "Rejecting connection because it does not match the first client's connection type");
+        char response[512];
+        snprintf(response, sizeof(response),
+                 "RTSP/1.0 461 Unsupported Transport\r\n"
+                 "CSeq: %d\r\n"
+                 "%s\r\n\r\n",
+                 session.cseq, dateHeader());
+        if (write(session.sock, response, strlen(response)) < 0) {
+          RTSP_LOGE(LOG_TAG, "Failed to send rejection response to client.");
+        }
+        return;
       }
-      return;
     }
-  }
 #else
-  setMaxClients(this->maxRTSPClients);
+    setMaxClients(this->maxRTSPClients);
 #endif
+  }
 
-  bool setVideo = strstr(request, "video") != NULL;
-  bool setAudio = strstr(request, "audio") != NULL;
-  bool setSubtitles = strstr(request, "subtitles") != NULL;
+  bool setVideo = isSetupFor(request, "video");
+  bool setAudio = isSetupFor(request, "audio");
+  bool setSubtitles = isSetupFor(request, "subtitles");
   uint16_t clientPort = 0;
   uint16_t serverPort = 0;
   uint8_t rtpChannel = 0;
@@ -164,12 +192,13 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   if (setVideo) {
     session.cVideoPort = clientPort;
     serverPort = this->rtpVideoPort;
-    this->videoCh = rtpChannel;
+    session.videoCh = rtpChannel;
     if (!session.isTCP) {
       if (session.isMulticast) {
-        this->checkAndSetupUDP(this->videoMulticastSocket, true, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->videoMulticastSocket, true, serverPort, this->socketOptions.videoDscp, this->rtpIp);
       } else {
-        this->checkAndSetupUDP(this->videoUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->videoUnicastSocket, false, serverPort, this->socketOptions.videoDscp, this->rtpIp);
+        this->checkAndSetupUDP(this->videoRtcpSocket, false, serverPort + 1, this->socketOptions.videoDscp, this->rtpIp);
       }
     }
   }
@@ -177,12 +206,13 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   if (setAudio) {
     session.cAudioPort = clientPort;
     serverPort = this->rtpAudioPort;
-    this->audioCh = rtpChannel;
+    session.audioCh = rtpChannel;
     if (!session.isTCP) {
       if (session.isMulticast) {
-        this->checkAndSetupUDP(this->audioMulticastSocket, true, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->audioMulticastSocket, true, serverPort, this->socketOptions.audioDscp, this->rtpIp);
       } else {
-        this->checkAndSetupUDP(this->audioUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->audioUnicastSocket, false, serverPort, this->socketOptions.audioDscp, this->rtpIp);
+        this->checkAndSetupUDP(this->audioRtcpSocket, false, serverPort + 1, this->socketOptions.audioDscp, this->rtpIp);
       }
     }
   }
@@ -190,53 +220,56 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
   if (setSubtitles) {
     session.cSrtPort = clientPort;
     serverPort = this->rtpSubtitlesPort;
-    this->subtitlesCh = rtpChannel;
+    session.subtitlesCh = rtpChannel;
     if (!session.isTCP) {
       if (session.isMulticast) {
-        this->checkAndSetupUDP(this->subtitlesMulticastSocket, true, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->subtitlesMulticastSocket, true, serverPort, this->socketOptions.subtitlesDscp, this->rtpIp);
       } else {
-        this->checkAndSetupUDP(this->subtitlesUnicastSocket, false, serverPort, this->rtpIp);
+        this->checkAndSetupUDP(this->subtitlesUnicastSocket, false, serverPort, this->socketOptions.subtitlesDscp, this->rtpIp);
+        this->checkAndSetupUDP(this->subtitlesRtcpSocket, false, serverPort + 1, this->socketOptions.subtitlesDscp, this->rtpIp);
       }
     }
   }
 
 
 #ifdef RTSP_VIDEO_NONBLOCK
-  if (setVideo && this->rtpVideoTaskHandle == NULL) {
-    xTaskCreate(rtpVideoTaskWrapper, "rtpVideoTask", RTP_STACK_SIZE, this, RTP_PRI, &this->rtpVideoTaskHandle);
+  if (setVideo && this->rtpVideoTaskHandle == NULL && this->mediaSchedulerTaskHandle == NULL) {
+    xTaskCreatePinnedToCore(rtpVideoTaskWrapper, "rtpVideoTask", RTP_STACK_SIZE, this, RTP_PRI, &this->rtpVideoTaskHandle, RTP_CORE);
   }
-  if (this->rtspStreamBuffer == NULL && psramFound()) {
+  if (this->rtspStreamBuffer == NULL && this->mediaSchedulerTaskHandle == NULL && psramFound()) {
     this->rtspStreamBuffer = (uint8_t*)ps_malloc(MAX_RTSP_BUFFER);
   }
 #endif
 
-  char* response = (char*)malloc(512);
-  if (response == NULL) {
-    RTSP_LOGE(LOG_TAG, "Failed to allocate memory");
-    return;
+  // The client has to send a request or RTCP report within the timeout to keep the session
+  char response[512];
+  char sessionHeader[40];
+  if (this->sessionTimeout) {
+    snprintf(sessionHeader, sizeof(sessionHeader), "%lu;timeout=%u", session.sessionID, this->sessionTimeout);
+  } else {
+    snprintf(sessionHeader, sizeof(sessionHeader), "%lu", session.sessionID);
   }
 
   // Formulate the response based on transport method
   if (session.isTCP) {
-    snprintf(response, 512,
+    snprintf(response, sizeof(response),
              "RTSP/1.0 200 OK\r\n"
              "CSeq: %d\r\n"
              "%s\r\n"
              "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
-             "Session: %lu\r\n\r\n",
-             session.cseq, dateHeader(), rtpChannel, rtpChannel + 1, session.sessionID);
+             "Session: %s\r\n\r\n",
+             session.cseq, dateHeader(), rtpChannel, rtpChannel + 1, sessionHeader);
   } else if (session.isMulticast) {
-    snprintf(response, 512,
-             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\nSession: %lu\r\n\r\n",
-             session.cseq, dateHeader(), this->rtpIp.toString().c_str(), serverPort, serverPort + 1, this->rtpTTL, session.sessionID);
+    snprintf(response, sizeof(response),
+             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\nSession: %s\r\n\r\n",
+             session.cseq, dateHeader(), this->rtpIp.toString().c_str(), serverPort, serverPort + 1, this->rtpTTL, sessionHeader);
   } else {
-    snprintf(response, 512,
-             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%d-%d;server_port=%d-%d\r\nSession: %lu\r\n\r\n",
-             session.cseq, dateHeader(), clientPort, clientPort + 1, serverPort, serverPort + 1, session.sessionID);
+    snprintf(response, sizeof(response),
+             "RTSP/1.0 200 OK\r\nCSeq: %d\r\n%s\r\nTransport: RTP/AVP;unicast;destination=127.0.0.1;source=127.0.0.1;client_port=%d-%d;server_port=%d-%d\r\nSession: %s\r\n\r\n",
+             session.cseq, dateHeader(), clientPort, clientPort + 1, serverPort, serverPort + 1, sessionHeader);
   }
 
   write(session.sock, response, strlen(response));
-  free(response);
   this->sessions[session.sessionID] = session;
 }
 
@@ -246,9 +279,20 @@ void RTSPServer::handleSetup(char* request, RTSP_Session& session) {
  * @param session The RTSP session.
  */
 void RTSPServer::handlePlay(RTSP_Session& session) {
+  if (!session.isPlaying && !admitSession(session)) {
+    char response[192];
+    int len = snprintf(response, sizeof(response),
+                       "RTSP/1.0 503 Service Unavailable\r\nCSeq: %d\r\n%s\r\nRetry-After: %d\r\n\r\n",
+                       session.cseq, dateHeader(), RTSP_RETRY_AFTER);
+    write(session.sock, response, len);
+    RTSP_STAT_ADD(this->rejectedClientCount, 1);
+    return;
+  }
   session.isPlaying = true;
+  session.awaitingKeyframe = true;
   this->sessions[session.sessionID] = session;
   setIsPlaying(true);
+  this->staticFrameDueUs = 0; // A new viewer gets the next frame even if the picture is still
 
   char response[256];
   snprintf(response, sizeof(response),
@@ -271,6 +315,7 @@ void RTSPServer::handlePlay(RTSP_Session& session) {
  * @param session The RTSP session.
  */
 void RTSPServer::handlePause(RTSP_Session& session) {
+  pausePlayback(session);
   session.isPlaying = false;
   this->sessions[session.sessionID] = session;
   updateIsPlayingStatus();
@@ -288,6 +333,7 @@ void RTSPServer::handlePause(RTSP_Session& session) {
  * @param session The RTSP session.
  */
 void RTSPServer::handleTeardown(RTSP_Session& session) {
+  closePlayback(session);
   session.isPlaying = false;
   this->sessions[session.sessionID] = session;
   updateIsPlayingStatus();
@@ -302,55 +348,252 @@ void RTSPServer::handleTeardown(RTSP_Session& session) {
 }
 
 /**
- * @brief Handles incoming RTSP requests.
+ * @brief Handles the GET_PARAMETER and SET_PARAMETER RTSP requests.
+ * 
+ * Clients send them with an empty body as keepalives. No parameters are supported, a request
+ * that names any gets 451 Parameter Not Understood.
+ * 
+ * @param request The RTSP request.
+ * @param session The RTSP session.
+ * @param isSet true for SET_PARAMETER.
+ */
+void RTSPServer::handleParameter(char* request, RTSP_Session& session, bool isSet) {
+  int contentLength = 0;
+  char* lengthStart = strstr(request, "Content-Length:");
+  if (lengthStart) {
+    contentLength = atoi(lengthStart + 15);
+  }
+  (void)isSet; // Only named in the log
+  char response[128];
+  int len;
+  if (contentLength > 0) {
+    len = snprintf(response, sizeof(response),
+                   "RTSP/1.0 451 Parameter Not Understood\r\nCSeq: %d\r\nSession: %lu\r\n\r\n",
+                   session.cseq, session.sessionID);
+    RTSP_LOGW(LOG_TAG, "%s with parameters not supported", isSet ? "SET_PARAMETER" : "GET_PARAMETER");
+  } else {
+    len = snprintf(response, sizeof(response),
+                   "RTSP/1.0 200 OK\r\nCSeq: %d\r\nSession: %lu\r\n\r\n",
+                   session.cseq, session.sessionID);
+  }
+  write(session.sock, response, len);
+}
+
+/**
+ * @brief Picks up a frame rate cap the client asks for.
+ * 
+ * Either a fps=N query on the request URL, e.g. rtsp://camera/?fps=2, or a Frame-Rate: N header.
+ * Requests with neither leave the session's cap as it is.
  * 
- * @param sock The socket file descriptor.
- * @param clientAddr The client address.
+ * @param request The RTSP request.
+ * @param session The RTSP session.
+ */
+void RTSPServer::parseFrameRate(const char* request, RTSP_Session& session) {
+  const char* lineEnd = strstr(request, "\r\n");
+  const char* query = strchr(request, '?');
+  const char* value = NULL;
+  if (query && (!lineEnd || query < lineEnd)) {
+    const char* fps = strstr(query, "fps=");
+    if (fps && (!lineEnd || fps < lineEnd)) {
+      value = fps + 4;
+    }
+  }
+  const char* header = strstr(request, "Frame-Rate:");
+  if (header) {
+    value = header + 11;
+  }
+  if (value) {
+    unsigned long fps = strtoul(value, NULL, 10);
+    session.maxFps = fps > 255 ? 255 : fps;
+    session.nextFrameUs = 0;
+    RTSP_LOGD(LOG_TAG, "Session %u frame rate capped at %u", session.sessionID, session.maxFps);
+  }
+}
+
+/**
+ * @brief Marks the session as a preview session when the request URL is on RTSP_PREVIEW_MOUNT.
+ * 
+ * Only the request line is looked at. Once set it sticks, SETUP and PLAY may use the
+ * Content-Base or aggregate URL.
+ * 
+ * @param request The RTSP request.
+ * @param session The RTSP session.
+ */
+void RTSPServer::parseMount(const char* request, RTSP_Session& session) {
+  const char* urlStart = strstr(request, "rtsp://");
+  const char* lineEnd = strstr(request, "\r\n");
+  if (!urlStart || (lineEnd && urlStart > lineEnd)) {
+    return;
+  }
+  const char* pathStart = strchr(urlStart + 7, '/');
+  if (!pathStart || (lineEnd && pathStart > lineEnd)) {
+    return;
+  }
+  const size_t mountLen = strlen(RTSP_PREVIEW_MOUNT);
+  if (strncmp(pathStart + 1, RTSP_PREVIEW_MOUNT, mountLen) == 0) {
+    char next = pathStart[1 + mountLen];
+    if (next == '/' || next == ' ' || next == '?') {
+      session.isPreview = true;
+    }
+  }
+}
+
+/**
+ * @brief Checks whether a SETUP request is for a stream, by the last segment of its URL.
+ * 
+ * Only the URL counts, a file name or header that happens to contain "video" doesn't.
+ * 
+ * @param request The RTSP request.
+ * @param control The stream's a=control attribute, e.g. "video".
+ * @return true if the URL ends in control.
+ */
+bool RTSPServer::isSetupFor(const char* request, const char* control) {
+  const char* lineEnd = strstr(request, "\r\n");
+  const char* urlEnd = strstr(request, " RTSP/");
+  if (!urlEnd || (lineEnd && urlEnd > lineEnd)) {
+    return false;
+  }
+  const char* segment = urlEnd;
+  while (segment > request && segment[-1] != '/') {
+    segment--;
+  }
+  size_t len = strlen(control);
+  return (size_t)(urlEnd - segment) >= len && strncmp(segment, control, len) == 0 &&
+         (segment + len == urlEnd || segment[len] == '?');
+}
+
+/**
+ * @brief Handles incoming RTSP requests.
+ *
+ * Reads stop at the end of a request. Interleaved packets or the next request read along with it
+ * wait in the session and are handled before the socket is read again, so backchannel audio sent
+ * right after a request doesn't throw the interleaved stream out of step.
+ *
+ * @param session The client's session.
  * @return true if the request was handled successfully, false otherwise.
  */
 bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
-  char *buffer = (char *)ps_malloc(RTSP_BUFFER_SIZE);
+  char *buffer = this->rtspRequestBuffer;
   if (!buffer) {
-    RTSP_LOGE(LOG_TAG, "Failed to allocate buffer with ps_malloc");
+    RTSP_LOGE(LOG_TAG, "RTSP request buffer not allocated");
     return false;
   }
+  // A tunnel's kept bytes belong to its POST connection, see handleTunnelRequest()
+  const bool keepsPending = !session.isTunnel;
 
-  int totalLen = 0;
-  int len = 0;
+  do {
+    // Interleaved packets from the client, RTCP or backchannel audio, come between requests
+    if (!receiveInterleaved(session)) {
+      RTSP_LOGW(LOG_TAG, "Connection broke off in an interleaved packet");
+      return false;
+    }
 
-  // Read data from socket until end of RTSP header or buffer limit is reached
-  while ((len = recv(session.sock, buffer + totalLen, RTSP_BUFFER_SIZE - totalLen - 1, 0)) > 0) {
-    totalLen += len;
-    if (strstr(buffer, "\r\n\r\n")) {
-      break;
+    int totalLen = 0;
+    if (keepsPending) {
+      totalLen = session.pendingLen;
+      memcpy(buffer, session.pending, totalLen);
+      session.pendingLen = 0;
     }
-    if (totalLen >= RTSP_BUFFER_SIZE) { // Adjusted for null-terminator
-      RTSP_LOGE(LOG_TAG, "Request too large for buffer. Total length: %d", totalLen);
-      free(buffer); // Free allocated memory
-      return false;
+    buffer[totalLen] = 0;
+    int requestLen;
+    int len = 0;
+
+    // Read at most RTSP_PENDING_SIZE at a time, so whatever follows the request fits in the session
+    while ((requestLen = findRequestEnd(buffer, totalLen)) == 0) {
+      int room = RTSP_BUFFER_SIZE - totalLen - 1;
+      if (room <= 0) {
+        RTSP_LOGE(LOG_TAG, "Request too large for buffer. Total length: %d", totalLen);
+        return false;
+      }
+      len = recv(session.sock, buffer + totalLen, room < RTSP_PENDING_SIZE ? room : RTSP_PENDING_SIZE, 0);
+      if (len <= 0) {
+        break;
+      }
+      totalLen += len;
+      buffer[totalLen] = 0; // The buffer is reused, don't let strstr find the previous request
+      if (keepsPending && buffer[0] == '$') {
+        break;
+      }
+    }
+    if (keepsPending && totalLen > 0 && buffer[0] == '$') {
+      // A packet that arrived after receiveInterleaved() looked, one read is at most what fits
+      memcpy(session.pending, buffer, totalLen);
+      session.pendingLen = totalLen;
+      continue;
     }
-  }
 
-  if (totalLen <= 0) {
-    int err = errno;
-    free(buffer); // Free allocated memory
-    if (err == EWOULDBLOCK || err == EAGAIN) {
-      return true;
-    } else if (err == ECONNRESET || err == ENOTCONN) {
-      // Handle teardown when connection is reset or not connected based on client IP
-      RTSP_LOGD(LOG_TAG, "HandleTeardown");
-      this->handleTeardown(session);
-      return false;
-    } else {
-      RTSP_LOGE(LOG_TAG, "Error reading from socket, error: %d", err);
+    if (requestLen == 0) {
+      int err = errno;
+      if (len == 0) {
+        // Orderly close, errno is left over from an earlier call
+        RTSP_LOGD(LOG_TAG, "Client closed the connection");
+        this->handleTeardown(session);
+        return false;
+      } else if (err == ECONNRESET || err == ENOTCONN) {
+        // Handle teardown when connection is reset or not connected based on client IP
+        RTSP_LOGD(LOG_TAG, "HandleTeardown");
+        this->handleTeardown(session);
+        return false;
+      } else if (err != EWOULDBLOCK && err != EAGAIN) {
+        RTSP_LOGE(LOG_TAG, "Error reading from socket, error: %d", err);
+        return false;
+      }
+      if (totalLen == 0) {
+        return true;
+      }
+      if (keepsPending && totalLen <= RTSP_PENDING_SIZE) {
+        // The rest of the request is on its way
+        memcpy(session.pending, buffer, totalLen);
+        session.pendingLen = totalLen;
+        return true;
+      }
+      requestLen = totalLen; // Too long to keep, handled as far as it goes
+    }
+
+    bool isHttp = strncmp(buffer, "GET ", 4) == 0 || strncmp(buffer, "POST ", 5) == 0;
+    if (isHttp) {
+      requestLen = totalLen; // A tunnel's POST carries requests after its headers
+    } else if (keepsPending && totalLen > requestLen) {
+      // At most one read past the request, which fits
+      session.pendingLen = totalLen - requestLen;
+      memcpy(session.pending, buffer + requestLen, session.pendingLen);
+    }
+    buffer[requestLen] = 0; // Null-terminate the buffer
+
+    bool probe = session.sock == this->httpProbeSock;
+    if (probe) {
+      // Let in over the client limit in case it was a browser or a player of a recording
+      this->httpProbeSock = -1;
+      bool browser = strncmp(buffer, "GET ", 4) == 0 && !strstr(buffer, "x-sessioncookie:");
+      if (!browser && !findPlaybackName(buffer)) {
+        char response[64];
+        int responseLen = snprintf(response, sizeof(response), "RTSP/1.0 503 Service Unavailable\r\nRetry-After: %d\r\n\r\n", RTSP_RETRY_AFTER);
+        write(session.sock, response, responseLen);
+        RTSP_STAT_ADD(this->rejectedClientCount, 1);
+        return false;
+      }
+    }
+    if (isHttp) {
+      return handleHttpRequest(session, requestLen); // The session may be gone after it
+    }
+    // A recording that couldn't be opened was answered with the error, the probe goes
+    if (!processRTSPRequest(session, buffer) || (probe && session.playback < 0)) {
       return false;
     }
-  }
+  } while (keepsPending && session.pendingLen > 0);
+  return true;
+}
 
-  // Check to see if RTCP packet and ignore for now...
-  buffer[totalLen] = 0; // Null-terminate the buffer
+/**
+ * @brief Handles one RTSP request, read from the RTSP connection or decoded from a tunnel.
+ * 
+ * @param session The RTSP session.
+ * @param buffer The request, null terminated. Handlers may write into it.
+ * @return true to keep the connection, false after TEARDOWN.
+ */
+bool RTSPServer::processRTSPRequest(RTSP_Session& session, char* buffer) {
+  // Interleaved packets inside a tunnel aren't taken, see receiveInterleaved()
   if (buffer[0] == '$') {
-    free(buffer); // Free allocated memory
     return true; 
   }
 
@@ -359,10 +602,8 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
   if (version == 2) { 
     uint8_t payloadType = buffer[1] & 0x7F;
     if (payloadType >= 200 && payloadType <= 204) {
-      free(buffer); // Free allocated memory
       return true;
     }
-    free(buffer); // Free allocated memory
     return true;
   }
 
@@ -370,11 +611,12 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
   if (cseq == -1) {
     RTSP_LOGE(LOG_TAG, "CSeq not found in request");
     write(session.sock, "RTSP/1.0 400 Bad Request\r\n\r\n", 29);
-    free(buffer); // Free allocated memory
     return true;
   }
 
   session.cseq = cseq;
+  RTSP_STAT_ADD(session.rtspRequests, 1);
+  RTSP_STAT_ADD(this->rtspRequestCount, 1);
 
   // Extract session ID using the provided function
   uint32_t sessionID = extractSessionID(buffer);
@@ -387,7 +629,6 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
     char* authHeader = strstr(buffer, "Authorization: Basic ");
     if (!authHeader) {
       sendUnauthorizedResponse(session);
-      free(buffer); // Free allocated memory
       return true;
     } else {
       authHeader += 21; // Move pointer to the base64 encoded credentials
@@ -396,7 +637,6 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
         *authEnd = 0; // Null-terminate the base64 string
         if (strcmp(authHeader, base64Credentials) != 0) {
           sendUnauthorizedResponse(session);
-          free(buffer); // Free allocated memory
           return true;
         } else {
           // Remove the Authorization header from the buffer before continuing
@@ -404,38 +644,59 @@ bool RTSPServer::handleRTSPRequest(RTSP_Session& session) {
         }
       } else {
         sendUnauthorizedResponse(session);
-        free(buffer); // Free allocated memory
         return true;
       }
     }
   }
 
+  parseFrameRate(buffer, session);
+  parseMount(buffer, session);
+  if (!openPlayback(buffer, session)) {
+    return true;
+  }
+
   // Handle different RTSP methods
   if (strncmp(buffer, "OPTIONS", 7) == 0) {
     RTSP_LOGD(LOG_TAG, "HandleOptions");
     this->handleOptions(buffer, session);
   } else if (strncmp(buffer, "DESCRIBE", 8) == 0) {
     RTSP_LOGD(LOG_TAG, "HandleDescribe");
-    this->handleDescribe(session);
+    if (session.playback >= 0) {
+      this->describePlayback(session);
+    } else {
+      this->handleDescribe(session);
+    }
   } else if (strncmp(buffer, "SETUP", 5) == 0) {
     RTSP_LOGD(LOG_TAG, "HandleSetup");
-    this->handleSetup(buffer, session);
+    if (session.playback >= 0) {
+      this->setupPlayback(buffer, session);
+    } else {
+      this->handleSetup(buffer, session);
+    }
   } else if (strncmp(buffer, "PLAY", 4) == 0) {
     RTSP_LOGD(LOG_TAG, "HandlePlay");
-    this->handlePlay(session);
+    if (session.playback >= 0) {
+      this->startPlayback(buffer, session);
+    } else {
+      this->handlePlay(session);
+    }
   } else if (strncmp(buffer, "TEARDOWN", 8) == 0) {
     RTSP_LOGD(LOG_TAG, "HandleTeardown");
     this->handleTeardown(session);
-    free(buffer); // Free allocated memory
     return false;
   } else if (strncmp(buffer, "PAUSE", 5) == 0) {
     RTSP_LOGD(LOG_TAG, "HandlePause");
     this->handlePause(session);
+  } else if (strncmp(buffer, "GET_PARAMETER", 13) == 0) {
+    RTSP_LOGD(LOG_TAG, "HandleGetParameter");
+    this->handleParameter(buffer, session, false);
+  } else if (strncmp(buffer, "SET_PARAMETER", 13) == 0) {
+    RTSP_LOGD(LOG_TAG, "HandleSetParameter");
+    this->handleParameter(buffer, session, true);
   } else {
     RTSP_LOGW(LOG_TAG, "Unknown RTSP method: %s", buffer);
   }
 
-  free(buffer); // Free allocated memory
   return true;
 }
 
@@ -0,0 +1,109 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Sets how long a client may stay silent before its session is dropped.
+ *
+ * Any RTSP request (GET_PARAMETER and OPTIONS are the usual keepalives) and any RTCP report from
+ * the client counts as activity. The timeout is advertised in the SETUP response.
+ *
+ * @param seconds Timeout in seconds, 0 keeps sessions until the connection closes.
+ */
+void RTSPServer::setSessionTimeout(uint16_t seconds) {
+  this->sessionTimeout = seconds;
+}
+
+/**
+ * @brief Empties the timer wheel, called when the RTSP task starts.
+ */
+void RTSPServer::sessionTimerInit(uint32_t now) {
+  for (int i = 0; i < RTSP_TIMER_WHEEL_SLOTS; i++) {
+    this->sessionTimers.head[i] = -1;
+  }
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    this->sessionTimers.next[i] = -1;
+    this->sessionTimers.prev[i] = -1;
+    this->sessionTimers.armed[i] = false;
+  }
+  this->sessionTimers.now = now;
+}
+
+/**
+ * @brief Restarts the timeout of a client, called on every sign of life.
+ *
+ * Unlinks the client from its wheel slot and links it into the slot of the new deadline, both O(1).
+ *
+ * @param client Index of the client in the RTSP task's socket list.
+ * @param now Seconds since boot.
+ */
+void RTSPServer::sessionTimerTouch(int client, uint32_t now) {
+  RTSP_TimerWheel& wheel = this->sessionTimers;
+  sessionTimerCancel(client);
+  if (this->sessionTimeout == 0) {
+    return;
+  }
+  wheel.deadline[client] = now + this->sessionTimeout;
+  uint8_t slot = wheel.deadline[client] & (RTSP_TIMER_WHEEL_SLOTS - 1);
+  wheel.slot[client] = slot;
+  wheel.prev[client] = -1;
+  wheel.next[client] = wheel.head[slot];
+  if (wheel.head[slot] >= 0) {
+    wheel.prev[wheel.head[slot]] = client;
+  }
+  wheel.head[slot] = client;
+  wheel.armed[client] = true;
+}
+
+/**
+ * @brief Stops the timeout of a client that has gone.
+ */
+void RTSPServer::sessionTimerCancel(int client) {
+  RTSP_TimerWheel& wheel = this->sessionTimers;
+  if (!wheel.armed[client]) {
+    return;
+  }
+  if (wheel.prev[client] >= 0) {
+    wheel.next[wheel.prev[client]] = wheel.next[client];
+  } else {
+    wheel.head[wheel.slot[client]] = wheel.next[client];
+  }
+  if (wheel.next[client] >= 0) {
+    wheel.prev[wheel.next[client]] = wheel.prev[client];
+  }
+  wheel.next[client] = -1;
+  wheel.prev[client] = -1;
+  wheel.armed[client] = false;
+}
+
+/**
+ * @brief Advances the wheel to now and collects the clients whose deadline has passed.
+ *
+ * Each second only the clients in that second's slot are looked at. Timeouts longer than the
+ * wheel stay linked and come round again on the next turn.
+ *
+ * @param now Seconds since boot.
+ * @param expired Filled with the indices of expired clients, their timers are cancelled.
+ * @param maxExpired Size of expired.
+ * @return Number of expired clients.
+ */
+int RTSPServer::sessionTimerExpire(uint32_t now, int* expired, int maxExpired) {
+  RTSP_TimerWheel& wheel = this->sessionTimers;
+  int count = 0;
+  uint32_t ticks = now - wheel.now;
+  if (ticks > RTSP_TIMER_WHEEL_SLOTS) {
+    ticks = RTSP_TIMER_WHEEL_SLOTS; // Every slot gets looked at once after a long stall
+  }
+  for (uint32_t t = 1; t <= ticks; t++) {
+    uint8_t slot = (wheel.now + t) & (RTSP_TIMER_WHEEL_SLOTS - 1);
+    int client = wheel.head[slot];
+    while (client >= 0 && count < maxExpired) {
+      int next = wheel.next[client];
+      if ((int32_t)(now - wheel.deadline[client]) >= 0) {
+        sessionTimerCancel(client);
+        expired[count++] = client;
+      }
+      client = next;
+    }
+  }
+  wheel.now = now;
+  return count;
+}
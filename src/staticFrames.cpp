@@ -0,0 +1,107 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Throttles MJPEG frames that show the same picture as the last one sent.
+ *
+ * A frame counts as unchanged when its length and a checksum sampled across its scan data match
+ * the last changed frame, or with sizeTolerance set, when its length is within that many percent
+ * of it (sensor noise changes the bytes of a still scene, but hardly its size). Unchanged frames
+ * still go out at keepaliveFps so clients don't time out, and the first changed frame goes out
+ * at once. RTP timestamps come from the capture time, so they stay continuous across the gap.
+ * setFrameChanged() overrides the detector for the next frame, e.g. from a PIR sensor or the
+ * camera's motion detection.
+ *
+ * Only frames given to sendRTSPFrame() are checked.
+ *
+ * @param keepaliveFps Frames per second sent while the picture doesn't change, 0 turns suppression off.
+ * @param sizeTolerance Percent the length may differ and still count as unchanged, 0 for exact matches only.
+ */
+void RTSPServer::setStaticFrameSuppression(uint8_t keepaliveFps, uint8_t sizeTolerance) {
+  this->staticKeepaliveFps = keepaliveFps;
+  this->staticSizeTolerance = sizeTolerance;
+  this->staticFrameLen = 0;
+  this->staticFrameDueUs = 0;
+}
+
+/**
+ * @brief Tells the server whether the next frame shows a change, skipping the detector.
+ *
+ * @param changed true sends the next frame, false lets it be throttled to the keepalive rate.
+ */
+void RTSPServer::setFrameChanged(bool changed) {
+  this->frameChangedHint = changed ? 1 : 0;
+}
+
+/**
+ * @brief Checksums 4 bytes at 64 points of the entropy coded data.
+ *
+ * The scan starts after the SOS header. If it can't be found the whole frame is sampled.
+ */
+uint32_t RTSPServer::sampleFrameChecksum(const uint8_t* data, size_t len) {
+  const uint8_t* scan = data;
+  const uint8_t* end = data + len;
+  if (len >= 4 && data[0] == 0xFF && data[1] == 0xD8) {
+    const uint8_t* p = data + 2;
+    while (p + 4 <= end && p[0] == 0xFF) {
+      size_t segmentLen = (p[2] << 8) | p[3];
+      if (p[1] == 0xDA) {
+        if (p + 2 + segmentLen <= end) {
+          scan = p + 2 + segmentLen;
+        }
+        break;
+      }
+      p += 2 + segmentLen;
+    }
+  }
+  size_t scanLen = end - scan;
+  uint32_t hash = 2166136261u; // FNV-1a
+  if (scanLen < 4) {
+    return hash;
+  }
+  size_t step = (scanLen - 4) / 63;
+  for (int i = 0; i < 64; i++) {
+    const uint8_t* sample = scan + (step ? i * step : (size_t)i % (scanLen - 3));
+    for (int b = 0; b < 4; b++) {
+      hash = (hash ^ sample[b]) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+/**
+ * @brief Decides whether a frame can be left out because the picture hasn't changed.
+ *
+ * @param data The JPEG.
+ * @param len Length of the JPEG.
+ * @param timestampUs Capture time of the frame.
+ * @return true to drop the frame.
+ */
+bool RTSPServer::suppressStaticFrame(const uint8_t* data, size_t len, int64_t timestampUs) {
+  int8_t hint = this->frameChangedHint;
+  this->frameChangedHint = -1;
+  if (this->staticKeepaliveFps == 0) {
+    return false;
+  }
+  bool changed;
+  if (hint >= 0) {
+    changed = hint;
+  } else {
+    uint32_t checksum = sampleFrameChecksum(data, len);
+    changed = len != this->staticFrameLen || checksum != this->staticFrameChecksum;
+    if (changed && this->staticSizeTolerance && this->staticFrameLen) {
+      // Compared against the last changed frame, so a slow drift adds up and still gets through
+      size_t difference = len > this->staticFrameLen ? len - this->staticFrameLen : this->staticFrameLen - len;
+      changed = difference * 100 > this->staticFrameLen * this->staticSizeTolerance;
+    }
+    if (changed) {
+      this->staticFrameLen = len;
+      this->staticFrameChecksum = checksum;
+    }
+  }
+  if (!changed && timestampUs < this->staticFrameDueUs) {
+    RTSP_STAT_ADD(this->videoFramesSuppressed, 1);
+    return true;
+  }
+  this->staticFrameDueUs = timestampUs + 1000000 / this->staticKeepaliveFps;
+  return false;
+}
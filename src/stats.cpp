@@ -0,0 +1,179 @@
+#include "ESP32-RTSPServer.h"
+
+/**
+ * @brief Takes a snapshot of the server counters.
+ *
+ * Counters are updated with relaxed atomics by the sending tasks, so this never blocks streaming.
+ * Stream totals include multicast and sessions that have already disconnected.
+ *
+ * @param stats Filled with the current counters and one entry per connected session.
+ */
+void RTSPServer::getStats(RTSP_Stats& stats) {
+  memset(&stats, 0, sizeof(stats));
+  addStreamStats(stats.video, this->closedVideoStats);
+  addStreamStats(stats.audio, this->closedAudioStats);
+  addStreamStats(stats.subtitles, this->closedSubtitlesStats);
+  addStreamStats(stats.video, this->multicastVideoStats);
+  addStreamStats(stats.audio, this->multicastAudioStats);
+  addStreamStats(stats.subtitles, this->multicastSubtitlesStats);
+
+  readLockSessions();
+  for (const auto& sessionPair : this->sessions) {
+    const RTSP_Session& session = sessionPair.second;
+    addStreamStats(stats.video, session.videoStats);
+    addStreamStats(stats.audio, session.audioStats);
+    addStreamStats(stats.subtitles, session.subtitlesStats);
+    if (stats.sessionCount < MAX_CLIENTS) {
+      RTSP_SessionStats& sessionStats = stats.sessions[stats.sessionCount++];
+      sessionStats.sessionID = session.sessionID;
+      sessionStats.isPlaying = session.isPlaying;
+      sessionStats.isTCP = session.isTCP;
+      sessionStats.isMulticast = session.isMulticast;
+      sessionStats.isTunnel = session.isTunnel;
+      sessionStats.maxFps = session.maxFps;
+      sessionStats.rtspRequests = RTSP_STAT_GET(session.rtspRequests);
+      addStreamStats(sessionStats.video, session.videoStats);
+      addStreamStats(sessionStats.audio, session.audioStats);
+      addStreamStats(sessionStats.subtitles, session.subtitlesStats);
+    }
+  }
+  readUnlockSessions();
+
+  stats.videoFrames = RTSP_STAT_GET(this->videoFrameCount);
+  stats.videoFramesDropped = RTSP_STAT_GET(this->videoFramesDropped);
+  stats.videoFramesSuppressed = RTSP_STAT_GET(this->videoFramesSuppressed);
+  stats.audioBlocks = RTSP_STAT_GET(this->audioBlockCount);
+  stats.audioBlocksDropped = RTSP_STAT_GET(this->audioBlocksDropped);
+  stats.subtitlesSent = RTSP_STAT_GET(this->subtitlesCount);
+  stats.subtitlesDropped = RTSP_STAT_GET(this->subtitlesDropped);
+  stats.rtspRequests = RTSP_STAT_GET(this->rtspRequestCount);
+  stats.rejectedClients = RTSP_STAT_GET(this->rejectedClientCount);
+  stats.timedOutSessions = RTSP_STAT_GET(this->timedOutSessionCount);
+  stats.httpClients = this->httpClientCount;
+  stats.httpFramesSent = RTSP_STAT_GET(this->httpFramesSent);
+  stats.httpFramesDropped = RTSP_STAT_GET(this->httpFramesDropped);
+  stats.recording = this->recordTaskHandle != NULL;
+  stats.playbackSessions = countPlaybacks();
+  stats.recordedFrames = this->recorder.framesRecorded();
+  stats.recordDropped = this->recorder.chunksDropped();
+  stats.backchannelPackets = this->backchannel.packetsReceived();
+  stats.backchannelLost = this->backchannel.packetsLost();
+  stats.backchannelLate = this->backchannel.packetsLate();
+  stats.backchannelDelayMs = this->backchannel.delayMs();
+  stats.packetBuffers = this->packetPool.buffers ? RTSP_PACKET_POOL_SIZE : 0;
+  stats.packetBuffersInUse = RTSP_STAT_GET(this->packetPool.inUse);
+  stats.packetBuffersHighWater = RTSP_STAT_GET(this->packetPool.highWater);
+  stats.packetBuffersExhausted = RTSP_STAT_GET(this->packetPool.exhausted);
+  stats.rtspStackFree = taskStackFree(this->rtspTaskHandle);
+  stats.rtpStackFree = taskStackFree(this->rtpVideoTaskHandle);
+  stats.schedulerStackFree = taskStackFree(this->mediaSchedulerTaskHandle);
+}
+
+/**
+ * @brief Writes the counters as plain text, one "name{labels} value" line each.
+ *
+ * The format can be served as is to a Prometheus scraper or read in a browser.
+ *
+ * @param buffer Output buffer, always null terminated.
+ * @param size Size of the buffer.
+ * @return Number of characters written, output is cut short if the buffer is too small.
+ */
+size_t RTSPServer::formatStats(char* buffer, size_t size) {
+  if (!buffer || size == 0) {
+    return 0;
+  }
+  RTSP_Stats stats;
+  getStats(stats);
+
+  const char* streamNames[] = { "video", "audio", "subtitles" };
+  const RTSP_StreamStats* streamTotals[] = { &stats.video, &stats.audio, &stats.subtitles };
+
+  size_t len = 0;
+  int written;
+#define RTSP_STATS_PRINTF(...) \
+  written = snprintf(buffer + len, size - len, __VA_ARGS__); \
+  if (written < 0 || (size_t)written >= size - len) { return size - 1; } \
+  len += written;
+
+  for (int i = 0; i < 3; i++) {
+    RTSP_STATS_PRINTF("rtsp_packets_sent_total{stream=\"%s\"} %u\n", streamNames[i], streamTotals[i]->packetsSent);
+    RTSP_STATS_PRINTF("rtsp_bytes_sent_total{stream=\"%s\"} %u\n", streamNames[i], streamTotals[i]->bytesSent);
+    RTSP_STATS_PRINTF("rtsp_send_errors_total{stream=\"%s\"} %u\n", streamNames[i], streamTotals[i]->sendErrors);
+    RTSP_STATS_PRINTF("rtsp_tcp_stalls_total{stream=\"%s\"} %u\n", streamNames[i], streamTotals[i]->tcpStalls);
+  }
+  RTSP_STATS_PRINTF("rtsp_video_frames_total %u\n", stats.videoFrames);
+  RTSP_STATS_PRINTF("rtsp_video_frames_dropped_total %u\n", stats.videoFramesDropped);
+  RTSP_STATS_PRINTF("rtsp_video_frames_suppressed_total %u\n", stats.videoFramesSuppressed);
+  RTSP_STATS_PRINTF("rtsp_audio_blocks_total %u\n", stats.audioBlocks);
+  RTSP_STATS_PRINTF("rtsp_audio_blocks_dropped_total %u\n", stats.audioBlocksDropped);
+  RTSP_STATS_PRINTF("rtsp_subtitles_total %u\n", stats.subtitlesSent);
+  RTSP_STATS_PRINTF("rtsp_subtitles_dropped_total %u\n", stats.subtitlesDropped);
+  RTSP_STATS_PRINTF("rtsp_requests_total %u\n", stats.rtspRequests);
+  RTSP_STATS_PRINTF("rtsp_rejected_clients_total %u\n", stats.rejectedClients);
+  RTSP_STATS_PRINTF("rtsp_timed_out_sessions_total %u\n", stats.timedOutSessions);
+  RTSP_STATS_PRINTF("rtsp_sessions %u\n", stats.sessionCount);
+  RTSP_STATS_PRINTF("rtsp_http_clients %u\n", stats.httpClients);
+  RTSP_STATS_PRINTF("rtsp_http_frames_sent_total %u\n", stats.httpFramesSent);
+  RTSP_STATS_PRINTF("rtsp_http_frames_dropped_total %u\n", stats.httpFramesDropped);
+  RTSP_STATS_PRINTF("rtsp_recording %u\n", stats.recording ? 1 : 0);
+  RTSP_STATS_PRINTF("rtsp_playback_sessions %u\n", stats.playbackSessions);
+  RTSP_STATS_PRINTF("rtsp_record_frames_total %u\n", stats.recordedFrames);
+  RTSP_STATS_PRINTF("rtsp_record_dropped_total %u\n", stats.recordDropped);
+  RTSP_STATS_PRINTF("rtsp_backchannel_packets_total %u\n", stats.backchannelPackets);
+  RTSP_STATS_PRINTF("rtsp_backchannel_lost_total %u\n", stats.backchannelLost);
+  RTSP_STATS_PRINTF("rtsp_backchannel_late_total %u\n", stats.backchannelLate);
+  RTSP_STATS_PRINTF("rtsp_backchannel_delay_ms %u\n", stats.backchannelDelayMs);
+  RTSP_STATS_PRINTF("rtsp_packet_buffers %u\n", stats.packetBuffers);
+  RTSP_STATS_PRINTF("rtsp_packet_buffers_in_use %u\n", stats.packetBuffersInUse);
+  RTSP_STATS_PRINTF("rtsp_packet_buffers_high_water %u\n", stats.packetBuffersHighWater);
+  RTSP_STATS_PRINTF("rtsp_packet_buffers_exhausted_total %u\n", stats.packetBuffersExhausted);
+  RTSP_STATS_PRINTF("rtsp_stack_free_bytes{task=\"rtsp\"} %u\n", stats.rtspStackFree);
+  RTSP_STATS_PRINTF("rtsp_stack_free_bytes{task=\"rtp\"} %u\n", stats.rtpStackFree);
+  RTSP_STATS_PRINTF("rtsp_stack_free_bytes{task=\"scheduler\"} %u\n", stats.schedulerStackFree);
+
+  for (uint8_t s = 0; s < stats.sessionCount; s++) {
+    const RTSP_SessionStats& session = stats.sessions[s];
+    const RTSP_StreamStats* sessionStreams[] = { &session.video, &session.audio, &session.subtitles };
+    const char* transport = session.isMulticast ? "multicast" : (session.isTunnel ? "http" : (session.isTCP ? "tcp" : "udp"));
+    RTSP_STATS_PRINTF("rtsp_session_playing{session=\"%u\",transport=\"%s\"} %u\n", session.sessionID, transport, session.isPlaying ? 1 : 0);
+    RTSP_STATS_PRINTF("rtsp_session_requests_total{session=\"%u\"} %u\n", session.sessionID, session.rtspRequests);
+    RTSP_STATS_PRINTF("rtsp_session_max_fps{session=\"%u\"} %u\n", session.sessionID, session.maxFps);
+    for (int i = 0; i < 3; i++) {
+      RTSP_STATS_PRINTF("rtsp_session_packets_sent_total{session=\"%u\",stream=\"%s\"} %u\n", session.sessionID, streamNames[i], sessionStreams[i]->packetsSent);
+      RTSP_STATS_PRINTF("rtsp_session_bytes_sent_total{session=\"%u\",stream=\"%s\"} %u\n", session.sessionID, streamNames[i], sessionStreams[i]->bytesSent);
+      RTSP_STATS_PRINTF("rtsp_session_send_errors_total{session=\"%u\",stream=\"%s\"} %u\n", session.sessionID, streamNames[i], sessionStreams[i]->sendErrors);
+    }
+  }
+#undef RTSP_STATS_PRINTF
+  return len;
+}
+
+/**
+ * @brief Adds one set of stream counters to another, reading the source atomically.
+ */
+void RTSPServer::addStreamStats(RTSP_StreamStats& total, const RTSP_StreamStats& add) {
+  total.packetsSent += RTSP_STAT_GET(add.packetsSent);
+  total.bytesSent += RTSP_STAT_GET(add.bytesSent);
+  total.sendErrors += RTSP_STAT_GET(add.sendErrors);
+  total.tcpStalls += RTSP_STAT_GET(add.tcpStalls);
+  total.rtpPackets += RTSP_STAT_GET(add.rtpPackets);
+  total.rtpOctets += RTSP_STAT_GET(add.rtpOctets);
+}
+
+/**
+ * @brief Stack high-water mark of a task, the least it has had free since it started.
+ *
+ * @return Bytes on ESP-IDF, 0 for a task that isn't running.
+ */
+uint32_t RTSPServer::taskStackFree(TaskHandle_t task) {
+  return task ? uxTaskGetStackHighWaterMark(task) : 0;
+}
+
+/**
+ * @brief Folds the counters of a disconnecting session into the server totals.
+ */
+void RTSPServer::retireSessionStats(const RTSP_Session& session) {
+  addStreamStats(this->closedVideoStats, session.videoStats);
+  addStreamStats(this->closedAudioStats, session.audioStats);
+  addStreamStats(this->closedSubtitlesStats, session.subtitlesStats);
+}